@@ -273,16 +273,10 @@ bnet_clan_is_clan_channel(const BnetConnectionData *bnet, const char *channel_na
 static BnetClanMember *
 bnet_clan_find_member(const BnetConnectionData *bnet, const gchar *name)
 {
-    GList *el = NULL;
-    el = g_list_first(bnet->bncs.w3_clan.my_clanmembers);
-    while (el != NULL) {
-        BnetClanMember *member = el->data;
-        if (g_ascii_strcasecmp(name, member->name) == 0) {
-            return member;
-        }
-        el = g_list_next(el);
+    if (bnet->bncs.w3_clan.my_clanmembers == NULL) {
+        return NULL;
     }
-    return NULL;
+    return g_hash_table_lookup(bnet->bncs.w3_clan.my_clanmembers, bnet_normalize(NULL, name));
 }
 
 static const gchar *
@@ -304,74 +298,211 @@ bnet_clan_rank_to_string(const BnetClanMemberRank rank)
     }
 }
 
-static gboolean
-bnet_packet_cookie_keyequal(gconstpointer a, gconstpointer b)
+#define BNET_PACKET_COOKIE_KEY(packet_id, cookie) ((((guint64)(packet_id)) << 32) | (guint64)(cookie))
+
+static guint
+bnet_packet_cookie_slot(guint64 key, guint size)
 {
-    const struct BnetPacketCookieKey *key_a = a;
-    const struct BnetPacketCookieKey *key_b = b;
-    return key_a->packet_id == key_b->packet_id &&
-           key_a->cookie    == key_b->cookie;
+    // fibonacci hashing; size is always a power of 2
+    return (guint)((key * G_GUINT64_CONSTANT(0x9E3779B97F4A7C15)) >> 32) & (size - 1);
 }
 
-static guint32
-bnet_packet_cookie_keyhash(gconstpointer data)
+static void
+bnet_packet_cookie_table_insert(struct BnetPacketCookieEntry *table, guint size,
+        const struct BnetPacketCookieEntry *entry)
+{
+    guint i = bnet_packet_cookie_slot(entry->key, size);
+
+    while (table[i].key != 0) {
+        i = (i + 1) & (size - 1);
+    }
+    table[i] = *entry;
+}
+
+static void
+bnet_packet_cookie_table_grow(BnetConnectionData *bnet)
 {
-    const struct BnetPacketCookieKey *key = data;
-    gint32 i32 = key->cookie ^ (key->packet_id << 24);
-    return g_int_hash(&i32);
+    struct BnetPacketCookieEntry *old_table = bnet->bncs.chat_env.packet_cookie_table;
+    guint old_size = bnet->bncs.chat_env.packet_cookie_table_size;
+    guint new_size = old_size ? old_size * 2 : BNET_PACKET_COOKIE_TABLE_MIN;
+    struct BnetPacketCookieEntry *new_table = g_new0(struct BnetPacketCookieEntry, new_size);
+    guint i;
+
+    for (i = 0; i < old_size; i++) {
+        if (old_table[i].key != 0) {
+            bnet_packet_cookie_table_insert(new_table, new_size, &old_table[i]);
+        }
+    }
+    g_free(old_table);
+
+    bnet->bncs.chat_env.packet_cookie_table = new_table;
+    bnet->bncs.chat_env.packet_cookie_table_size = new_size;
 }
 
+// removes the slot at index i, shifting later entries of the probe run back
+// so that lookups never need tombstones
 static void
-bnet_packet_cookie_keyfree(gpointer data)
+bnet_packet_cookie_table_remove_at(BnetConnectionData *bnet, guint i)
 {
-    g_free(data);
+    struct BnetPacketCookieEntry *table = bnet->bncs.chat_env.packet_cookie_table;
+    guint mask = bnet->bncs.chat_env.packet_cookie_table_size - 1;
+    guint j = i;
+
+    for (;;) {
+        guint home;
+        j = (j + 1) & mask;
+        if (table[j].key == 0) {
+            break;
+        }
+        home = bnet_packet_cookie_slot(table[j].key, mask + 1);
+        // move table[j] into the hole if its home is not cyclically in (i, j]
+        if ((j > i && (home <= i || home > j)) ||
+            (j < i && (home <= i && home > j))) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    memset(&table[i], 0, sizeof(struct BnetPacketCookieEntry));
+    bnet->bncs.chat_env.packet_cookie_count--;
 }
 
 static guint32
-bnet_packet_cookie_register(BnetConnectionData *bnet, const guint8 packet_id, gpointer data)
+bnet_packet_cookie_register_full(BnetConnectionData *bnet, const guint8 packet_id, gpointer data,
+        GDestroyNotify data_free, BnetPacketCookieExpireFunc expire_cb)
 {
-    static guint32 cookie = 1;
-    
-    struct BnetPacketCookieKey *key = NULL;
-    
-    cookie++;
-    
-    key = g_new(struct BnetPacketCookieKey, 1);
-    key->packet_id = packet_id;
-    key->cookie = cookie;
+    struct BnetPacketCookieEntry entry;
+    guint32 cookie;
 
-    if (bnet->bncs.chat_env.packet_cookie_table == NULL) {
-        bnet->bncs.chat_env.packet_cookie_table = g_hash_table_new_full(
-                            (GHashFunc)bnet_packet_cookie_keyhash,
-                            (GEqualFunc)bnet_packet_cookie_keyequal,
-                            (GDestroyNotify)bnet_packet_cookie_keyfree,
-                            NULL);
+    // keep the load factor under 3/4
+    if ((bnet->bncs.chat_env.packet_cookie_count + 1) * 4 > bnet->bncs.chat_env.packet_cookie_table_size * 3) {
+        bnet_packet_cookie_table_grow(bnet);
     }
-    
-    g_hash_table_insert(bnet->bncs.chat_env.packet_cookie_table, key, data);
+
+    cookie = ++bnet->bncs.chat_env.packet_cookie_next;
+    if (cookie == 0) {
+        // 0 marks an empty slot
+        cookie = ++bnet->bncs.chat_env.packet_cookie_next;
+    }
+
+    entry.key = BNET_PACKET_COOKIE_KEY(packet_id, cookie);
+    entry.data = data;
+    entry.expires = time(NULL) + BNET_PACKET_COOKIE_TTL;
+    entry.expire_cb = expire_cb;
+    entry.data_free = data_free;
+
+    bnet_packet_cookie_table_insert(bnet->bncs.chat_env.packet_cookie_table,
+            bnet->bncs.chat_env.packet_cookie_table_size, &entry);
+    bnet->bncs.chat_env.packet_cookie_count++;
+
+    if (bnet->bncs.chat_env.packet_cookie_timer_handle == 0) {
+        bnet->bncs.chat_env.packet_cookie_timer_handle =
+            purple_timeout_add_seconds(BNET_PACKET_COOKIE_SWEEP,
+                    (GSourceFunc)bnet_packet_cookie_expire_timer, bnet);
+    }
+
     return cookie;
 }
 
+static guint32
+bnet_packet_cookie_register(BnetConnectionData *bnet, const guint8 packet_id, gpointer data)
+{
+    return bnet_packet_cookie_register_full(bnet, packet_id, data, NULL, NULL);
+}
+
 static gpointer
 bnet_packet_cookie_unregister(BnetConnectionData *bnet, const guint8 packet_id, const guint32 cookie)
 {
-    gpointer ret;
-    struct BnetPacketCookieKey *key = NULL;
-    
-    if (bnet->bncs.chat_env.packet_cookie_table == NULL) {
+    struct BnetPacketCookieEntry *table = bnet->bncs.chat_env.packet_cookie_table;
+    guint size = bnet->bncs.chat_env.packet_cookie_table_size;
+    guint64 key = BNET_PACKET_COOKIE_KEY(packet_id, cookie);
+    guint i;
+
+    if (table == NULL || cookie == 0) {
         return NULL;
     }
-    
-    key = g_new(struct BnetPacketCookieKey, 1);
-    key->packet_id = packet_id;
-    key->cookie = cookie;
 
-    ret = g_hash_table_lookup(bnet->bncs.chat_env.packet_cookie_table, key);
-    if (ret != NULL) {
-        g_hash_table_remove(bnet->bncs.chat_env.packet_cookie_table, key);
+    i = bnet_packet_cookie_slot(key, size);
+    while (table[i].key != 0) {
+        if (table[i].key == key) {
+            gpointer ret = table[i].data;
+            bnet_packet_cookie_table_remove_at(bnet, i);
+            return ret;
+        }
+        i = (i + 1) & (size - 1);
     }
-    g_free(key);
-    return ret;
+    return NULL;
+}
+
+static gboolean
+bnet_packet_cookie_expire_timer(BnetConnectionData *bnet)
+{
+    struct BnetPacketCookieEntry *table = bnet->bncs.chat_env.packet_cookie_table;
+    GSList *expired = NULL;
+    GSList *el;
+    time_t now = time(NULL);
+    guint i = 0;
+
+    while (i < bnet->bncs.chat_env.packet_cookie_table_size) {
+        if (table[i].key != 0 && table[i].expires <= now) {
+            // a later entry may be shifted into this slot; examine it again
+            struct BnetPacketCookieEntry *entry = g_new(struct BnetPacketCookieEntry, 1);
+            *entry = table[i];
+            expired = g_slist_prepend(expired, entry);
+            bnet_packet_cookie_table_remove_at(bnet, i);
+        } else {
+            i++;
+        }
+    }
+
+    // callbacks may register new cookies, so only run them once the sweep is done
+    for (el = expired; el != NULL; el = g_slist_next(el)) {
+        struct BnetPacketCookieEntry *entry = el->data;
+        guint8 packet_id = (guint8)(entry->key >> 32);
+
+        purple_debug_warning("bnet", "Cookie %u for packet 0x%02x expired without a response\n",
+                (guint32)(entry->key & 0xffffffff), packet_id);
+        if (entry->expire_cb != NULL) {
+            entry->expire_cb(bnet, packet_id, (guint32)(entry->key & 0xffffffff), entry->data);
+        }
+        if (entry->data_free != NULL && entry->data != NULL) {
+            entry->data_free(entry->data);
+        }
+        g_free(entry);
+    }
+    g_slist_free(expired);
+
+    if (bnet->bncs.chat_env.packet_cookie_count == 0) {
+        bnet->bncs.chat_env.packet_cookie_timer_handle = 0;
+        return _G_SOURCE_REMOVE;
+    }
+    return _G_SOURCE_CONTINUE;
+}
+
+static void
+bnet_packet_cookie_table_free(BnetConnectionData *bnet)
+{
+    struct BnetPacketCookieEntry *table = bnet->bncs.chat_env.packet_cookie_table;
+    guint i;
+
+    if (bnet->bncs.chat_env.packet_cookie_timer_handle != 0) {
+        purple_timeout_remove(bnet->bncs.chat_env.packet_cookie_timer_handle);
+        bnet->bncs.chat_env.packet_cookie_timer_handle = 0;
+    }
+
+    if (table == NULL) {
+        return;
+    }
+
+    for (i = 0; i < bnet->bncs.chat_env.packet_cookie_table_size; i++) {
+        if (table[i].key != 0 && table[i].data_free != NULL && table[i].data != NULL) {
+            table[i].data_free(table[i].data);
+        }
+    }
+    g_free(table);
+
+    bnet->bncs.chat_env.packet_cookie_table = NULL;
+    bnet->bncs.chat_env.packet_cookie_table_size = 0;
+    bnet->bncs.chat_env.packet_cookie_count = 0;
 }
 
 static BnetClanMember *
@@ -540,8 +671,6 @@ bnet_connect(PurpleAccount *account, const gboolean do_register)
     PurpleConnection *gc = NULL;
     BnetConnectionData *bnet = NULL;
     char **userparts = NULL;
-    PurpleProxyConnectData *bnls_conn_data = NULL;
-    PurpleProxyConnectData *conn_data = NULL;
     const char *username = purple_account_get_username(account);
 
     // set connection flags
@@ -576,6 +705,7 @@ bnet_connect(PurpleAccount *account, const gboolean do_register)
     bnet->bnls.conn.server = g_strdup(purple_account_get_string(account,
             "bnlsserver", BNET_DEFAULT_BNLSSERVER));
     bnet->bnls.conn.port = BNET_DEFAULT_BNLSPORT;
+    bnet->bnls.servers = bnet_bnls_parse_servers(bnet->bnls.conn.server);
 
     bnet->bncs.logon.type = BNET_LOGON_XSHA1;
     bnet->bncs.logon.username = g_strdup(userparts[0]);
@@ -594,370 +724,1731 @@ bnet_connect(PurpleAccount *account, const gboolean do_register)
 
     g_strfreev(userparts);
 
+    bnet_warm_load(bnet);
+
     if (bnet_is_telnet(bnet)) {
-        // connect to bnet
-        purple_debug_info("bnet", "Connecting to (CHAT) %s:%d...\n",
-                bnet->bncs.conn.server, bnet->bncs.conn.port);
-        if (!bnet->bncs.logon.create_account) {
-            purple_connection_update_progress(gc, "Connecting to Battle.net",
-                    BNET_STEP_CONNECTING, BNET_STEP_COUNT);
-        }
-        conn_data = purple_proxy_connect(gc, account, bnet->bncs.conn.server,
-                bnet->bncs.conn.port, bnet_login_cb, gc);
-        if (conn_data == NULL) {
-            purple_connection_error_reason(gc,
-                    PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
-                    "Unable to connect");
-            return;
-        }
-        bnet->bncs.conn.prpl_conn_data = conn_data;
+        bnet_bncs_connect(bnet);
     } else {
-        // begin connections
-        purple_debug_info("bnet", "Connecting to BNLS %s:%d...\n",
-                bnet->bnls.conn.server, bnet->bnls.conn.port);
-        if (!bnet->bncs.logon.create_account) {
-            purple_connection_update_progress(gc, "Connecting to BNLS",
-                    BNET_STEP_BNLS, BNET_STEP_COUNT);
-        }
-        bnls_conn_data = purple_proxy_connect(gc, account, bnet->bnls.conn.server,
-                bnet->bnls.conn.port, bnet_bnls_login_cb, gc);
-        if (bnls_conn_data == NULL) {
-            purple_connection_error_reason(gc,
-                    PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
-                    "Unable to connect to the BNLS server");
+        if (!do_register) {
+            bnet_logon_trace_start(bnet);
+        }
+        bnet->bncs.versioning.game_type = bnet_get_game_type(bnet->bncs.versioning.product);
+        if (bnet_is_w3(bnet)) {
+            // the SRP values are ready by the time SID_AUTH_CHECK passes
+            bnet_srp_prepare(bnet);
+        }
+        bnet_logon_deps_wait(bnet, BNET_LOGON_STEP_BEGIN);
+        if (bnet_versioning_cache_get_byte(bnet)) {
+            // BNLS is only needed if the version check misses the cache too
+            purple_debug_info("bnet", "Using cached version byte 0x%02x\n",
+                    bnet->bncs.versioning.version_code);
+            bnet_logon_deps_satisfy(bnet, BNET_LOGON_DEP_VERSION_BYTE);
+        } else if (bnet_bnls_send_REQUESTVERSIONBYTE(bnet) < 0) {
             return;
         }
-        bnet->bnls.conn.prpl_conn_data = bnls_conn_data;
+        // SID_AUTH_INFO waits for the version byte, not for BNLS to connect
+        bnet_bncs_connect(bnet);
     }
 }
 
-static void
-bnet_login(PurpleAccount *account)
+static gboolean
+bnet_bncs_connect(BnetConnectionData *bnet)
 {
-    bnet_connect(account, FALSE);
+    PurpleConnection *gc = bnet->account->gc;
+    PurpleProxyInfo *proxy_info = purple_proxy_get_setup(bnet->account);
+
+    purple_debug_info("bnet", "Connecting to Battle.net %s:%d...\n", bnet->bncs.conn.server, bnet->bncs.conn.port);
+    if (!bnet->bncs.logon.create_account) {
+        purple_connection_update_progress(gc, "Connecting to Battle.net", BNET_STEP_CONNECTING, BNET_STEP_COUNT);
+    }
+
+    // through a proxy, the proxy resolves the name
+    if (proxy_info == NULL || purple_proxy_info_get_type(proxy_info) == PURPLE_PROXY_NONE) {
+        bnet->bncs.gateway.query = purple_dnsquery_a(bnet->bncs.conn.server, bnet->bncs.conn.port,
+                bnet_gateway_resolved_cb, bnet);
+        if (bnet->bncs.gateway.query != NULL) {
+            return TRUE;
+        }
+    }
+    return bnet_bncs_connect_direct(bnet);
 }
 
-static void
-bnet_bnls_login_cb(gpointer data, gint source, const gchar *error_message)
+// connects to the server name as given
+static gboolean
+bnet_bncs_connect_direct(BnetConnectionData *bnet)
 {
-    PurpleConnection *gc = data;
-    BnetConnectionData *bnet = gc->proto_data;
+    PurpleConnection *gc = bnet->account->gc;
+    PurpleProxyConnectData *conn_data = NULL;
 
-    if (source < 0) {
-        gchar *tmp = g_strdup_printf("Unable to connect to BNLS: %s",
-                error_message);
+    conn_data = purple_proxy_connect(gc, bnet->account, bnet->bncs.conn.server, bnet->bncs.conn.port,
+            bnet_login_cb, gc);
+    if (conn_data == NULL) {
         purple_connection_error_reason(gc,
-                PURPLE_CONNECTION_ERROR_NETWORK_ERROR, tmp);
-        g_free(tmp);
-        return; 
+                PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+                "Unable to connect");
+        return FALSE;
     }
+    bnet->bncs.conn.prpl_conn_data = conn_data;
+    return TRUE;
+}
 
-    purple_debug_info("bnet", "BNLS connected!\n");
-
-    bnet->bnls.conn.fd = source;
+static void
+bnet_host_stats_load(BnetHostStats *stats, const gchar *name, const gchar *key)
+{
+    gpointer cache_val;
+    gsize cache_len;
+    guint64 timestamp;
 
-    if (bnet_bnls_send_REQUESTVERSIONBYTE(bnet)) {
-        bnet->bnls.conn.prpl_input_watcher = purple_input_add(bnet->bnls.conn.fd, PURPLE_INPUT_READ, bnet_bnls_input_cb, gc);
+    memset(stats, 0, sizeof(BnetHostStats));
+    // the data cache does not need an account
+    cache_val = bnet_cache_get(NULL, name, key, &timestamp, &cache_len);
+    if (cache_val != NULL && cache_len == sizeof(BnetHostStats)) {
+        memcpy(stats, cache_val, sizeof(BnetHostStats));
     }
+    g_free(cache_val);
 }
 
-/* NO LONGER USED
-   static int
-   bnet_bnls_send_CHOOSENLSREVISION(const BnetConnectionData *bnet)
-   {
-   BnetPacket *pkt = NULL;
-   int ret = -1;
+static void
+bnet_host_stats_save(BnetHostStats *stats, const gchar *name, const gchar *key)
+{
+    // old history fades out
+    if (stats->attempts > BNET_HOST_STATS_WINDOW) {
+        stats->attempts /= 2;
+        stats->failures /= 2;
+    }
+    bnet_cache_set(NULL, name, time(NULL), key, stats, sizeof(BnetHostStats));
+}
 
-   pkt = bnet_packet_create(BNET_PACKET_BNLS);
-   bnet_packet_insert(pkt, &bnet->bncs.logon.type, BNET_SIZE_DWORD);
+// folds a latency sample (ms since start) into the smoothed latency
+static void
+bnet_host_stats_sample(BnetHostStats *stats, const GTimeVal *start)
+{
+    GTimeVal now;
+    glong ms;
 
-   ret = bnet_packet_send_bnls(pkt, BNET_BNLS_CHOOSENLSREVISION, bnet->bnls.conn.fd);
+    g_get_current_time(&now);
+    ms = (now.tv_sec - start->tv_sec) * 1000 + (now.tv_usec - start->tv_usec) / 1000;
+    if (ms < 0) {
+        ms = 0;
+    }
 
-   return ret;
-   }
-   */
+    if (stats->srtt == 0) {
+        stats->srtt = ms;
+    } else {
+        stats->srtt = (stats->srtt * 7 + ms) / 8;
+    }
+}
 
-static int
-bnet_bnls_send_LOGONCHALLENGE(const BnetConnectionData *bnet)
+// expected time to an answer in ms: smoothed latency plus a penalty for
+// the share of attempts that failed; unknown hosts rank in the middle
+static guint
+bnet_host_stats_score(const BnetHostStats *stats)
 {
-    BnetPacket *pkt = NULL;
-    int ret = -1;
-    const char *username = bnet->bncs.logon.username;
-    const char *password = purple_account_get_password(bnet->account);
-
-    pkt = bnet_packet_create(BNET_PACKET_BNLS);
-    bnet_packet_insert(pkt, username, BNET_SIZE_CSTRING);
-    bnet_packet_insert(pkt, password, BNET_SIZE_CSTRING);
-
-    ret = bnet_packet_send_bnls(pkt, BNET_BNLS_LOGONCHALLENGE, bnet->bnls.conn.fd);
+    guint srtt = (stats->srtt != 0) ? stats->srtt : BNET_HOST_DEFAULT_RTT;
 
-    return ret;
+    return srtt + (stats->failures * BNET_HOST_FAILURE_PENALTY) / (stats->attempts + 1);
 }
 
-/* NO LONGER USED
-   static int
-   bnet_bnls_send_LOGONPROOF(const BnetConnectionData *bnet, const char *s_and_B)
-   {
-   BnetPacket *pkt = NULL;
-   int ret = -1;
+static void
+bnet_gateway_resolved_cb(GSList *hosts, gpointer data, const char *error_message)
+{
+    BnetConnectionData *bnet = data;
+    // address -> BnetHostStats
+    GHashTable *stats = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+    GList *addresses = NULL;
 
-   pkt = bnet_packet_create(BNET_PACKET_BNLS);
-   bnet_packet_insert(pkt, s_and_B, 64);
+    bnet->bncs.gateway.query = NULL;
 
-   ret = bnet_packet_send_bnls(pkt, BNET_BNLS_LOGONPROOF, bnet->bnls.conn.fd);
+    // hosts alternates address lengths and addresses
+    while (hosts != NULL) {
+        struct sockaddr *addr;
 
-   return ret;
-   }
-   */
+        hosts = g_slist_delete_link(hosts, hosts);
+        addr = hosts->data;
+        hosts = g_slist_delete_link(hosts, hosts);
 
-static int
-bnet_bnls_send_VERSIONCHECKEX2(const BnetConnectionData *bnet,
-        guint32 login_type, guint32 server_cookie, guint32 session_cookie,
-        guint64 mpq_ft, char *mpq_fn, char *checksum_formula)
-{
-    BnetPacket *pkt = NULL;
-    int ret = -1;
+        // Battle.net servers only listen on IPv4
+        if (addr->sa_family == AF_INET) {
+            gchar *address = g_strdup(inet_ntoa(((struct sockaddr_in *)addr)->sin_addr));
+            if (g_hash_table_lookup(stats, address) == NULL) {
+                gchar *key = g_strdup_printf("%s:%d", address, bnet->bncs.conn.port);
+                BnetHostStats *host_stats = g_new0(BnetHostStats, 1);
+                bnet_host_stats_load(host_stats, "bncs:stats", key);
+                g_hash_table_insert(stats, address, host_stats);
+                addresses = g_list_append(addresses, address);
+                g_free(key);
+            } else {
+                g_free(address);
+            }
+        }
+        g_free(addr);
+    }
 
-    guint32 bnls_flags = 0;
+    if (addresses == NULL) {
+        g_hash_table_destroy(stats);
+        purple_debug_warning("bnet", "Unable to resolve %s: %s\n", bnet->bncs.conn.server,
+                error_message != NULL ? error_message : "no IPv4 address");
+        // let the proxy code report the error
+        bnet_bncs_connect_direct(bnet);
+        return;
+    }
 
-    pkt = bnet_packet_create(BNET_PACKET_BNLS);
-    bnet_packet_insert(pkt, &bnet->bncs.versioning.game_type, BNET_SIZE_DWORD);
-    bnet_packet_insert(pkt, &bnls_flags, BNET_SIZE_DWORD);
-    bnet_packet_insert(pkt, &bnls_flags, BNET_SIZE_DWORD);
-    bnet_packet_insert(pkt, &mpq_ft, BNET_SIZE_FILETIME);
-    bnet_packet_insert(pkt, mpq_fn, BNET_SIZE_CSTRING);
-    bnet_packet_insert(pkt, checksum_formula, BNET_SIZE_CSTRING);
+    // the sort is stable, so ties keep the resolver's order
+    bnet->bncs.gateway.pending = g_list_sort_with_data(addresses, bnet_gateway_rank_cmp, stats);
+    g_hash_table_destroy(stats);
 
-    ret = bnet_packet_send_bnls(pkt, BNET_BNLS_VERSIONCHECKEX2, bnet->bnls.conn.fd);
+    bnet_gateway_start_next(bnet);
+}
 
-    return ret;
+static gint
+bnet_gateway_rank_cmp(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    GHashTable *stats = user_data;
+    guint score_a = bnet_host_stats_score(g_hash_table_lookup(stats, a));
+    guint score_b = bnet_host_stats_score(g_hash_table_lookup(stats, b));
+
+    return (score_a > score_b) - (score_a < score_b);
 }
 
-static int
-bnet_bnls_send_REQUESTVERSIONBYTE(BnetConnectionData *bnet)
+// starts a connect to the next best address, and schedules the one after it
+static void
+bnet_gateway_start_next(BnetConnectionData *bnet)
 {
-    BnetPacket *pkt = NULL;
-    int ret = -1;
-    BnetGameType game = 0;
+    PurpleConnection *gc = bnet->account->gc;
 
-    const BnetProductID product_id = bnet->bncs.versioning.product;
+    while (bnet->bncs.gateway.pending != NULL) {
+        BnetGatewayAttempt *attempt = g_new0(BnetGatewayAttempt, 1);
 
-    switch (product_id) {
-        default:
-        case BNET_PRODUCT_STAR: game = BNET_GAME_TYPE_STAR; break;
-        case BNET_PRODUCT_SEXP: game = BNET_GAME_TYPE_SEXP; break;
-        case BNET_PRODUCT_W2BN: game = BNET_GAME_TYPE_W2BN; break;
-        case BNET_PRODUCT_D2DV: game = BNET_GAME_TYPE_D2DV; break;
-        case BNET_PRODUCT_D2XP: game = BNET_GAME_TYPE_D2XP; break;
-        case BNET_PRODUCT_JSTR: game = BNET_GAME_TYPE_JSTR; break;
-        case BNET_PRODUCT_WAR3: game = BNET_GAME_TYPE_WAR3; break;
-        case BNET_PRODUCT_W3XP: game = BNET_GAME_TYPE_W3XP; break;
-        case BNET_PRODUCT_DRTL: game = BNET_GAME_TYPE_DRTL; break;
-        case BNET_PRODUCT_DSHR: game = BNET_GAME_TYPE_DSHR; break;
-        case BNET_PRODUCT_SSHR: game = BNET_GAME_TYPE_SSHR; break;
+        attempt->bnet = bnet;
+        attempt->address = bnet->bncs.gateway.pending->data;
+        bnet->bncs.gateway.pending = g_list_delete_link(bnet->bncs.gateway.pending,
+                bnet->bncs.gateway.pending);
+
+        purple_debug_info("bnet", "Connecting to %s (%s)...\n", bnet->bncs.conn.server, attempt->address);
+        g_get_current_time(&attempt->start);
+        attempt->conn_data = purple_proxy_connect(gc, bnet->account, attempt->address,
+                bnet->bncs.conn.port, bnet_gateway_connect_cb, attempt);
+        if (attempt->conn_data != NULL) {
+            bnet->bncs.gateway.connecting = g_list_append(bnet->bncs.gateway.connecting, attempt);
+            break;
+        }
+        bnet_gateway_attempt_free(attempt);
+    }
+
+    if (bnet->bncs.gateway.connecting == NULL) {
+        purple_connection_error_reason(gc,
+                PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+                "Unable to connect");
+        return;
     }
 
-    bnet->bncs.versioning.game_type = game;
+    if (bnet->bncs.gateway.pending != NULL && bnet->bncs.gateway.stagger_timer_handle == 0) {
+        bnet->bncs.gateway.stagger_timer_handle = purple_timeout_add(BNET_GATEWAY_RACE_STAGGER,
+                bnet_gateway_stagger_cb, bnet);
+    }
+}
 
-    pkt = bnet_packet_create(BNET_PACKET_BNLS);
-    bnet_packet_insert(pkt, &game, BNET_SIZE_DWORD);
+static gboolean
+bnet_gateway_stagger_cb(gpointer data)
+{
+    BnetConnectionData *bnet = data;
 
-    ret = bnet_packet_send_bnls(pkt, BNET_BNLS_REQUESTVERSIONBYTE, bnet->bnls.conn.fd);
+    bnet->bncs.gateway.stagger_timer_handle = 0;
+    bnet_gateway_start_next(bnet);
 
-    return ret;
+    return _G_SOURCE_REMOVE;
 }
 
+// the first address to connect is used; the other connects are cancelled
 static void
-bnet_bnls_input_cb(gpointer data, gint source, PurpleInputCondition cond)
+bnet_gateway_connect_cb(gpointer data, gint source, const gchar *error_message)
 {
-    PurpleConnection *gc = data;
-    BnetConnectionData *bnet = NULL;
-    int len = 0;
-
-    g_assert(gc != NULL);
+    BnetGatewayAttempt *attempt = data;
+    BnetConnectionData *bnet = attempt->bnet;
+    PurpleConnection *gc = bnet->account->gc;
+    gchar *key = g_strdup_printf("%s:%d", attempt->address, bnet->bncs.conn.port);
+    BnetHostStats stats;
 
-    bnet = gc->proto_data;
+    attempt->conn_data = NULL;
+    bnet->bncs.gateway.connecting = g_list_remove(bnet->bncs.gateway.connecting, attempt);
 
-    if (bnet->bnls.conn.inbuf_length < bnet->bnls.conn.inbuf_used + BNET_INITIAL_BUFSIZE) {
-        bnet->bnls.conn.inbuf_length += BNET_INITIAL_BUFSIZE;
-        bnet->bnls.conn.inbuf = g_realloc(bnet->bnls.conn.inbuf, bnet->bnls.conn.inbuf_length);
-    }
+    bnet_host_stats_load(&stats, "bncs:stats", key);
+    stats.attempts++;
 
-    len = read(bnet->bnls.conn.fd, bnet->bnls.conn.inbuf + bnet->bnls.conn.inbuf_used, bnet->bnls.conn.inbuf_length - bnet->bnls.conn.inbuf_used);
-    if (len < 0 && errno == EAGAIN) {
-        return;
-    } else if (len < 0) {
-        gchar *tmp = NULL;
-        tmp = g_strdup_printf("Lost connection with BNLS server: %s\n",
-                g_strerror(errno));
-        if (bnet->bncs.versioning.complete == FALSE) {
-            purple_connection_error_reason(gc,
-                    PURPLE_CONNECTION_ERROR_NETWORK_ERROR, tmp);
-            if (bnet->bncs.conn.fd != 0) {
-                bnet_input_free(&bnet->bncs.conn);
-            }
-        }
-        purple_debug_info("bnet", tmp);
-        g_free(tmp);
-        if (bnet->bnls.conn.fd != 0) {
-            bnet_input_free(&bnet->bnls.conn);
-        }
-        return;
-    } else if (len == 0) {
-        if (bnet->bncs.versioning.complete == FALSE) {
-            purple_connection_error_reason(gc,
-                    PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
-                    "BNLS server closed the connection\n");
-            if (bnet->bncs.conn.fd != 0) {
-                bnet_input_free(&bnet->bncs.conn);
+    if (source < 0) {
+        stats.failures++;
+        bnet_host_stats_save(&stats, "bncs:stats", key);
+        purple_debug_warning("bnet", "Unable to connect to %s: %s\n", attempt->address, error_message);
+        g_free(key);
+        bnet_gateway_attempt_free(attempt);
+
+        if (bnet->bncs.gateway.connecting == NULL) {
+            if (bnet->bncs.gateway.pending != NULL) {
+                // don't wait out the stagger
+                if (bnet->bncs.gateway.stagger_timer_handle != 0) {
+                    purple_timeout_remove(bnet->bncs.gateway.stagger_timer_handle);
+                    bnet->bncs.gateway.stagger_timer_handle = 0;
+                }
+                bnet_gateway_start_next(bnet);
+            } else {
+                bnet_login_cb(gc, source, error_message);
             }
         }
-        purple_debug_info("bnet", "BNLS disconnected.\n");
-        if (bnet->bnls.conn.fd != 0) {
-            bnet_input_free(&bnet->bnls.conn);
-        }
         return;
     }
 
-    bnet_bnls_read_input(bnet, len);
+    bnet_host_stats_sample(&stats, &attempt->start);
+    bnet_host_stats_save(&stats, "bncs:stats", key);
+    purple_debug_info("bnet", "Connected to %s (%s) in %ldms\n", bnet->bncs.conn.server,
+            attempt->address, (glong)stats.srtt);
+    g_free(key);
+    bnet_gateway_attempt_free(attempt);
+
+    bnet_gateway_race_free(bnet);
+    bnet_login_cb(gc, source, NULL);
 }
 
 static void
-bnet_bnls_read_input(BnetConnectionData *bnet, int len)
+bnet_gateway_attempt_free(BnetGatewayAttempt *attempt)
 {
-    gchar *this_start = NULL;
-    guint16 inbuftouse = 0;
-
-    bnet->account->gc->last_received = time(NULL);
-    bnet->bnls.conn.inbuf_used += len;
-
-    this_start = bnet->bnls.conn.inbuf;
+    if (attempt->conn_data != NULL) {
+        purple_proxy_connect_cancel(attempt->conn_data);
+    }
+    g_free(attempt->address);
+    g_free(attempt);
+}
 
-    while (this_start + 3 <= bnet->bnls.conn.inbuf + bnet->bnls.conn.inbuf_used)
-    {
-#pragma pack(push)
-#pragma pack(1)
+static void
+bnet_gateway_race_free(BnetConnectionData *bnet)
+{
+    if (bnet->bncs.gateway.query != NULL) {
+        purple_dnsquery_destroy(bnet->bncs.gateway.query);
+        bnet->bncs.gateway.query = NULL;
+    }
+    if (bnet->bncs.gateway.stagger_timer_handle != 0) {
+        purple_timeout_remove(bnet->bncs.gateway.stagger_timer_handle);
+        bnet->bncs.gateway.stagger_timer_handle = 0;
+    }
+    if (bnet->bncs.gateway.connecting != NULL) {
+        _g_list_free_full(bnet->bncs.gateway.connecting, (GDestroyNotify)bnet_gateway_attempt_free);
+        bnet->bncs.gateway.connecting = NULL;
+    }
+    if (bnet->bncs.gateway.pending != NULL) {
+        _g_list_free_full(bnet->bncs.gateway.pending, g_free);
+        bnet->bncs.gateway.pending = NULL;
+    }
+}
+
+static void
+bnet_logon_deps_satisfy(BnetConnectionData *bnet, BnetLogonDependency dep)
+{
+    bnet->logon_deps.ready |= dep;
+    bnet_logon_deps_run(bnet);
+}
+
+static void
+bnet_logon_deps_wait(BnetConnectionData *bnet, BnetLogonStep step)
+{
+    bnet->logon_deps.waiting |= step;
+    bnet_logon_deps_run(bnet);
+}
+
+// runs every waiting step whose dependencies are all satisfied
+static void
+bnet_logon_deps_run(BnetConnectionData *bnet)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(bnet_logon_step_deps); i++) {
+        BnetLogonStep step = bnet_logon_step_deps[i].step;
+        guint32 requires = bnet_logon_step_deps[i].requires;
+
+        if ((bnet->logon_deps.waiting & step) &&
+                (bnet->logon_deps.ready & requires) == requires) {
+            bnet->logon_deps.waiting &= ~step;
+            bnet_logon_step_run(bnet, step);
+        }
+    }
+}
+
+static void
+bnet_logon_step_run(BnetConnectionData *bnet, BnetLogonStep step)
+{
+    PurpleConnection *gc = bnet->account->gc;
+
+    switch (step) {
+        case BNET_LOGON_STEP_ACCOUNTLOGON:
+            bnet_account_logon_send(bnet);
+            break;
+        case BNET_LOGON_STEP_BEGIN:
+            purple_debug_info("bnet", "Beginning versioning with version byte 0x%02x\n",
+                    bnet->bncs.versioning.version_code);
+            if (!bnet->bncs.logon.create_account) {
+                purple_connection_update_progress(gc, "Checking product key and version", BNET_STEP_CREV, BNET_STEP_COUNT);
+            }
+            if (!bnet_protocol_begin(bnet)) {
+                purple_connection_error_reason(gc,
+                        PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+                        "Unable to write to Battle.net");
+            }
+            break;
+    }
+}
+
+static void
+bnet_logon_trace_start(BnetConnectionData *bnet)
+{
+    int i;
+
+    bnet->logon_trace.timer = g_timer_new();
+    for (i = 0; i < BNET_LOGON_MARK_COUNT; i++) {
+        bnet->logon_trace.at[i] = -1;
+    }
+}
+
+// records the first time a milestone is reached
+static void
+bnet_logon_trace_mark(BnetConnectionData *bnet, BnetLogonMark mark)
+{
+    if (bnet->logon_trace.timer == NULL || bnet->logon_trace.at[mark] >= 0) {
+        return;
+    }
+    bnet->logon_trace.at[mark] = g_timer_elapsed(bnet->logon_trace.timer, NULL);
+}
+
+static void
+bnet_json_append_string(GString *out, const gchar *str)
+{
+    const gchar *c;
+
+    g_string_append_c(out, '"');
+    for (c = str; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            g_string_append_c(out, '\\');
+            g_string_append_c(out, *c);
+        } else if ((guchar)*c < 0x20) {
+            g_string_append_printf(out, "\\u%04x", (guchar)*c);
+        } else {
+            g_string_append_c(out, *c);
+        }
+    }
+    g_string_append_c(out, '"');
+}
+
+// logs how long each phase took and appends the logon to
+// BNET_FILE_LOGON_TRACE; a phase runs from the previous milestone reached
+// (or the start) to its own, so the phases add up to the last milestone
+static void
+bnet_logon_trace_finish(BnetConnectionData *bnet, const gchar *result)
+{
+    GString *log;
+    GString *at;
+    GString *phases;
+    gchar *line;
+    gchar *path;
+    FILE *file;
+    BnetLogonMark order[BNET_LOGON_MARK_COUNT];
+    gchar number[G_ASCII_DTOSTR_BUF_SIZE];
+    gdouble total_ms;
+    gdouble previous = 0;
+    int count = 0;
+    int i, j;
+
+    if (bnet->logon_trace.timer == NULL) {
+        return;
+    }
+
+    total_ms = g_timer_elapsed(bnet->logon_trace.timer, NULL) * 1000;
+    g_timer_destroy(bnet->logon_trace.timer);
+    bnet->logon_trace.timer = NULL;
+
+    // reached milestones by time
+    for (i = 0; i < BNET_LOGON_MARK_COUNT; i++) {
+        if (bnet->logon_trace.at[i] < 0) {
+            continue;
+        }
+        for (j = count; j > 0 && bnet->logon_trace.at[order[j - 1]] > bnet->logon_trace.at[i]; j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+        count++;
+    }
+
+    log = g_string_new(NULL);
+    at = g_string_new(NULL);
+    phases = g_string_new(NULL);
+    for (i = 0; i < count; i++) {
+        const gchar *name = bnet_logon_mark_names[order[i]];
+        gdouble at_ms = bnet->logon_trace.at[order[i]] * 1000;
+
+        g_string_append_printf(log, "%s%s %.0f ms", (i == 0) ? "" : ", ", name, at_ms - previous);
+        // JSON numbers always use '.', whatever the locale says
+        g_string_append_printf(at, "%s\"%s\":%s", (i == 0) ? "" : ",", name,
+                g_ascii_formatd(number, sizeof(number), "%.1f", at_ms));
+        g_string_append_printf(phases, "%s\"%s\":%s", (i == 0) ? "" : ",", name,
+                g_ascii_formatd(number, sizeof(number), "%.1f", at_ms - previous));
+        previous = at_ms;
+    }
+
+    purple_debug_info("bnet", "Logon %s after %.0f ms: %s\n", result, total_ms,
+            (count == 0) ? "no milestones reached" : log->str);
+    g_string_free(log, TRUE);
+
+    log = g_string_new(NULL);
+    g_string_append_printf(log, "{\"time\":%lu,\"account\":", (gulong)time(NULL));
+    bnet_json_append_string(log, purple_account_get_username(bnet->account));
+    g_string_append(log, ",\"product\":");
+    bnet_json_append_string(log, purple_account_get_string(bnet->account, "product", "RATS"));
+    g_string_append(log, ",\"result\":");
+    bnet_json_append_string(log, result);
+    g_string_append_printf(log, ",\"total_ms\":%s,\"at_ms\":{%s},\"phase_ms\":{%s}}\n",
+            g_ascii_formatd(number, sizeof(number), "%.1f", total_ms), at->str, phases->str);
+    g_string_free(at, TRUE);
+    g_string_free(phases, TRUE);
+    line = g_string_free(log, FALSE);
+
+    path = g_build_filename(purple_user_dir(), BNET_FILE_LOGON_TRACE, NULL);
+    file = g_fopen(path, "a");
+    if (file != NULL) {
+        fputs(line, file);
+        fclose(file);
+    } else {
+        purple_debug_warning("bnet", "Unable to write the logon trace to %s: %s\n", path, g_strerror(errno));
+    }
+    g_free(path);
+    g_free(line);
+}
+
+static void
+bnet_login(PurpleAccount *account)
+{
+    bnet_connect(account, FALSE);
+}
+
+static void
+bnet_bnls_request_free(BnetBnlsRequest *request)
+{
+    if (request->pkt != NULL) {
+        bnet_packet_free(request->pkt);
+    }
+    g_list_free(request->waiters);
+    g_free(request->key);
+    g_free(request);
+}
+
+// splits the "Logon Server" option into "host:port" entries
+static gchar **
+bnet_bnls_parse_servers(const gchar *option)
+{
+    gchar **entries = g_strsplit_set(option != NULL ? option : "", ",; ", -1);
+    GPtrArray *servers = g_ptr_array_new();
+    gchar **entry;
+
+    for (entry = entries; *entry != NULL; entry++) {
+        if (strlen(*entry) == 0) {
+            continue;
+        }
+        if (strchr(*entry, ':') != NULL) {
+            g_ptr_array_add(servers, g_strdup(*entry));
+        } else {
+            g_ptr_array_add(servers, g_strdup_printf("%s:%d", *entry, BNET_DEFAULT_BNLSPORT));
+        }
+    }
+    g_strfreev(entries);
+
+    if (servers->len == 0) {
+        g_ptr_array_add(servers, g_strdup_printf("%s:%d", BNET_DEFAULT_BNLSSERVER, BNET_DEFAULT_BNLSPORT));
+    }
+    g_ptr_array_add(servers, NULL);
+    return (gchar **)g_ptr_array_free(servers, FALSE);
+}
+
+// returns the client for a "host:port", creating it with its remembered stats
+static BnetBnlsClient *
+bnet_bnls_client_lookup(const gchar *server_key)
+{
+    BnetBnlsClient *client;
+    const gchar *colon;
+
+    if (bnet_bnls_clients == NULL) {
+        bnet_bnls_clients = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+
+    client = g_hash_table_lookup(bnet_bnls_clients, server_key);
+    if (client != NULL) {
+        return client;
+    }
+
+    colon = strrchr(server_key, ':');
+    client = g_new0(BnetBnlsClient, 1);
+    client->key = g_strdup(server_key);
+    client->conn.server = g_strndup(server_key, colon - server_key);
+    client->conn.port = (guint16)atoi(colon + 1);
+    client->next_cookie = 1;
+
+    bnet_host_stats_load(&client->stats, "bnls:stats", server_key);
+
+    g_hash_table_insert(bnet_bnls_clients, g_strdup(server_key), client);
+    return client;
+}
+
+static gint
+bnet_bnls_client_rank_cmp(gconstpointer a, gconstpointer b)
+{
+    guint score_a = bnet_host_stats_score(&((const BnetBnlsClient *)a)->stats);
+    guint score_b = bnet_host_stats_score(&((const BnetBnlsClient *)b)->stats);
+
+    return (score_a > score_b) - (score_a < score_b);
+}
+
+// returns a client for this account's BNLS servers to queue requests on: the
+// best one already connected, or the home of a race between them
+static BnetBnlsClient *
+bnet_bnls_client_get(BnetConnectionData *bnet)
+{
+    GList *candidates = NULL;
+    BnetBnlsClient *client = NULL;
+    BnetBnlsRace *busy = NULL;
+    BnetBnlsRace *race = NULL;
+    GList *el;
+    gchar **server;
+
+    for (server = bnet->bnls.servers; *server != NULL; server++) {
+        BnetBnlsClient *candidate = bnet_bnls_client_lookup(*server);
+        if (g_list_find(candidates, candidate) == NULL) {
+            candidates = g_list_append(candidates, candidate);
+        }
+    }
+    candidates = g_list_sort(candidates, bnet_bnls_client_rank_cmp);
+
+    // an open connection wins outright; then a race one of ours is leading
+    for (el = candidates; el != NULL && client == NULL; el = el->next) {
+        if (((BnetBnlsClient *)el->data)->conn.fd != 0) {
+            client = el->data;
+        }
+    }
+    for (el = candidates; el != NULL && client == NULL; el = el->next) {
+        BnetBnlsClient *candidate = el->data;
+        if (candidate->race != NULL) {
+            if (g_list_find(candidates, candidate->race->home) != NULL) {
+                client = candidate->race->home;
+            } else {
+                busy = candidate->race;
+            }
+        }
+    }
+
+    if (client == NULL) {
+        race = g_new0(BnetBnlsRace, 1);
+        race->account = bnet->account;
+        for (el = candidates; el != NULL; el = el->next) {
+            BnetBnlsClient *candidate = el->data;
+            // servers racing for another account are left to that race
+            if (candidate->race == NULL) {
+                candidate->race = race;
+                race->pending = g_list_append(race->pending, candidate);
+            }
+        }
+
+        if (race->pending == NULL) {
+            g_free(race);
+            client = busy->home;
+        } else {
+            race->home = race->pending->data;
+            bnet_bnls_race_start_next(race);
+            if (race->connecting == NULL) {
+                bnet_bnls_race_free(race);
+            } else {
+                client = race->home;
+            }
+        }
+    }
+    g_list_free(candidates);
+
+    if (client == NULL) {
+        purple_connection_error_reason(bnet->account->gc,
+                PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+                "Unable to connect to the BNLS server");
+        return NULL;
+    }
+
+    if (client->message != NULL && bnet->bncs.motds[BNET_MOTD_TYPE_BNLS].message == NULL) {
+        bnet->bncs.motds[BNET_MOTD_TYPE_BNLS].message = g_strdup(client->message);
+    }
+
+    return client;
+}
+
+static gboolean
+bnet_bnls_client_connect(BnetBnlsClient *client, PurpleAccount *account)
+{
+    purple_debug_info("bnet", "Connecting to BNLS %s:%d...\n",
+            client->conn.server, client->conn.port);
+    g_get_current_time(&client->connect_start);
+    // the client, not the account's connection, owns the connect attempt
+    client->conn.prpl_conn_data = purple_proxy_connect(client, account, client->conn.server,
+            client->conn.port, bnet_bnls_client_connect_cb, client);
+    return (client->conn.prpl_conn_data != NULL);
+}
+
+// moves the race's queued requests off a candidate that is leaving it
+static void
+bnet_bnls_race_rehome(BnetBnlsRace *race, BnetBnlsClient *leaving)
+{
+    BnetBnlsClient *home = NULL;
+
+    if (race->home != leaving) {
+        return;
+    }
+    if (race->connecting != NULL) {
+        home = race->connecting->data;
+    } else if (race->pending != NULL) {
+        home = race->pending->data;
+    } else {
+        // nobody left; the requests stay for bnet_bnls_client_fail
+        return;
+    }
+    home->requests = g_list_concat(home->requests, leaving->requests);
+    leaving->requests = NULL;
+    race->home = home;
+}
+
+// starts the next best candidate, and schedules the one after it
+static void
+bnet_bnls_race_start_next(BnetBnlsRace *race)
+{
+    while (race->pending != NULL) {
+        BnetBnlsClient *client = race->pending->data;
+
+        race->pending = g_list_delete_link(race->pending, race->pending);
+        if (bnet_bnls_client_connect(client, race->account)) {
+            race->connecting = g_list_append(race->connecting, client);
+            break;
+        }
+        client->stats.attempts++;
+        client->stats.failures++;
+        client->race = NULL;
+        bnet_bnls_race_rehome(race, client);
+    }
+
+    if (race->pending != NULL && race->stagger_timer_handle == 0) {
+        race->stagger_timer_handle = purple_timeout_add(BNET_BNLS_RACE_STAGGER,
+                bnet_bnls_race_stagger_cb, race);
+    }
+}
+
+static gboolean
+bnet_bnls_race_stagger_cb(gpointer data)
+{
+    BnetBnlsRace *race = data;
+
+    race->stagger_timer_handle = 0;
+    bnet_bnls_race_start_next(race);
+
+    return _G_SOURCE_REMOVE;
+}
+
+// a candidate failed; returns FALSE once no candidate is left
+static gboolean
+bnet_bnls_race_drop(BnetBnlsRace *race, BnetBnlsClient *client)
+{
+    race->connecting = g_list_remove(race->connecting, client);
+    race->pending = g_list_remove(race->pending, client);
+    client->race = NULL;
+    bnet_bnls_race_rehome(race, client);
+
+    if (race->connecting == NULL) {
+        // don't wait out the stagger
+        bnet_bnls_race_start_next(race);
+    }
+    return (race->connecting != NULL);
+}
+
+// the first candidate to connect takes the queued requests; the rest are cancelled
+static void
+bnet_bnls_race_won(BnetBnlsRace *race, BnetBnlsClient *winner)
+{
+    GList *el;
+
+    race->connecting = g_list_remove(race->connecting, winner);
+    winner->race = NULL;
+    if (race->home != winner) {
+        winner->requests = g_list_concat(winner->requests, race->home->requests);
+        race->home->requests = NULL;
+    }
+
+    for (el = race->connecting; el != NULL; el = el->next) {
+        BnetBnlsClient *loser = el->data;
+        loser->race = NULL;
+        bnet_bnls_client_close(loser);
+    }
+    bnet_bnls_race_free(race);
+}
+
+static void
+bnet_bnls_race_free(BnetBnlsRace *race)
+{
+    GList *el;
+
+    if (race->stagger_timer_handle != 0) {
+        purple_timeout_remove(race->stagger_timer_handle);
+    }
+    for (el = race->connecting; el != NULL; el = el->next) {
+        ((BnetBnlsClient *)el->data)->race = NULL;
+    }
+    for (el = race->pending; el != NULL; el = el->next) {
+        ((BnetBnlsClient *)el->data)->race = NULL;
+    }
+    g_list_free(race->connecting);
+    g_list_free(race->pending);
+    g_free(race);
+}
+
+static void
+bnet_bnls_client_connect_cb(gpointer data, gint source, const gchar *error_message)
+{
+    BnetBnlsClient *client = data;
+    BnetBnlsRace *race = client->race;
+    GList *el;
+
+    client->conn.prpl_conn_data = NULL;
+    client->stats.attempts++;
+
+    if (source < 0) {
+        gchar *tmp = g_strdup_printf("Unable to connect to BNLS: %s",
+                error_message);
+        client->stats.failures++;
+        bnet_host_stats_save(&client->stats, "bnls:stats", client->key);
+        purple_debug_warning("bnet", "BNLS %s: %s\n", client->key, error_message);
+        if (race != NULL) {
+            if (bnet_bnls_race_drop(race, client)) {
+                g_free(tmp);
+                return;
+            }
+            client = race->home;
+            bnet_bnls_race_free(race);
+        }
+        bnet_bnls_client_fail(client, tmp);
+        g_free(tmp);
+        return;
+    }
+
+    bnet_host_stats_sample(&client->stats, &client->connect_start);
+    bnet_host_stats_save(&client->stats, "bnls:stats", client->key);
+    purple_debug_info("bnet", "BNLS connected to %s in %ldms\n", client->key,
+            (glong)client->stats.srtt);
+
+    client->conn.fd = source;
+    client->conn.prpl_input_watcher = purple_input_add(client->conn.fd, PURPLE_INPUT_READ, bnet_bnls_client_input_cb, client);
+
+    if (race != NULL) {
+        bnet_bnls_race_won(race, client);
+    }
+
+    for (el = client->requests; el != NULL; el = el->next) {
+        bnet_bnls_request_send(client, el->data);
+    }
+}
+
+static void
+bnet_bnls_client_close(BnetBnlsClient *client)
+{
+    if (client->idle_timer_handle != 0) {
+        purple_timeout_remove(client->idle_timer_handle);
+        client->idle_timer_handle = 0;
+    }
+    if (client->conn.prpl_conn_data != NULL) {
+        purple_proxy_connect_cancel(client->conn.prpl_conn_data);
+        client->conn.prpl_conn_data = NULL;
+    }
+    if (client->conn.fd != 0) {
+        bnet_input_free(&client->conn);
+    }
+}
+
+// closes the connection; every account still waiting on it gets the error
+static void
+bnet_bnls_client_fail(BnetBnlsClient *client, const gchar *message)
+{
+    GList *requests = client->requests;
+    GList *el;
+
+    purple_debug_info("bnet", "%s\n", message);
+
+    client->requests = NULL;
+    bnet_bnls_client_close(client);
+
+    for (el = requests; el != NULL; el = el->next) {
+        BnetBnlsRequest *request = el->data;
+        GList *wl;
+
+        for (wl = request->waiters; wl != NULL; wl = wl->next) {
+            BnetConnectionData *bnet = wl->data;
+            if (bnet->bncs.versioning.complete == FALSE) {
+                purple_connection_error_reason(bnet->account->gc,
+                        PURPLE_CONNECTION_ERROR_NETWORK_ERROR, message);
+                if (bnet->bncs.conn.fd != 0) {
+                    bnet_input_free(&bnet->bncs.conn);
+                }
+            }
+        }
+        bnet_bnls_request_free(request);
+    }
+    g_list_free(requests);
+}
+
+static gboolean
+bnet_bnls_client_idle_cb(gpointer data)
+{
+    BnetBnlsClient *client = data;
+
+    client->idle_timer_handle = 0;
+    if (client->requests == NULL) {
+        purple_debug_info("bnet", "Closing idle BNLS connection to %s\n", client->key);
+        bnet_bnls_client_close(client);
+    }
+
+    return _G_SOURCE_REMOVE;
+}
+
+static void
+bnet_bnls_request_send(BnetBnlsClient *client, BnetBnlsRequest *request)
+{
+    if (request->pkt != NULL) {
+        GList *wl;
+
+        for (wl = request->waiters; wl != NULL; wl = wl->next) {
+            bnet_logon_trace_mark(wl->data, BNET_LOGON_MARK_BNLS_CONNECT);
+        }
+        g_get_current_time(&request->sent);
+        // frees the packet
+        bnet_packet_send_bnls(request->pkt, request->id, client->conn.fd);
+        request->pkt = NULL;
+    }
+}
+
+// adds bnet to an identical request already in flight
+static gboolean
+bnet_bnls_client_join(BnetBnlsClient *client, BnetConnectionData *bnet, const gchar *key)
+{
+    GList *el;
+
+    for (el = client->requests; el != NULL; el = el->next) {
+        BnetBnlsRequest *request = el->data;
+        if (request->key != NULL && strcmp(request->key, key) == 0) {
+            if (g_list_find(request->waiters, bnet) == NULL) {
+                request->waiters = g_list_append(request->waiters, bnet);
+            }
+            if (request->pkt == NULL) {
+                // already sent
+                bnet_logon_trace_mark(bnet, BNET_LOGON_MARK_BNLS_CONNECT);
+            }
+            purple_debug_info("bnet", "Sharing BNLS request %s\n", key);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// queues a request for bnet; takes ownership of pkt
+static void
+bnet_bnls_client_submit(BnetBnlsClient *client, BnetConnectionData *bnet,
+        BnetBnlsPacketID id, guint32 tag, const gchar *key, BnetPacket *pkt)
+{
+    BnetBnlsRequest *request = g_new0(BnetBnlsRequest, 1);
+
+    request->id = id;
+    request->tag = tag;
+    request->key = g_strdup(key);
+    request->pkt = pkt;
+    request->waiters = g_list_append(NULL, bnet);
+    client->requests = g_list_append(client->requests, request);
+
+    if (client->idle_timer_handle != 0) {
+        purple_timeout_remove(client->idle_timer_handle);
+        client->idle_timer_handle = 0;
+    }
+    if (client->conn.fd != 0) {
+        bnet_bnls_request_send(client, request);
+    }
+}
+
+// finds the request a BNLS answer belongs to: by its tag when it has one,
+// otherwise the oldest request of that kind (BNLS answers in order)
+static BnetBnlsRequest *
+bnet_bnls_client_match(BnetBnlsClient *client, const guint8 packet_id,
+        const gchar *packet_start, const guint16 packet_len)
+{
+    BnetPacket *pkt = bnet_packet_refer_bnls(packet_start, packet_len);
+    BnetBnlsRequest *oldest = NULL;
+    gboolean tagged = FALSE;
+    guint32 tag = 0;
+    GList *el;
+
+    switch (packet_id) {
+        case BNET_BNLS_REQUESTVERSIONBYTE:
+            // product is 0 on failure
+            tag = bnet_packet_read_dword(pkt);
+            tagged = (tag != 0);
+            break;
+        case BNET_BNLS_VERSIONCHECKEX2:
+            if (bnet_packet_read_dword(pkt)) {
+                bnet_packet_read_dword(pkt);
+                bnet_packet_read_dword(pkt);
+                g_free(bnet_packet_read_cstring(pkt));
+            }
+            tag = bnet_packet_read_dword(pkt);
+            tagged = TRUE;
+            break;
+        default:
+            break;
+    }
+    bnet_packet_free(pkt);
+
+    for (el = client->requests; el != NULL; el = el->next) {
+        BnetBnlsRequest *request = el->data;
+        if (request->id != packet_id) {
+            continue;
+        }
+        if (!tagged || request->tag == tag) {
+            return request;
+        }
+        if (oldest == NULL) {
+            oldest = request;
+        }
+    }
+    return oldest;
+}
+
+// hands a BNLS packet to every account waiting on the request it answers
+static void
+bnet_bnls_client_dispatch(BnetBnlsClient *client, const guint8 packet_id,
+        const gchar *packet_start, const guint16 packet_len)
+{
+    BnetBnlsRequest *request;
+    GList *el;
+
+    if (packet_id == BNET_BNLS_MESSAGE) {
+        BnetPacket *pkt = bnet_packet_refer_bnls(packet_start, packet_len);
+        g_free(client->message);
+        client->message = bnet_packet_read_cstring(pkt);
+        bnet_packet_free(pkt);
+
+        for (el = client->requests; el != NULL; el = el->next) {
+            GList *wl;
+            for (wl = ((BnetBnlsRequest *)el->data)->waiters; wl != NULL; wl = wl->next) {
+                bnet_bnls_parse_packet(wl->data, packet_id, packet_start, packet_len);
+            }
+        }
+        return;
+    }
+
+    request = bnet_bnls_client_match(client, packet_id, packet_start, packet_len);
+    if (request == NULL) {
+        purple_debug_warning("bnet", "Received unrequested BNLS packet 0x%02x, length %d\n", packet_id, packet_len);
+        return;
+    }
+
+    bnet_host_stats_sample(&client->stats, &request->sent);
+    bnet_host_stats_save(&client->stats, "bnls:stats", client->key);
+
+    client->requests = g_list_remove(client->requests, request);
+    for (el = request->waiters; el != NULL; el = el->next) {
+        bnet_bnls_parse_packet(el->data, packet_id, packet_start, packet_len);
+    }
+    bnet_bnls_request_free(request);
+
+    if (client->requests == NULL && client->idle_timer_handle == 0 && client->conn.fd != 0) {
+        client->idle_timer_handle = purple_timeout_add_seconds(BNET_BNLS_IDLE_TIMEOUT,
+                bnet_bnls_client_idle_cb, client);
+    }
+}
+
+static void
+bnet_bnls_client_forget_cb(gpointer key, gpointer value, gpointer user_data)
+{
+    BnetBnlsClient *client = value;
+    BnetConnectionData *bnet = user_data;
+    GList *el = client->requests;
+
+    while (el != NULL) {
+        BnetBnlsRequest *request = el->data;
+        GList *next = el->next;
+
+        request->waiters = g_list_remove(request->waiters, bnet);
+        // sent requests stay so the answer still matches up
+        if (request->waiters == NULL && request->pkt != NULL) {
+            client->requests = g_list_delete_link(client->requests, el);
+            bnet_bnls_request_free(request);
+        }
+        el = next;
+    }
+}
+
+// a race connecting with this account's proxy settings restarts for another
+// waiting account, or stops if nobody is waiting
+static void
+bnet_bnls_race_forget_cb(gpointer key, gpointer value, gpointer user_data)
+{
+    BnetBnlsClient *client = value;
+    BnetConnectionData *bnet = user_data;
+    BnetBnlsRace *race = client->race;
+    PurpleAccount *other = NULL;
+    GList *el;
+
+    if (race == NULL || race->account != bnet->account) {
+        return;
+    }
+
+    if (race->home->requests != NULL) {
+        BnetBnlsRequest *request = race->home->requests->data;
+        other = ((BnetConnectionData *)request->waiters->data)->account;
+    }
+
+    for (el = race->connecting; el != NULL; el = el->next) {
+        BnetBnlsClient *candidate = el->data;
+        purple_proxy_connect_cancel(candidate->conn.prpl_conn_data);
+        candidate->conn.prpl_conn_data = NULL;
+    }
+
+    if (other == NULL) {
+        bnet_bnls_race_free(race);
+        return;
+    }
+
+    race->pending = g_list_concat(race->connecting, race->pending);
+    race->connecting = NULL;
+    race->account = other;
+    bnet_bnls_race_start_next(race);
+    if (race->connecting == NULL) {
+        client = race->home;
+        bnet_bnls_race_free(race);
+        bnet_bnls_client_fail(client, "Unable to connect to the BNLS server");
+    }
+}
+
+// drops bnet from every BNLS request it waits on
+static void
+bnet_bnls_client_forget(BnetConnectionData *bnet)
+{
+    if (bnet_bnls_clients != NULL) {
+        g_hash_table_foreach(bnet_bnls_clients, bnet_bnls_client_forget_cb, bnet);
+        g_hash_table_foreach(bnet_bnls_clients, bnet_bnls_race_forget_cb, bnet);
+    }
+}
+
+/* NO LONGER USED
+   static int
+   bnet_bnls_send_CHOOSENLSREVISION(const BnetConnectionData *bnet)
+   {
+   BnetPacket *pkt = NULL;
+   int ret = -1;
+
+   pkt = bnet_packet_create(BNET_PACKET_BNLS);
+   bnet_packet_insert(pkt, &bnet->bncs.logon.type, BNET_SIZE_DWORD);
+
+   ret = bnet_packet_send_bnls(pkt, BNET_BNLS_CHOOSENLSREVISION, bnet->bnls.conn.fd);
+
+   return ret;
+   }
+   */
+
+static int
+bnet_bnls_send_LOGONCHALLENGE(BnetConnectionData *bnet)
+{
+    BnetPacket *pkt = NULL;
+    BnetBnlsClient *client = bnet_bnls_client_get(bnet);
+    const char *username = bnet->bncs.logon.username;
+    const char *password = purple_account_get_password(bnet->account);
+
+    if (client == NULL) {
+        return -1;
+    }
+
+    pkt = bnet_packet_create(BNET_PACKET_BNLS);
+    bnet_packet_insert(pkt, username, BNET_SIZE_CSTRING);
+    bnet_packet_insert(pkt, password, BNET_SIZE_CSTRING);
+
+    // per-account; never shared
+    bnet_bnls_client_submit(client, bnet, BNET_BNLS_LOGONCHALLENGE, 0, NULL, pkt);
+
+    return 0;
+}
+
+/* NO LONGER USED
+   static int
+   bnet_bnls_send_LOGONPROOF(const BnetConnectionData *bnet, const char *s_and_B)
+   {
+   BnetPacket *pkt = NULL;
+   int ret = -1;
+
+   pkt = bnet_packet_create(BNET_PACKET_BNLS);
+   bnet_packet_insert(pkt, s_and_B, 64);
+
+   ret = bnet_packet_send_bnls(pkt, BNET_BNLS_LOGONPROOF, bnet->bnls.conn.fd);
+
+   return ret;
+   }
+   */
+
+static int
+bnet_bnls_send_VERSIONCHECKEX2(BnetConnectionData *bnet,
+        guint64 mpq_ft, const char *mpq_fn, const char *checksum_formula)
+{
+    BnetPacket *pkt = NULL;
+    BnetBnlsClient *client = bnet_bnls_client_get(bnet);
+    gchar *key = NULL;
+
+    guint32 bnls_flags = 0;
+    guint32 cookie = 0;
+
+    if (client == NULL) {
+        return -1;
+    }
+
+    key = g_strdup_printf("%02x/%08x/%s/%" G_GINT64_MODIFIER "x/%s", BNET_BNLS_VERSIONCHECKEX2,
+            bnet->bncs.versioning.game_type, mpq_fn, mpq_ft, checksum_formula);
+    if (!bnet_bnls_client_join(client, bnet, key)) {
+        cookie = client->next_cookie++;
+
+        pkt = bnet_packet_create(BNET_PACKET_BNLS);
+        bnet_packet_insert(pkt, &bnet->bncs.versioning.game_type, BNET_SIZE_DWORD);
+        bnet_packet_insert(pkt, &bnls_flags, BNET_SIZE_DWORD);
+        bnet_packet_insert(pkt, &cookie, BNET_SIZE_DWORD);
+        bnet_packet_insert(pkt, &mpq_ft, BNET_SIZE_FILETIME);
+        bnet_packet_insert(pkt, mpq_fn, BNET_SIZE_CSTRING);
+        bnet_packet_insert(pkt, checksum_formula, BNET_SIZE_CSTRING);
+
+        bnet_bnls_client_submit(client, bnet, BNET_BNLS_VERSIONCHECKEX2, cookie, key, pkt);
+    }
+    g_free(key);
+
+    return 0;
+}
+
+static BnetGameType
+bnet_get_game_type(BnetProductID product_id)
+{
+    switch (product_id) {
+        default:
+        case BNET_PRODUCT_STAR: return BNET_GAME_TYPE_STAR;
+        case BNET_PRODUCT_SEXP: return BNET_GAME_TYPE_SEXP;
+        case BNET_PRODUCT_W2BN: return BNET_GAME_TYPE_W2BN;
+        case BNET_PRODUCT_D2DV: return BNET_GAME_TYPE_D2DV;
+        case BNET_PRODUCT_D2XP: return BNET_GAME_TYPE_D2XP;
+        case BNET_PRODUCT_JSTR: return BNET_GAME_TYPE_JSTR;
+        case BNET_PRODUCT_WAR3: return BNET_GAME_TYPE_WAR3;
+        case BNET_PRODUCT_W3XP: return BNET_GAME_TYPE_W3XP;
+        case BNET_PRODUCT_DRTL: return BNET_GAME_TYPE_DRTL;
+        case BNET_PRODUCT_DSHR: return BNET_GAME_TYPE_DSHR;
+        case BNET_PRODUCT_SSHR: return BNET_GAME_TYPE_SSHR;
+    }
+}
+
+static int
+bnet_bnls_send_REQUESTVERSIONBYTE(BnetConnectionData *bnet)
+{
+    BnetPacket *pkt = NULL;
+    BnetBnlsClient *client = bnet_bnls_client_get(bnet);
+    BnetGameType game = bnet->bncs.versioning.game_type;
+    gchar *key = NULL;
+
+    if (client == NULL) {
+        return -1;
+    }
+
+    key = g_strdup_printf("%02x/%08x", BNET_BNLS_REQUESTVERSIONBYTE, game);
+    if (!bnet_bnls_client_join(client, bnet, key)) {
+        pkt = bnet_packet_create(BNET_PACKET_BNLS);
+        bnet_packet_insert(pkt, &game, BNET_SIZE_DWORD);
+
+        bnet_bnls_client_submit(client, bnet, BNET_BNLS_REQUESTVERSIONBYTE, game, key, pkt);
+    }
+    g_free(key);
+
+    return 0;
+}
+
+static void
+bnet_bnls_client_input_cb(gpointer data, gint source, PurpleInputCondition cond)
+{
+    BnetBnlsClient *client = data;
+    int len = 0;
+
+    g_assert(client != NULL);
+
+    if (client->conn.inbuf_length < client->conn.inbuf_used + BNET_INITIAL_BUFSIZE) {
+        client->conn.inbuf_length += BNET_INITIAL_BUFSIZE;
+        client->conn.inbuf = g_realloc(client->conn.inbuf, client->conn.inbuf_length);
+    }
+
+    len = read(client->conn.fd, client->conn.inbuf + client->conn.inbuf_used, client->conn.inbuf_length - client->conn.inbuf_used);
+    if (len < 0 && errno == EAGAIN) {
+        return;
+    } else if (len < 0) {
+        gchar *tmp = NULL;
+        tmp = g_strdup_printf("Lost connection with BNLS server: %s",
+                g_strerror(errno));
+        bnet_bnls_client_fail(client, tmp);
+        g_free(tmp);
+        return;
+    } else if (len == 0) {
+        bnet_bnls_client_fail(client, "BNLS server closed the connection");
+        return;
+    }
+
+    bnet_bnls_client_read_input(client, len);
+}
+
+static void
+bnet_bnls_client_read_input(BnetBnlsClient *client, int len)
+{
+    gchar *this_start = NULL;
+    guint16 inbuftouse = 0;
+
+    client->conn.inbuf_used += len;
+
+    this_start = client->conn.inbuf;
+
+    while (this_start + 3 <= client->conn.inbuf + client->conn.inbuf_used)
+    {
+#pragma pack(push)
+#pragma pack(1)
         struct {
             guint16 len;
             guint8 id;
         } *header = (void *)this_start;
 #pragma pack(pop)
         inbuftouse += header->len;
-        if (inbuftouse <= bnet->bnls.conn.inbuf_used) {
-            bnet_bnls_parse_packet(bnet, header->id, this_start, header->len);
-            if (bnet->bnls.conn.fd == 0) {
-                /* the packet parser closed the connection! -- frees everything */
+        if (inbuftouse <= client->conn.inbuf_used) {
+            bnet_bnls_client_dispatch(client, header->id, this_start, header->len);
+            if (client->conn.fd == 0) {
+                /* the connection was closed -- frees everything */
                 return;
             }
             this_start += header->len;
         } else break;
     }
 
-    if (this_start != bnet->bnls.conn.inbuf + bnet->bnls.conn.inbuf_used) {
-        bnet->bnls.conn.inbuf_used -= (this_start - bnet->bnls.conn.inbuf);
-        memmove(bnet->bnls.conn.inbuf, this_start, bnet->bnls.conn.inbuf_used);
-    } else {
-        bnet->bnls.conn.inbuf_used = 0;
+    if (this_start != client->conn.inbuf + client->conn.inbuf_used) {
+        client->conn.inbuf_used -= (this_start - client->conn.inbuf);
+        memmove(client->conn.inbuf, this_start, client->conn.inbuf_used);
+    } else {
+        client->conn.inbuf_used = 0;
+    }
+}
+
+static void
+bnet_bnls_recv_CHOOSENLSREVISION(BnetConnectionData *bnet, BnetPacket *pkt)
+{
+    gboolean result = bnet_packet_read_dword(pkt);
+
+    if (result) {
+        bnet_bnls_send_LOGONCHALLENGE(bnet);
+    }
+}
+
+static void
+bnet_bnls_recv_LOGONCHALLENGE(const BnetConnectionData *bnet, BnetPacket *pkt)
+{
+    char *A = (char *)bnet_packet_read(pkt, 32);
+
+    bnet_send_AUTH_ACCOUNTLOGON(bnet, A);
+
+    g_free(A);
+}
+
+static void
+bnet_bnls_recv_LOGONPROOF(const BnetConnectionData *bnet, BnetPacket *pkt)
+{
+    char *M1 = (char *)bnet_packet_read(pkt, SHA1_HASH_SIZE);
+
+    bnet_send_AUTH_ACCOUNTLOGONPROOF(bnet, M1);
+
+    g_free(M1);
+}
+
+static void
+bnet_bnls_recv_REQUESTVERSIONBYTE(BnetConnectionData *bnet, BnetPacket *pkt)
+{
+    // store version byte
+    BnetProductID product_id = bnet_packet_read_dword(pkt);
+
+    bnet_logon_trace_mark(bnet, BNET_LOGON_MARK_VERSION_BYTE);
+
+    if (product_id != 0) {
+        guint32 version_code = bnet_packet_read_dword(pkt);
+        bnet->bncs.versioning.version_code = version_code;
+        bnet_versioning_cache_set_byte(bnet);
+    }
+
+    // SID_AUTH_INFO goes out now if BNCS is already up
+    bnet_logon_deps_satisfy(bnet, BNET_LOGON_DEP_VERSION_BYTE);
+}
+
+static void
+bnet_bnls_recv_VERSIONCHECKEX2(BnetConnectionData *bnet, BnetPacket *pkt)
+{
+    //
+    guint32 success = bnet_packet_read_dword(pkt);
+    guint32 exe_version = 0;
+    guint32 exe_checksum = 0;
+    //guint32 cookie = 0; - assigned but not used
+    guint32 version_code = 0;
+    char *exe_info = NULL;
+
+    if (success == TRUE) {
+        exe_version = bnet_packet_read_dword(pkt);
+        exe_checksum = bnet_packet_read_dword(pkt);
+        exe_info = bnet_packet_read_cstring(pkt);
+        /*cookie = */bnet_packet_read_dword(pkt);
+        version_code = bnet_packet_read_dword(pkt);
+        bnet->bncs.versioning.version_code = version_code;
+        bnet_versioning_cache_set_byte(bnet);
+        bnet_versioning_cache_set_check(bnet, exe_version, exe_checksum, exe_info);
+        bnet_versioning_report(bnet, exe_version, exe_checksum, exe_info);
+
+        g_free(exe_info);
+    } else {
+        char *tmp = NULL;
+        bnet->bncs.versioning.complete = TRUE;
+        tmp = g_strdup("The BNLS server could says version check failure");
+        purple_connection_error_reason(bnet->account->gc,
+                PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+                tmp);
+        g_free(tmp);
+    }
+}
+
+static gchar *
+bnet_versioning_cache_byte_key(const BnetConnectionData *bnet)
+{
+    return g_strdup_printf("%08x", bnet->bncs.versioning.product);
+}
+
+static gboolean
+bnet_versioning_cache_get_byte(BnetConnectionData *bnet)
+{
+    gchar *cache_key = bnet_versioning_cache_byte_key(bnet);
+    gpointer cache_val;
+    gsize cache_len;
+    guint64 timestamp;
+    gboolean hit = FALSE;
+
+    cache_val = bnet_cache_get(bnet, "bnls:REQUESTVERSIONBYTE", cache_key, &timestamp, &cache_len);
+    if (cache_val != NULL && cache_len == BNET_SIZE_DWORD &&
+            timestamp + BNET_VERSIONING_CACHE_TTL > (guint64)time(NULL)) {
+        memcpy(&bnet->bncs.versioning.version_code, cache_val, BNET_SIZE_DWORD);
+        bnet->bncs.versioning.from_cache = TRUE;
+        hit = TRUE;
+    }
+    g_free(cache_val);
+    g_free(cache_key);
+    return hit;
+}
+
+static void
+bnet_versioning_cache_set_byte(BnetConnectionData *bnet)
+{
+    gchar *cache_key = bnet_versioning_cache_byte_key(bnet);
+
+    bnet_cache_set(bnet, "bnls:REQUESTVERSIONBYTE", time(NULL), cache_key,
+            &bnet->bncs.versioning.version_code, BNET_SIZE_DWORD);
+    g_free(cache_key);
+}
+
+// a cached check answers SID_AUTH_INFO or SID_STARTVERSIONING directly
+static gboolean
+bnet_versioning_cache_get_check(BnetConnectionData *bnet)
+{
+    gpointer cache_val;
+    gsize cache_len;
+    guint64 timestamp;
+    BnetPacket *pkt;
+    gboolean hit = FALSE;
+
+    cache_val = bnet_cache_get(bnet, "bnls:VERSIONCHECKEX2", bnet->bncs.versioning.check_key,
+            &timestamp, &cache_len);
+    if (cache_val == NULL || timestamp + BNET_VERSIONING_CACHE_TTL <= (guint64)time(NULL)) {
+        g_free(cache_val);
+        return FALSE;
+    }
+
+    pkt = bnet_packet_refer_raw(cache_val, cache_len);
+    if (bnet_packet_can_read(pkt, 13)) {
+        guint32 exe_version = bnet_packet_read_dword(pkt);
+        guint32 exe_checksum = bnet_packet_read_dword(pkt);
+        guint32 version_code = bnet_packet_read_dword(pkt);
+        gchar *exe_info = bnet_packet_read_cstring(pkt);
+
+        if (exe_info != NULL) {
+            purple_debug_info("bnet", "Using cached version check for %s\n", bnet->bncs.versioning.check_key);
+            bnet->bncs.versioning.version_code = version_code;
+            bnet->bncs.versioning.from_cache = TRUE;
+            bnet_versioning_report(bnet, exe_version, exe_checksum, exe_info);
+            g_free(exe_info);
+            hit = TRUE;
+        }
+    }
+    bnet_packet_free(pkt);
+    g_free(cache_val);
+    return hit;
+}
+
+static void
+bnet_versioning_cache_set_check(BnetConnectionData *bnet,
+        guint32 exe_version, guint32 exe_checksum, const gchar *exe_info)
+{
+    BnetPacket *pkt;
+
+    if (bnet->bncs.versioning.check_key == NULL) {
+        return;
+    }
+
+    pkt = bnet_packet_create(BNET_PACKET_RAW);
+    bnet_packet_insert(pkt, &exe_version, BNET_SIZE_DWORD);
+    bnet_packet_insert(pkt, &exe_checksum, BNET_SIZE_DWORD);
+    bnet_packet_insert(pkt, &bnet->bncs.versioning.version_code, BNET_SIZE_DWORD);
+    bnet_packet_insert(pkt, exe_info, BNET_SIZE_CSTRING);
+    bnet_cache_set(bnet, "bnls:VERSIONCHECKEX2", time(NULL), bnet->bncs.versioning.check_key,
+            pkt->data, pkt->pos);
+    bnet_packet_free(pkt);
+}
+
+// Battle.net rejected a version we took from the cache or computed locally:
+// forget it so the reconnect asks BNLS again
+static gboolean
+bnet_versioning_cache_forget(BnetConnectionData *bnet)
+{
+    gchar *cache_key;
+    gboolean forgot = FALSE;
+
+    if (bnet->bncs.versioning.from_cache) {
+        purple_debug_warning("bnet", "Cached version information was rejected, discarding it\n");
+        cache_key = bnet_versioning_cache_byte_key(bnet);
+        bnet_cache_set(bnet, "bnls:REQUESTVERSIONBYTE", 0, cache_key, NULL, 0);
+        g_free(cache_key);
+        if (bnet->bncs.versioning.check_key != NULL) {
+            bnet_cache_set(bnet, "bnls:VERSIONCHECKEX2", 0, bnet->bncs.versioning.check_key, NULL, 0);
+        }
+        bnet->bncs.versioning.from_cache = FALSE;
+        forgot = TRUE;
+    }
+
+    if (bnet->bncs.versioning.from_local && bnet->bncs.versioning.local_key != NULL) {
+        guint8 rejected = 0;
+
+        purple_debug_warning("bnet", "Local version check was rejected, using BNLS for these files\n");
+        // hashing the same files again gives the same answer; a one-byte
+        // entry in its place sends the next check to BNLS instead
+        bnet_cache_set(bnet, "crev:local", time(NULL), bnet->bncs.versioning.local_key,
+                &rejected, BNET_SIZE_BYTE);
+        bnet->bncs.versioning.from_local = FALSE;
+        forgot = TRUE;
+    }
+    return forgot;
+}
+
+// game files hashed by the version check, executable first
+static const gchar * const *
+bnet_get_crev_files(BnetProductID product)
+{
+    static const gchar * const star[] = { "StarCraft.exe", "Storm.dll", "Battle.snp", NULL };
+    static const gchar * const jstr[] = { "StarcraftJ.exe", "Storm.dll", "Battle.snp", NULL };
+    static const gchar * const w2bn[] = { "Warcraft II BNE.exe", "Storm.dll", "Battle.snp", NULL };
+    static const gchar * const d2dv[] = { "Game.exe", "Bnclient.dll", "D2Client.dll", NULL };
+    static const gchar * const war3[] = { "war3.exe", "Storm.dll", "game.dll", NULL };
+    static const gchar * const drtl[] = { "Diablo.exe", "Storm.dll", "Battle.snp", NULL };
+
+    switch (product) {
+        case BNET_PRODUCT_STAR:
+        case BNET_PRODUCT_SEXP:
+        case BNET_PRODUCT_SSHR:
+            return star;
+        case BNET_PRODUCT_JSTR:
+            return jstr;
+        case BNET_PRODUCT_W2BN:
+            return w2bn;
+        case BNET_PRODUCT_D2DV:
+        case BNET_PRODUCT_D2XP:
+            return d2dv;
+        case BNET_PRODUCT_WAR3:
+        case BNET_PRODUCT_W3XP:
+            return war3;
+        case BNET_PRODUCT_DRTL:
+        case BNET_PRODUCT_DSHR:
+            return drtl;
+        default:
+            return NULL;
+    }
+}
+
+// answers the version check from the game files in the "crev_dir" folder;
+// results are cached per file set (path, size and time) and formula, and a
+// miss hashes the files on the crypto pool. returns FALSE if the caller
+// should use the cache or BNLS instead
+static gboolean
+bnet_versioning_local(BnetConnectionData *bnet, guint64 mpq_ft, const gchar *mpq_fn, const gchar *checksum_formula)
+{
+    const gchar *crev_dir = purple_account_get_string(bnet->account, "crev_dir", "");
+    const gchar * const *names = bnet_get_crev_files(bnet->bncs.versioning.product);
+    gchar *files[BNET_CREV_FILE_COUNT + 1] = { NULL };
+    GString *cache_key;
+    gpointer cache_val;
+    gsize cache_len;
+    guint64 timestamp;
+    gboolean found = TRUE;
+    gboolean rejected = FALSE;
+    gboolean handled = FALSE;
+    int i;
+
+    if (crev_dir == NULL || strlen(crev_dir) == 0 || names == NULL) {
+        return FALSE;
+    }
+    if (bnet_crev_get_mpq_number(mpq_fn) < 0) {
+        purple_debug_info("bnet", "Local version check does not support %s; using BNLS\n", mpq_fn);
+        return FALSE;
     }
-}
 
-static void
-bnet_bnls_recv_CHOOSENLSREVISION(const BnetConnectionData *bnet, BnetPacket *pkt)
-{
-    gboolean result = bnet_packet_read_dword(pkt);
+    cache_key = g_string_new(NULL);
+    g_string_append_printf(cache_key, "%d/%s", bnet_crev_get_mpq_number(mpq_fn), checksum_formula);
+    for (i = 0; i < BNET_CREV_FILE_COUNT && names[i] != NULL; i++) {
+        struct stat st;
 
-    if (result) {
-        bnet_bnls_send_LOGONCHALLENGE(bnet);
+        files[i] = bnet_crev_find_file(crev_dir, names[i]);
+        if (files[i] == NULL || g_stat(files[i], &st) != 0) {
+            purple_debug_warning("bnet", "Local version check: %s not found in %s; using BNLS\n",
+                    names[i], crev_dir);
+            found = FALSE;
+            break;
+        }
+        g_string_append_printf(cache_key, "/%s:%lu:%lu", files[i],
+                (gulong)st.st_size, (gulong)st.st_mtime);
+    }
+
+    cache_val = NULL;
+    if (found) {
+        cache_val = bnet_cache_get(bnet, "crev:local", cache_key->str, &timestamp, &cache_len);
+    }
+    if (cache_val != NULL && cache_len == BNET_SIZE_BYTE) {
+        purple_debug_info("bnet", "Local version check was rejected before; using BNLS\n");
+        rejected = TRUE;
+    } else if (cache_val != NULL && cache_len > 8) {
+        BnetPacket *pkt = bnet_packet_refer_raw(cache_val, cache_len);
+        guint32 exe_version = bnet_packet_read_dword(pkt);
+        guint32 exe_checksum = bnet_packet_read_dword(pkt);
+        gchar *exe_info = bnet_packet_read_cstring(pkt);
+
+        bnet_packet_free(pkt);
+        if (exe_info != NULL) {
+            purple_debug_info("bnet", "Local version check: %s checksum %08x (cached)\n", exe_info, exe_checksum);
+            bnet->bncs.versioning.from_local = TRUE;
+            g_free(bnet->bncs.versioning.local_key);
+            bnet->bncs.versioning.local_key = g_strdup(cache_key->str);
+            bnet_versioning_report(bnet, exe_version, exe_checksum, exe_info);
+            g_free(exe_info);
+            handled = TRUE;
+        }
+    }
+
+    if (found && !rejected && !handled) {
+        // the executable and DLLs are several MB: hash them off the main loop
+        BnetCryptoJob *job = bnet_crypto_job_new(bnet, BNET_CRYPTO_JOB_CREV);
+        memcpy(job->crev_files, files, sizeof(files));
+        memset(files, 0, sizeof(files));
+        job->mpq_ft = mpq_ft;
+        job->mpq_fn = g_strdup(mpq_fn);
+        job->checksum_formula = g_strdup(checksum_formula);
+        job->crev_key = g_strdup(cache_key->str);
+        bnet_crypto_job_submit(job);
+        handled = TRUE;
+    }
+
+    for (i = 0; i < BNET_CREV_FILE_COUNT; i++) {
+        g_free(files[i]);
     }
+    g_free(cache_val);
+    g_string_free(cache_key, TRUE);
+    return handled;
 }
 
+// a BNET_CRYPTO_JOB_CREV job came back: report and cache its answer, or fall
+// back to the cache or BNLS
 static void
-bnet_bnls_recv_LOGONCHALLENGE(const BnetConnectionData *bnet, BnetPacket *pkt)
+bnet_versioning_local_done(BnetConnectionData *bnet, BnetCryptoJob *job)
 {
-    char *A = (char *)bnet_packet_read(pkt, 32);
+    BnetPacket *pkt;
 
-    bnet_send_AUTH_ACCOUNTLOGON(bnet, A);
+    if (job->crev_result != BNET_CREV_SUCCESS) {
+        purple_debug_warning("bnet", "Local version check failed (%d); using BNLS\n", job->crev_result);
+        bnet_versioning_remote(bnet, job->mpq_ft, job->mpq_fn, job->checksum_formula);
+        return;
+    }
 
-    g_free(A);
+    pkt = bnet_packet_create(BNET_PACKET_RAW);
+    bnet_packet_insert(pkt, &job->exe_version, BNET_SIZE_DWORD);
+    bnet_packet_insert(pkt, &job->exe_checksum, BNET_SIZE_DWORD);
+    bnet_packet_insert(pkt, job->exe_info, BNET_SIZE_CSTRING);
+    bnet_cache_set(bnet, "crev:local", time(NULL), job->crev_key, pkt->data, pkt->pos);
+    bnet_packet_free(pkt);
+
+    purple_debug_info("bnet", "Local version check: %s checksum %08x\n", job->exe_info, job->exe_checksum);
+    bnet->bncs.versioning.from_local = TRUE;
+    g_free(bnet->bncs.versioning.local_key);
+    bnet->bncs.versioning.local_key = job->crev_key;
+    job->crev_key = NULL;
+    bnet_versioning_report(bnet, job->exe_version, job->exe_checksum, job->exe_info);
 }
 
+// answers the version check from the cache or BNLS
 static void
-bnet_bnls_recv_LOGONPROOF(const BnetConnectionData *bnet, BnetPacket *pkt)
+bnet_versioning_remote(BnetConnectionData *bnet, guint64 mpq_ft, const gchar *mpq_fn, const gchar *checksum_formula)
 {
-    char *M1 = (char *)bnet_packet_read(pkt, SHA1_HASH_SIZE);
-
-    bnet_send_AUTH_ACCOUNTLOGONPROOF(bnet, M1);
+    if (bnet_versioning_cache_get_check(bnet)) {
+        return;
+    }
 
-    g_free(M1);
+    // the shared BNLS client connects if the version byte came from the cache
+    bnet_bnls_send_VERSIONCHECKEX2(bnet, mpq_ft, mpq_fn, checksum_formula);
 }
 
+// answers the server's version check request from local game files, the
+// cache, or BNLS
 static void
-bnet_bnls_recv_REQUESTVERSIONBYTE(BnetConnectionData *bnet, BnetPacket *pkt)
+bnet_versioning_check(BnetConnectionData *bnet, guint64 mpq_ft, const gchar *mpq_fn, const gchar *checksum_formula)
 {
-    // store version byte
-    BnetProductID product_id = bnet_packet_read_dword(pkt);
-    PurpleAccount *account = bnet->account;
-    PurpleConnection *gc = account->gc;
-    PurpleProxyConnectData *conn_data = NULL;
-
-    if (product_id != 0) {
-        guint32 version_code = bnet_packet_read_dword(pkt);
-        bnet->bncs.versioning.version_code = version_code;
-    }
+    g_free(bnet->bncs.versioning.check_key);
+    bnet->bncs.versioning.check_key = g_strdup_printf("%08x/%s/%" G_GINT64_MODIFIER "x/%s",
+            bnet->bncs.versioning.product, mpq_fn, mpq_ft, checksum_formula);
 
-    // connect to bnet
-    purple_debug_info("bnet", "Connecting to Battle.net %s:%d...\n", bnet->bncs.conn.server, bnet->bncs.conn.port);
-    if (!bnet->bncs.logon.create_account) {
-        purple_connection_update_progress(gc, "Connecting to Battle.net", BNET_STEP_CONNECTING, BNET_STEP_COUNT);
-    }
-    conn_data = purple_proxy_connect(gc, account, bnet->bncs.conn.server, bnet->bncs.conn.port,
-            bnet_login_cb, gc);
-    if (conn_data == NULL) {
-        purple_connection_error_reason(gc,
-                PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
-                "Unable to connect");
+    if (bnet_versioning_local(bnet, mpq_ft, mpq_fn, checksum_formula)) {
         return;
     }
-    bnet->bncs.conn.prpl_conn_data = conn_data;
+    bnet_versioning_remote(bnet, mpq_ft, mpq_fn, checksum_formula);
 }
 
+// sends the version check answer to Battle.net
 static void
-bnet_bnls_recv_VERSIONCHECKEX2(BnetConnectionData *bnet, BnetPacket *pkt)
+bnet_versioning_report(BnetConnectionData *bnet,
+        guint32 exe_version, guint32 exe_checksum, char *exe_info)
 {
-    //
-    guint32 success = bnet_packet_read_dword(pkt);
-    guint32 exe_version = 0;
-    guint32 exe_checksum = 0;
-    //guint32 cookie = 0; - assigned but not used
-    guint32 version_code = 0;
-    char *exe_info = NULL;
-
     bnet->bncs.versioning.complete = TRUE;
-
-    if (success == TRUE) {
-        exe_version = bnet_packet_read_dword(pkt);
-        exe_checksum = bnet_packet_read_dword(pkt);
-        exe_info = bnet_packet_read_cstring(pkt);
-        /*cookie = */bnet_packet_read_dword(pkt);
-        version_code = bnet_packet_read_dword(pkt);
-        bnet->bncs.versioning.version_code = version_code;
-        bnet->bncs.logon.client_cookie = g_random_int();
-        if (bnet->bncs.versioning.type == BNET_VERSIONING_AUTH) {
-            bnet_send_AUTH_CHECK(bnet,
-                    exe_version, exe_checksum, exe_info);
-        } else {
-            bnet_send_REPORTVERSION(bnet,
-                    exe_version, exe_checksum, exe_info);
-        }
-
-        g_free(exe_info);
+    bnet->bncs.logon.client_cookie = g_random_int();
+    if (bnet->bncs.versioning.type == BNET_VERSIONING_AUTH) {
+        // SID_AUTH_CHECK is sent once the keys are decoded
+        BnetCryptoJob *job = bnet_crypto_job_new(bnet, BNET_CRYPTO_JOB_KEY_DECODE);
+        job->client_cookie = bnet->bncs.logon.client_cookie;
+        job->server_cookie = bnet->bncs.logon.server_cookie;
+        job->key_count = bnet_get_key_count(bnet);
+        job->key1 = g_strdup(purple_account_get_string(bnet->account, "key1", ""));
+        job->key2 = g_strdup(purple_account_get_string(bnet->account, "key2", ""));
+        job->exe_version = exe_version;
+        job->exe_checksum = exe_checksum;
+        job->exe_info = g_strdup(exe_info);
+        bnet_crypto_job_submit(job);
     } else {
-        char *tmp = NULL;
-        tmp = g_strdup("The BNLS server could says version check failure");
-        purple_connection_error_reason(bnet->account->gc,
-                PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
-                tmp);
-        g_free(tmp);
+        bnet_send_REPORTVERSION(bnet,
+                exe_version, exe_checksum, exe_info);
     }
 }
 
@@ -976,6 +2467,9 @@ static void
 bnet_bnls_parse_packet(BnetConnectionData *bnet, const guint8 packet_id, const gchar *packet_start, const guint16 packet_len)
 {
     BnetPacket *pkt = NULL;
+    GTimeVal start;
+
+    g_get_current_time(&start);
 
     purple_debug_misc("bnet", "BNLS S>C 0x%02x: length %d\n", packet_id, packet_len);
 
@@ -1007,6 +2501,8 @@ bnet_bnls_parse_packet(BnetConnectionData *bnet, const guint8 packet_id, const g
     }
 
     bnet_packet_free(pkt);
+
+    bnet_packet_stats_handled(BNET_PACKET_STATS_BNLS, packet_id, packet_len, &start);
 }
 
 static void
@@ -1362,6 +2858,9 @@ bnet_realm_parse_packet(BnetConnectionData *bnet, const guint8 packet_id,
             const gchar *packet_start, const guint16 packet_len)
 {
     BnetPacket *pkt = NULL;
+    GTimeVal start;
+
+    g_get_current_time(&start);
 
     purple_debug_misc("bnet", "Realm S>C 0x%02x: length %d\n", packet_id, packet_len);
 
@@ -1387,6 +2886,8 @@ bnet_realm_parse_packet(BnetConnectionData *bnet, const guint8 packet_id,
     }
 
     bnet_packet_free(pkt);
+
+    bnet_packet_stats_handled(BNET_PACKET_STATS_D2MCP, packet_id, packet_len, &start);
 }
 
 static void
@@ -1406,6 +2907,7 @@ bnet_login_cb(gpointer data, gint source, const gchar *error_message)
 
     bnet->bncs.conn.fd = source;
     purple_debug_info("bnet", "BNCS connected!\n");
+    bnet_logon_trace_mark(bnet, BNET_LOGON_MARK_BNCS_CONNECT);
 
     if (bnet_is_telnet(bnet)) {
         purple_connection_update_progress(gc, "Authenticating", BNET_STEP_LOGON, BNET_STEP_COUNT);
@@ -1413,13 +2915,20 @@ bnet_login_cb(gpointer data, gint source, const gchar *error_message)
             bnet->bncs.conn.prpl_input_watcher = gc->inpa = purple_input_add(bnet->bncs.conn.fd, PURPLE_INPUT_READ, bnet_input_cb, gc);
         }
     } else {
-        if (!bnet->bncs.logon.create_account) {
-            purple_connection_update_progress(gc, "Checking product key and version", BNET_STEP_CREV, BNET_STEP_COUNT);
+        bnet->bncs.conn.prpl_conn_data = NULL;
+        if (bnet_send_protocol_byte(BNET_PROTOCOL_BNCS, bnet->bncs.conn.fd) < 0) {
+            purple_connection_error_reason(gc,
+                    PURPLE_CONNECTION_ERROR_NETWORK_ERROR,
+                    "Unable to write to Battle.net");
+            return;
         }
+        bnet->bncs.conn.prpl_input_watcher = gc->inpa = purple_input_add(bnet->bncs.conn.fd, PURPLE_INPUT_READ, bnet_input_cb, gc);
 
-        if (bnet_protocol_begin(bnet)) {
-            bnet->bncs.conn.prpl_input_watcher = gc->inpa = purple_input_add(bnet->bncs.conn.fd, PURPLE_INPUT_READ, bnet_input_cb, gc);
+        if (!(bnet->logon_deps.ready & BNET_LOGON_DEP_VERSION_BYTE) && !bnet->bncs.logon.create_account) {
+            purple_connection_update_progress(gc, "Waiting for BNLS", BNET_STEP_BNLS, BNET_STEP_COUNT);
         }
+        // SID_AUTH_INFO goes out now if the version byte is already known
+        bnet_logon_deps_satisfy(bnet, BNET_LOGON_DEP_BNCS);
     }
 }
 
@@ -1444,13 +2953,10 @@ bnet_protocol_telnet_begin(const BnetConnectionData *bnet)
     return TRUE;
 }
 
+// the protocol byte is sent by bnet_login_cb
 static gboolean
 bnet_protocol_begin(const BnetConnectionData *bnet)
 {
-    if (bnet_send_protocol_byte(BNET_PROTOCOL_BNCS, bnet->bncs.conn.fd) < 0) {
-        return FALSE;
-    }
-
     switch (bnet->bncs.versioning.type) {
         default:
         case BNET_VERSIONING_AUTH:
@@ -1763,30 +3269,18 @@ bnet_send_CDKEY2(const BnetConnectionData *bnet)
     return ret;
 }
 
+// password_hash is from a BNET_CRYPTO_JOB_PASSWORD_HASH job
 static int
-bnet_send_LOGONRESPONSE2(const BnetConnectionData *bnet)
+bnet_send_LOGONRESPONSE2(const BnetConnectionData *bnet, const guint8 *password_hash)
 {
     BnetPacket *pkt = NULL;
     int ret = -1;
-    sha1_context sha;
-    guint8 h1[SHA1_HASH_SIZE], h2[SHA1_HASH_SIZE];
     const char *username = bnet->bncs.logon.username;
-    const char *password = purple_account_get_password(bnet->account);
-
-    sha.version = SHA1_TYPE_BROKEN;
-    sha1_reset(&sha);
-    sha1_input(&sha, (guint8 *)password, strlen(password));
-    sha1_digest(&sha, h1);
-    sha1_reset(&sha);
-    sha1_input(&sha, (guint8 *)&bnet->bncs.logon.client_cookie, BNET_SIZE_DWORD);
-    sha1_input(&sha, (guint8 *)&bnet->bncs.logon.server_cookie, BNET_SIZE_DWORD);
-    sha1_input(&sha, h1, SHA1_HASH_SIZE);
-    sha1_digest(&sha, h2);
 
     pkt = bnet_packet_create(BNET_PACKET_BNCS);
     bnet_packet_insert(pkt, &bnet->bncs.logon.client_cookie, BNET_SIZE_DWORD);
     bnet_packet_insert(pkt, &bnet->bncs.logon.server_cookie, BNET_SIZE_DWORD);
-    bnet_packet_insert(pkt, h2, SHA1_HASH_SIZE);
+    bnet_packet_insert(pkt, password_hash, SHA1_HASH_SIZE);
     bnet_packet_insert(pkt, username, BNET_SIZE_CSTRING);
 
     ret = bnet_packet_send(pkt, BNET_SID_LOGONRESPONSE2, bnet->bncs.conn.fd);
@@ -1944,11 +3438,12 @@ bnet_send_PING(const BnetConnectionData *bnet, guint32 cookie)
 
 static int
 bnet_send_READUSERDATA(const BnetConnectionData *bnet,
-        int request_cookie, const char *username, char **keys)
+        int request_cookie, const BnetUserDataRequest *req)
 {
     BnetPacket *pkt = NULL;
     int ret = -1;
-    int account_count = 1;
+    int account_count = bnet_userdata_request_get_account_count(req);
+    char **keys = bnet_userdata_request_get_keys(req);
     int key_count = g_strv_length(keys);
     int i = 0;
 
@@ -1956,7 +3451,9 @@ bnet_send_READUSERDATA(const BnetConnectionData *bnet,
     bnet_packet_insert(pkt, &account_count, BNET_SIZE_DWORD);
     bnet_packet_insert(pkt, &key_count, BNET_SIZE_DWORD);
     bnet_packet_insert(pkt, &request_cookie, BNET_SIZE_DWORD);
-    bnet_packet_insert(pkt, username, BNET_SIZE_CSTRING);
+    for (i = 0; i < account_count; i++) {
+        bnet_packet_insert(pkt, bnet_userdata_request_get_account_by_index(req, i), BNET_SIZE_CSTRING);
+    }
     for (i = 0; i < key_count; i++) {
         bnet_packet_insert(pkt, keys[i], BNET_SIZE_CSTRING);
     }
@@ -2125,45 +3622,19 @@ bnet_send_AUTH_INFO(const BnetConnectionData *bnet)
     return ret;
 }
 
+// keys are from a BNET_CRYPTO_JOB_KEY_DECODE job
 static int
-bnet_send_AUTH_CHECK(const BnetConnectionData *bnet,
+bnet_send_AUTH_CHECK(const BnetConnectionData *bnet, const BnetKey *keys, guint32 key_count,
         guint32 exe_version, guint32 exe_checksum, char *exe_info)
 {
     BnetPacket *pkt = NULL;
     int ret = -1;
-    guint32 key_count = 0;
     guint32 key_spawn = 0;
-    BnetKey *keys = NULL;
     int i = 0;
-    gboolean keys_are_valid = FALSE;
 
     purple_debug_info("bnet", "server cookie: %08x\n", bnet->bncs.logon.server_cookie);
     purple_debug_info("bnet", "client cookie: %08x\n", bnet->bncs.logon.client_cookie);
 
-    key_count = bnet_get_key_count(bnet);
-
-    keys = g_new0(BnetKey, 2);
-
-    keys_are_valid = bnet_key_decode(keys, key_count,
-            bnet->bncs.logon.client_cookie, bnet->bncs.logon.server_cookie,
-            purple_account_get_string(bnet->account, "key1", ""),
-            purple_account_get_string(bnet->account, "key2", ""));
-
-    if (!keys_are_valid) {
-        const char *exp = "";
-        char *tmp = NULL;
-        if (keys[0].length > 0) {
-            // first key valid, second key must not be then
-            exp = "expansion ";
-        }
-        tmp = g_strdup_printf("The provided %sCD-key could not be decoded.", exp);
-        purple_connection_error_reason(bnet->account->gc,
-                PURPLE_CONNECTION_ERROR_INVALID_SETTINGS,
-                tmp);
-        g_free(tmp);
-        return -1;
-    }
-
     pkt = bnet_packet_create(BNET_PACKET_BNCS);
     bnet_packet_insert(pkt, &bnet->bncs.logon.client_cookie, BNET_SIZE_DWORD);
     bnet_packet_insert(pkt, &exe_version, BNET_SIZE_DWORD);
@@ -2177,8 +3648,6 @@ bnet_send_AUTH_CHECK(const BnetConnectionData *bnet,
     g_assert(bnet->bncs.versioning.key_owner != NULL);
     bnet_packet_insert(pkt, bnet->bncs.versioning.key_owner, BNET_SIZE_CSTRING);
 
-    g_free(keys);
-
     ret = bnet_packet_send(pkt, BNET_SID_AUTH_CHECK, bnet->bncs.conn.fd);
 
     return ret;
@@ -2370,28 +3839,307 @@ bnet_send_CLANMEMBERINFO(const BnetConnectionData *bnet, const int cookie, const
 static void
 bnet_account_logon(BnetConnectionData *bnet)
 {
-    if (bnet->bncs.logon.type == 0) {
-        if (bnet->bncs.logon.create_account) {
-            bnet_send_CREATEACCOUNT2(bnet);
-        } else {
-            bnet_account_lockout_set(bnet);
-            bnet_send_LOGONRESPONSE2(bnet);
-        }
-    } else {
-        const char *username = bnet->bncs.logon.username;
-        const char *password = purple_account_get_password(bnet->account);
-        bnet->bncs.logon.auth_ctx = srp_init(username, password);
-        if (bnet->bncs.logon.create_account) {
-            gchar salt_and_v[64];
-            srp_generate_salt_and_v(bnet->bncs.logon.auth_ctx, salt_and_v);
-            bnet_send_AUTH_ACCOUNTCREATE(bnet, salt_and_v);
-        } else {
-            gchar A[32];
-            srp_get_A(bnet->bncs.logon.auth_ctx, A);
-            bnet_account_lockout_set(bnet);
-            bnet_send_AUTH_ACCOUNTLOGON(bnet, A);
-        }
+    if (bnet->bncs.logon.type == 0) {
+        if (bnet->bncs.logon.create_account) {
+            bnet_send_CREATEACCOUNT2(bnet);
+        } else {
+            // SID_LOGONRESPONSE2 is sent once the password is hashed
+            BnetCryptoJob *job = bnet_crypto_job_new(bnet, BNET_CRYPTO_JOB_PASSWORD_HASH);
+            job->password = g_strdup(purple_account_get_password(bnet->account));
+            job->client_cookie = bnet->bncs.logon.client_cookie;
+            job->server_cookie = bnet->bncs.logon.server_cookie;
+            bnet_account_lockout_set(bnet);
+            bnet_crypto_job_submit(job);
+        }
+    } else {
+        // usually started when the connection was, see bnet_connect
+        if (bnet->bncs.logon.auth_ctx == NULL &&
+                !bnet_crypto_job_pending(bnet, BNET_CRYPTO_JOB_SRP_PREPARE)) {
+            bnet_srp_prepare(bnet);
+        }
+        bnet_logon_deps_wait(bnet, BNET_LOGON_STEP_ACCOUNTLOGON);
+    }
+}
+
+// BNET_LOGON_STEP_ACCOUNTLOGON: the SRP values are ready
+static void
+bnet_account_logon_send(BnetConnectionData *bnet)
+{
+    if (bnet->bncs.logon.create_account) {
+        bnet_send_AUTH_ACCOUNTCREATE(bnet, bnet->bncs.logon.salt_and_v);
+        g_free(bnet->bncs.logon.salt_and_v);
+        bnet->bncs.logon.salt_and_v = NULL;
+    } else {
+        gchar A[32];
+        // computed by the job
+        srp_get_A(bnet->bncs.logon.auth_ctx, A);
+        bnet_account_lockout_set(bnet);
+        bnet_send_AUTH_ACCOUNTLOGON(bnet, A);
+    }
+}
+
+// starts computing the SRP secret and A; satisfies BNET_LOGON_DEP_SRP
+static void
+bnet_srp_prepare(BnetConnectionData *bnet)
+{
+    BnetCryptoJob *job = bnet_crypto_job_new(bnet, BNET_CRYPTO_JOB_SRP_PREPARE);
+
+    job->username = g_strdup(bnet->bncs.logon.username);
+    job->password = g_strdup(purple_account_get_password(bnet->account));
+    job->create_account = bnet->bncs.logon.create_account;
+    bnet_crypto_job_submit(job);
+}
+
+static BnetCryptoJob *
+bnet_crypto_job_new(BnetConnectionData *bnet, BnetCryptoJobType type)
+{
+    BnetCryptoJob *job = g_new0(BnetCryptoJob, 1);
+
+    job->type = type;
+    job->bnet = bnet;
+    return job;
+}
+
+// hands a filled-in job to the pool; the main loop must not touch it after this
+static void
+bnet_crypto_job_submit(BnetCryptoJob *job)
+{
+    BnetConnectionData *bnet = job->bnet;
+    GError *err = NULL;
+
+    bnet->crypto_jobs = g_list_append(bnet->crypto_jobs, job);
+
+    if (bnet_crypto_pool == NULL && g_thread_supported()) {
+        bnet_crypto_pool = g_thread_pool_new(bnet_crypto_job_run, NULL,
+                BNET_CRYPTO_THREADS, FALSE, &err);
+        if (bnet_crypto_pool == NULL) {
+            purple_debug_warning("bnet", "Crypto pool failed: %s\n", err->message);
+            g_error_free(err);
+            err = NULL;
+        }
+    }
+
+    if (bnet_crypto_pool != NULL) {
+        g_thread_pool_push(bnet_crypto_pool, job, &err);
+        if (err == NULL) {
+            return;
+        }
+        purple_debug_warning("bnet", "Crypto pool push failed: %s\n", err->message);
+        g_error_free(err);
+    }
+    // the result still comes back through the idle callback
+    bnet_crypto_job_run(job, NULL);
+}
+
+static gboolean
+bnet_crypto_job_pending(const BnetConnectionData *bnet, BnetCryptoJobType type)
+{
+    GList *el;
+
+    for (el = bnet->crypto_jobs; el != NULL; el = el->next) {
+        if (((BnetCryptoJob *)el->data)->type == type) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// runs on a pool thread; must not call into libpurple
+static void
+bnet_crypto_job_run(gpointer data, gpointer user_data)
+{
+    BnetCryptoJob *job = data;
+
+    if (g_atomic_int_get(&job->cancelled)) {
+        g_idle_add(bnet_crypto_job_done_cb, job);
+        return;
+    }
+
+    switch (job->type) {
+        case BNET_CRYPTO_JOB_SRP_PREPARE:
+            {
+                gchar A[32];
+                // srp stays NULL if the OS has no random source
+                job->srp = srp_init(job->username, job->password);
+                if (job->srp == NULL) {
+                    break;
+                }
+                // A is cached in the srp_t for SID_AUTH_ACCOUNTLOGON
+                srp_get_A(job->srp, A);
+                if (job->create_account && srp_generate_salt_and_v(job->srp, job->out) == 0) {
+                    srp_free(job->srp);
+                    job->srp = NULL;
+                }
+                break;
+            }
+        case BNET_CRYPTO_JOB_SRP_PROOF:
+            srp_get_M1(job->srp, job->out, job->B, job->salt);
+            break;
+        case BNET_CRYPTO_JOB_KEY_DECODE:
+            job->keys_valid = bnet_key_decode(job->keys, job->key_count,
+                    job->client_cookie, job->server_cookie, job->key1, job->key2);
+            break;
+        case BNET_CRYPTO_JOB_PASSWORD_HASH:
+            {
+                sha1_context sha;
+                guint8 h1[SHA1_HASH_SIZE];
+
+                sha.version = SHA1_TYPE_BROKEN;
+                sha1_reset(&sha);
+                sha1_input(&sha, (guint8 *)job->password, strlen(job->password));
+                sha1_digest(&sha, h1);
+                sha1_reset(&sha);
+                sha1_input(&sha, (guint8 *)&job->client_cookie, BNET_SIZE_DWORD);
+                sha1_input(&sha, (guint8 *)&job->server_cookie, BNET_SIZE_DWORD);
+                sha1_input(&sha, h1, SHA1_HASH_SIZE);
+                sha1_digest(&sha, (guint8 *)job->out);
+                memset(h1, 0, SHA1_HASH_SIZE);
+                break;
+            }
+        case BNET_CRYPTO_JOB_CREV:
+            job->crev_result = bnet_crev_exe_info(job->crev_files[0], &job->exe_version, &job->exe_info);
+            if (job->crev_result == BNET_CREV_SUCCESS) {
+                job->crev_result = bnet_crev_classic(job->checksum_formula, job->mpq_fn,
+                        job->crev_files, &job->exe_checksum);
+            }
+            break;
+    }
+
+    // GLib's main context is safe to add to from any thread
+    g_idle_add(bnet_crypto_job_done_cb, job);
+}
+
+static gboolean
+bnet_crypto_job_done_cb(gpointer data)
+{
+    BnetCryptoJob *job = data;
+    BnetConnectionData *bnet = job->bnet;
+
+    if (bnet == NULL) {
+        // the connection closed while the job was out
+        bnet_crypto_jobs_orphaned = g_list_remove(bnet_crypto_jobs_orphaned, job);
+        bnet_crypto_job_free(job);
+        return _G_SOURCE_REMOVE;
+    }
+
+    bnet->crypto_jobs = g_list_remove(bnet->crypto_jobs, job);
+
+    switch (job->type) {
+        case BNET_CRYPTO_JOB_SRP_PREPARE:
+            if (job->srp == NULL) {
+                purple_connection_error_reason(bnet->account->gc,
+                        PURPLE_CONNECTION_ERROR_ENCRYPTION_ERROR,
+                        "Could not get secure random data for the logon.");
+                break;
+            }
+            bnet->bncs.logon.auth_ctx = job->srp;
+            job->srp = NULL;
+            if (job->create_account) {
+                bnet->bncs.logon.salt_and_v = g_memdup(job->out, 64);
+            }
+            bnet_logon_deps_satisfy(bnet, BNET_LOGON_DEP_SRP);
+            break;
+        case BNET_CRYPTO_JOB_SRP_PROOF:
+            bnet->bncs.logon.auth_ctx = job->srp;
+            job->srp = NULL;
+            bnet_send_AUTH_ACCOUNTLOGONPROOF(bnet, job->out);
+            break;
+        case BNET_CRYPTO_JOB_KEY_DECODE:
+            if (!job->keys_valid) {
+                const char *exp = "";
+                char *tmp = NULL;
+                if (job->keys[0].length > 0) {
+                    // first key valid, second key must not be then
+                    exp = "expansion ";
+                }
+                tmp = g_strdup_printf("The provided %sCD-key could not be decoded.", exp);
+                purple_connection_error_reason(bnet->account->gc,
+                        PURPLE_CONNECTION_ERROR_INVALID_SETTINGS,
+                        tmp);
+                g_free(tmp);
+                break;
+            }
+            bnet_send_AUTH_CHECK(bnet, job->keys, job->key_count,
+                    job->exe_version, job->exe_checksum, job->exe_info);
+            break;
+        case BNET_CRYPTO_JOB_PASSWORD_HASH:
+            bnet_send_LOGONRESPONSE2(bnet, (guint8 *)job->out);
+            break;
+        case BNET_CRYPTO_JOB_CREV:
+            bnet_versioning_local_done(bnet, job);
+            break;
+    }
+
+    bnet_crypto_job_free(job);
+    return _G_SOURCE_REMOVE;
+}
+
+static void
+bnet_crypto_job_free(BnetCryptoJob *job)
+{
+    int i;
+
+    if (job->srp != NULL) {
+        srp_free(job->srp);
+    }
+    g_free(job->username);
+    if (job->password != NULL) {
+        memset(job->password, 0, strlen(job->password));
+        g_free(job->password);
+    }
+    if (job->key1 != NULL) {
+        memset(job->key1, 0, strlen(job->key1));
+        g_free(job->key1);
+    }
+    if (job->key2 != NULL) {
+        memset(job->key2, 0, strlen(job->key2));
+        g_free(job->key2);
+    }
+    g_free(job->exe_info);
+    for (i = 0; i < BNET_CREV_FILE_COUNT; i++) {
+        g_free(job->crev_files[i]);
+    }
+    g_free(job->mpq_fn);
+    g_free(job->checksum_formula);
+    g_free(job->crev_key);
+    memset(job, 0, sizeof(BnetCryptoJob));
+    g_free(job);
+}
+
+// jobs still out are skipped if not started, and free themselves when they come back
+static void
+bnet_crypto_jobs_cancel(BnetConnectionData *bnet)
+{
+    GList *el;
+
+    for (el = bnet->crypto_jobs; el != NULL; el = el->next) {
+        BnetCryptoJob *job = el->data;
+        g_atomic_int_set(&job->cancelled, 1);
+        job->bnet = NULL;
+    }
+    bnet_crypto_jobs_orphaned = g_list_concat(bnet_crypto_jobs_orphaned, bnet->crypto_jobs);
+    bnet->crypto_jobs = NULL;
+}
+
+// stops the pool, then drops the done callbacks of jobs that came back too late to run
+static void
+bnet_crypto_pool_shutdown(void)
+{
+    GList *el;
+
+    if (bnet_crypto_pool != NULL) {
+        // unstarted jobs are dropped, running ones are waited for
+        g_thread_pool_free(bnet_crypto_pool, TRUE, TRUE);
+        bnet_crypto_pool = NULL;
+    }
+
+    for (el = bnet_crypto_jobs_orphaned; el != NULL; el = el->next) {
+        // each job queues exactly one done callback
+        g_idle_remove_by_data(el->data);
+        bnet_crypto_job_free(el->data);
     }
+    g_list_free(bnet_crypto_jobs_orphaned);
+    bnet_crypto_jobs_orphaned = NULL;
 }
 
 static void
@@ -2409,6 +4157,10 @@ bnet_realm_logon_cb(BnetConnectionData *bnet)
 {
     const gchar *my_stats = purple_account_get_string(bnet->account, "my_stats", "");
 
+    if (purple_account_get_bool(bnet->account, "use_d2realm", FALSE)) {
+        bnet_logon_trace_mark(bnet, BNET_LOGON_MARK_REALM_LOGON);
+    }
+
     bnet_send_GETCHANNELLIST(bnet);
     bnet_send_ENTERCHAT(bnet, my_stats);
 }
@@ -2418,6 +4170,8 @@ bnet_enter_chat(BnetConnectionData *bnet)
 {
     const gchar *my_stats = purple_account_get_string(bnet->account, "my_stats", "");
 
+    bnet_logon_trace_mark(bnet, BNET_LOGON_MARK_ACCOUNT_LOGON);
+
     if (bnet_is_d2(bnet)) {
         if (purple_account_get_bool(bnet->account, "use_d2realm", FALSE)) {
             bnet->d2mcp.on_character = FALSE;
@@ -2660,35 +4414,135 @@ bnet_realm_character_list(BnetConnectionData *bnet, GList *char_list)
             bnet);
 }
 
+static guint32
+bnet_poll_hash(const gchar *data, gsize length)
+{
+    // FNV-1a
+    guint32 hash = 2166136261U;
+    gsize i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= (guint8)data[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+// returns interval seconds, spread by up to +/- 1/BNET_POLL_JITTER so that
+// many accounts in one process do not poll in lockstep
+static time_t
+bnet_poll_jitter(guint interval)
+{
+    gint32 spread = interval / BNET_POLL_JITTER;
+
+    if (spread == 0) {
+        return interval;
+    }
+    return interval + g_random_int_range(-spread, spread + 1);
+}
+
+static void
+bnet_poll_init(BnetConnectionData *bnet)
+{
+    time_t now = time(NULL);
+    int i;
+
+    if (bnet_is_w3(bnet) || bnet_is_scrt(bnet)) {
+        // these clients get friend updates pushed, so the list is only a consistency check
+        bnet->bncs.chat_env.polls[BNET_POLL_FRIENDS].min_interval = 240;
+        bnet->bncs.chat_env.polls[BNET_POLL_FRIENDS].max_interval = 1920;
+    } else {
+        bnet->bncs.chat_env.polls[BNET_POLL_FRIENDS].min_interval = 60;
+        bnet->bncs.chat_env.polls[BNET_POLL_FRIENDS].max_interval = 480;
+    }
+    // clan member changes are pushed as well; the full roster only catches drift
+    bnet->bncs.chat_env.polls[BNET_POLL_CLANMEMBERS].min_interval = 3840;
+    bnet->bncs.chat_env.polls[BNET_POLL_CLANMEMBERS].max_interval = 15360;
+    bnet->bncs.chat_env.polls[BNET_POLL_CLANMOTD].min_interval = 240;
+    bnet->bncs.chat_env.polls[BNET_POLL_CLANMOTD].max_interval = 1920;
+
+    for (i = 0; i < BNET_POLL_COUNT; i++) {
+        BnetPollState *poll = &bnet->bncs.chat_env.polls[i];
+        poll->interval = poll->min_interval;
+        poll->last_hash = 0;
+        // the first poll of each kind lands anywhere in its first interval
+        poll->next = now + g_random_int_range(poll->min_interval / 2, poll->min_interval + 1);
+    }
+}
+
+// whether a poll of this kind should be sent now; if so, schedules the next one
+// (which the response will reschedule based on whether anything changed)
+static gboolean
+bnet_poll_due(BnetConnectionData *bnet, BnetPollKind kind, time_t now)
+{
+    BnetPollState *poll = &bnet->bncs.chat_env.polls[kind];
+
+    if (poll->next > now) {
+        return FALSE;
+    }
+    poll->next = now + bnet_poll_jitter(poll->interval);
+    return TRUE;
+}
+
+// called with each poll response: back off while nothing changes, tighten when it does
+// only the unread part of pkt is compared, so read any per-request cookie first
+static void
+bnet_poll_response(BnetConnectionData *bnet, BnetPollKind kind, const BnetPacket *pkt)
+{
+    BnetPollState *poll = &bnet->bncs.chat_env.polls[kind];
+    guint32 hash = bnet_poll_hash(pkt->data + pkt->pos, pkt->len - pkt->pos);
+
+    if (poll->min_interval == 0) {
+        // not in chat yet
+        return;
+    }
+
+    if (hash == poll->last_hash) {
+        poll->interval = MIN(poll->interval * 2, poll->max_interval);
+    } else {
+        poll->interval = poll->min_interval;
+        poll->last_hash = hash;
+    }
+    poll->next = time(NULL) + bnet_poll_jitter(poll->interval);
+    purple_debug_misc("bnet", "Poll %d: next in %u seconds\n", kind, poll->interval);
+}
+
+// the user did something that makes a change more likely: poll at the fastest rate again
+static void
+bnet_poll_tighten(BnetConnectionData *bnet, BnetPollKind kind)
+{
+    BnetPollState *poll = &bnet->bncs.chat_env.polls[kind];
+    time_t soonest;
+
+    if (poll->min_interval == 0) {
+        return;
+    }
+
+    soonest = time(NULL) + bnet_poll_jitter(poll->min_interval);
+    poll->interval = poll->min_interval;
+    if (poll->next > soonest) {
+        poll->next = soonest;
+    }
+}
+
 static gboolean
 bnet_updatelist_timer(BnetConnectionData *bnet)
 {
-    // keep alive every 30 seconds
-    int tick = ++bnet->bncs.chat_env.updatelist_timer_tick;
+    time_t now = time(NULL);
 
     if (!bnet_is_telnet(bnet)) {
-        if (bnet_is_w3(bnet) || bnet_is_scrt(bnet)) {
-            // SID_FRIENDSLIST: every 4 minutes for fl updating clients
-            if ((tick % 8) == 0) {
-                bnet_send_FRIENDSLIST(bnet);
-            }
-        } else {
-            // SID_FRIENDSLIST: every 1 minute for non-fl updating clients
-            if ((tick % 2) == 0) {
-                bnet_send_FRIENDSLIST(bnet);
-            }
+        if (bnet_poll_due(bnet, BNET_POLL_FRIENDS, now)) {
+            bnet_send_FRIENDSLIST(bnet);
         }
 
         if (bnet_clan_in_clan(bnet)) {
-            // SID_CLANMEMBERLIST; every 16 minutes, 1 minute before the 4th SID_FRIENDSLIST and 1 minute after the 3rd SID_CLANMOTD
-            if ((tick % 32) == 30) { // 0 8 16 24 32
+            if (bnet_poll_due(bnet, BNET_POLL_CLANMEMBERS, now)) {
                 int memblist_cookie = bnet_packet_cookie_register(bnet,
                         BNET_SID_CLANMEMBERLIST, NULL);
                 bnet_send_CLANMEMBERLIST(bnet, memblist_cookie);
             }
 
-            // SID_MOTD; every 4 minutes, 4 minutes before and after every SID_FRIENDSLIST
-            if ((tick % 8) == 4) { 
+            if (bnet_poll_due(bnet, BNET_POLL_CLANMOTD, now)) {
                 int motd_cookie = bnet_packet_cookie_register(bnet,
                         BNET_SID_CLANMOTD, NULL);
                 bnet_send_CLANMOTD(bnet, motd_cookie);
@@ -2982,8 +4836,7 @@ bnet_recv_STARTVERSIONING(BnetConnectionData *bnet, BnetPacket *pkt)
     char* mpq_fn = bnet_packet_read_cstring(pkt);
     char* checksum_formula = bnet_packet_read_cstring(pkt);
 
-    bnet_bnls_send_VERSIONCHECKEX2(bnet,
-            bnet->bncs.logon.type, bnet->bncs.logon.server_cookie, bnet->bncs.logon.session_cookie, mpq_ft, mpq_fn, checksum_formula);
+    bnet_versioning_check(bnet, mpq_ft, mpq_fn, checksum_formula);
 
     g_free(mpq_fn);
     g_free(checksum_formula);
@@ -3053,6 +4906,11 @@ bnet_recv_REPORTVERSION(BnetConnectionData *bnet, BnetPacket *pkt)
             break;
     }
 
+    if (bnet_versioning_cache_forget(bnet)) {
+        // retry with fresh version information
+        conn_error = PURPLE_CONNECTION_ERROR_NETWORK_ERROR;
+    }
+
     tmpe = g_strdup_printf(" (%s)", extra_info);
     tmpf = g_strdup_printf(tmp, strlen(extra_info) > 0 ? tmpe : "");
     purple_connection_error_reason(gc, conn_error, tmpf);
@@ -3075,6 +4933,12 @@ bnet_recv_ENTERCHAT(BnetConnectionData *bnet, BnetPacket *pkt)
     purple_connection_set_display_name(bnet->account->gc, bnet->bncs.logon.username);
     g_free(account);
 
+    bnet_logon_trace_mark(bnet, BNET_LOGON_MARK_ENTERCHAT);
+    bnet_logon_trace_finish(bnet, "ok");
+
+    // SID_CLANINFO comes before SID_ENTERCHAT for clan members
+    bnet_clan_sweep_stale(bnet);
+
     if (bnet_is_d2(bnet) || bnet_is_w3(bnet)) {
         // reset news count
         bnet_news_load(bnet);
@@ -3087,6 +4951,10 @@ bnet_recv_GETCHANNELLIST(BnetConnectionData *bnet, BnetPacket *pkt)
 {
     char *channel = NULL;
 
+    // replaces the list from the last request (or the data cache)
+    _g_list_free_full(bnet->bncs.chat_env.channel_list, g_free);
+    bnet->bncs.chat_env.channel_list = NULL;
+
     while (TRUE) {
         channel = bnet_packet_read_cstring(pkt);
         if (channel == NULL) {
@@ -4155,7 +6023,8 @@ bnet_entered_chat(BnetConnectionData *bnet)
     bnet->bncs.chat_env.first_join = TRUE;
     bnet->bncs.channel.seen_self = FALSE;
 
-    bnet->bncs.chat_env.updatelist_timer_handle = purple_timeout_add_seconds(30, (GSourceFunc)bnet_updatelist_timer, bnet);
+    bnet_poll_init(bnet);
+    bnet->bncs.chat_env.updatelist_timer_handle = purple_timeout_add_seconds(BNET_POLL_TICK, (GSourceFunc)bnet_updatelist_timer, bnet);
 
     purple_connection_set_display_name(gc, bnet->bncs.chat_env.unique_name);
     purple_connection_set_state(gc, PURPLE_CONNECTED);
@@ -4251,309 +6120,348 @@ bnet_recv_PING(BnetConnectionData *bnet, BnetPacket *pkt)
 }
 
 static void
-bnet_recv_READUSERDATA(BnetConnectionData *bnet, BnetPacket *pkt)
+bnet_userdata_request_process(BnetConnectionData *bnet, const BnetUserDataRequest *req,
+        const gchar *username, GHashTable *userdata)
 {
-    // readuserdata
-    guint32 key_count, request_cookie/*, account_count*/;
-    int i, j;
-    /*account_count = */bnet_packet_read_dword(pkt); // always 1
-    key_count = bnet_packet_read_dword(pkt);
-    request_cookie = bnet_packet_read_dword(pkt);
+    gboolean showing_lookup_dialog = FALSE;
+    gboolean is_profile_editor;
+    BnetUserDataRequestType request_type = bnet_userdata_request_get_type(req);
+    char *pstr = NULL;
+    int j;
 
-    for (i = 0; i < g_list_length(bnet->bncs.user_data.requests); i++) {
-        BnetUserDataRequest *req = g_list_nth_data(bnet->bncs.user_data.requests, i);
-        if (bnet_userdata_request_get_cookie(req) == request_cookie) {
-            GHashTable *userdata = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
-            gboolean showing_lookup_dialog = FALSE;
-            BnetUserDataRequestType request_type = bnet_userdata_request_get_type(req);
-            char *pstr = NULL;
-
-            for (j = 0; j < key_count; j++) {
-                g_hash_table_insert(userdata,
-                        bnet_userdata_request_get_key_by_index(req, j),
-                        bnet_packet_read_cstring(pkt));
-            }
-
-            if (!bnet->bncs.user_data.writing_profile &&
-                    bnet->bncs.lookup_info.flags & BNET_LOOKUP_INFO_AWAIT_USER_DATA) {
-                bnet->bncs.lookup_info.flags &= ~BNET_LOOKUP_INFO_AWAIT_USER_DATA;
-                if (!(bnet->bncs.lookup_info.flags & BNET_LOOKUP_INFO_CANCELLED)) {
-                    showing_lookup_dialog = TRUE;
-
-                    if (!bnet->bncs.lookup_info.prpl_notify_handle) {
-                        bnet->bncs.lookup_info.prpl_notify_handle = purple_notify_user_info_new();
-                    } else if (!(bnet->bncs.lookup_info.flags & BNET_LOOKUP_INFO_FIRST_SECTION)) {
-                        purple_notify_user_info_add_section_break(bnet->bncs.lookup_info.prpl_notify_handle);
-                    }
-                    bnet->bncs.lookup_info.flags &= ~BNET_LOOKUP_INFO_FIRST_SECTION;
-                    purple_debug_info("bnet", "Lookup complete: USER_DATA(%s)\n", bnet->bncs.lookup_info.name);
-                } else {
-                    purple_debug_info("bnet", "Lookup complete: USER_DATA([freed])\n");
-                }
-            }
+    if (request_type & BNET_READUSERDATA_REQUEST_ROSTER) {
+        // the roster table is built from the cache once every member has answered
+        bnet_clan_roster_accounts_done(bnet, 1);
+        return;
+    }
 
-            if (request_type & BNET_READUSERDATA_REQUEST_PROFILE) {
-                if (bnet->bncs.user_data.writing_profile) {
-                    gchar *psex = bnet_to_utf8_crlf(g_hash_table_lookup(userdata, "profile\\sex"));
-                    gchar *page = bnet_to_utf8_crlf(g_hash_table_lookup(userdata, "profile\\age"));
-                    gchar *ploc = bnet_to_utf8_crlf(g_hash_table_lookup(userdata, "profile\\location"));
-                    gchar *pdescr = bnet_to_utf8_crlf(g_hash_table_lookup(userdata, "profile\\description"));
-                    purple_debug_info("bnet", "Current values: sex=%s age=%s loc=%s desc=%s\n", psex, page, ploc, pdescr);
-                    bnet_profile_show_write_dialog(bnet, psex, page, ploc, pdescr);
-                    g_free(psex);
-                    g_free(page);
-                    g_free(ploc);
-                    g_free(pdescr);
-                } else if (showing_lookup_dialog) {
-                    gchar *pstr_utf8 = NULL;
-                    int section_count = 0;
-
-                    // profile\sex
-                    pstr = g_hash_table_lookup(userdata, "profile\\sex");
-                    if (pstr != NULL && strlen(pstr) > 0) {
-                        pstr_utf8 = bnet_to_utf8_crlf(pstr);
-                        purple_notify_user_info_add_pair(bnet->bncs.lookup_info.prpl_notify_handle, "Profile sex", pstr_utf8);
-                        g_free(pstr_utf8);
-                        section_count++;
-                    }
+    // a batch can hold the profile editor's own request and lookups for other users
+    is_profile_editor = bnet->bncs.user_data.writing_profile &&
+        (request_type & BNET_READUSERDATA_REQUEST_PROFILE) &&
+        g_ascii_strcasecmp(username, bnet->bncs.logon.username) == 0;
 
-                    // profile\age
-                    pstr = g_hash_table_lookup(userdata, "profile\\age");
-                    if (pstr != NULL && strlen(pstr) > 0) {
-                        pstr_utf8 = bnet_to_utf8_crlf(pstr);
-                        purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, "Profile age", pstr_utf8);
-                        g_free(pstr_utf8);
-                        section_count++;
-                    }
+    if (!is_profile_editor &&
+            bnet->bncs.lookup_info.flags & BNET_LOOKUP_INFO_AWAIT_USER_DATA &&
+            bnet->bncs.lookup_info.name != NULL &&
+            g_ascii_strcasecmp(username, bnet_account_normalize(bnet->account, bnet->bncs.lookup_info.name)) == 0) {
+        bnet->bncs.lookup_info.flags &= ~BNET_LOOKUP_INFO_AWAIT_USER_DATA;
+        if (!(bnet->bncs.lookup_info.flags & BNET_LOOKUP_INFO_CANCELLED)) {
+            showing_lookup_dialog = TRUE;
 
-                    // profile\location
-                    pstr = g_hash_table_lookup(userdata, "profile\\location");
-                    if (pstr != NULL && strlen(pstr) > 0) {
-                        pstr_utf8 = bnet_to_utf8_crlf(pstr);
-                        purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, "Profile location", pstr_utf8);
-                        g_free(pstr_utf8);
-                        section_count++;
-                    }
+            if (!bnet->bncs.lookup_info.prpl_notify_handle) {
+                bnet->bncs.lookup_info.prpl_notify_handle = purple_notify_user_info_new();
+            } else if (!(bnet->bncs.lookup_info.flags & BNET_LOOKUP_INFO_FIRST_SECTION)) {
+                purple_notify_user_info_add_section_break(bnet->bncs.lookup_info.prpl_notify_handle);
+            }
+            bnet->bncs.lookup_info.flags &= ~BNET_LOOKUP_INFO_FIRST_SECTION;
+            purple_debug_info("bnet", "Lookup complete: USER_DATA(%s)\n", bnet->bncs.lookup_info.name);
+        } else {
+            purple_debug_info("bnet", "Lookup complete: USER_DATA([freed])\n");
+        }
+    }
+
+    if (request_type & BNET_READUSERDATA_REQUEST_PROFILE) {
+        if (is_profile_editor) {
+            gchar *psex = bnet_to_utf8_crlf(bnet_userdata_cache_value(userdata, "profile\\sex"));
+            gchar *page = bnet_to_utf8_crlf(bnet_userdata_cache_value(userdata, "profile\\age"));
+            gchar *ploc = bnet_to_utf8_crlf(bnet_userdata_cache_value(userdata, "profile\\location"));
+            gchar *pdescr = bnet_to_utf8_crlf(bnet_userdata_cache_value(userdata, "profile\\description"));
+            purple_debug_info("bnet", "Current values: sex=%s age=%s loc=%s desc=%s\n", psex, page, ploc, pdescr);
+            bnet_profile_show_write_dialog(bnet, psex, page, ploc, pdescr);
+            g_free(psex);
+            g_free(page);
+            g_free(ploc);
+            g_free(pdescr);
+        } else if (showing_lookup_dialog) {
+            gchar *pstr_utf8 = NULL;
+            int section_count = 0;
+
+            // profile\sex
+            pstr = bnet_userdata_cache_value(userdata, "profile\\sex");
+            if (pstr != NULL && strlen(pstr) > 0) {
+                pstr_utf8 = bnet_to_utf8_crlf(pstr);
+                purple_notify_user_info_add_pair(bnet->bncs.lookup_info.prpl_notify_handle, "Profile sex", pstr_utf8);
+                g_free(pstr_utf8);
+                section_count++;
+            }
+
+            // profile\age
+            pstr = bnet_userdata_cache_value(userdata, "profile\\age");
+            if (pstr != NULL && strlen(pstr) > 0) {
+                pstr_utf8 = bnet_to_utf8_crlf(pstr);
+                purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, "Profile age", pstr_utf8);
+                g_free(pstr_utf8);
+                section_count++;
+            }
+
+            // profile\location
+            pstr = bnet_userdata_cache_value(userdata, "profile\\location");
+            if (pstr != NULL && strlen(pstr) > 0) {
+                pstr_utf8 = bnet_to_utf8_crlf(pstr);
+                purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, "Profile location", pstr_utf8);
+                g_free(pstr_utf8);
+                section_count++;
+            }
+
+            // profile\description
+            pstr = bnet_userdata_cache_value(userdata, "profile\\description");
+            if (pstr != NULL && strlen(pstr) > 0) {
+                gchar *tmp;
+                pstr_utf8 = bnet_to_utf8_crlf(pstr);
+                tmp = g_strdup_printf("\r\n%s", pstr_utf8);
+                purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, "Profile description", tmp);
+                g_free(pstr_utf8);
+                g_free(tmp);
+                section_count++;
+            }
 
-                    // profile\description
-                    pstr = g_hash_table_lookup(userdata, "profile\\description");
-                    if (pstr != NULL && strlen(pstr) > 0) {
-                        gchar *tmp;
-                        pstr_utf8 = bnet_to_utf8_crlf(pstr);
-                        tmp = g_strdup_printf("\r\n%s", pstr_utf8);
-                        purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, "Profile description", tmp);
-                        g_free(pstr_utf8);
-                        g_free(tmp);
-                        section_count++;
-                    }
+            if (section_count == 0) {
+                purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, "Profile", 
+                        "No information is stored in this user's profile.");
+            }
+        }
+    }
 
-                    if (section_count == 0) {
-                        purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, "Profile", 
-                                "No information is stored in this user's profile.");
-                    }
+    if (request_type & BNET_READUSERDATA_REQUEST_SYSTEM) {
+        if (showing_lookup_dialog) {
+            gboolean is_section = FALSE;
+
+            // System\Time Logged
+            pstr = bnet_userdata_cache_value(userdata, "System\\Time Logged");
+            if (pstr != NULL && strlen(pstr) > 0) {
+                gchar *str_sec = bnet_format_strsec(pstr);
+                if (!is_section) {
+                    purple_notify_user_info_add_section_break(bnet->bncs.lookup_info.prpl_notify_handle);
+                    is_section = TRUE;
                 }
+
+                purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, "Account time logged", str_sec);
+                g_free(str_sec);
             }
 
-            if (request_type & BNET_READUSERDATA_REQUEST_SYSTEM) {
-                if (showing_lookup_dialog) {
-                    gboolean is_section = FALSE;
+            // System\Account Created
+            pstr = bnet_userdata_cache_value(userdata, "System\\Account Created");
+            if (pstr != NULL && strlen(pstr) > 0) {
+                gchar *str_time = bnet_format_filetime_string(pstr);
+                if (!is_section) {
+                    purple_notify_user_info_add_section_break(bnet->bncs.lookup_info.prpl_notify_handle);
+                    is_section = TRUE;
+                }
 
-                    // System\Time Logged
-                    pstr = g_hash_table_lookup(userdata, "System\\Time Logged");
-                    if (pstr != NULL && strlen(pstr) > 0) {
-                        gchar *str_sec = bnet_format_strsec(pstr);
-                        if (!is_section) {
-                            purple_notify_user_info_add_section_break(bnet->bncs.lookup_info.prpl_notify_handle);
-                            is_section = TRUE;
-                        }
+                purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, "Account creation time", str_time);
+                g_free(str_time);
+            }
 
-                        purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, "Account time logged", str_sec);
-                        g_free(str_sec);
-                    }
+            // System\Account Expires
+            pstr = bnet_userdata_cache_value(userdata, "System\\Account Expires");
+            if (pstr != NULL && strlen(pstr) > 0) {
+                gchar *str_time = bnet_format_filetime_string(pstr);
+                if (!is_section) {
+                    purple_notify_user_info_add_section_break(bnet->bncs.lookup_info.prpl_notify_handle);
+                    is_section = TRUE;
+                }
 
-                    // System\Account Created
-                    pstr = g_hash_table_lookup(userdata, "System\\Account Created");
-                    if (pstr != NULL && strlen(pstr) > 0) {
-                        gchar *str_time = bnet_format_filetime_string(pstr);
-                        if (!is_section) {
-                            purple_notify_user_info_add_section_break(bnet->bncs.lookup_info.prpl_notify_handle);
-                            is_section = TRUE;
-                        }
+                purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, "Account expires time", str_time);
+                g_free(str_time);
+            }
 
-                        purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, "Account creation time", str_time);
-                        g_free(str_time);
-                    }
+            // System\Last Logoff
+            pstr = bnet_userdata_cache_value(userdata, "System\\Last Logoff");
+            if (pstr != NULL && strlen(pstr) > 0) {
+                gchar *str_time = bnet_format_filetime_string(pstr);
+                if (!is_section) {
+                    purple_notify_user_info_add_section_break(bnet->bncs.lookup_info.prpl_notify_handle);
+                    is_section = TRUE;
+                }
 
-                    // System\Account Expires
-                    pstr = g_hash_table_lookup(userdata, "System\\Account Expires");
-                    if (pstr != NULL && strlen(pstr) > 0) {
-                        gchar *str_time = bnet_format_filetime_string(pstr);
-                        if (!is_section) {
-                            purple_notify_user_info_add_section_break(bnet->bncs.lookup_info.prpl_notify_handle);
-                            is_section = TRUE;
-                        }
+                purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, "Account last logged off", str_time);
+                g_free(str_time);
+            }
 
-                        purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, "Account expires time", str_time);
-                        g_free(str_time);
-                    }
+            // System\Last Logon
+            pstr = bnet_userdata_cache_value(userdata, "System\\Last Logon");
+            if (pstr != NULL && strlen(pstr) > 0) {
+                gchar *str_time = bnet_format_filetime_string(pstr);
+                if (!is_section) {
+                    purple_notify_user_info_add_section_break(bnet->bncs.lookup_info.prpl_notify_handle);
+                    is_section = TRUE;
+                }
 
-                    // System\Last Logoff
-                    pstr = g_hash_table_lookup(userdata, "System\\Last Logoff");
-                    if (pstr != NULL && strlen(pstr) > 0) {
-                        gchar *str_time = bnet_format_filetime_string(pstr);
-                        if (!is_section) {
-                            purple_notify_user_info_add_section_break(bnet->bncs.lookup_info.prpl_notify_handle);
-                            is_section = TRUE;
-                        }
+                purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, "Account last logged on", str_time);
+                g_free(str_time);
+            }
+        }
+    }
 
-                        purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, "Account last logged off", str_time);
-                        g_free(str_time);
-                    }
+    if (request_type & BNET_READUSERDATA_REQUEST_RECORD) {
+        if (showing_lookup_dialog) {
+            gboolean is_section = FALSE;
 
-                    // System\Last Logon
-                    pstr = g_hash_table_lookup(userdata, "System\\Last Logon");
-                    if (pstr != NULL && strlen(pstr) > 0) {
-                        gchar *str_time = bnet_format_filetime_string(pstr);
-                        if (!is_section) {
-                            purple_notify_user_info_add_section_break(bnet->bncs.lookup_info.prpl_notify_handle);
-                            is_section = TRUE;
-                        }
+            for (j = 0; j < 4; j++) {
+                char *zero = "0";
+                char *key; char *prpl_key; char *prpl_val;
+                char *wins; char *losses; char *discs; char *lgame; char *lgameres;
+                char *rating; char *hrating; char *rank; char *hrank;
+                char *header_text = NULL;
+                char *product_id = bnet_get_product_id_str(bnet_userdata_request_get_product(req));
+                const char *product = bnet_get_product_name(bnet_userdata_request_get_product(req));
 
-                        purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, "Account last logged on", str_time);
-                        g_free(str_time);
-                    }
+                switch (j) {
+                    case 0: header_text = "Normal"; break;
+                    case 1: header_text = "Ladder"; break;
+                    case 3: header_text = "IronMan"; break;
                 }
-            }
-
-            if (request_type & BNET_READUSERDATA_REQUEST_RECORD) {
-                if (showing_lookup_dialog) {
-                    gboolean is_section = FALSE;
 
-                    for (j = 0; j < 4; j++) {
-                        char *zero = "0";
-                        char *key; char *prpl_key; char *prpl_val;
-                        char *wins; char *losses; char *discs; char *lgame; char *lgameres;
-                        char *rating; char *hrating; char *rank; char *hrank;
-                        char *header_text = NULL;
-                        char *product_id = bnet_get_product_id_str(bnet_userdata_request_get_product(req));
-                        const char *product = bnet_get_product_name(bnet_userdata_request_get_product(req));
+                key = g_strdup_printf("Record\\%s\\%d\\wins", product_id, j);
+                wins = bnet_userdata_cache_value(userdata, key);
+                purple_debug_info("bnet", "key: %s  value: %s\n", key, wins);
+                g_free(key);
+                key = g_strdup_printf("Record\\%s\\%d\\losses", product_id, j);
+                losses = bnet_userdata_cache_value(userdata, key);
+                purple_debug_info("bnet", "key: %s  value: %s\n", key, losses);
+                g_free(key);
+                key = g_strdup_printf("Record\\%s\\%d\\disconnects", product_id, j);
+                discs = bnet_userdata_cache_value(userdata, key);
+                purple_debug_info("bnet", "key: %s  value: %s\n", key, discs);
+                g_free(key);
+                key = g_strdup_printf("Record\\%s\\%d\\last game", product_id, j);
+                lgame = bnet_userdata_cache_value(userdata, key);
+                purple_debug_info("bnet", "key: %s  value: %s\n", key, lgame);
+                g_free(key);
+                key = g_strdup_printf("Record\\%s\\%d\\last game result", product_id, j);
+                lgameres = bnet_userdata_cache_value(userdata, key);
+                purple_debug_info("bnet", "key: %s  value: %s\n", key, lgameres);
+                g_free(key);
+
+                if (wins != NULL && losses != NULL && discs != NULL &&
+                        lgame != NULL && lgameres != NULL) {
+                    if (!is_section) {
+                        purple_notify_user_info_add_section_break(bnet->bncs.lookup_info.prpl_notify_handle);
+                        is_section = TRUE;
+                    }
 
-                        switch (j) {
-                            case 0: header_text = "Normal"; break;
-                            case 1: header_text = "Ladder"; break;
-                            case 3: header_text = "IronMan"; break;
-                        }
+                    if (strlen(wins) == 0) wins = zero;
+                    if (strlen(losses) == 0) losses = zero;
+                    if (strlen(discs) == 0) discs = zero;
+                    if (strlen(lgame) == 0 || strcmp(lgameres, "NONE") == 0) {
+                        lgame = "never";
+                    } else {
+                        char *tmp = bnet_format_filetime_string(lgame);
+                        lgame = g_strdup_printf("%s on %s", lgameres, tmp);
+                        g_free(tmp);
+                    }
 
-                        key = g_strdup_printf("Record\\%s\\%d\\wins", product_id, j);
-                        wins = g_hash_table_lookup(userdata, key);
-                        purple_debug_info("bnet", "key: %s  value: %s\n", key, wins);
-                        g_free(key);
-                        key = g_strdup_printf("Record\\%s\\%d\\losses", product_id, j);
-                        losses = g_hash_table_lookup(userdata, key);
-                        purple_debug_info("bnet", "key: %s  value: %s\n", key, losses);
-                        g_free(key);
-                        key = g_strdup_printf("Record\\%s\\%d\\disconnects", product_id, j);
-                        discs = g_hash_table_lookup(userdata, key);
-                        purple_debug_info("bnet", "key: %s  value: %s\n", key, discs);
-                        g_free(key);
-                        key = g_strdup_printf("Record\\%s\\%d\\last game", product_id, j);
-                        lgame = g_hash_table_lookup(userdata, key);
-                        purple_debug_info("bnet", "key: %s  value: %s\n", key, lgame);
-                        g_free(key);
-                        key = g_strdup_printf("Record\\%s\\%d\\last game result", product_id, j);
-                        lgameres = g_hash_table_lookup(userdata, key);
-                        purple_debug_info("bnet", "key: %s  value: %s\n", key, lgameres);
-                        g_free(key);
-
-                        if (wins != NULL && losses != NULL && discs != NULL &&
-                                lgame != NULL && lgameres != NULL) {
-                            if (!is_section) {
-                                purple_notify_user_info_add_section_break(bnet->bncs.lookup_info.prpl_notify_handle);
-                                is_section = TRUE;
-                            }
+                    prpl_key = g_strdup_printf("%s record for %s", header_text, product);
+                    prpl_val = g_strdup_printf("%s-%s-%s", wins, losses, discs);
+                    purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, prpl_key, prpl_val);
+                    g_free(prpl_key);
+                    g_free(prpl_val);
 
-                            if (strlen(wins) == 0) wins = zero;
-                            if (strlen(losses) == 0) losses = zero;
-                            if (strlen(discs) == 0) discs = zero;
-                            if (strlen(lgame) == 0 || strcmp(lgameres, "NONE") == 0) {
-                                lgame = "never";
-                            } else {
-                                char *tmp = bnet_format_filetime_string(lgame);
-                                lgame = g_strdup_printf("%s on %s", lgameres, tmp);
-                                g_free(tmp);
-                            }
+                    prpl_key = g_strdup_printf("Last %s game", header_text);
+                    purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, prpl_key, lgame);
+                    g_free(prpl_key);
+                }
 
-                            prpl_key = g_strdup_printf("%s record for %s", header_text, product);
-                            prpl_val = g_strdup_printf("%s-%s-%s", wins, losses, discs);
-                            purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, prpl_key, prpl_val);
-                            g_free(prpl_key);
-                            g_free(prpl_val);
+                key = g_strdup_printf("Record\\%s\\%d\\rating", product_id, j);
+                rating = bnet_userdata_cache_value(userdata, key);
+                purple_debug_info("bnet", "key: %s  value: %s\n", key, rating);
+                g_free(key);
+                key = g_strdup_printf("Record\\%s\\%d\\high rating", product_id, j);
+                hrating = bnet_userdata_cache_value(userdata, key);
+                purple_debug_info("bnet", "key: %s  value: %s\n", key, hrating);
+                g_free(key);
+                key = g_strdup_printf("DynKey\\%s\\%d\\rank", product_id, j);
+                rank = bnet_userdata_cache_value(userdata, key);
+                purple_debug_info("bnet", "key: %s  value: %s\n", key, rank);
+                g_free(key);
+                key = g_strdup_printf("Record\\%s\\%d\\high rank", product_id, j);
+                hrank = bnet_userdata_cache_value(userdata, key);
+                purple_debug_info("bnet", "key: %s  value: %s\n", key, hrank);
+                g_free(key);
+
+                if (rating != NULL && hrating != NULL &&
+                        rank != NULL && hrank != NULL) {
+
+                    if (!is_section) {
+                        purple_notify_user_info_add_section_break(bnet->bncs.lookup_info.prpl_notify_handle);
+                        is_section = TRUE;
+                    }
 
-                            prpl_key = g_strdup_printf("Last %s game", header_text);
-                            purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, prpl_key, lgame);
-                            g_free(prpl_key);
-                        }
+                    if (strlen(rating) == 0) rating = zero;
+                    if (strlen(hrating) == 0) hrating = zero;
+                    if (strlen(rank) == 0) rank = zero;
+                    if (strlen(hrank) == 0) hrank = zero;
 
-                        key = g_strdup_printf("Record\\%s\\%d\\rating", product_id, j);
-                        rating = g_hash_table_lookup(userdata, key);
-                        purple_debug_info("bnet", "key: %s  value: %s\n", key, rating);
-                        g_free(key);
-                        key = g_strdup_printf("Record\\%s\\%d\\high rating", product_id, j);
-                        hrating = g_hash_table_lookup(userdata, key);
-                        purple_debug_info("bnet", "key: %s  value: %s\n", key, hrating);
-                        g_free(key);
-                        key = g_strdup_printf("DynKey\\%s\\%d\\rank", product_id, j);
-                        rank = g_hash_table_lookup(userdata, key);
-                        purple_debug_info("bnet", "key: %s  value: %s\n", key, rank);
-                        g_free(key);
-                        key = g_strdup_printf("Record\\%s\\%d\\high rank", product_id, j);
-                        hrank = g_hash_table_lookup(userdata, key);
-                        purple_debug_info("bnet", "key: %s  value: %s\n", key, hrank);
-                        g_free(key);
-
-                        if (rating != NULL && hrating != NULL &&
-                                rank != NULL && hrank != NULL) {
-
-                            if (!is_section) {
-                                purple_notify_user_info_add_section_break(bnet->bncs.lookup_info.prpl_notify_handle);
-                                is_section = TRUE;
-                            }
+                    prpl_key = g_strdup_printf("%s rating", header_text);
+                    prpl_val = g_strdup_printf("%s (high: %s)", rating, hrating);
+                    purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, prpl_key, prpl_val);
+                    g_free(prpl_key);
+                    g_free(prpl_val);
 
-                            if (strlen(rating) == 0) rating = zero;
-                            if (strlen(hrating) == 0) hrating = zero;
-                            if (strlen(rank) == 0) rank = zero;
-                            if (strlen(hrank) == 0) hrank = zero;
-
-                            prpl_key = g_strdup_printf("%s rating", header_text);
-                            prpl_val = g_strdup_printf("%s (high: %s)", rating, hrating);
-                            purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, prpl_key, prpl_val);
-                            g_free(prpl_key);
-                            g_free(prpl_val);
-
-                            prpl_key = g_strdup_printf("%s rank", header_text);
-                            prpl_val = g_strdup_printf("%s (high: %s)", rank, hrank);
-                            purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, prpl_key, prpl_val);
-                            g_free(prpl_key);
-                            g_free(prpl_val);
-                        }
-                    }
+                    prpl_key = g_strdup_printf("%s rank", header_text);
+                    prpl_val = g_strdup_printf("%s (high: %s)", rank, hrank);
+                    purple_notify_user_info_add_pair_plaintext(bnet->bncs.lookup_info.prpl_notify_handle, prpl_key, prpl_val);
+                    g_free(prpl_key);
+                    g_free(prpl_val);
                 }
             }
+        }
+    }
 
-            if (showing_lookup_dialog) {
-                if (!(bnet->bncs.lookup_info.flags & BNET_LOOKUP_INFO_AWAIT_MASK)) {
-                    purple_notify_userinfo(bnet->account->gc, bnet->bncs.lookup_info.name,
-                            bnet->bncs.lookup_info.prpl_notify_handle, bnet_lookup_info_close, bnet);
-                }
-            }
+    if (showing_lookup_dialog) {
+        if (!(bnet->bncs.lookup_info.flags & BNET_LOOKUP_INFO_AWAIT_MASK)) {
+            purple_notify_userinfo(bnet->account->gc, bnet->bncs.lookup_info.name,
+                    bnet->bncs.lookup_info.prpl_notify_handle, bnet_lookup_info_close, bnet);
+        }
+    }
+}
+
+static void
+bnet_recv_READUSERDATA(BnetConnectionData *bnet, BnetPacket *pkt)
+{
+    // readuserdata
+    guint32 account_count, key_count, request_cookie;
+    BnetUserDataRequest *req;
+    int i, j;
 
-            bnet->bncs.user_data.requests = g_list_remove(bnet->bncs.user_data.requests, req);
+    account_count = bnet_packet_read_dword(pkt);
+    key_count = bnet_packet_read_dword(pkt);
+    request_cookie = bnet_packet_read_dword(pkt);
+
+    req = bnet_packet_cookie_unregister(bnet, BNET_SID_READUSERDATA, request_cookie);
+    if (req == NULL) {
+        purple_debug_warning("bnet", "Received SID_READUSERDATA for unknown request %u\n", request_cookie);
+        return;
+    }
+
+    if (account_count != bnet_userdata_request_get_account_count(req) ||
+            key_count != g_strv_length(bnet_userdata_request_get_keys(req))) {
+        purple_debug_warning("bnet", "SID_READUSERDATA response %u does not match its request\n", request_cookie);
+        // the cookie is gone, so the expiry will not finish the lookup either
+        if (bnet_userdata_request_get_type(req) & BNET_READUSERDATA_REQUEST_ROSTER) {
+            bnet_clan_roster_accounts_done(bnet, bnet_userdata_request_get_account_count(req));
+        } else if (bnet_lookup_info_awaits_userdata(bnet, req)) {
+            bnet_lookup_info_step_failed(bnet, BNET_LOOKUP_INFO_AWAIT_USER_DATA);
+        }
+        bnet_userdata_request_free(req);
+        return;
+    }
 
-            g_hash_table_destroy(userdata);
+    // values are sent account-major: every key of the first account, then the next
+    for (i = 0; i < account_count; i++) {
+        const gchar *username = bnet_userdata_request_get_account_by_index(req, i);
+        GHashTable *userdata = bnet_userdata_cache_get_account(bnet, username, TRUE);
 
-            bnet_userdata_request_free(req);
+        for (j = 0; j < key_count; j++) {
+            bnet_userdata_cache_store(userdata,
+                    bnet_userdata_request_get_key_by_index(req, j),
+                    bnet_packet_read_cstring(pkt));
         }
+
+        bnet_userdata_request_process(bnet, req, username, userdata);
     }
+
+    bnet_userdata_request_free(req);
 }
 
 static void
@@ -5257,6 +7165,8 @@ bnet_recv_AUTH_INFO(BnetConnectionData *bnet, BnetPacket *pkt)
     char* mpq_fn = bnet_packet_read_cstring(pkt);
     char* checksum_formula = bnet_packet_read_cstring(pkt);
 
+    bnet_logon_trace_mark(bnet, BNET_LOGON_MARK_AUTH_INFO);
+
     //purple_debug_info("bnet", "mpqfn: %s; chfm: %s\n",
     //    mpq_fn, checksum_formula);
     bnet->bncs.logon.type = logon_system;
@@ -5289,8 +7199,7 @@ bnet_recv_AUTH_INFO(BnetConnectionData *bnet, BnetPacket *pkt)
         }
     }
 
-    bnet_bnls_send_VERSIONCHECKEX2(bnet,
-            logon_system, server_cookie, session_cookie, mpq_ft, mpq_fn, checksum_formula);
+    bnet_versioning_check(bnet, mpq_ft, mpq_fn, checksum_formula);
 
     g_free(mpq_fn);
     g_free(checksum_formula);
@@ -5312,6 +7221,8 @@ bnet_recv_AUTH_CHECK(BnetConnectionData *bnet, BnetPacket *pkt)
 
     PurpleConnectionError conn_error = PURPLE_CONNECTION_ERROR_AUTHENTICATION_FAILED;
 
+    bnet_logon_trace_mark(bnet, BNET_LOGON_MARK_AUTH_CHECK);
+
     if (result == BNET_SUCCESS) {
         bnet->bncs.versioning.complete = TRUE;
 
@@ -5341,6 +7252,10 @@ bnet_recv_AUTH_CHECK(BnetConnectionData *bnet, BnetPacket *pkt)
                 tmp = "Version invalid%s.";
                 break;
         }
+        if (bnet_versioning_cache_forget(bnet)) {
+            // retry with fresh version information
+            conn_error = PURPLE_CONNECTION_ERROR_NETWORK_ERROR;
+        }
     } else if (result & BNET_AUTH_CHECK_KEYERROR_MASK) {
         guint32 keynum = (result & BNET_AUTH_CHECK_KEYNUMBER_MASK) >> 4;
         switch (result & BNET_AUTH_CHECK_ERROR_MASK) {
@@ -5370,6 +7285,9 @@ bnet_recv_AUTH_CHECK(BnetConnectionData *bnet, BnetPacket *pkt)
         tmp = tmpkn;
     } else if (result & BNET_AUTH_CHECK_VERCODEERROR_MASK) {
         tmp = "Version code invalid%s.";
+        if (bnet_versioning_cache_forget(bnet)) {
+            conn_error = PURPLE_CONNECTION_ERROR_NETWORK_ERROR;
+        }
     } else {
         tmp = "Authorization failed%s.";
     }
@@ -5462,11 +7380,16 @@ bnet_recv_AUTH_ACCOUNTLOGON(BnetConnectionData *bnet, BnetPacket *pkt)
     switch (result) {
         case BNET_SUCCESS:
             {
-                gchar M1[SHA1_HASH_SIZE];
                 gchar *salt = (gchar *)bnet_packet_read(pkt, 32);
                 gchar *B = (gchar *)bnet_packet_read(pkt, 32);
-                srp_get_M1(bnet->bncs.logon.auth_ctx, M1, B, salt);
-                bnet_send_AUTH_ACCOUNTLOGONPROOF(bnet, M1);
+                // SID_AUTH_ACCOUNTLOGONPROOF is sent when M[1] comes back
+                BnetCryptoJob *job = bnet_crypto_job_new(bnet, BNET_CRYPTO_JOB_SRP_PROOF);
+                // the main loop must not touch it while the job runs
+                job->srp = bnet->bncs.logon.auth_ctx;
+                bnet->bncs.logon.auth_ctx = NULL;
+                memcpy(job->salt, salt, 32);
+                memcpy(job->B, B, 32);
+                bnet_crypto_job_submit(job);
                 g_free(salt);
                 g_free(B);
                 return;
@@ -5668,111 +7591,166 @@ bnet_recv_CREATEACCOUNT2(BnetConnectionData *bnet, BnetPacket *pkt)
     g_free(tmp_error);
 }
 
+static BnetFriendInfo *
+bnet_friend_info_new(gchar *account_name)
+{
+    BnetFriendInfo *bfi = g_new0(BnetFriendInfo, 1);
+    bfi->type = BNET_USER_TYPE_FRIEND;
+    bfi->account = account_name;
+    bfi->status = -1;
+    bfi->location = -1;
+    bfi->product = -1;
+    bfi->location_name = g_strdup("");
+    return bfi;
+}
+
+static BnetFriendInfo *
+bnet_friend_find(const BnetConnectionData *bnet, const char *account_name)
+{
+    if (bnet->bncs.friends.by_name == NULL) {
+        return NULL;
+    }
+    return g_hash_table_lookup(bnet->bncs.friends.by_name, bnet_normalize(NULL, account_name));
+}
+
+static void
+bnet_friend_index_add(BnetConnectionData *bnet, BnetFriendInfo *bfi)
+{
+    if (bnet->bncs.friends.list == NULL) {
+        bnet->bncs.friends.list = g_ptr_array_new();
+    }
+    if (bnet->bncs.friends.by_name == NULL) {
+        bnet->bncs.friends.by_name = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+    g_hash_table_replace(bnet->bncs.friends.by_name, g_strdup(bnet_normalize(NULL, bfi->account)), bfi);
+}
+
+static void
+bnet_friend_index_remove(BnetConnectionData *bnet, const BnetFriendInfo *bfi)
+{
+    if (bnet->bncs.friends.by_name != NULL && bfi != NULL) {
+        g_hash_table_remove(bnet->bncs.friends.by_name, bnet_normalize(NULL, bfi->account));
+    }
+}
+
+// frees a friend that is no longer on the Battle.net friend list, and its buddy
+static void
+bnet_friend_remove_buddy(BnetConnectionData *bnet, BnetFriendInfo *bfi)
+{
+    PurpleBuddy *buddy = purple_find_buddy(bnet->account, bfi->account);
+
+    bnet_friend_index_remove(bnet, bfi);
+    bnet_friend_info_free(bfi);
+
+    if (buddy) {
+        // set proto data to NULL so that it doesn't /f r again.
+        purple_buddy_set_protocol_data(buddy, NULL);
+        // remove
+        purple_blist_remove_buddy(buddy);
+    }
+}
+
+static gboolean
+bnet_friend_info_changed(const BnetFriendInfo *bfi, BnetFriendStatus status,
+        BnetFriendLocation location, BnetProductID product_id,
+        const gchar *location_name)
+{
+    return bfi->buddy == NULL ||
+        bfi->status != status || bfi->location != location ||
+        bfi->product != product_id || strcmp(bfi->location_name, location_name) != 0;
+}
+
 static void
 bnet_recv_FRIENDSLIST(BnetConnectionData *bnet, BnetPacket *pkt)
 {
     guint8 fcount = bnet_packet_read_byte(pkt);
     guint8 idx = 0;
-    GList *old_friends_list = bnet->bncs.friends.list;
-    GList *el = NULL;
+    GPtrArray *old_friends_list = bnet->bncs.friends.list;
+    guint i;
+
+    bnet_poll_response(bnet, BNET_POLL_FRIENDS, pkt);
 
-    bnet->bncs.friends.list = NULL;
+    bnet->bncs.friends.list = g_ptr_array_sized_new(fcount);
     purple_debug_info("bnet", "%d friends on list\n", fcount);
 
-    if (fcount > 0) {
-        while (idx < fcount) {
-            BnetFriendInfo *bfi = NULL;
-            BnetFriendInfo *old_bfi = NULL;
+    while (idx < fcount) {
+        BnetFriendInfo *bfi = NULL;
 
-            gchar *account_name = bnet_packet_read_cstring(pkt);
-            BnetFriendStatus status = bnet_packet_read_byte(pkt);
-            BnetFriendLocation location = bnet_packet_read_byte(pkt);
-            BnetProductID product_id = bnet_packet_read_dword(pkt);
-            gchar *location_name = bnet_packet_read_cstring(pkt);
+        gchar *account_name = bnet_packet_read_cstring(pkt);
+        BnetFriendStatus status = bnet_packet_read_byte(pkt);
+        BnetFriendLocation location = bnet_packet_read_byte(pkt);
+        BnetProductID product_id = bnet_packet_read_dword(pkt);
+        gchar *location_name = bnet_packet_read_cstring(pkt);
 
-            el = g_list_first(old_friends_list);
-            while (el != NULL) {
-                if (el->data != NULL) {
-                    if (strcmp(((BnetFriendInfo *)el->data)->account, account_name) == 0) {
-                        old_bfi = el->data;
-                    }
-                }
-                el = g_list_next(el);
-            }
+        bfi = bnet_friend_find(bnet, account_name);
 
-            if (old_bfi == NULL) {
-                bfi = g_new0(BnetFriendInfo, 1);
-                bfi->type = BNET_USER_TYPE_FRIEND;
-                bfi->account = account_name;
-                bfi->status = -1;
-                bfi->location = -1;
-                bfi->product = -1;
-                bfi->location_name = g_strdup("");
-                purple_debug_info("bnet", "Friend diff: %s added\n", bfi->account);
-            } else {
-                bfi = old_bfi;
-                //purple_debug_info("bnet", "Friend diff: %s still on list\n", bfi->account);
-            }
-            bfi->on_list = TRUE;
+        if (bfi == NULL) {
+            bfi = bnet_friend_info_new(account_name);
+            bnet_friend_index_add(bnet, bfi);
+            purple_debug_info("bnet", "Friend diff: %s added\n", bfi->account);
+        } else {
+            g_free(account_name);
+            //purple_debug_info("bnet", "Friend diff: %s still on list\n", bfi->account);
+        }
+        bfi->on_list = TRUE;
 
-            bnet->bncs.friends.list = g_list_append(bnet->bncs.friends.list, bfi);
+        g_ptr_array_add(bnet->bncs.friends.list, bfi);
 
+        if (bnet_friend_info_changed(bfi, status, location, product_id, location_name)) {
+            bfi->stale = FALSE;
             bnet_friend_update(bnet, idx, bfi, status, location, product_id, location_name);
+        } else if (bfi->stale) {
+            // the cached state was right, just drop the stale marker
+            bfi->stale = FALSE;
+            purple_blist_update_node_icon(PURPLE_BLIST_NODE(bfi->buddy));
+        }
 
-            g_free(location_name);
+        g_free(location_name);
 
-            idx++;
-        }
+        idx++;
     }
 
-    el = g_list_first(old_friends_list);
-    while (el != NULL) {
-        if (el->data != NULL) {
-            if (!((BnetFriendInfo *)el->data)->on_list) {
-                PurpleBuddy *buddy;
-                BnetFriendInfo *old_bfi = NULL;
-
-                old_bfi = el->data;
+    if (old_friends_list != NULL) {
+        for (i = 0; i < old_friends_list->len; i++) {
+            BnetFriendInfo *old_bfi = g_ptr_array_index(old_friends_list, i);
+            if (old_bfi != NULL && !old_bfi->on_list) {
                 purple_debug_info("bnet", "Friend diff: %s no longer on list\n", old_bfi->account);
-
-                buddy = purple_find_buddy(bnet->account, old_bfi->account);
-
-                bnet_friend_info_free(old_bfi);
-
-                if (buddy) {
-                    // set proto data to NULL so that it doesn't /f r again.
-                    purple_buddy_set_protocol_data(buddy, NULL);
-                    // remove
-                    purple_blist_remove_buddy(buddy);
-                }
+                bnet_friend_remove_buddy(bnet, old_bfi);
             }
         }
-        el = g_list_next(el);
+        g_ptr_array_free(old_friends_list, TRUE);
     }
 
-    g_list_free(old_friends_list);
-
-    el = g_list_first(bnet->bncs.friends.list);
-    while (el != NULL) {
-        ((BnetFriendInfo *)el->data)->on_list = FALSE;
-        el = g_list_next(el);
+    for (i = 0; i < bnet->bncs.friends.list->len; i++) {
+        ((BnetFriendInfo *)g_ptr_array_index(bnet->bncs.friends.list, i))->on_list = FALSE;
     }
 
     bnet_find_detached_buddies(bnet);
+    bnet_warm_save(bnet);
 }
 
 static void
 bnet_recv_FRIENDSUPDATE(BnetConnectionData *bnet, BnetPacket *pkt)
 {
     guint8 index = bnet_packet_read_byte(pkt);
-    BnetFriendInfo *bfi = g_list_nth_data(bnet->bncs.friends.list, index);
+    BnetFriendInfo *bfi = NULL;
 
     BnetFriendStatus status = bnet_packet_read_byte(pkt);
     BnetFriendLocation location = bnet_packet_read_byte(pkt);
     BnetProductID product_id = bnet_packet_read_dword(pkt);
     gchar *location_name = bnet_packet_read_cstring(pkt);
 
-    bnet_friend_update(bnet, index, bfi, status, location, product_id, location_name);
+    if (bnet->bncs.friends.list != NULL && index < bnet->bncs.friends.list->len) {
+        bfi = g_ptr_array_index(bnet->bncs.friends.list, index);
+    }
+    // positions in a cached list are not trustworthy; the full list follows shortly
+    if (bfi != NULL && bfi->stale) {
+        bfi = NULL;
+    }
+
+    if (bfi != NULL && bnet_friend_info_changed(bfi, status, location, product_id, location_name)) {
+        bnet_friend_update(bnet, index, bfi, status, location, product_id, location_name);
+    }
 
     g_free(location_name);
 }
@@ -5780,8 +7758,8 @@ bnet_recv_FRIENDSUPDATE(BnetConnectionData *bnet, BnetPacket *pkt)
 static void
 bnet_recv_FRIENDSADD(BnetConnectionData *bnet, BnetPacket *pkt)
 {
-    BnetFriendInfo *bfi = g_new0(BnetFriendInfo, 1);
-    guint8 index = g_list_length(bnet->bncs.friends.list);
+    BnetFriendInfo *bfi = NULL;
+    guint8 index;
 
     gchar *account_name = bnet_packet_read_cstring(pkt);
 
@@ -5790,54 +7768,39 @@ bnet_recv_FRIENDSADD(BnetConnectionData *bnet, BnetPacket *pkt)
     BnetProductID product_id = bnet_packet_read_dword(pkt);
     gchar *location_name = bnet_packet_read_cstring(pkt);
 
-    bfi->type = BNET_USER_TYPE_FRIEND;
-    bfi->account = account_name;
-    bfi->status = -1;
-    bfi->location = -1;
-    bfi->product = -1;
-    bfi->location_name = g_strdup("");
+    bfi = bnet_friend_info_new(account_name);
+    bnet_friend_index_add(bnet, bfi);
 
-    bnet->bncs.friends.list = g_list_append(bnet->bncs.friends.list, bfi);
+    index = bnet->bncs.friends.list->len;
+    g_ptr_array_add(bnet->bncs.friends.list, bfi);
 
     bnet_friend_update(bnet, index, bfi, status, location, product_id, location_name);
 
     g_free(location_name);
-
-    //g_free(bfi);
 }
 
 static void
 bnet_recv_FRIENDSREMOVE(BnetConnectionData *bnet, BnetPacket *pkt)
 {
-    PurpleBuddy *buddy = NULL;
     BnetFriendInfo *bfi = NULL;
     guint8 index = bnet_packet_read_byte(pkt);
-    GList *el = g_list_nth(bnet->bncs.friends.list, index);
 
-    g_return_if_fail(el != NULL);
+    g_return_if_fail(bnet->bncs.friends.list != NULL && index < bnet->bncs.friends.list->len);
 
-    bfi = (BnetFriendInfo *) el->data;
-
-    if (bfi == NULL) {
-        // already freed (was a libpurple initiated remove), simply remove link
-        bnet->bncs.friends.list = g_list_remove_link(bnet->bncs.friends.list, el);
-        g_list_free_1(el);
-    } else {
-        // chat command initiated remove, find libpurple buddy
-        buddy = purple_find_buddy(bnet->account, bfi->account);
+    bfi = g_ptr_array_index(bnet->bncs.friends.list, index);
+    if (bfi != NULL && bfi->stale) {
+        // positions in a cached list are not trustworthy; the full list follows shortly
+        return;
+    }
 
-        if (buddy) {
-            // set proto data to NULL so that it doesn't /f r again.
-            purple_buddy_set_protocol_data(buddy, NULL);
-            // remove
-            purple_blist_remove_buddy(buddy);
-            // free locally
-            bnet_friend_info_free(el->data);
-        }
+    // removing by index keeps the positions of the following friends in step with the server
+    bfi = g_ptr_array_remove_index(bnet->bncs.friends.list, index);
 
-        bnet->bncs.friends.list = g_list_remove_link(bnet->bncs.friends.list, el);
-        g_list_free_1(el);
+    if (bfi != NULL) {
+        // chat command initiated remove
+        bnet_friend_remove_buddy(bnet, bfi);
     }
+    // else already freed (was a libpurple initiated remove)
 }
 
 static void
@@ -5845,10 +7808,20 @@ bnet_recv_FRIENDSPOSITION(BnetConnectionData *bnet, BnetPacket *pkt)
 {
     guint8 old_index = bnet_packet_read_byte(pkt);
     guint8 new_index = bnet_packet_read_byte(pkt);
-    GList *bfi_link = g_list_nth(bnet->bncs.friends.list, old_index);
+    GPtrArray *list = bnet->bncs.friends.list;
+    gpointer bfi;
+
+    g_return_if_fail(list != NULL && old_index < list->len && new_index < list->len);
 
-    bnet->bncs.friends.list = g_list_remove_link(bnet->bncs.friends.list, bfi_link);
-    bnet->bncs.friends.list = g_list_insert(bnet->bncs.friends.list, bfi_link->data, new_index);
+    bfi = list->pdata[old_index];
+    if (old_index < new_index) {
+        memmove(&list->pdata[old_index], &list->pdata[old_index + 1],
+                (new_index - old_index) * sizeof(gpointer));
+    } else if (old_index > new_index) {
+        memmove(&list->pdata[new_index + 1], &list->pdata[new_index],
+                (old_index - new_index) * sizeof(gpointer));
+    }
+    list->pdata[new_index] = bfi;
 }
 
 static void
@@ -6023,6 +7996,7 @@ bnet_recv_CLANMOTD(BnetConnectionData *bnet, BnetPacket *pkt)
     const gchar *s_name;
 
     cookie = bnet_packet_read_dword(pkt);
+    bnet_poll_response(bnet, BNET_POLL_CLANMOTD, pkt);
     bnet_packet_read_dword(pkt);
     motd = bnet_packet_read_cstring(pkt);
 
@@ -6048,121 +8022,284 @@ bnet_recv_CLANMOTD(BnetConnectionData *bnet, BnetPacket *pkt)
     g_free(motd);
 }
 
-static void
-bnet_recv_CLANMEMBERLIST(BnetConnectionData *bnet, BnetPacket *pkt)
+static PurpleGroup *
+bnet_clan_get_group(const BnetConnectionData *bnet)
 {
-    guint32 cookie;
-    guint8 number_of_members;
-    GList *members = NULL;
     const gchar *group_name_setting;
+    gchar *clan_tag_text;
     gchar *group_name;
     PurpleGroup *group;
-    BnetClanTag clan_tag;
-    gchar *clan_tag_text;
-    int i;
-    gboolean do_not_free = FALSE;
-
-    cookie = bnet_packet_read_dword(pkt);
-    bnet_packet_cookie_unregister(bnet, BNET_SID_CLANMEMBERLIST, cookie);
-
-    clan_tag = bnet->bncs.w3_clan.my_clantag;
-    clan_tag_text = bnet_tag_to_string(clan_tag);
-
-    number_of_members = bnet_packet_read_byte(pkt);
 
-    purple_debug_info("bnet", "Clan members: %d\n", number_of_members);
-    // get or create default "Buddies" group
+    clan_tag_text = bnet_tag_to_string(bnet->bncs.w3_clan.my_clantag);
+    // get or create the clan group
     group_name_setting = purple_account_get_string(bnet->account, "grpclan", BNET_DEFAULT_GROUP_CLAN);
     group_name = g_strdup_printf(group_name_setting, clan_tag_text);
     group = purple_group_new(group_name);
 
-    for (i = 0; i < number_of_members; i++) {
-        gchar *name = bnet_packet_read_cstring(pkt);
-        BnetClanMemberRank rank = bnet_packet_read_byte(pkt);
-        BnetClanMemberStatus status = bnet_packet_read_byte(pkt);
-        gchar *location = bnet_packet_read_cstring(pkt);
+    g_free(group_name);
+    g_free(clan_tag_text);
+    return group;
+}
 
-        BnetClanMember *member = bnet_clan_member_new(name, rank, status, location);
-        members = g_list_append(members, member);
+static const gchar *
+bnet_clan_member_prpl_status(const BnetClanMember *member)
+{
+    switch (bnet_clan_member_get_status(member)) {
+        case BNET_CLAN_STATUS_OFFLINE:
+            return BNET_STATUS_OFFLINE;
+        case BNET_CLAN_STATUS_ONLINE:
+        default:
+            return BNET_STATUS_ONLINE;
     }
+}
 
-    if (purple_account_get_bool(bnet->account, "showgrpclan", FALSE)) {
-        GList *el = g_list_first(members);
-        for (i = 0; i < number_of_members; i++) {
-            BnetClanMember *member = el->data;
-            gchar *name = bnet_clan_member_get_name(member);
-            const gchar *prpl_status = NULL;
-            GSList *buddies;
-            PurpleBuddy *buddy = NULL;
-            BnetUser *current_member = NULL;
-            gboolean found_mergable;
+// attaches a member to its buddy in the clan group, creating the buddy if needed
+// only buddies that are already clan members, or that we detached on the last
+// disconnect, are reused; a friend's buddy keeps its own BnetFriendInfo
+static void
+bnet_clan_member_show(BnetConnectionData *bnet, BnetClanMember *member, PurpleGroup *group)
+{
+    gchar *name = bnet_clan_member_get_name(member);
+    PurpleBuddy *buddy = NULL;
+    GSList *buddies = purple_find_buddies(bnet->account, name);
+    GSList *el;
 
-            bnet->bncs.w3_clan.clan_members_in_blist = TRUE;
+    for (el = buddies; el != NULL; el = g_slist_next(el)) {
+        PurpleBuddy *candidate = el->data;
+        BnetUser *current = purple_buddy_get_protocol_data(candidate);
 
-            switch (bnet_clan_member_get_status(member)) {
-                case BNET_CLAN_STATUS_OFFLINE:
-                    prpl_status = BNET_STATUS_OFFLINE;
-                    break;
-                case BNET_CLAN_STATUS_ONLINE:
-                default:
-                    prpl_status = BNET_STATUS_ONLINE;
-                    break;
+        if (current != NULL) {
+            if (current->type == BNET_USER_TYPE_CLANMEMBER) {
+                buddy = candidate;
+                break;
             }
+        } else if (purple_buddy_get_group(candidate) == group &&
+                (purple_blist_node_get_flags(PURPLE_BLIST_NODE(candidate)) & PURPLE_BLIST_NODE_FLAG_NO_SAVE)) {
+            buddy = candidate;
+            break;
+        }
+    }
+    g_slist_free(buddies);
 
-            buddies = purple_find_buddies(bnet->account, name);
-            found_mergable = FALSE;
-            while (buddies != NULL) {
-                buddy = buddies->data;
-                current_member = purple_buddy_get_protocol_data(buddy);
-                if (current_member != NULL && current_member->type == BNET_USER_TYPE_CLANMEMBER) {
-                    //purple_debug_info("bnet", "Clan diff: %s merged\n", name);
-                    found_mergable = TRUE;
-                    purple_buddy_set_protocol_data(buddy, member);
-                    bnet_clan_member_set_joindate(member, bnet_clan_member_get_joindate((BnetClanMember *)current_member));
-                    break;
-                }
-                buddies = g_slist_next(buddies);
-            }
-            if (!found_mergable) {
-                purple_debug_info("bnet", "Clan diff: %s added\n", name);
-                buddy = purple_buddy_new(bnet->account, name, name);
-                purple_blist_node_set_flags(PURPLE_BLIST_NODE(buddy), PURPLE_BLIST_NODE_FLAG_NO_SAVE);
-                purple_blist_add_buddy(buddy, NULL, group, NULL);
-                purple_buddy_set_protocol_data(buddy, member);
-                purple_prpl_got_user_status(bnet->account, name, prpl_status, NULL);
-            } else if (bnet_clan_member_get_status((BnetClanMember *)current_member) !=
-                    bnet_clan_member_get_status(member)) {
-                purple_debug_info("bnet", "Clan diff: %s updated\n", name);
-                purple_prpl_got_user_status(bnet->account, name, prpl_status, NULL);
-            }
-            el = g_list_next(el);
+    if (buddy == NULL) {
+        purple_debug_info("bnet", "Clan diff: %s added\n", name);
+        buddy = purple_buddy_new(bnet->account, name, name);
+        purple_blist_node_set_flags(PURPLE_BLIST_NODE(buddy), PURPLE_BLIST_NODE_FLAG_NO_SAVE);
+        purple_blist_add_buddy(buddy, NULL, group, NULL);
+    }
+    purple_buddy_set_protocol_data(buddy, member);
+    member->buddy = buddy;
+    purple_prpl_got_user_status(bnet->account, name, bnet_clan_member_prpl_status(member), NULL);
+}
+
+// detaches a member from its buddy; the buddy is removed from the list if remove is set
+static void
+bnet_clan_member_hide(BnetClanMember *member, gboolean remove)
+{
+    PurpleBuddy *buddy = member->buddy;
+
+    if (buddy == NULL) {
+        return;
+    }
+    // the table owns the member, do not let bnet_buddy_free see it
+    purple_buddy_set_protocol_data(buddy, NULL);
+    member->buddy = NULL;
+    if (remove) {
+        purple_blist_remove_buddy(buddy);
+    }
+}
+
+static void
+bnet_clan_member_hide_cb(gpointer key, gpointer value, gpointer user_data)
+{
+    bnet_clan_member_hide((BnetClanMember *)value, GPOINTER_TO_INT(user_data));
+}
+
+// adds a member to the table or updates it in place; takes ownership of name and location
+static BnetClanMember *
+bnet_clan_update_member(BnetConnectionData *bnet, gchar *name, BnetClanMemberRank rank,
+        BnetClanMemberStatus status, gchar *location, PurpleGroup *group)
+{
+    BnetClanMember *member = bnet_clan_find_member(bnet, name);
+
+    if (bnet->bncs.w3_clan.my_clanmembers == NULL) {
+        bnet->bncs.w3_clan.my_clanmembers = g_hash_table_new_full(g_str_hash, g_str_equal,
+                g_free, (GDestroyNotify)bnet_clan_member_free);
+    }
+
+    if (member == NULL) {
+        member = bnet_clan_member_new(name, rank, status, location);
+        g_hash_table_insert(bnet->bncs.w3_clan.my_clanmembers,
+                g_strdup(bnet_normalize(NULL, name)), member);
+        if (group != NULL) {
+            bnet_clan_member_show(bnet, member, group);
+        }
+    } else {
+        gboolean status_changed = bnet_clan_member_get_status(member) != status || member->stale;
+
+        member->stale = FALSE;
+        g_free(name);
+        member->rank = rank;
+        bnet_clan_member_set_status(member, status);
+        bnet_clan_member_set_location(member, location);
+        if (group != NULL && member->buddy == NULL) {
+            // the user turned on the setting while connected
+            bnet_clan_member_show(bnet, member, group);
+        } else if (status_changed && member->buddy != NULL) {
+            purple_debug_info("bnet", "Clan diff: %s updated\n", bnet_clan_member_get_name(member));
+            purple_prpl_got_user_status(bnet->account, bnet_clan_member_get_name(member),
+                    bnet_clan_member_prpl_status(member), NULL);
         }
+    }
+    return member;
+}
+
+static void
+bnet_clan_remove_member(BnetConnectionData *bnet, const gchar *name)
+{
+    BnetClanMember *member = bnet_clan_find_member(bnet, name);
+
+    if (member == NULL) {
+        return;
+    }
+    purple_debug_info("bnet", "Clan diff: %s removed\n", bnet_clan_member_get_name(member));
+    bnet_clan_member_hide(member, TRUE);
+    g_hash_table_remove(bnet->bncs.w3_clan.my_clanmembers, bnet_normalize(NULL, name));
+}
+
+static gboolean
+bnet_clan_member_sweep_cb(gpointer key, gpointer value, gpointer user_data)
+{
+    BnetClanMember *member = value;
+
+    if (member->on_list) {
+        member->on_list = FALSE;
+        return FALSE;
+    }
+    purple_debug_info("bnet", "Clan diff: %s removed\n", bnet_clan_member_get_name(member));
+    bnet_clan_member_hide(member, TRUE);
+    return TRUE;
+}
+
+static void
+bnet_clan_members_free(BnetConnectionData *bnet)
+{
+    if (bnet->bncs.w3_clan.my_clanmembers == NULL) {
+        return;
+    }
+    // buddies stay on the list (offline) until the next connect reattaches them
+    g_hash_table_foreach(bnet->bncs.w3_clan.my_clanmembers, bnet_clan_member_hide_cb, GINT_TO_POINTER(FALSE));
+    g_hash_table_destroy(bnet->bncs.w3_clan.my_clanmembers);
+    bnet->bncs.w3_clan.my_clanmembers = NULL;
+}
+
+// the account left its clan since the warm start was saved: SID_CLANINFO never
+// came, so drop the cached tag, roster and MOTD instead of showing them stale
+static void
+bnet_clan_sweep_stale(BnetConnectionData *bnet)
+{
+    if (bnet_clan_in_clan(bnet) || bnet->bncs.w3_clan.my_clantag == 0) {
+        return;
+    }
+    purple_debug_info("bnet", "Warm start: no longer in a clan\n");
+    if (bnet->bncs.w3_clan.my_clanmembers != NULL) {
+        g_hash_table_foreach(bnet->bncs.w3_clan.my_clanmembers, bnet_clan_member_hide_cb, GINT_TO_POINTER(TRUE));
+        g_hash_table_destroy(bnet->bncs.w3_clan.my_clanmembers);
+        bnet->bncs.w3_clan.my_clanmembers = NULL;
+    }
+    bnet->bncs.w3_clan.my_clantag = 0;
+    bnet->bncs.w3_clan.my_rank = 0;
+    if (bnet->bncs.w3_clan.my_clanname != NULL) {
+        g_free(bnet->bncs.w3_clan.my_clanname);
+        bnet->bncs.w3_clan.my_clanname = NULL;
+    }
+    bnet_motd_free(bnet, BNET_MOTD_TYPE_CLAN);
+}
+
+static void
+bnet_recv_CLANMEMBERLIST(BnetConnectionData *bnet, BnetPacket *pkt)
+{
+    guint32 cookie;
+    guint8 number_of_members;
+    PurpleGroup *group = NULL;
+    int i;
+
+    cookie = bnet_packet_read_dword(pkt);
+    bnet_packet_cookie_unregister(bnet, BNET_SID_CLANMEMBERLIST, cookie);
+    bnet_poll_response(bnet, BNET_POLL_CLANMEMBERS, pkt);
+
+    number_of_members = bnet_packet_read_byte(pkt);
+
+    purple_debug_info("bnet", "Clan members: %d\n", number_of_members);
+
+    if (purple_account_get_bool(bnet->account, "showgrpclan", FALSE)) {
+        group = bnet_clan_get_group(bnet);
+        bnet->bncs.w3_clan.clan_members_in_blist = TRUE;
     } else if (bnet->bncs.w3_clan.clan_members_in_blist) {
         // the user turned off the setting while connected
-        // prpl holds the memory to the old list, do not free it
         bnet->bncs.w3_clan.clan_members_in_blist = FALSE;
-        do_not_free = TRUE;
+        if (bnet->bncs.w3_clan.my_clanmembers != NULL) {
+            g_hash_table_foreach(bnet->bncs.w3_clan.my_clanmembers, bnet_clan_member_hide_cb, GINT_TO_POINTER(TRUE));
+        }
+    }
+
+    for (i = 0; i < number_of_members; i++) {
+        gchar *name = bnet_packet_read_cstring(pkt);
+        BnetClanMemberRank rank = bnet_packet_read_byte(pkt);
+        BnetClanMemberStatus status = bnet_packet_read_byte(pkt);
+        gchar *location = bnet_packet_read_cstring(pkt);
+
+        BnetClanMember *member = bnet_clan_update_member(bnet, name, rank, status, location, group);
+        member->on_list = TRUE;
     }
 
-    if (!do_not_free && bnet->bncs.w3_clan.my_clanmembers != NULL) {
-        _g_list_free_full(bnet->bncs.w3_clan.my_clanmembers, (GDestroyNotify)bnet_clan_member_free);
+    // drop anyone who left without us seeing SID_CLANMEMBERREMOVED
+    if (bnet->bncs.w3_clan.my_clanmembers != NULL) {
+        g_hash_table_foreach_remove(bnet->bncs.w3_clan.my_clanmembers, bnet_clan_member_sweep_cb, NULL);
     }
-    bnet->bncs.w3_clan.my_clanmembers = members;
+    bnet_warm_save(bnet);
 }
 
 static void
 bnet_recv_CLANMEMBERREMOVED(BnetConnectionData *bnet, BnetPacket *pkt)
 {
+    gchar *name = bnet_packet_read_cstring(pkt);
+
+    bnet_clan_remove_member(bnet, name);
+    g_free(name);
 }
 
 static void
 bnet_recv_CLANMEMBERSTATUSCHANGE(BnetConnectionData *bnet, BnetPacket *pkt)
 {
+    gchar *name = bnet_packet_read_cstring(pkt);
+    BnetClanMemberRank rank = bnet_packet_read_byte(pkt);
+    BnetClanMemberStatus status = bnet_packet_read_byte(pkt);
+    gchar *location = bnet_packet_read_cstring(pkt);
+    PurpleGroup *group = NULL;
+
+    if (bnet->bncs.w3_clan.clan_members_in_blist) {
+        group = bnet_clan_get_group(bnet);
+    }
+    bnet_clan_update_member(bnet, name, rank, status, location, group);
 }
 
 static void
 bnet_recv_CLANMEMBERRANKCHANGE(BnetConnectionData *bnet, BnetPacket *pkt)
 {
+    BnetClanMemberRank old_rank = bnet_packet_read_byte(pkt);
+    BnetClanMemberRank new_rank = bnet_packet_read_byte(pkt);
+    gchar *changed_by = bnet_packet_read_cstring(pkt);
+    BnetClanMember *member = bnet_clan_find_member(bnet, bnet->bncs.logon.username);
+
+    purple_debug_info("bnet", "Clan rank changed from %s to %s by %s\n",
+            bnet_clan_rank_to_string(old_rank), bnet_clan_rank_to_string(new_rank), changed_by);
+
+    bnet->bncs.w3_clan.my_rank = new_rank;
+    if (member != NULL) {
+        member->rank = new_rank;
+    }
+    g_free(changed_by);
 }
 
 static void
@@ -6413,6 +8550,9 @@ static void
 bnet_parse_packet(BnetConnectionData *bnet, const guint8 packet_id, const gchar *packet_start, const guint16 packet_len)
 {
     BnetPacket *pkt = NULL;
+    GTimeVal start;
+
+    g_get_current_time(&start);
 
     purple_debug_misc("bnet", "BNCS S>C 0x%02x: length %d\n", packet_id, packet_len);
 
@@ -6580,6 +8720,8 @@ bnet_parse_packet(BnetConnectionData *bnet, const guint8 packet_id, const gchar
     }
 
     bnet_packet_free(pkt);
+
+    bnet_packet_stats_handled(BNET_PACKET_STATS_BNCS, packet_id, packet_len, &start);
 }
 
 static void
@@ -6826,29 +8968,6 @@ bnet_channel_user_compare(gconstpointer a, gconstpointer b)
     return cmp;
 }
 
-static gint
-bnet_friend_user_compare(gconstpointer a, gconstpointer b)
-{
-    const BnetFriendInfo *bfi = a;
-    const char *usr = b;
-    const char *a_n = NULL;
-    const char *b_n = NULL;
-    char *a_nc;
-    int cmp = 0;
-    if (a == NULL || b == NULL) {
-        return 1;
-    }
-    if (bfi->account == NULL) {
-        return 1;
-    }
-    a_n = bnet_normalize(NULL, bfi->account);
-    a_nc = g_strdup(a_n);
-    b_n = bnet_normalize(NULL, usr);
-    cmp = strcmp(a_nc, b_n);
-    g_free(a_nc);
-    return cmp;
-}
-
 static PurpleCmdRet
 bnet_handle_cmd(PurpleConversation *conv, const gchar *cmdword,
         gchar **args, gchar **error, void *data)
@@ -7213,7 +9332,8 @@ bnet_friend_update(const BnetConnectionData *bnet, int index,
         }
     }
 
-    if (whoising) {
+    // no lookups for cached state, we are not logged on yet
+    if (whoising && !bfi->stale) {
         // TODO: make queue and put this as low priority
         bfi->automated_lookup = whoising;
         bnet_do_whois(bnet, bfi->account);
@@ -7227,6 +9347,11 @@ bnet_close(PurpleConnection *gc)
     BnetConnectionData *bnet = gc->proto_data;
     //purple_connection_set_state(gc, PURPLE_DISCONNECTED);
     if (bnet != NULL) {
+        // a logon that never reached chat
+        bnet_logon_trace_finish(bnet, "closed");
+        if (bnet->bncs.chat_env.is_online) {
+            bnet_warm_save(bnet);
+        }
         bnet->bncs.chat_env.first_join = FALSE;
         bnet->bncs.chat_env.is_online = FALSE;
         bnet->bncs.chat_env.sent_enter_channel = FALSE;
@@ -7246,8 +9371,9 @@ bnet_close(PurpleConnection *gc)
             g_free(bnet->bnls.conn.server);
             bnet->bnls.conn.server = NULL;
         }
-        if (bnet->bnls.conn.fd != 0) {
-            bnet_input_free(&bnet->bnls.conn);
+        if (bnet->bnls.servers != NULL) {
+            g_strfreev(bnet->bnls.servers);
+            bnet->bnls.servers = NULL;
         }
         if (bnet->bncs.conn.fd != 0) {
             bnet_input_free(&bnet->bncs.conn);
@@ -7263,6 +9389,15 @@ bnet_close(PurpleConnection *gc)
             g_free(bnet->bncs.versioning.key_owner);
             bnet->bncs.versioning.key_owner = NULL;
         }
+        if (bnet->bncs.versioning.check_key != NULL) {
+            g_free(bnet->bncs.versioning.check_key);
+            bnet->bncs.versioning.check_key = NULL;
+        }
+        if (bnet->bncs.versioning.local_key != NULL) {
+            g_free(bnet->bncs.versioning.local_key);
+            bnet->bncs.versioning.local_key = NULL;
+        }
+        bnet_bnls_client_forget(bnet);
         if (bnet->bncs.chat_env.stats != NULL) {
             g_free(bnet->bncs.chat_env.stats);
             bnet->bncs.chat_env.stats = NULL;
@@ -7271,20 +9406,35 @@ bnet_close(PurpleConnection *gc)
             g_free(bnet->bncs.chat_env.unique_name);
             bnet->bncs.chat_env.unique_name = NULL;
         }
-        if (bnet_clan_in_clan(bnet)) {
-            if (bnet->bncs.w3_clan.my_clanname != NULL) {
-                g_free(bnet->bncs.w3_clan.my_clanname);
-                bnet->bncs.w3_clan.my_clanname = NULL;
-            }
-            if (bnet->bncs.w3_clan.my_clanmembers != NULL) {
-                _g_list_free_full(bnet->bncs.w3_clan.my_clanmembers, (GDestroyNotify)bnet_clan_member_free);
-                bnet->bncs.w3_clan.my_clanmembers = NULL;
-            }
+        if (bnet->bncs.w3_clan.my_clanname != NULL) {
+            g_free(bnet->bncs.w3_clan.my_clanname);
+            bnet->bncs.w3_clan.my_clanname = NULL;
         }
-        if (bnet->bncs.chat_env.packet_cookie_table != NULL) {
-            g_hash_table_destroy(bnet->bncs.chat_env.packet_cookie_table);
-            bnet->bncs.chat_env.packet_cookie_table = NULL;
+        // members may have come from the data cache without SID_CLANINFO
+        bnet_clan_members_free(bnet);
+        bnet_packet_cookie_table_free(bnet);
+        bnet_cache_flush();
+        if (bnet->bncs.user_data.batch_timer_handle != 0) {
+            purple_timeout_remove(bnet->bncs.user_data.batch_timer_handle);
+            bnet->bncs.user_data.batch_timer_handle = 0;
         }
+        if (bnet->bncs.user_data.pending != NULL) {
+            _g_list_free_full(bnet->bncs.user_data.pending, (GDestroyNotify)bnet_userdata_request_free);
+            bnet->bncs.user_data.pending = NULL;
+        }
+        if (bnet->bncs.user_data.cached_timer_handle != 0) {
+            purple_timeout_remove(bnet->bncs.user_data.cached_timer_handle);
+            bnet->bncs.user_data.cached_timer_handle = 0;
+        }
+        if (bnet->bncs.user_data.cached != NULL) {
+            _g_list_free_full(bnet->bncs.user_data.cached, (GDestroyNotify)bnet_userdata_request_free);
+            bnet->bncs.user_data.cached = NULL;
+        }
+        if (bnet->bncs.user_data.cache != NULL) {
+            g_hash_table_destroy(bnet->bncs.user_data.cache);
+            bnet->bncs.user_data.cache = NULL;
+        }
+        bnet_clan_roster_free(bnet);
         if (bnet->bncs.chat_env.channel_list != NULL) {
             _g_list_free_full(bnet->bncs.chat_env.channel_list, g_free);
             bnet->bncs.chat_env.channel_list = NULL;
@@ -7301,8 +9451,15 @@ bnet_close(PurpleConnection *gc)
             _g_queue_free_full(bnet->bncs.channel.delayed_event_queue, (GDestroyNotify)bnet_delayed_event_free);
             bnet->bncs.channel.delayed_event_queue = NULL;
         }
+        if (bnet->bncs.friends.by_name != NULL) {
+            g_hash_table_destroy(bnet->bncs.friends.by_name);
+            bnet->bncs.friends.by_name = NULL;
+        }
         if (bnet->bncs.friends.list != NULL) {
-            _g_list_free_full(bnet->bncs.friends.list, (GDestroyNotify)bnet_friend_info_free);
+            for (i = 0; i < bnet->bncs.friends.list->len; i++) {
+                bnet_friend_info_free(g_ptr_array_index(bnet->bncs.friends.list, i));
+            }
+            g_ptr_array_free(bnet->bncs.friends.list, TRUE);
             bnet->bncs.friends.list = NULL;
         }
         if (bnet->bncs.news.item_list != NULL) {
@@ -7320,14 +9477,20 @@ bnet_close(PurpleConnection *gc)
             g_free(bnet->bncs.status.dnd_msg);
             bnet->bncs.status.dnd_msg = NULL;
         }
+        bnet_gateway_race_free(bnet);
         if (bnet->bncs.conn.server != NULL) {
             g_free(bnet->bncs.conn.server);
             bnet->bncs.conn.server = NULL;
         }
+        bnet_crypto_jobs_cancel(bnet);
         if (bnet->bncs.logon.auth_ctx != NULL) {
             srp_free(bnet->bncs.logon.auth_ctx);
             bnet->bncs.logon.auth_ctx = NULL;
         }
+        if (bnet->bncs.logon.salt_and_v != NULL) {
+            g_free(bnet->bncs.logon.salt_and_v);
+            bnet->bncs.logon.salt_and_v = NULL;
+        }
         if (bnet->bncs.whisper.last_sent_to != NULL) {
             g_free(bnet->bncs.whisper.last_sent_to);
             bnet->bncs.whisper.last_sent_to = NULL;
@@ -7443,6 +9606,10 @@ bnet_lookup_info(PurpleConnection *gc, const char *who)
     bnet->bncs.lookup_info.name = g_strdup(norm);
     bnet->bncs.lookup_info.flags = BNET_LOOKUP_INFO_FIRST_SECTION;
     bnet->bncs.lookup_info.w3_tag = (BnetClanTag)0;
+    bnet->bncs.lookup_info.w3_user_profile_cookie = 0;
+    bnet->bncs.lookup_info.w3_user_stats_cookie = 0;
+    bnet->bncs.lookup_info.w3_clan_stats_cookie = 0;
+    bnet->bncs.lookup_info.w3_clan_mi_cookie = 0;
 
     // show user info
     // step 1: get data from channel list (stored in bnet->bncs.channel.user_list)
@@ -7621,18 +9788,15 @@ static gboolean
 bnet_lookup_info_cached_friends(BnetConnectionData *bnet)
 {
     const char *acct_norm = bnet_account_normalize(bnet->account, bnet->bncs.lookup_info.name);
-    GList *li = g_list_find_custom(bnet->bncs.friends.list, acct_norm, bnet_friend_user_compare);
-    BnetFriendInfo *bfi;
+    BnetFriendInfo *bfi = bnet_friend_find(bnet, acct_norm);
 
-    if (li == NULL) {
+    if (bfi == NULL) {
         // the user was not on our friends list
         return FALSE;
     }
 
     purple_debug_info("bnet", "Lookup local found: FRIENDS_LIST(%s)\n", acct_norm);
 
-    bfi = li->data;
-
     if (!bnet->bncs.lookup_info.prpl_notify_handle) {
         bnet->bncs.lookup_info.prpl_notify_handle = purple_notify_user_info_new();
     } else if (!(bnet->bncs.lookup_info.flags & BNET_LOOKUP_INFO_FIRST_SECTION)) {
@@ -7725,12 +9889,10 @@ static void
 bnet_lookup_info_user_data(BnetConnectionData *bnet)
 {
     gchar *final_request;
-    BnetUserDataRequest *req;
     BnetUserDataRequestType request_type;
     gboolean is_self = FALSE;
     int recordbits = 0;
     char **keys;
-    int request_cookie = g_str_hash(bnet->bncs.lookup_info.name);
     char *acct_norm = g_strdup(bnet_account_normalize(bnet->account, bnet->bncs.lookup_info.name));
     char *uu_norm = g_strdup(bnet_account_normalize(bnet->account, bnet_normalize(bnet->account, bnet->bncs.chat_env.unique_name)));
 
@@ -7808,14 +9970,9 @@ bnet_lookup_info_user_data(BnetConnectionData *bnet)
         ((is_self) ? BNET_READUSERDATA_REQUEST_SYSTEM : 0) |
         ((recordbits == BNET_RECORD_NONE) ? 0 : BNET_READUSERDATA_REQUEST_RECORD);
 
-    req = bnet_userdata_request_new(request_cookie, request_type,
-            acct_norm, keys,
+    bnet_userdata_request_queue(bnet, request_type, acct_norm, keys,
             bnet->bncs.versioning.product);
 
-    bnet->bncs.user_data.requests = g_list_append(bnet->bncs.user_data.requests, req);
-
-    bnet_send_READUSERDATA(bnet, request_cookie, acct_norm, keys);
-
     g_free(final_request);
     g_free(acct_norm);
     g_free(uu_norm);
@@ -7830,7 +9987,9 @@ bnet_lookup_info_w3_user_profile(BnetConnectionData *bnet)
     bnet->bncs.lookup_info.flags |= BNET_LOOKUP_INFO_AWAIT_W3_USER_PROFILE;
     purple_debug_info("bnet", "Lookup: W3_USER_PROFILE(%s)\n", acct_norm);
     
-    cookie = bnet_packet_cookie_register(bnet, BNET_SID_W3PROFILE, g_strdup(acct_norm));
+    cookie = bnet_packet_cookie_register_full(bnet, BNET_SID_W3PROFILE, g_strdup(acct_norm),
+            g_free, bnet_lookup_info_cookie_expired);
+    bnet->bncs.lookup_info.w3_user_profile_cookie = cookie;
 
     bnet_send_W3PROFILE(bnet, cookie, acct_norm);
     
@@ -7846,42 +10005,136 @@ bnet_lookup_info_w3_user_stats(BnetConnectionData *bnet)
     bnet->bncs.lookup_info.flags |= BNET_LOOKUP_INFO_AWAIT_W3_USER_STATS;
     purple_debug_info("bnet", "Lookup: W3_USER_STATS(%s)\n", acct_norm);
 
-    cookie = bnet_packet_cookie_register(bnet, BNET_SID_W3GENERAL, g_strdup(acct_norm));
+    cookie = bnet_packet_cookie_register_full(bnet, BNET_SID_W3GENERAL, g_strdup(acct_norm),
+            g_free, bnet_lookup_info_cookie_expired);
+    bnet->bncs.lookup_info.w3_user_stats_cookie = cookie;
 
     bnet_send_W3GENERAL_USERRECORD(bnet, cookie, acct_norm, bnet->bncs.versioning.product);
     
     g_free(acct_norm);
 }
 
-static void
-bnet_lookup_info_w3_clan_stats(BnetConnectionData *bnet)
+static void
+bnet_lookup_info_w3_clan_stats(BnetConnectionData *bnet)
+{
+    gchar *s_clan = bnet_tag_to_string(bnet->bncs.lookup_info.w3_tag);
+    guint32 cookie;
+
+    bnet->bncs.lookup_info.flags |= BNET_LOOKUP_INFO_AWAIT_W3_CLAN_STATS;
+    purple_debug_info("bnet", "Lookup: W3_CLAN_STATS(Clan %s)\n", s_clan);
+
+    cookie = bnet_packet_cookie_register_full(bnet, BNET_SID_W3GENERAL, s_clan,
+            g_free, bnet_lookup_info_cookie_expired);
+    bnet->bncs.lookup_info.w3_clan_stats_cookie = cookie;
+
+    bnet_send_W3GENERAL_CLANRECORD(bnet, cookie, bnet->bncs.lookup_info.w3_tag, bnet->bncs.versioning.product);
+}
+
+static void
+bnet_lookup_info_w3_clan_mi(BnetConnectionData *bnet)
+{
+    gchar *s_clan = bnet_tag_to_string(bnet->bncs.lookup_info.w3_tag);
+    char *acct_norm = g_strdup(bnet_account_normalize(bnet->account, bnet->bncs.lookup_info.name));
+    guint32 cookie;
+
+    bnet->bncs.lookup_info.flags |= BNET_LOOKUP_INFO_AWAIT_W3_CLAN_MI;
+    purple_debug_info("bnet", "Lookup: W3_CLAN_MI(%s, Clan %s)\n", acct_norm, s_clan);
+
+    cookie = bnet_packet_cookie_register_full(bnet, BNET_SID_CLANMEMBERINFO, s_clan,
+            g_free, bnet_lookup_info_cookie_expired);
+    bnet->bncs.lookup_info.w3_clan_mi_cookie = cookie;
+
+    bnet_send_CLANMEMBERINFO(bnet, cookie, bnet->bncs.lookup_info.w3_tag, acct_norm);
+    
+    g_free(acct_norm);
+}
+
+static void
+bnet_lookup_info_cookie_expired(gpointer data, guint8 packet_id, guint32 cookie, gpointer cookie_data)
+{
+    BnetConnectionData *bnet = data;
+    BnetLookupInfoFlags step;
+
+    // a lookup started since this request went out has requests of its own
+    switch (packet_id) {
+        case BNET_SID_W3PROFILE:
+            if (cookie != bnet->bncs.lookup_info.w3_user_profile_cookie) {
+                return;
+            }
+            step = BNET_LOOKUP_INFO_AWAIT_W3_USER_PROFILE;
+            break;
+        case BNET_SID_CLANMEMBERINFO:
+            if (cookie != bnet->bncs.lookup_info.w3_clan_mi_cookie) {
+                return;
+            }
+            step = BNET_LOOKUP_INFO_AWAIT_W3_CLAN_MI;
+            break;
+        case BNET_SID_READUSERDATA:
+            if (cookie_data != NULL &&
+                    bnet_userdata_request_get_type(cookie_data) & BNET_READUSERDATA_REQUEST_ROSTER) {
+                purple_debug_warning("bnet", "Clan roster request %u timed out\n", cookie);
+                bnet_clan_roster_accounts_done(bnet, bnet_userdata_request_get_account_count(cookie_data));
+                return;
+            }
+            // a batch can be for other users only
+            if (!bnet_lookup_info_awaits_userdata(bnet, cookie_data)) {
+                return;
+            }
+            step = BNET_LOOKUP_INFO_AWAIT_USER_DATA;
+            break;
+        case BNET_SID_W3GENERAL:
+            // user and clan records share a packet
+            if (cookie == bnet->bncs.lookup_info.w3_clan_stats_cookie) {
+                step = BNET_LOOKUP_INFO_AWAIT_W3_CLAN_STATS;
+            } else if (cookie == bnet->bncs.lookup_info.w3_user_stats_cookie) {
+                step = BNET_LOOKUP_INFO_AWAIT_W3_USER_STATS;
+            } else {
+                return;
+            }
+            break;
+        default:
+            return;
+    }
+
+    if (bnet->bncs.lookup_info.flags & step) {
+        purple_debug_warning("bnet", "Lookup step 0x%08x timed out\n", step);
+        bnet_lookup_info_step_failed(bnet, step);
+    }
+}
+
+// whether the open lookup is waiting on req for the looked-up account
+static gboolean
+bnet_lookup_info_awaits_userdata(BnetConnectionData *bnet, const BnetUserDataRequest *req)
 {
-    gchar *s_clan = bnet_tag_to_string(bnet->bncs.lookup_info.w3_tag);
-    guint32 cookie;
-
-    bnet->bncs.lookup_info.flags |= BNET_LOOKUP_INFO_AWAIT_W3_CLAN_STATS;
-    purple_debug_info("bnet", "Lookup: W3_CLAN_STATS(Clan %s)\n", s_clan);
-
-    cookie = bnet_packet_cookie_register(bnet, BNET_SID_W3GENERAL, s_clan);
+    const gchar *lookup_norm;
+    int i;
 
-    bnet_send_W3GENERAL_CLANRECORD(bnet, cookie, bnet->bncs.lookup_info.w3_tag, bnet->bncs.versioning.product);
+    if (req == NULL || bnet->bncs.lookup_info.name == NULL ||
+            !(bnet->bncs.lookup_info.flags & BNET_LOOKUP_INFO_AWAIT_USER_DATA) ||
+            (bnet_userdata_request_get_type(req) & BNET_READUSERDATA_REQUEST_ROSTER)) {
+        return FALSE;
+    }
+    lookup_norm = bnet_account_normalize(bnet->account, bnet->bncs.lookup_info.name);
+    for (i = 0; i < bnet_userdata_request_get_account_count(req); i++) {
+        if (g_ascii_strcasecmp(bnet_userdata_request_get_account_by_index(req, i), lookup_norm) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
 }
 
+// stops the open lookup waiting on step, showing what it has if that was the last one
 static void
-bnet_lookup_info_w3_clan_mi(BnetConnectionData *bnet)
+bnet_lookup_info_step_failed(BnetConnectionData *bnet, BnetLookupInfoFlags step)
 {
-    gchar *s_clan = bnet_tag_to_string(bnet->bncs.lookup_info.w3_tag);
-    char *acct_norm = g_strdup(bnet_account_normalize(bnet->account, bnet->bncs.lookup_info.name));
-    guint32 cookie;
-
-    bnet->bncs.lookup_info.flags |= BNET_LOOKUP_INFO_AWAIT_W3_CLAN_MI;
-    purple_debug_info("bnet", "Lookup: W3_CLAN_MI(%s, Clan %s)\n", acct_norm, s_clan);
+    bnet->bncs.lookup_info.flags &= ~step;
 
-    cookie = bnet_packet_cookie_register(bnet, BNET_SID_CLANMEMBERINFO, s_clan);
-
-    bnet_send_CLANMEMBERINFO(bnet, cookie, bnet->bncs.lookup_info.w3_tag, acct_norm);
-    
-    g_free(acct_norm);
+    if (!(bnet->bncs.lookup_info.flags & BNET_LOOKUP_INFO_CANCELLED) &&
+            !(bnet->bncs.lookup_info.flags & BNET_LOOKUP_INFO_AWAIT_MASK) &&
+            bnet->bncs.lookup_info.prpl_notify_handle != NULL) {
+        purple_notify_userinfo(bnet->account->gc, bnet->bncs.lookup_info.name,
+                bnet->bncs.lookup_info.prpl_notify_handle, bnet_lookup_info_close, bnet);
+    }
 }
 
 static void
@@ -7919,6 +10172,7 @@ bnet_action_set_motd_cb(gpointer data)
             PurpleConversation *conv = NULL;
             PurpleConvChat *chat = NULL;
             bnet_send_CLANSETMOTD(bnet, 0xbaadf00du, motd);
+            bnet_poll_tighten(bnet, BNET_POLL_CLANMOTD);
             if (!bnet->bncs.chat_env.first_join && bnet->bncs.channel.prpl_chat_id != 0) {
                 conv = purple_find_chat(bnet->account->gc, bnet->bncs.channel.prpl_chat_id);
             }
@@ -7957,111 +10211,442 @@ bnet_locale_full_escape_nullable(const gchar *input)
     return r2;
 }
 
+static gchar *
+bnet_cache_entry_id(const gchar *name, const gchar *key)
+{
+    return g_strdup_printf("%s\n%s", name, key);
+}
+
+static gchar *
+bnet_cache_path(void)
+{
+    return g_build_filename(purple_user_dir(), BNET_FILE_CACHE, NULL);
+}
+
+// maps the data cache file the first time any account needs it, and again
+// once the writer has replaced it; nothing is parsed
 static void
-bnet_cache_set(BnetConnectionData *bnet, gchar *name, guint64 timestamp, gchar *key, gchar *val)
+bnet_cache_load(void)
 {
-    xmlnode *current_cache;
-    xmlnode *file;
-    xmlnode *file_child;
-    gboolean was_set = FALSE;
-    gchar *output;
-    int length;
-    
-    current_cache = purple_util_read_xml_from_file(BNET_FILE_CACHE, "Battle.net data cache");
-    
-    if (current_cache != NULL) {
-        // wrong root name, replace
-        if (!g_str_equal(current_cache->name, "cache")) {
-            xmlnode_free(current_cache);
-            current_cache = xmlnode_new("cache");
-        }
-        
-        // find any matching entries and replace them
-        for (file = current_cache->child; file; file = file->next) {
-            if (file->type != XMLNODE_TYPE_TAG) {
-                continue;
-            }
-            if (g_str_equal(file->name, "file")) {
-                const gchar *current_name = xmlnode_get_attrib(file, "name");
-                const gchar *current_key = xmlnode_get_attrib(file, "key");
-                if (g_str_equal(name, current_name) &&
-                        g_str_equal(key, current_key)) {
-                    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
-                    g_ascii_dtostr(buf, G_ASCII_DTOSTR_BUF_SIZE, timestamp);
-                    xmlnode_set_attrib(file, "timestamp", buf);
-                    for (file_child = file->child; file_child; file_child = file_child->next) {
-                        if (file_child->type != XMLNODE_TYPE_DATA) {
-                            continue;
-                        }
-                        g_free(file_child->data);
-                        file_child->data = val;
-                        was_set = TRUE;
-                    }
-                    if (!was_set) {
-                        xmlnode_insert_data(file, val, -1);
-                        was_set = TRUE;
-                    }
-                    break;
-                }
-            }
+    gchar *path;
+
+    if (bnet_data_cache.loaded) {
+        // keep the old mapping while a write runs: values set this session
+        // are in entries anyway, and the writer may still be renaming
+        if (g_atomic_int_get(&bnet_data_cache.writer_busy) ||
+                g_atomic_int_get(&bnet_data_cache.generation) == bnet_data_cache.mapped_generation) {
+            return;
         }
+        bnet_cache_file_close(bnet_data_cache.file);
+        bnet_data_cache.file = NULL;
     } else {
-        current_cache = xmlnode_new("cache");
+        bnet_data_cache.loaded = TRUE;
+        bnet_data_cache.entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+                NULL, (GDestroyNotify)bnet_cache_entry_free);
+        bnet_data_cache.dirty = g_hash_table_new_full(g_str_hash, g_str_equal,
+                NULL, (GDestroyNotify)bnet_cache_entry_free);
     }
-    
-    // not found, new file
-    if (!was_set) {
-        xmlnode *file = xmlnode_new_child(current_cache, "file");
-        gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
-        g_ascii_dtostr(buf, G_ASCII_DTOSTR_BUF_SIZE, timestamp);
-        xmlnode_set_attrib(file, "name", name);
-        xmlnode_set_attrib(file, "key", key);
-        xmlnode_set_attrib(file, "timestamp", buf);
-        xmlnode_insert_data(file, val, -1);
+
+    path = bnet_cache_path();
+    bnet_data_cache.mapped_generation = g_atomic_int_get(&bnet_data_cache.generation);
+    bnet_cache_file_commit(path);
+    bnet_data_cache.file = bnet_cache_file_open(path);
+    g_free(path);
+}
+
+// runs off the main loop; must not call into libpurple
+static gpointer
+bnet_cache_write_thread(gpointer data)
+{
+    BnetCacheWrite *write = data;
+    GList *entries = g_hash_table_get_values(write->entries);
+
+    bnet_cache_file_write(write->path, entries);
+
+    g_list_free(entries);
+    g_hash_table_destroy(write->entries);
+    g_free(write->path);
+    g_free(write);
+    g_atomic_int_inc(&bnet_data_cache.generation);
+
+    g_static_mutex_lock(&bnet_data_cache_mutex);
+    g_atomic_int_set(&bnet_data_cache.writer_busy, 0);
+    if (bnet_data_cache_writer_idle != NULL) {
+        g_cond_broadcast(bnet_data_cache_writer_idle);
     }
-    
-    // save to bnet-cache.xml
-	output = xmlnode_to_formatted_str(current_cache, &length);
-	xmlnode_free(current_cache);
-	purple_util_write_data_to_file(BNET_FILE_CACHE, output, length);
-    g_free(output);
+    g_static_mutex_unlock(&bnet_data_cache_mutex);
+    return NULL;
 }
 
-static gchar *
-bnet_cache_get(BnetConnectionData *bnet, gchar *name, guint64 *timestamp, gchar *key)
+// hands the dirty entries to a writer; the caller checked writer_busy
+static BnetCacheWrite *
+bnet_cache_take_dirty(void)
 {
-    xmlnode *current_cache;
-    xmlnode *file;
-    
+    BnetCacheWrite *write = g_new0(BnetCacheWrite, 1);
+
+    write->path = bnet_cache_path();
+    write->entries = bnet_data_cache.dirty;
+    bnet_data_cache.dirty = g_hash_table_new_full(g_str_hash, g_str_equal,
+            NULL, (GDestroyNotify)bnet_cache_entry_free);
+    g_atomic_int_set(&bnet_data_cache.writer_busy, 1);
+    return write;
+}
+
+// starts a writer for the dirty entries; the caller checked writer_busy
+static void
+bnet_cache_write_start(void)
+{
+    BnetCacheWrite *write;
+    GError *err = NULL;
+
+    if (g_thread_supported() && bnet_data_cache_writer_idle == NULL) {
+        bnet_data_cache_writer_idle = g_cond_new();
+    }
+
+    write = bnet_cache_take_dirty();
+    if (!g_thread_supported() || g_thread_create(bnet_cache_write_thread, write, FALSE, &err) == NULL) {
+        if (err != NULL) {
+            purple_debug_warning("bnet", "Data cache writer thread failed: %s\n", err->message);
+            g_error_free(err);
+        }
+        bnet_cache_write_thread(write);
+    }
+}
+
+// blocks until no writer is running
+static void
+bnet_cache_writer_wait(void)
+{
+    g_static_mutex_lock(&bnet_data_cache_mutex);
+    while (g_atomic_int_get(&bnet_data_cache.writer_busy)) {
+        g_cond_wait(bnet_data_cache_writer_idle, g_static_mutex_get_mutex(&bnet_data_cache_mutex));
+    }
+    g_static_mutex_unlock(&bnet_data_cache_mutex);
+}
+
+static gboolean
+bnet_cache_write_timer(gpointer data)
+{
+    if (g_atomic_int_get(&bnet_data_cache.writer_busy)) {
+        // the previous write is still running, try again next tick
+        return _G_SOURCE_CONTINUE;
+    }
+    bnet_data_cache.write_timer_handle = 0;
+
+    bnet_cache_write_start();
+    return _G_SOURCE_REMOVE;
+}
+
+// coalesces writes from every account into one append to the file
+static void
+bnet_cache_schedule_write(void)
+{
+    if (bnet_data_cache.write_timer_handle == 0) {
+        bnet_data_cache.write_timer_handle = purple_timeout_add_seconds(BNET_CACHE_WRITE_DELAY,
+                bnet_cache_write_timer, NULL);
+    }
+}
+
+// hands a pending change to the writer now instead of after the delay;
+// bnet_plugin_destroy waits for it so it is not lost at exit
+static void
+bnet_cache_flush(void)
+{
+    if (bnet_data_cache.write_timer_handle == 0) {
+        return;
+    }
+    purple_timeout_remove(bnet_data_cache.write_timer_handle);
+    bnet_data_cache.write_timer_handle = 0;
+
+    // only one writer may touch the file; this only blocks if one is running
+    bnet_cache_writer_wait();
+    bnet_cache_write_start();
+}
+
+static void
+bnet_cache_set(BnetConnectionData *bnet, const gchar *name, guint64 timestamp, const gchar *key,
+        gconstpointer value, gsize length)
+{
+    gchar *id = bnet_cache_entry_id(name, key);
+    BnetCacheEntry *entry = bnet_cache_entry_new(id, timestamp, value, length);
+    BnetCacheEntry *dirty = bnet_cache_entry_new(id, timestamp, value, length);
+
+    bnet_cache_load();
+    g_hash_table_replace(bnet_data_cache.entries, entry->id, entry);
+    g_hash_table_replace(bnet_data_cache.dirty, dirty->id, dirty);
+    bnet_cache_schedule_write();
+    g_free(id);
+}
+
+// returns a copy of the value (NUL terminated) for the caller to g_free, or NULL
+static gpointer
+bnet_cache_get(BnetConnectionData *bnet, const gchar *name, const gchar *key,
+        guint64 *timestamp, gsize *length)
+{
+    gchar *id = bnet_cache_entry_id(name, key);
+    BnetCacheEntry *entry;
+    gchar *value = NULL;
+
+    bnet_cache_load();
+
     *timestamp = 0;
-    current_cache = purple_util_read_xml_from_file(BNET_FILE_CACHE, "Battle.net data cache");
-    
-    if (current_cache != NULL) {
-        // wrong root name
-        if (!g_str_equal(current_cache->name, "cache")) {
-            return NULL;
+    *length = 0;
+    entry = g_hash_table_lookup(bnet_data_cache.entries, id);
+    if (entry != NULL) {
+        *timestamp = entry->timestamp;
+        *length = entry->value_length;
+        value = g_memdup(entry->value, entry->value_length + 1);
+    } else if (!bnet_cache_file_lookup(bnet_data_cache.file, id, timestamp, &value, length)) {
+        value = NULL;
+    }
+    g_free(id);
+    return value;
+}
+
+static gchar *
+bnet_news_cache_key(BnetConnectionData *bnet)
+{
+    return g_strdup_printf("%s/%08x", bnet->bncs.conn.server, bnet->bncs.versioning.product);
+}
+
+static gchar *
+bnet_warm_cache_key(const BnetConnectionData *bnet)
+{
+    return g_strdup_printf("%s@%s", bnet_normalize(NULL, bnet->bncs.logon.username), bnet->bncs.conn.server);
+}
+
+static void
+bnet_warm_save_member(gpointer key, gpointer value, gpointer user_data)
+{
+    BnetClanMember *member = value;
+    BnetPacket *pkt = user_data;
+    guint8 rank = bnet_clan_member_get_rank(member);
+    guint8 status = bnet_clan_member_get_status(member);
+    const gchar *location = bnet_clan_member_get_location(member);
+
+    bnet_packet_insert(pkt, bnet_clan_member_get_name(member), BNET_SIZE_CSTRING);
+    bnet_packet_insert(pkt, &rank, BNET_SIZE_BYTE);
+    bnet_packet_insert(pkt, &status, BNET_SIZE_BYTE);
+    bnet_packet_insert(pkt, location == NULL ? "" : location, BNET_SIZE_CSTRING);
+}
+
+// remembers the friend list, clan roster and MOTD, and channel list for the
+// next logon to this gateway
+static void
+bnet_warm_save(BnetConnectionData *bnet)
+{
+    BnetPacket *pkt;
+    GList *el;
+    GHashTableIter iter;
+    gpointer key, value;
+    gchar *cache_key;
+    guint8 version = BNET_WARM_VERSION;
+    guint8 count = 0;
+    guint8 in_clan = bnet_clan_in_clan(bnet) ? 1 : 0;
+    guint16 channel_count;
+    guint i;
+
+    if (bnet_is_telnet(bnet)) {
+        return;
+    }
+
+    pkt = bnet_packet_create(BNET_PACKET_RAW);
+    bnet_packet_insert(pkt, &version, BNET_SIZE_BYTE);
+
+    for (i = 0; bnet->bncs.friends.list != NULL && i < bnet->bncs.friends.list->len; i++) {
+        if (g_ptr_array_index(bnet->bncs.friends.list, i) != NULL) {
+            count++;
         }
-        
-        // find any matching entries and replace them
-        for (file = current_cache->child; file; file = file->next) {
-            if (file->type != XMLNODE_TYPE_TAG) {
-                continue;
-            }
-            if (g_str_equal(file->name, "file")) {
-                const gchar *current_name = xmlnode_get_attrib(file, "name");
-                const gchar *current_key = xmlnode_get_attrib(file, "key");
-                if (g_str_equal(name, current_name) &&
-                        g_str_equal(key, current_key)) {
-                    const gchar *current_timestamp = xmlnode_get_attrib(file, "timestamp");
-                    const gchar *current_value = xmlnode_get_data(file);
-                    *timestamp = g_ascii_strtod(current_timestamp, NULL);
-                    return g_strdup(current_value);
-                }
+    }
+    bnet_packet_insert(pkt, &count, BNET_SIZE_BYTE);
+    for (i = 0; bnet->bncs.friends.list != NULL && i < bnet->bncs.friends.list->len; i++) {
+        BnetFriendInfo *bfi = g_ptr_array_index(bnet->bncs.friends.list, i);
+        guint8 status;
+        guint8 location;
+
+        if (bfi == NULL) {
+            continue;
+        }
+        status = bfi->status;
+        location = bfi->location;
+        bnet_packet_insert(pkt, bfi->account, BNET_SIZE_CSTRING);
+        bnet_packet_insert(pkt, &status, BNET_SIZE_BYTE);
+        bnet_packet_insert(pkt, &location, BNET_SIZE_BYTE);
+        bnet_packet_insert(pkt, &bfi->product, BNET_SIZE_DWORD);
+        bnet_packet_insert(pkt, bfi->location_name == NULL ? "" : bfi->location_name, BNET_SIZE_CSTRING);
+    }
+
+    bnet_packet_insert(pkt, &in_clan, BNET_SIZE_BYTE);
+    if (in_clan) {
+        const gchar *clan_name = bnet->bncs.w3_clan.my_clanname;
+        const gchar *motd = bnet->bncs.motds[BNET_MOTD_TYPE_CLAN].message;
+        guint8 rank = bnet->bncs.w3_clan.my_rank;
+
+        bnet_packet_insert(pkt, &bnet->bncs.w3_clan.my_clantag, BNET_SIZE_DWORD);
+        bnet_packet_insert(pkt, &rank, BNET_SIZE_BYTE);
+        bnet_packet_insert(pkt, clan_name == NULL ? "" : clan_name, BNET_SIZE_CSTRING);
+        bnet_packet_insert(pkt, motd == NULL ? "" : motd, BNET_SIZE_CSTRING);
+
+        count = 0;
+        if (bnet->bncs.w3_clan.my_clanmembers != NULL) {
+            count = MIN(g_hash_table_size(bnet->bncs.w3_clan.my_clanmembers), G_MAXUINT8);
+        }
+        bnet_packet_insert(pkt, &count, BNET_SIZE_BYTE);
+        if (count > 0) {
+            // write no more members than the count byte promises
+            i = 0;
+            g_hash_table_iter_init(&iter, bnet->bncs.w3_clan.my_clanmembers);
+            while (i < count && g_hash_table_iter_next(&iter, &key, &value)) {
+                bnet_warm_save_member(key, value, pkt);
+                i++;
             }
         }
     }
-    
-    return NULL;
+
+    channel_count = g_list_length(bnet->bncs.chat_env.channel_list);
+    bnet_packet_insert(pkt, &channel_count, BNET_SIZE_WORD);
+    for (el = bnet->bncs.chat_env.channel_list; el != NULL; el = g_list_next(el)) {
+        bnet_packet_insert(pkt, el->data, BNET_SIZE_CSTRING);
+    }
+
+    cache_key = bnet_warm_cache_key(bnet);
+    bnet_cache_set(bnet, "warm", time(NULL), cache_key, pkt->data, pkt->pos);
+    g_free(cache_key);
+    bnet_packet_free(pkt);
+}
+
+// fills the buddy list from the last session on this gateway before logon
+// completes; everything shown is marked stale until the live lists arrive
+static void
+bnet_warm_load(BnetConnectionData *bnet)
+{
+    BnetPacket *pkt;
+    gchar *cache_key;
+    gpointer cache_val;
+    gsize cache_len;
+    guint64 timestamp;
+    guint8 count;
+    guint16 channel_count;
+    int i;
+
+    if (bnet_is_telnet(bnet)) {
+        return;
+    }
+
+    cache_key = bnet_warm_cache_key(bnet);
+    cache_val = bnet_cache_get(bnet, "warm", cache_key, &timestamp, &cache_len);
+    g_free(cache_key);
+    if (cache_val == NULL) {
+        return;
+    }
+
+    pkt = bnet_packet_refer_raw(cache_val, cache_len);
+    if (!bnet_packet_can_read(pkt, 2) || bnet_packet_read_byte(pkt) != BNET_WARM_VERSION) {
+        bnet_packet_free(pkt);
+        g_free(cache_val);
+        return;
+    }
+
+    count = bnet_packet_read_byte(pkt);
+    purple_debug_info("bnet", "Warm start: %d cached friends\n", count);
+    bnet->bncs.friends.list = g_ptr_array_sized_new(count);
+    for (i = 0; i < count && bnet_packet_can_read(pkt, 8); i++) {
+        gchar *account_name = bnet_packet_read_cstring(pkt);
+        BnetFriendStatus status = bnet_packet_read_byte(pkt);
+        BnetFriendLocation location = bnet_packet_read_byte(pkt);
+        BnetProductID product_id = bnet_packet_read_dword(pkt);
+        gchar *location_name = bnet_packet_read_cstring(pkt);
+        BnetFriendInfo *bfi;
+
+        if (account_name == NULL || location_name == NULL) {
+            g_free(account_name);
+            g_free(location_name);
+            break;
+        }
+        bfi = bnet_friend_info_new(account_name);
+        bfi->stale = TRUE;
+        bnet_friend_index_add(bnet, bfi);
+        g_ptr_array_add(bnet->bncs.friends.list, bfi);
+        bnet_friend_update(bnet, i, bfi, status, location, product_id, location_name);
+        g_free(location_name);
+    }
+
+    if (bnet_packet_can_read(pkt, 1) && bnet_packet_read_byte(pkt) && bnet_packet_can_read(pkt, 8)) {
+        PurpleGroup *group = NULL;
+        gchar *clan_name;
+        gchar *motd;
+        gchar *s_tag;
+
+        // in_clan stays unset until SID_CLANINFO confirms it
+        bnet->bncs.w3_clan.my_clantag = bnet_packet_read_dword(pkt);
+        bnet->bncs.w3_clan.my_rank = bnet_packet_read_byte(pkt);
+        clan_name = bnet_packet_read_cstring(pkt);
+        motd = bnet_packet_read_cstring(pkt);
+
+        if (clan_name != NULL && strlen(clan_name) > 0) {
+            g_free(bnet->bncs.w3_clan.my_clanname);
+            bnet->bncs.w3_clan.my_clanname = clan_name;
+        } else {
+            g_free(clan_name);
+        }
+
+        s_tag = bnet_tag_to_string(bnet->bncs.w3_clan.my_clantag);
+        bnet_motd_free(bnet, BNET_MOTD_TYPE_CLAN);
+        bnet->bncs.motds[BNET_MOTD_TYPE_CLAN].name = g_strdup_printf("Clan %s", s_tag);
+        if (bnet->bncs.w3_clan.my_clanname != NULL) {
+            bnet->bncs.motds[BNET_MOTD_TYPE_CLAN].subname = g_strdup(bnet->bncs.w3_clan.my_clanname);
+        }
+        bnet->bncs.motds[BNET_MOTD_TYPE_CLAN].message = motd;
+        g_free(s_tag);
+
+        if (purple_account_get_bool(bnet->account, "showgrpclan", FALSE)) {
+            group = bnet_clan_get_group(bnet);
+            bnet->bncs.w3_clan.clan_members_in_blist = TRUE;
+        }
+        count = bnet_packet_can_read(pkt, 1) ? bnet_packet_read_byte(pkt) : 0;
+        purple_debug_info("bnet", "Warm start: %d cached clan members\n", count);
+        for (i = 0; i < count && bnet_packet_can_read(pkt, 4); i++) {
+            gchar *name = bnet_packet_read_cstring(pkt);
+            BnetClanMemberRank rank = bnet_packet_read_byte(pkt);
+            BnetClanMemberStatus status = bnet_packet_read_byte(pkt);
+            gchar *location = bnet_packet_read_cstring(pkt);
+
+            if (name == NULL || location == NULL) {
+                g_free(name);
+                g_free(location);
+                break;
+            }
+            bnet_clan_update_member(bnet, name, rank, status, location, group)->stale = TRUE;
+        }
+    }
+
+    if (bnet_packet_can_read(pkt, 2)) {
+        channel_count = bnet_packet_read_word(pkt);
+        for (i = 0; i < channel_count; i++) {
+            gchar *channel = bnet_packet_read_cstring(pkt);
+            if (channel == NULL) {
+                break;
+            }
+            bnet->bncs.chat_env.channel_list = g_list_prepend(bnet->bncs.chat_env.channel_list, channel);
+        }
+        bnet->bncs.chat_env.channel_list = g_list_reverse(bnet->bncs.chat_env.channel_list);
+    }
+
+    bnet_packet_free(pkt);
+    g_free(cache_val);
+}
+
+static gboolean
+bnet_user_is_stale(const BnetUser *bu)
+{
+    switch (bu->type) {
+        case BNET_USER_TYPE_FRIEND:
+            return ((const BnetFriendInfo *)bu)->stale;
+        case BNET_USER_TYPE_CLANMEMBER:
+            return ((const BnetClanMember *)bu)->stale;
+        default:
+            return FALSE;
+    }
 }
 
 static void
@@ -8070,12 +10655,8 @@ bnet_news_save(BnetConnectionData *bnet)
     GList *el;
     BnetPacket *pkt;
     gchar *cache_key;
-    gchar *cache_val;
     
-    pkt = bnet_packet_create(BNET_PACKET_RAW);
-    bnet_packet_insert(pkt, bnet->bncs.conn.server, BNET_SIZE_CSTRING);
-    bnet_packet_insert(pkt, &bnet->bncs.versioning.product, BNET_SIZE_DWORD);
-    cache_key = bnet_packet_serialize(pkt);
+    cache_key = bnet_news_cache_key(bnet);
     
     pkt = bnet_packet_create(BNET_PACKET_RAW);
     bnet_packet_insert(pkt, &bnet->bncs.news.item_count, BNET_SIZE_BYTE);
@@ -8090,8 +10671,9 @@ bnet_news_save(BnetConnectionData *bnet)
     
         el = g_list_next(el);
     }
-    cache_val = bnet_packet_serialize(pkt);
-    bnet_cache_set(bnet, "pkt:SID_NEWS_INFO", bnet->bncs.news.latest, cache_key, cache_val);
+    bnet_cache_set(bnet, "pkt:SID_NEWS_INFO", bnet->bncs.news.latest, cache_key, pkt->data, pkt->pos);
+    bnet_packet_free(pkt);
+    g_free(cache_key);
 }
 
 static void
@@ -8099,30 +10681,41 @@ bnet_news_load(BnetConnectionData *bnet)
 {
     BnetPacket *pkt;
     gchar *cache_key;
-    gchar *cache_val;
+    gpointer cache_val;
+    gsize cache_len;
     int i;
     guint64 timestamp;
     
-    pkt = bnet_packet_create(BNET_PACKET_RAW);
-    bnet_packet_insert(pkt, bnet->bncs.conn.server, BNET_SIZE_CSTRING);
-    bnet_packet_insert(pkt, &bnet->bncs.versioning.product, BNET_SIZE_DWORD);
-    cache_key = bnet_packet_serialize(pkt);
-    cache_val = bnet_cache_get(bnet, "pkt:SID_NEWS_INFO", &timestamp, cache_key);
+    cache_key = bnet_news_cache_key(bnet);
+    cache_val = bnet_cache_get(bnet, "pkt:SID_NEWS_INFO", cache_key, &timestamp, &cache_len);
     
     bnet->bncs.news.latest = timestamp;
-    if (cache_val == NULL) {
-        bnet->bncs.news.item_count = 0;
-        bnet->bncs.news.item_list = NULL;
-    } else {
-        pkt = bnet_packet_deserialize(cache_val);
-        if (pkt != NULL && bnet_packet_can_read(pkt, 1)) {
+    bnet->bncs.news.item_count = 0;
+    bnet->bncs.news.item_list = NULL;
+    if (cache_val != NULL) {
+        // reads straight out of the cached copy, nothing is decoded
+        pkt = bnet_packet_refer_raw(cache_val, cache_len);
+        if (bnet_packet_can_read(pkt, 1)) {
             bnet->bncs.news.item_count = bnet_packet_read_byte(pkt);
             for (i = 0; i < bnet->bncs.news.item_count; i++) {
-                BnetNewsItem *item = g_new0(BnetNewsItem, 1);
-                guint32 timestamp = bnet_packet_read_dword(pkt);
-                gchar *message = bnet_packet_read_cstring(pkt);
-                GList *el2 = g_list_first(bnet->bncs.news.item_list);
+                BnetNewsItem *item;
+                guint32 timestamp;
+                gchar *message;
+                GList *el2;
+                
+                if (!bnet_packet_can_read(pkt, BNET_SIZE_DWORD + 1)) {
+                    purple_debug_warning("bnet", "truncated news in data cache\n");
+                    bnet->bncs.news.item_count = i;
+                    break;
+                }
+                timestamp = bnet_packet_read_dword(pkt);
+                message = bnet_packet_read_cstring(pkt);
+                if (message == NULL) {
+                    bnet->bncs.news.item_count = i;
+                    break;
+                }
                 
+                el2 = g_list_first(bnet->bncs.news.item_list);
                 while (el2 != NULL) {
                     if (((BnetNewsItem *)el2->data)->timestamp == timestamp) {
                         purple_debug_warning("bnet", "duplicate in bnet_news_load\n");
@@ -8130,6 +10723,7 @@ bnet_news_load(BnetConnectionData *bnet)
                     el2 = g_list_next(el2);
                 }
                 
+                item = g_new0(BnetNewsItem, 1);
                 item->timestamp = timestamp;
                 item->message = message;
                 
@@ -8235,10 +10829,221 @@ bnet_action_show_news(PurplePluginAction *action)
         g_free(formatted);
         formatted = g_strdup("<i>No news returned.</i>");
     }
-    purple_notify_formatted(bnet->account->gc, "Battle.net News",
-            "News for this Battle.net server.", NULL, formatted, NULL, NULL);
+    purple_notify_formatted(bnet->account->gc, "Battle.net News",
+            "News for this Battle.net server.", NULL, formatted, NULL, NULL);
+
+    g_free(formatted);
+}
+
+// names a packet ID for the packet statistics report
+static const gchar *
+bnet_packet_name(BnetPacketStatsProtocol protocol, guint8 id)
+{
+    switch (protocol) {
+        case BNET_PACKET_STATS_BNCS:
+            switch (id) {
+                case BNET_SID_NULL:
+                    return "SID_NULL";
+                case BNET_SID_CLIENTID:
+                    return "SID_CLIENTID";
+                case BNET_SID_STARTVERSIONING:
+                    return "SID_STARTVERSIONING";
+                case BNET_SID_REPORTVERSION:
+                    return "SID_REPORTVERSION";
+                case BNET_SID_ENTERCHAT:
+                    return "SID_ENTERCHAT";
+                case BNET_SID_GETCHANNELLIST:
+                    return "SID_GETCHANNELLIST";
+                case BNET_SID_JOINCHANNEL:
+                    return "SID_JOINCHANNEL";
+                case BNET_SID_CHATCOMMAND:
+                    return "SID_CHATCOMMAND";
+                case BNET_SID_CHATEVENT:
+                    return "SID_CHATEVENT";
+                case BNET_SID_LEAVECHAT:
+                    return "SID_LEAVECHAT";
+                case BNET_SID_LOCALEINFO:
+                    return "SID_LOCALEINFO";
+                case BNET_SID_FLOODDETECTED:
+                    return "SID_FLOODDETECTED";
+                case BNET_SID_UDPPINGRESPONSE:
+                    return "SID_UDPPINGRESPONSE";
+                case BNET_SID_MESSAGEBOX:
+                    return "SID_MESSAGEBOX";
+                case BNET_SID_LOGONCHALLENGEEX:
+                    return "SID_LOGONCHALLENGEEX";
+                case BNET_SID_CLIENTID2:
+                    return "SID_CLIENTID2";
+                case BNET_SID_PING:
+                    return "SID_PING";
+                case BNET_SID_READUSERDATA:
+                    return "SID_READUSERDATA";
+                case BNET_SID_WRITEUSERDATA:
+                    return "SID_WRITEUSERDATA";
+                case BNET_SID_LOGONCHALLENGE:
+                    return "SID_LOGONCHALLENGE";
+                case BNET_SID_SYSTEMINFO:
+                    return "SID_SYSTEMINFO";
+                case BNET_SID_CDKEY:
+                    return "SID_CDKEY";
+                case BNET_SID_W3PROFILE:
+                    return "SID_W3PROFILE";
+                case BNET_SID_CDKEY2:
+                    return "SID_CDKEY2";
+                case BNET_SID_LOGONRESPONSE2:
+                    return "SID_LOGONRESPONSE2";
+                case BNET_SID_CREATEACCOUNT2:
+                    return "SID_CREATEACCOUNT2";
+                case BNET_SID_LOGONREALMEX:
+                    return "SID_LOGONREALMEX";
+                case BNET_SID_QUERYREALMS2:
+                    return "SID_QUERYREALMS2";
+                case BNET_SID_W3GENERAL:
+                    return "SID_W3GENERAL";
+                case BNET_SID_NETGAMEPORT:
+                    return "SID_NETGAMEPORT";
+                case BNET_SID_NEWS_INFO:
+                    return "SID_NEWS_INFO";
+                case BNET_SID_OPTIONALWORK:
+                    return "SID_OPTIONALWORK";
+                case BNET_SID_REQUIREDWORK:
+                    return "SID_REQUIREDWORK";
+                case BNET_SID_AUTH_INFO:
+                    return "SID_AUTH_INFO";
+                case BNET_SID_AUTH_CHECK:
+                    return "SID_AUTH_CHECK";
+                case BNET_SID_AUTH_ACCOUNTCREATE:
+                    return "SID_AUTH_ACCOUNTCREATE";
+                case BNET_SID_AUTH_ACCOUNTLOGON:
+                    return "SID_AUTH_ACCOUNTLOGON";
+                case BNET_SID_AUTH_ACCOUNTLOGONPROOF:
+                    return "SID_AUTH_ACCOUNTLOGONPROOF";
+                case BNET_SID_AUTH_ACCOUNTCHANGE:
+                    return "SID_AUTH_ACCOUNTCHANGE";
+                case BNET_SID_AUTH_ACCOUNTCHANGEPROOF:
+                    return "SID_AUTH_ACCOUNTCHANGEPROOF";
+                case BNET_SID_SETEMAIL:
+                    return "SID_SETEMAIL";
+                case BNET_SID_FRIENDSLIST:
+                    return "SID_FRIENDSLIST";
+                case BNET_SID_FRIENDSUPDATE:
+                    return "SID_FRIENDSUPDATE";
+                case BNET_SID_FRIENDSADD:
+                    return "SID_FRIENDSADD";
+                case BNET_SID_FRIENDSREMOVE:
+                    return "SID_FRIENDSREMOVE";
+                case BNET_SID_FRIENDSPOSITION:
+                    return "SID_FRIENDSPOSITION";
+                case BNET_SID_CLANFINDCANDIDATES:
+                    return "SID_CLANFINDCANDIDATES";
+                case BNET_SID_CLANINVITEMULTIPLE:
+                    return "SID_CLANINVITEMULTIPLE";
+                case BNET_SID_CLANCREATIONINVITATION:
+                    return "SID_CLANCREATIONINVITATION";
+                case BNET_SID_CLANDISBAND:
+                    return "SID_CLANDISBAND";
+                case BNET_SID_CLANMAKECHIEFTAIN:
+                    return "SID_CLANMAKECHIEFTAIN";
+                case BNET_SID_CLANINFO:
+                    return "SID_CLANINFO";
+                case BNET_SID_CLANQUITNOTIFY:
+                    return "SID_CLANQUITNOTIFY";
+                case BNET_SID_CLANINVITATION:
+                    return "SID_CLANINVITATION";
+                case BNET_SID_CLANREMOVEMEMBER:
+                    return "SID_CLANREMOVEMEMBER";
+                case BNET_SID_CLANINVITATIONRESPONSE:
+                    return "SID_CLANINVITATIONRESPONSE";
+                case BNET_SID_CLANRANKCHANGE:
+                    return "SID_CLANRANKCHANGE";
+                case BNET_SID_CLANSETMOTD:
+                    return "SID_CLANSETMOTD";
+                case BNET_SID_CLANMOTD:
+                    return "SID_CLANMOTD";
+                case BNET_SID_CLANMEMBERLIST:
+                    return "SID_CLANMEMBERLIST";
+                case BNET_SID_CLANMEMBERREMOVED:
+                    return "SID_CLANMEMBERREMOVED";
+                case BNET_SID_CLANMEMBERSTATUSCHANGE:
+                    return "SID_CLANMEMBERSTATUSCHANGE";
+                case BNET_SID_CLANMEMBERRANKCHANGE:
+                    return "SID_CLANMEMBERRANKCHANGE";
+                case BNET_SID_CLANMEMBERINFO:
+                    return "SID_CLANMEMBERINFO";
+            }
+            break;
+        case BNET_PACKET_STATS_BNLS:
+            switch (id) {
+                case BNET_BNLS_REQUESTVERSIONBYTE:
+                    return "BNLS_REQUESTVERSIONBYTE";
+                case BNET_BNLS_VERSIONCHECKEX2:
+                    return "BNLS_VERSIONCHECKEX2";
+                case BNET_BNLS_LOGONCHALLENGE:
+                    return "BNLS_LOGONCHALLENGE";
+                case BNET_BNLS_LOGONPROOF:
+                    return "BNLS_LOGONPROOF";
+                case BNET_BNLS_CHOOSENLSREVISION:
+                    return "BNLS_CHOOSENLSREVISION";
+                case BNET_BNLS_MESSAGE:
+                    return "BNLS_MESSAGE";
+            }
+            break;
+        case BNET_PACKET_STATS_D2MCP:
+            switch (id) {
+                case BNET_D2MCP_STARTUP:
+                    return "MCP_STARTUP";
+                case BNET_D2MCP_CHARLOGON:
+                    return "MCP_CHARLOGON";
+                case BNET_D2MCP_MOTD:
+                    return "MCP_MOTD";
+                case BNET_D2MCP_CHARLIST2:
+                    return "MCP_CHARLIST2";
+            }
+            break;
+    }
+    return NULL;
+}
+
+static void
+bnet_action_show_packet_stats(PurplePluginAction *action)
+{
+    PurpleConnection *gc = action->context;
+    gchar *report = bnet_packet_stats_report(bnet_packet_name, FALSE);
+    gchar *escaped = g_markup_escape_text(report, -1);
+    gchar *lines = purple_strdup_withhtml(escaped);
+    gchar *formatted = g_strdup_printf("<font face=\"monospace\">%s</font>", lines);
+
+    purple_notify_formatted(gc, "Packet Statistics",
+            "Packets for all Battle.net accounts, most handler time first.", NULL, formatted, NULL, NULL);
+
+    g_free(formatted);
+    g_free(lines);
+    g_free(escaped);
+    g_free(report);
+}
+
+static void
+bnet_action_save_packet_stats_cb(gpointer data, const char *filename)
+{
+    PurpleConnection *gc = data;
+
+    if (!PURPLE_CONNECTION_IS_VALID(gc)) {
+        return;
+    }
+
+    if (!bnet_packet_stats_write(filename, bnet_packet_name)) {
+        purple_notify_error(gc, "Packet Statistics", "Unable to save packet statistics.", filename);
+    }
+}
 
-    g_free(formatted);
+static void
+bnet_action_save_packet_stats(PurplePluginAction *action)
+{
+    PurpleConnection *gc = action->context;
+
+    purple_request_file(gc, "Save Packet Statistics", BNET_FILE_PACKET_STATS, TRUE,
+            (GCallback)bnet_action_save_packet_stats_cb, NULL,
+            purple_connection_get_account(gc), NULL, NULL, gc);
 }
 
 static void
@@ -8294,6 +11099,129 @@ bnet_action_set_motd(PurplePluginAction *action)
     g_free(group_name);
 }
 
+static gint
+bnet_clan_roster_name_cmp(gconstpointer a, gconstpointer b)
+{
+    return g_ascii_strcasecmp(*(const gchar **)a, *(const gchar **)b);
+}
+
+static void
+bnet_action_show_clan_profiles(PurplePluginAction *action)
+{
+    PurpleConnection *gc = action->context;
+    BnetConnectionData *bnet = gc->proto_data;
+    GPtrArray *accounts = NULL;
+    GHashTableIter iter;
+    gpointer value;
+
+    if (bnet == NULL) return;
+    if (bnet_is_telnet(bnet)) return;
+    if (!bnet_clan_in_clan(bnet)) return;
+    if (bnet->bncs.w3_clan.my_clanmembers == NULL) return;
+
+    if (bnet->bncs.user_data.roster_accounts != NULL) {
+        purple_notify_info(gc, "Clan Member Profiles",
+                "The clan member profiles are still being fetched.", NULL);
+        return;
+    }
+
+    accounts = g_ptr_array_new();
+    g_hash_table_iter_init(&iter, bnet->bncs.w3_clan.my_clanmembers);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        const gchar *name = bnet_clan_member_get_name(value);
+        g_ptr_array_add(accounts, g_strdup(bnet_account_normalize(bnet->account, name)));
+    }
+    g_ptr_array_sort(accounts, bnet_clan_roster_name_cmp);
+
+    if (accounts->len == 0) {
+        g_ptr_array_free(accounts, TRUE);
+        return;
+    }
+
+    bnet->bncs.user_data.roster_accounts = accounts;
+    bnet->bncs.user_data.roster_waiting = accounts->len;
+    purple_debug_info("bnet", "Fetching profiles for %u clan members\n", accounts->len);
+
+    // the whole roster in one pass, so the batcher packs it into few requests
+    bnet_userdata_request_queue_accounts(bnet,
+            BNET_READUSERDATA_REQUEST_PROFILE | BNET_READUSERDATA_REQUEST_ROSTER,
+            accounts, g_strsplit(BNET_USERDATA_PROFILE_REQUEST, "\n", -1),
+            bnet->bncs.versioning.product);
+}
+
+// count roster accounts as answered (or given up on); shows the table after the last
+static void
+bnet_clan_roster_accounts_done(BnetConnectionData *bnet, guint count)
+{
+    GString *html = NULL;
+    gchar *tag_string = NULL;
+    gchar *primary = NULL;
+    guint i;
+
+    if (bnet->bncs.user_data.roster_accounts == NULL) {
+        return;
+    }
+
+    bnet->bncs.user_data.roster_waiting -= MIN(count, bnet->bncs.user_data.roster_waiting);
+    if (bnet->bncs.user_data.roster_waiting > 0) {
+        return;
+    }
+
+    html = g_string_new("<table><tr><th>Account</th><th>Sex</th><th>Age</th><th>Location</th></tr>");
+    for (i = 0; i < bnet->bncs.user_data.roster_accounts->len; i++) {
+        const gchar *account = g_ptr_array_index(bnet->bncs.user_data.roster_accounts, i);
+        GHashTable *userdata = bnet_userdata_cache_get_account(bnet, account, FALSE);
+        gchar *account_escaped = g_markup_escape_text(account, -1);
+
+        g_string_append_printf(html, "<tr><td>%s</td>", account_escaped);
+        if (userdata == NULL) {
+            g_string_append(html, "<td colspan=\"3\">(no answer)</td>");
+        } else {
+            const gchar *keys[] = { "profile\\sex", "profile\\age", "profile\\location", NULL };
+            int j;
+
+            for (j = 0; keys[j] != NULL; j++) {
+                gchar *pstr = bnet_userdata_cache_value(userdata, keys[j]);
+                gchar *pstr_utf8 = bnet_to_utf8_crlf(pstr);
+                gchar *pstr_escaped = g_markup_escape_text(pstr_utf8, -1);
+
+                g_string_append_printf(html, "<td>%s</td>", pstr_escaped);
+                g_free(pstr_escaped);
+                g_free(pstr_utf8);
+            }
+        }
+        g_string_append(html, "</tr>");
+        g_free(account_escaped);
+    }
+    g_string_append(html, "</table>");
+
+    tag_string = bnet_tag_to_string(bnet->bncs.w3_clan.my_clantag);
+    primary = g_strdup_printf("Profiles of the members of Clan %s.", tag_string);
+    purple_notify_formatted(bnet->account->gc, "Clan Member Profiles", primary, NULL, html->str, NULL, NULL);
+
+    g_free(primary);
+    g_free(tag_string);
+    g_string_free(html, TRUE);
+    bnet_clan_roster_free(bnet);
+}
+
+static void
+bnet_clan_roster_free(BnetConnectionData *bnet)
+{
+    guint i;
+
+    if (bnet->bncs.user_data.roster_accounts == NULL) {
+        return;
+    }
+
+    for (i = 0; i < bnet->bncs.user_data.roster_accounts->len; i++) {
+        g_free(g_ptr_array_index(bnet->bncs.user_data.roster_accounts, i));
+    }
+    g_ptr_array_free(bnet->bncs.user_data.roster_accounts, TRUE);
+    bnet->bncs.user_data.roster_accounts = NULL;
+    bnet->bncs.user_data.roster_waiting = 0;
+}
+
 static void
 bnet_action_set_user_data(PurplePluginAction *action)
 {
@@ -8310,21 +11238,14 @@ bnet_action_set_user_data(PurplePluginAction *action)
 static void
 bnet_profile_get_for_edit(BnetConnectionData *bnet)
 {
-    const char *uu_norm = bnet_normalize(bnet->account, bnet->bncs.chat_env.unique_name);
-    int request_cookie = g_str_hash(uu_norm);
-    BnetUserDataRequest *req;
     char **keys;
 
     keys = g_strsplit(BNET_USERDATA_PROFILE_REQUEST, "\n", -1);
 
     bnet->bncs.user_data.writing_profile = TRUE;
 
-    req = bnet_userdata_request_new(request_cookie, BNET_READUSERDATA_REQUEST_PROFILE,
+    bnet_userdata_request_queue(bnet, BNET_READUSERDATA_REQUEST_PROFILE,
             bnet->bncs.logon.username, keys, bnet->bncs.versioning.product);
-
-    bnet->bncs.user_data.requests = g_list_append(bnet->bncs.user_data.requests, req);
-
-    bnet_send_READUSERDATA(bnet, request_cookie, bnet->bncs.logon.username, keys);
 }
 
 static void
@@ -8433,18 +11354,314 @@ bnet_profile_write_cb(gpointer data)
         location != s_const ||
         description == s_const) {
         bnet_send_WRITEUSERDATA(bnet, sex, age, location, description);
+        // our own profile changed; do not serve the old one from cache
+        bnet_userdata_cache_invalidate(bnet, bnet->bncs.logon.username);
+    }
+}
+
+/**
+ * Queues a SID_READUSERDATA lookup. Lookups for the same keys queued during one
+ * main loop iteration are sent together as one multi-account request.
+ * Takes ownership of: userdata_keys
+ */
+static void
+bnet_userdata_request_queue(BnetConnectionData *bnet, BnetUserDataRequestType type,
+        const gchar *username, gchar **userdata_keys, BnetProductID product)
+{
+    GList *el;
+    GHashTable *cached = bnet_userdata_cache_get_account(bnet, username, FALSE);
+
+    if (cached != NULL && bnet_userdata_cache_is_fresh(cached, userdata_keys)) {
+        // answer on the next main loop iteration, as a server response would be
+        purple_debug_info("bnet", "SID_READUSERDATA for %s served from cache\n", username);
+        bnet->bncs.user_data.cached = g_list_append(bnet->bncs.user_data.cached,
+                bnet_userdata_request_new(type, username, userdata_keys, product));
+        if (bnet->bncs.user_data.cached_timer_handle == 0) {
+            bnet->bncs.user_data.cached_timer_handle =
+                purple_timeout_add(0, (GSourceFunc)bnet_userdata_cached_timer, bnet);
+        }
+        return;
+    }
+
+    for (el = bnet->bncs.user_data.pending; el != NULL; el = g_list_next(el)) {
+        BnetUserDataRequest *req = el->data;
+        if (bnet_userdata_request_can_merge(req, type, userdata_keys, product)) {
+            bnet_userdata_request_add_account(req, username);
+            g_strfreev(userdata_keys);
+            return;
+        }
+    }
+
+    bnet->bncs.user_data.pending = g_list_append(bnet->bncs.user_data.pending,
+            bnet_userdata_request_new(type, username, userdata_keys, product));
+
+    if (bnet->bncs.user_data.batch_timer_handle == 0) {
+        bnet->bncs.user_data.batch_timer_handle =
+            purple_timeout_add(0, (GSourceFunc)bnet_userdata_batch_timer, bnet);
+    }
+}
+
+/**
+ * Queues the same SID_READUSERDATA lookup for every account in usernames, which
+ * go out BNET_USERDATA_BATCH_MAX accounts to a request.
+ * Takes ownership of: userdata_keys
+ */
+static void
+bnet_userdata_request_queue_accounts(BnetConnectionData *bnet, BnetUserDataRequestType type,
+        GPtrArray *usernames, gchar **userdata_keys, BnetProductID product)
+{
+    guint i;
+
+    for (i = 0; i < usernames->len; i++) {
+        bnet_userdata_request_queue(bnet, type, g_ptr_array_index(usernames, i),
+                g_strdupv(userdata_keys), product);
+    }
+    g_strfreev(userdata_keys);
+}
+
+static gboolean
+bnet_userdata_batch_timer(BnetConnectionData *bnet)
+{
+    GList *el;
+
+    bnet->bncs.user_data.batch_timer_handle = 0;
+
+    for (el = bnet->bncs.user_data.pending; el != NULL; el = g_list_next(el)) {
+        BnetUserDataRequest *req = el->data;
+        guint32 cookie = bnet_packet_cookie_register_full(bnet, BNET_SID_READUSERDATA, req,
+                (GDestroyNotify)bnet_userdata_request_free, bnet_lookup_info_cookie_expired);
+
+        purple_debug_info("bnet", "SID_READUSERDATA %u: %d account(s)\n", cookie,
+                bnet_userdata_request_get_account_count(req));
+        bnet_send_READUSERDATA(bnet, cookie, req);
+    }
+    g_list_free(bnet->bncs.user_data.pending);
+    bnet->bncs.user_data.pending = NULL;
+
+    return _G_SOURCE_REMOVE;
+}
+
+static gboolean
+bnet_userdata_cached_timer(BnetConnectionData *bnet)
+{
+    GList *cached = bnet->bncs.user_data.cached;
+    GList *el;
+
+    bnet->bncs.user_data.cached_timer_handle = 0;
+    bnet->bncs.user_data.cached = NULL;
+
+    for (el = cached; el != NULL; el = g_list_next(el)) {
+        BnetUserDataRequest *req = el->data;
+        const gchar *username = bnet_userdata_request_get_account_by_index(req, 0);
+        GHashTable *userdata = bnet_userdata_cache_get_account(bnet, username, FALSE);
+
+        // it may have been invalidated since it was queued
+        if (userdata != NULL) {
+            bnet_userdata_request_process(bnet, req, username, userdata);
+        } else if (bnet_userdata_request_get_type(req) & BNET_READUSERDATA_REQUEST_ROSTER) {
+            bnet_clan_roster_accounts_done(bnet, 1);
+        }
+    }
+    _g_list_free_full(cached, (GDestroyNotify)bnet_userdata_request_free);
+
+    return _G_SOURCE_REMOVE;
+}
+
+static void
+bnet_userdata_value_free(BnetUserDataValue *val)
+{
+    if (val != NULL) {
+        g_free(val->value);
+        g_free(val);
+    }
+}
+
+static int
+bnet_userdata_cache_ttl(const gchar *key)
+{
+    if (g_ascii_strncasecmp(key, "profile\\", 8) == 0) {
+        return BNET_USERDATA_TTL_PROFILE;
+    } else if (g_ascii_strncasecmp(key, "System\\", 7) == 0) {
+        return BNET_USERDATA_TTL_SYSTEM;
+    } else {
+        // Record\... and DynKey\...
+        return BNET_USERDATA_TTL_RECORD;
     }
 }
 
+// returns the cached values for username (key -> BnetUserDataValue)
+static GHashTable *
+bnet_userdata_cache_get_account(BnetConnectionData *bnet, const gchar *username, gboolean create)
+{
+    gchar *account = g_ascii_strdown(username, -1);
+    GHashTable *values = NULL;
+
+    if (bnet->bncs.user_data.cache == NULL) {
+        if (!create) {
+            g_free(account);
+            return NULL;
+        }
+        bnet->bncs.user_data.cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+                g_free, (GDestroyNotify)g_hash_table_destroy);
+    }
+
+    values = g_hash_table_lookup(bnet->bncs.user_data.cache, account);
+    if (values == NULL && create) {
+        if (g_hash_table_size(bnet->bncs.user_data.cache) >= BNET_USERDATA_CACHE_MAX) {
+            bnet_userdata_cache_prune(bnet);
+        }
+        values = g_hash_table_new_full(g_str_hash, g_str_equal,
+                g_free, (GDestroyNotify)bnet_userdata_value_free);
+        g_hash_table_insert(bnet->bncs.user_data.cache, account, values);
+        return values;
+    }
+
+    g_free(account);
+    return values;
+}
+
+/**
+ * Takes ownership of: value
+ */
+static void
+bnet_userdata_cache_store(GHashTable *values, const gchar *key, gchar *value)
+{
+    BnetUserDataValue *val = g_hash_table_lookup(values, key);
+
+    if (val == NULL) {
+        val = g_new0(BnetUserDataValue, 1);
+        g_hash_table_insert(values, g_strdup(key), val);
+    } else {
+        g_free(val->value);
+    }
+    val->value = value;
+    val->expires = time(NULL) + bnet_userdata_cache_ttl(key);
+}
+
+// returns the value for key, or NULL if it is not cached or has expired
+static gchar *
+bnet_userdata_cache_value(GHashTable *values, const gchar *key)
+{
+    BnetUserDataValue *val = g_hash_table_lookup(values, key);
+
+    if (val == NULL || val->expires <= time(NULL)) {
+        return NULL;
+    }
+    return val->value;
+}
+
+static gboolean
+bnet_userdata_cache_is_fresh(GHashTable *values, gchar **keys)
+{
+    time_t now = time(NULL);
+    int i;
+
+    for (i = 0; keys[i] != NULL; i++) {
+        BnetUserDataValue *val = g_hash_table_lookup(values, keys[i]);
+        if (val == NULL || val->expires <= now) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static gboolean
+bnet_userdata_cache_prune_account(gpointer key, gpointer value, gpointer user_data)
+{
+    GHashTable *values = value;
+    time_t *now = user_data;
+    GHashTableIter iter;
+    BnetUserDataValue *val;
+
+    g_hash_table_iter_init(&iter, values);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&val)) {
+        if (val->expires > *now) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// collects each account with the expiry of its freshest value
+static void
+bnet_userdata_cache_age_account(gpointer key, gpointer value, gpointer user_data)
+{
+    GArray *ages = user_data;
+    GHashTableIter iter;
+    BnetUserDataValue *val;
+    struct BnetUserDataCacheAge age;
+
+    age.account = key;
+    age.newest = 0;
+    g_hash_table_iter_init(&iter, value);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&val)) {
+        if (val->expires > age.newest) {
+            age.newest = val->expires;
+        }
+    }
+    g_array_append_val(ages, age);
+}
+
+static gint
+bnet_userdata_cache_age_cmp(gconstpointer a, gconstpointer b)
+{
+    time_t newest_a = ((const struct BnetUserDataCacheAge *)a)->newest;
+    time_t newest_b = ((const struct BnetUserDataCacheAge *)b)->newest;
+
+    return (newest_a > newest_b) - (newest_a < newest_b);
+}
+
+// drops accounts whose cached values have all expired; if that leaves the
+// cache full, the least recently stored accounts go too, down to 3/4 of
+// BNET_USERDATA_CACHE_MAX so this doesn't run on every new account
+static void
+bnet_userdata_cache_prune(BnetConnectionData *bnet)
+{
+    time_t now = time(NULL);
+    GArray *ages;
+    guint excess;
+    guint i;
+
+    if (bnet->bncs.user_data.cache == NULL) {
+        return;
+    }
+    g_hash_table_foreach_remove(bnet->bncs.user_data.cache, bnet_userdata_cache_prune_account, &now);
+
+    if (g_hash_table_size(bnet->bncs.user_data.cache) < BNET_USERDATA_CACHE_MAX) {
+        return;
+    }
+    excess = g_hash_table_size(bnet->bncs.user_data.cache) - BNET_USERDATA_CACHE_MAX * 3 / 4;
+
+    ages = g_array_new(FALSE, FALSE, sizeof(struct BnetUserDataCacheAge));
+    g_hash_table_foreach(bnet->bncs.user_data.cache, bnet_userdata_cache_age_account, ages);
+    g_array_sort(ages, bnet_userdata_cache_age_cmp);
+    for (i = 0; i < excess && i < ages->len; i++) {
+        g_hash_table_remove(bnet->bncs.user_data.cache,
+                g_array_index(ages, struct BnetUserDataCacheAge, i).account);
+    }
+    g_array_free(ages, TRUE);
+}
+
+static void
+bnet_userdata_cache_invalidate(BnetConnectionData *bnet, const gchar *username)
+{
+    gchar *account;
+
+    if (bnet->bncs.user_data.cache == NULL) {
+        return;
+    }
+    account = g_ascii_strdown(username, -1);
+    g_hash_table_remove(bnet->bncs.user_data.cache, account);
+    g_free(account);
+}
+
 struct _BnetUserDataRequest {
     // readuserdata data:
-    // the cookie
-    int cookie;
     // the type of request
     BnetUserDataRequestType request_type;
-    // the user name
-    gchar *username;
-    // user data keys
+    // the user names, in the order they are sent
+    GPtrArray *usernames;
+    // user data keys (the same set is requested for every user)
     gchar **userdata_keys;
     // product for this request
     BnetProductID product;
@@ -8455,9 +11672,14 @@ void
 bnet_userdata_request_free(BnetUserDataRequest *req)
 {
     if (req != NULL) {
-        if (((struct _BnetUserDataRequest *) req)->username != NULL) {
-            g_free(((struct _BnetUserDataRequest *) req)->username);
-            ((struct _BnetUserDataRequest *) req)->username = NULL;
+        if (((struct _BnetUserDataRequest *) req)->usernames != NULL) {
+            int i;
+
+            for (i = 0; i < ((struct _BnetUserDataRequest *) req)->usernames->len; i++) {
+                g_free(g_ptr_array_index(((struct _BnetUserDataRequest *) req)->usernames, i));
+            }
+            g_ptr_array_free(((struct _BnetUserDataRequest *) req)->usernames, TRUE);
+            ((struct _BnetUserDataRequest *) req)->usernames = NULL;
         }
         if (((struct _BnetUserDataRequest *) req)->userdata_keys != NULL) {
             g_strfreev(((struct _BnetUserDataRequest *) req)->userdata_keys);
@@ -8472,23 +11694,74 @@ bnet_userdata_request_free(BnetUserDataRequest *req)
  * Do not free: userdata_keys
  */
 BnetUserDataRequest *
-bnet_userdata_request_new(int cookie, BnetUserDataRequestType type,
+bnet_userdata_request_new(BnetUserDataRequestType type,
                           const gchar *username, gchar **userdata_keys,
                           BnetProductID product)
 {
     struct _BnetUserDataRequest *req = g_new0(struct _BnetUserDataRequest, 1);
-    req->cookie = cookie;
     req->request_type = type;
-    req->username = g_strdup(username);
+    req->usernames = g_ptr_array_new();
+    g_ptr_array_add(req->usernames, g_strdup(username));
     req->userdata_keys = userdata_keys;
     req->product = product;
     return (BnetUserDataRequest *)req;
 }
 
+/**
+ * Whether a request for these keys can be merged into req.
+ */
+gboolean
+bnet_userdata_request_can_merge(const BnetUserDataRequest *req, BnetUserDataRequestType type,
+                                gchar **userdata_keys, BnetProductID product)
+{
+    const struct _BnetUserDataRequest *r = (const struct _BnetUserDataRequest *) req;
+    int i;
+
+    if (r->request_type != type || r->product != product ||
+            r->usernames->len >= BNET_USERDATA_BATCH_MAX) {
+        return FALSE;
+    }
+    for (i = 0; r->userdata_keys[i] != NULL && userdata_keys[i] != NULL; i++) {
+        if (strcmp(r->userdata_keys[i], userdata_keys[i]) != 0) {
+            return FALSE;
+        }
+    }
+    return r->userdata_keys[i] == NULL && userdata_keys[i] == NULL;
+}
+
+/**
+ * Duplicates: username
+ */
+void
+bnet_userdata_request_add_account(BnetUserDataRequest *req, const gchar *username)
+{
+    struct _BnetUserDataRequest *r = (struct _BnetUserDataRequest *) req;
+    int i;
+
+    for (i = 0; i < r->usernames->len; i++) {
+        if (g_ascii_strcasecmp(g_ptr_array_index(r->usernames, i), username) == 0) {
+            return;
+        }
+    }
+    g_ptr_array_add(r->usernames, g_strdup(username));
+}
+
 int
-bnet_userdata_request_get_cookie(const BnetUserDataRequest *req)
+bnet_userdata_request_get_account_count(const BnetUserDataRequest *req)
 {
-    return ((struct _BnetUserDataRequest *) req)->cookie;
+    return ((struct _BnetUserDataRequest *) req)->usernames->len;
+}
+
+const gchar *
+bnet_userdata_request_get_account_by_index(const BnetUserDataRequest *req, int i)
+{
+    return g_ptr_array_index(((struct _BnetUserDataRequest *) req)->usernames, i);
+}
+
+gchar **
+bnet_userdata_request_get_keys(const BnetUserDataRequest *req)
+{
+    return ((struct _BnetUserDataRequest *) req)->userdata_keys;
 }
 
 gchar *
@@ -8744,6 +12017,8 @@ bnet_status_text(PurpleBuddy *b)
     BnetUser *bfi = purple_buddy_get_protocol_data(b);
     if (bfi == NULL) {
         return g_strdup("Not on Battle.net's friend list.");
+    } else if (bnet_user_is_stale(bfi)) {
+        return g_strdup("Last known status");
     } else if (bfi->type == BNET_USER_TYPE_FRIEND && ((BnetFriendInfo *)bfi)->away_stored_status != NULL) {
         return g_strdup(((BnetFriendInfo *)bfi)->away_stored_status);
     } else if (bfi->type == BNET_USER_TYPE_FRIEND && ((BnetFriendInfo *)bfi)->dnd_stored_status != NULL) {
@@ -8763,7 +12038,12 @@ bnet_tooltip_text(PurpleBuddy *buddy,
     if (bfi == NULL) {
         // no information saved
         purple_notify_user_info_add_pair_plaintext(info, "Status", "Not on Battle.net's friend list.");
-    } else if (bfi->type == BNET_USER_TYPE_FRIEND && ((BnetFriendInfo *)bfi)->location != BNET_FRIEND_LOCATION_OFFLINE) {
+        return;
+    }
+    if (bnet_user_is_stale(bfi)) {
+        purple_notify_user_info_add_pair_plaintext(info, "Cached", "Last known status, not yet confirmed by Battle.net");
+    }
+    if (bfi->type == BNET_USER_TYPE_FRIEND && ((BnetFriendInfo *)bfi)->location != BNET_FRIEND_LOCATION_OFFLINE) {
         // add things to online friends
         gboolean is_available = TRUE;
         purple_notify_user_info_add_pair_plaintext(info, "Mutual",
@@ -9575,6 +12855,8 @@ bnet_add_buddy(PurpleConnection *gc, PurpleBuddy *buddy, PurpleGroup *group)
         bnet_send_CHATCOMMAND(bnet, cmd);
     }
     g_free(cmd);
+
+    bnet_poll_tighten(bnet, BNET_POLL_FRIENDS);
 }
 
 static void
@@ -9591,7 +12873,7 @@ bnet_remove_buddy(PurpleConnection *gc, PurpleBuddy *buddy, PurpleGroup *group)
     if (bfi == NULL) return;
 
     if (bfi->type == BNET_USER_TYPE_FRIEND) {
-        GList *el;
+        guint i;
         cmd = g_strdup_printf("/f r %s", username);
         if (bnet_is_telnet(bnet)) {
             bnet_send_telnet_line(bnet, cmd);
@@ -9599,20 +12881,20 @@ bnet_remove_buddy(PurpleConnection *gc, PurpleBuddy *buddy, PurpleGroup *group)
             bnet_send_CHATCOMMAND(bnet, cmd);
         }
         g_free(cmd);
+        bnet_poll_tighten(bnet, BNET_POLL_FRIENDS);
 
         // remove the data from the free list
         // purple_blist_remove_buddy will call bnet_friend_info_free and
         // friend list diff will remove the link
-        el = g_list_first(bnet->bncs.friends.list);
-        while (el != NULL) {
-            if (el->data != NULL) {
-                BnetUser *bfi_link = el->data;
-                if (strcmp(bfi_link->username, bfi->username) == 0) {
-                    el->data = NULL;
-                }
+        bnet_friend_index_remove(bnet, (BnetFriendInfo *)bfi);
+        for (i = 0; bnet->bncs.friends.list != NULL && i < bnet->bncs.friends.list->len; i++) {
+            if (g_ptr_array_index(bnet->bncs.friends.list, i) == bfi) {
+                g_ptr_array_index(bnet->bncs.friends.list, i) = NULL;
             }
-            el = g_list_next(el);
         }
+    } else if (bfi->type == BNET_USER_TYPE_CLANMEMBER) {
+        // the member stays in the clan table, only the buddy goes away
+        bnet_clan_member_hide((BnetClanMember *)bfi, FALSE);
     }
 }
 
@@ -10042,7 +13324,16 @@ bnet_actions(PurplePlugin *plugin, gpointer context)
     action = purple_plugin_action_new("Show News and MOTD...", bnet_action_show_news);
     list = g_list_append(list, action);
 
+    action = purple_plugin_action_new("Show Packet Statistics...", bnet_action_show_packet_stats);
+    list = g_list_append(list, action);
+
+    action = purple_plugin_action_new("Save Packet Statistics...", bnet_action_save_packet_stats);
+    list = g_list_append(list, action);
+
     if (bnet_clan_in_clan(bnet)) {
+        action = purple_plugin_action_new("Show Clan Member Profiles...", bnet_action_show_clan_profiles);
+        list = g_list_append(list, action);
+
         my_rank = bnet->bncs.w3_clan.my_rank;
         if (my_rank == BNET_CLAN_RANK_SHAMAN || my_rank == BNET_CLAN_RANK_CHIEFTAIN) {
             action = purple_plugin_action_new("Set Clan MOTD...", bnet_action_set_motd);
@@ -10138,6 +13429,17 @@ static PurplePluginProtocolInfo prpl_info =
     NULL,                               /* add_buddies_with_invite */
 };
 
+// decoded CD-keys are kept process-wide; don't leave them behind
+static void
+bnet_plugin_destroy(PurplePlugin *plugin)
+{
+    // connections are closed by now, so every job left is orphaned
+    bnet_crypto_pool_shutdown();
+    // let the last data cache write finish
+    bnet_cache_writer_wait();
+    bnet_key_cache_clear();
+}
+
 static PurplePluginInfo info =
 {
     PURPLE_PLUGIN_MAGIC,                /* magic */
@@ -10159,7 +13461,7 @@ static PurplePluginInfo info =
 
     NULL,                               /* load */
     NULL,                               /* unload */
-    NULL,                               /* destroy */
+    bnet_plugin_destroy,                /* destroy */
 
     NULL,                               /* ui_info */
     &prpl_info,                         /* extra_info */
@@ -10267,7 +13569,10 @@ init_plugin(PurplePlugin *plugin)
     option = purple_account_option_string_new("Key Owner", "key_owner", "");
     prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
 
-    option = purple_account_option_string_new("Logon Server", "bnlsserver", BNET_DEFAULT_BNLSSERVER);
+    option = purple_account_option_string_new("Logon Servers (comma-separated)", "bnlsserver", BNET_DEFAULT_BNLSSERVER);
+    prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
+
+    option = purple_account_option_string_new("Game files folder (local version check)", "crev_dir", "");
     prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
 
     option = purple_account_option_bool_new("Show ban messages", "showbans", TRUE);
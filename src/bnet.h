@@ -32,6 +32,8 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
 
 // libpurple includes
 #ifdef _WIN32
@@ -51,9 +53,11 @@
 #include "connection.h"
 #include "cmds.h"
 #include "debug.h"
+#include "dnsquery.h"
 #include "network.h"
 #include "notify.h"
 #include "plugin.h"
+#include "proxy.h"
 #include "prpl.h"
 #include "roomlist.h"
 #include "request.h"
@@ -61,6 +65,8 @@
 
 // includes
 #include "bufferer.h"
+#include "cache.h"
+#include "checkrevision.h"
 #include "keydecode.h"
 #include "sha1.h"
 #include "srp.h"
@@ -88,7 +94,31 @@
 #define BNET_DEFAULT_GROUP_FRIENDS "Friends"
 #define BNET_DEFAULT_GROUP_CLAN    "Clan %s members"
 
-#define BNET_FILE_CACHE  "bnet-cache.xml"
+#define BNET_FILE_CACHE  "bnet-cache.dat"
+#define BNET_FILE_PACKET_STATS "bnet-packet-stats.txt"
+// one JSON object per line for every traced logon
+#define BNET_FILE_LOGON_TRACE  "bnet-logon-trace.jsonl"
+// seconds to coalesce data cache changes before rewriting the file
+#define BNET_CACHE_WRITE_DELAY 2
+// layout version of the cached friends, clan and channel state
+#define BNET_WARM_VERSION 1
+// worker threads in the crypto pool
+#define BNET_CRYPTO_THREADS 4
+
+// seconds an unused shared BNLS connection stays open
+#define BNET_BNLS_IDLE_TIMEOUT 120
+// ms between starting connects to successive BNLS servers
+#define BNET_BNLS_RACE_STAGGER 250
+// ms between starting connects to successive addresses of a Battle.net server
+#define BNET_GATEWAY_RACE_STAGGER 250
+// assumed latency in ms of a host never used
+#define BNET_HOST_DEFAULT_RTT 500
+// ms added to a host's rank for each of its attempts that failed
+#define BNET_HOST_FAILURE_PENALTY 5000
+// connect attempts remembered before a host's history is halved
+#define BNET_HOST_STATS_WINDOW 32
+// seconds a cached BNLS version byte or version check answer is trusted
+#define BNET_VERSIONING_CACHE_TTL (7 * 24 * 60 * 60)
 
 // glib 2.32
 #define _G_SOURCE_CONTINUE TRUE
@@ -249,6 +279,61 @@ typedef enum {
     BNET_LOGON_SRP    = 0x02,
 } BnetLogonSystem;
 
+// something a logon step can wait on; BNCS and BNLS are connected in parallel
+typedef enum {
+    // BNCS connected and the protocol byte sent
+    BNET_LOGON_DEP_BNCS         = 0x01,
+    // version byte known (from BNLS or the data cache)
+    BNET_LOGON_DEP_VERSION_BYTE = 0x02,
+    // SRP secret and public key (or new account verifier) computed
+    BNET_LOGON_DEP_SRP          = 0x04,
+} BnetLogonDependency;
+
+// logon steps run by bnet_logon_deps_run once their dependencies are met
+typedef enum {
+    // send SID_AUTH_INFO or the legacy versioning packets
+    BNET_LOGON_STEP_BEGIN        = 0x01,
+    // send SID_AUTH_ACCOUNTLOGON or SID_AUTH_ACCOUNTCREATE
+    BNET_LOGON_STEP_ACCOUNTLOGON = 0x02,
+} BnetLogonStep;
+
+// milestones timed by the logon trace; BNLS and BNCS run in parallel, so the
+// first four can be reached in any order
+typedef enum {
+    // our first BNLS request went out on a connected socket
+    BNET_LOGON_MARK_BNLS_CONNECT = 0,
+    // BNLS_REQUESTVERSIONBYTE answered
+    BNET_LOGON_MARK_VERSION_BYTE,
+    // BNCS connected
+    BNET_LOGON_MARK_BNCS_CONNECT,
+    // SID_AUTH_INFO received
+    BNET_LOGON_MARK_AUTH_INFO,
+    // SID_AUTH_CHECK received
+    BNET_LOGON_MARK_AUTH_CHECK,
+    // SRP proof or SID_LOGONRESPONSE2 accepted
+    BNET_LOGON_MARK_ACCOUNT_LOGON,
+    // Diablo II realm logon over (includes choosing a realm and character)
+    BNET_LOGON_MARK_REALM_LOGON,
+    // SID_ENTERCHAT received
+    BNET_LOGON_MARK_ENTERCHAT,
+} BnetLogonMark;
+
+#define BNET_LOGON_MARK_COUNT 8
+
+// logon crypto done on the worker pool; results come back on the main loop
+typedef enum {
+    // SRP: draw the secret and compute A, plus the salt and verifier to create an account
+    BNET_CRYPTO_JOB_SRP_PREPARE   = 0x01,
+    // SRP: compute S, K and M[1] from the server's salt and B
+    BNET_CRYPTO_JOB_SRP_PROOF     = 0x02,
+    // decode and hash the CD-keys for SID_AUTH_CHECK
+    BNET_CRYPTO_JOB_KEY_DECODE    = 0x03,
+    // double-hash the password for SID_LOGONRESPONSE2
+    BNET_CRYPTO_JOB_PASSWORD_HASH = 0x04,
+    // hash the game files for a local version check
+    BNET_CRYPTO_JOB_CREV          = 0x05,
+} BnetCryptoJobType;
+
 // possible event numbers for telnet
 // 10xx => CHATEVENT EIDs
 #define BNET_TELNET_EID 1000
@@ -501,6 +586,8 @@ typedef struct {
     gchar *away_stored_status;
     // whether this account is on the Battle.net friend list
     gboolean on_list;
+    // loaded from the data cache and not yet confirmed by Battle.net
+    gboolean stale;
     
     // prpl buddy object
     PurpleBuddy *buddy;
@@ -542,6 +629,13 @@ typedef struct {
     gchar *location;
 
     guint64 join_date;
+
+    // buddy list entry while shown in the clan group
+    PurpleBuddy *buddy;
+    // set while diffing a full SID_CLANMEMBERLIST
+    gboolean on_list;
+    // loaded from the data cache and not yet confirmed by Battle.net
+    gboolean stale;
 } BnetClanMember;
 
 typedef BnetDwordTag BnetClanTag;
@@ -720,17 +814,41 @@ typedef struct {
     gchar *message;
 } BnetNewsItem;
 
+// a batch of changed entries handed to the cache writer thread
+typedef struct {
+    gchar *path;
+    // id -> BnetCacheEntry
+    GHashTable *entries;
+} BnetCacheWrite;
+
 typedef struct {
     gchar *name;
     gchar *subname;
     gchar *message;
 } BnetMotdItem;
 
-struct BnetPacketCookieKey {
-    guint8 packet_id;
-    guint32 cookie;
+// called with the cookie and its registered data when the response never arrives
+typedef void (*BnetPacketCookieExpireFunc)(gpointer bnet, guint8 packet_id, guint32 cookie, gpointer data);
+
+// a slot in the open-addressed packet cookie table (stored inline)
+struct BnetPacketCookieEntry {
+    // packed (packet_id << 32) | cookie; 0 = empty slot (cookies are never 0)
+    guint64 key;
+    gpointer data;
+    // when the response is considered lost
+    time_t expires;
+    BnetPacketCookieExpireFunc expire_cb;
+    // frees data if it is never claimed (expiry or close)
+    GDestroyNotify data_free;
 };
 
+// initial slot count of the cookie table (power of 2)
+#define BNET_PACKET_COOKIE_TABLE_MIN    16
+// seconds until an unanswered cookie expires
+#define BNET_PACKET_COOKIE_TTL          120
+// seconds between expiry sweeps while cookies are outstanding
+#define BNET_PACKET_COOKIE_SWEEP        30
+
 // these are used in the "Get News Info" dialog to classify BnetNewsItems.
 // motd sent by the BNCS in response to SID_NEWS_INFO, with timestamp 0 (name = gateway)
 #define BNET_MOTD_TYPE_BNCS     0
@@ -758,16 +876,65 @@ struct BnetPacketCookieKey {
 #define BNET_RECORD_NORMAL  1
 #define BNET_RECORD_LADDER  2
 #define BNET_RECORD_IRONMAN 8
+// most accounts sent in one SID_READUSERDATA
+#define BNET_USERDATA_BATCH_MAX     16
+// seconds to keep user data, per key class
+#define BNET_USERDATA_TTL_PROFILE   600
+#define BNET_USERDATA_TTL_RECORD    300
+#define BNET_USERDATA_TTL_SYSTEM    60
+// accounts cached before expired, then least recently stored, ones are pruned
+#define BNET_USERDATA_CACHE_MAX     256
 
 typedef enum {
     BNET_READUSERDATA_REQUEST_NONE    = 0x0,
     BNET_READUSERDATA_REQUEST_PROFILE = 0x1,
     BNET_READUSERDATA_REQUEST_RECORD  = 0x2,
-    BNET_READUSERDATA_REQUEST_SYSTEM  = 0x4
+    BNET_READUSERDATA_REQUEST_SYSTEM  = 0x4,
+    // part of a clan roster fetch, not of a lookup
+    BNET_READUSERDATA_REQUEST_ROSTER  = 0x8
 } BnetUserDataRequestType;
 
 typedef struct _BnetUserDataRequest BnetUserDataRequest;
 
+// a cached SID_READUSERDATA value
+typedef struct {
+    gchar *value;
+    time_t expires;
+} BnetUserDataValue;
+
+// an account in the user data cache, for evicting the least recently stored
+struct BnetUserDataCacheAge {
+    // the cache's key, not owned
+    gchar *account;
+    // expiry of the account's freshest value
+    time_t newest;
+};
+
+// things we poll the server for
+typedef enum {
+    BNET_POLL_FRIENDS     = 0,
+    BNET_POLL_CLANMEMBERS = 1,
+    BNET_POLL_CLANMOTD    = 2,
+    BNET_POLL_COUNT       = 3
+} BnetPollKind;
+
+// adaptive poll schedule for one BnetPollKind
+typedef struct {
+    // current interval, doubling up to max_interval while responses are unchanged
+    guint interval;
+    guint min_interval;
+    guint max_interval;
+    // when the next poll is due
+    time_t next;
+    // hash of the last response
+    guint32 last_hash;
+} BnetPollState;
+
+// seconds between checks of the poll schedule
+#define BNET_POLL_TICK   30
+// polls are spread by up to +/- 1/BNET_POLL_JITTER of their interval
+#define BNET_POLL_JITTER 8
+
 // stores socket connection data for a specific socket
 struct SocketData {
     // file descriptor
@@ -788,17 +955,109 @@ struct SocketData {
     guint16 port;
 };
 
+// connect history of a server or address, kept in the data cache for ranking
+typedef struct {
+    // finished connect attempts
+    guint32 attempts;
+    // failed connect attempts
+    guint32 failures;
+    // smoothed latency in ms, 0 if unknown
+    guint32 srtt;
+} BnetHostStats;
+
+// one connect to a resolved Battle.net server address
+typedef struct {
+    gpointer bnet;
+    // dotted address, also the key of its BnetHostStats
+    gchar *address;
+    PurpleProxyConnectData *conn_data;
+    GTimeVal start;
+} BnetGatewayAttempt;
+
+// a computation handed to the crypto pool; the worker only touches the job's
+// own fields, and the result comes back through an idle callback
+typedef struct {
+    BnetCryptoJobType type;
+    // NULL once the connection has closed; only used on the main loop
+    gpointer bnet;
+    // set when the connection closes, so a queued job is skipped
+    volatile gint cancelled;
+    // SRP_*: owned by the job until it comes back
+    srp_t *srp;
+    // SRP_PREPARE, PASSWORD_HASH: credentials (wiped when freed)
+    gchar *username;
+    gchar *password;
+    gboolean create_account;
+    // SRP_PROOF: from SID_AUTH_ACCOUNTLOGON
+    gchar salt[32];
+    gchar B[32];
+    // KEY_DECODE, PASSWORD_HASH
+    guint32 client_cookie;
+    guint32 server_cookie;
+    // KEY_DECODE: keys in (wiped when freed) and out
+    int key_count;
+    gchar *key1;
+    gchar *key2;
+    BnetKey keys[2];
+    gboolean keys_valid;
+    // KEY_DECODE: the version check answer sent along with the keys;
+    // CREV: the answer computed
+    guint32 exe_version;
+    guint32 exe_checksum;
+    gchar *exe_info;
+    // CREV: the game files (executable first), the server's request, and the
+    // data cache key for the answer
+    gchar *crev_files[BNET_CREV_FILE_COUNT + 1];
+    guint64 mpq_ft;
+    gchar *mpq_fn;
+    gchar *checksum_formula;
+    gchar *crev_key;
+    BnetCRevResult crev_result;
+    // SRP_PREPARE: salt and verifier when creating an account;
+    // SRP_PROOF: M[1]; PASSWORD_HASH: the double hash
+    gchar out[64];
+} BnetCryptoJob;
+
 // this struct stores extra info for a battle.net connection
 typedef struct {
     int magic;
     /* The libpurple account */
     PurpleAccount *account;
 
+    /* BnetCryptoJob in flight for this connection */
+    GList *crypto_jobs;
+
+    /* Logon dependency tracker */
+    struct {
+        // BnetLogonDependency flags that are satisfied
+        guint32 ready;
+        // BnetLogonStep flags that are waiting to run
+        guint32 waiting;
+    } logon_deps;
+
+    /* Logon phase timing */
+    struct {
+        // started by bnet_connect, destroyed once the trace is written
+        GTimer *timer;
+        // seconds on the timer at each BnetLogonMark, negative if not reached
+        gdouble at[BNET_LOGON_MARK_COUNT];
+    } logon_trace;
+
     /* BNCS (Battle.net Chat Server) state */
     struct {
         /* Generic connection data */
         struct SocketData conn;
 
+        /* Race between the server's resolved addresses */
+        struct {
+            PurpleDnsQueryData *query;
+            // BnetGatewayAttempt connecting
+            GList *connecting;
+            // addresses not tried yet, best ranked first
+            GList *pending;
+            guint stagger_timer_handle;
+        } gateway;
+
         /* Versioning/product state */
         struct {
             BnetVersioningSystem type;
@@ -807,6 +1066,14 @@ typedef struct {
             guint32 version_code;
             BnetGameType game_type;
             gchar *key_owner;
+            // version byte or check answer was taken from the data cache
+            gboolean from_cache;
+            // check answer was computed from local game files
+            gboolean from_local;
+            // data cache key of the local check answer
+            gchar *local_key;
+            // data cache key of the current version check
+            gchar *check_key;
         } versioning;
         
         /* Account logon state */
@@ -819,6 +1086,8 @@ typedef struct {
             gchar *username;
             srp_t *auth_ctx;
             srp_t *auth_ctx_pending;
+            // prepared for SID_AUTH_ACCOUNTCREATE (64 bytes)
+            gchar *salt_and_v;
             guint lockout_timer_handle;
             PurpleRequestFields *prpl_setemail_fields_handle;
         } logon;
@@ -831,13 +1100,17 @@ typedef struct {
             gchar *unique_name;
             gchar *stats;
             const gchar *d2_star;
-            guint updatelist_timer_tick;
             guint updatelist_timer_handle;
+            BnetPollState polls[BNET_POLL_COUNT];
             //BnetQueeu *queue
             GList *channel_list;
             PurpleRoomlist *prpl_room_list_handle;
             PurpleConversation *prpl_last_cmd_conv_handle;
-            GHashTable *packet_cookie_table;
+            struct BnetPacketCookieEntry *packet_cookie_table;
+            guint packet_cookie_table_size;
+            guint packet_cookie_count;
+            guint32 packet_cookie_next;
+            guint packet_cookie_timer_handle;
         } chat_env;
 
         /* MOTDs */
@@ -871,7 +1144,10 @@ typedef struct {
 
         /* Friends list state */
         struct {
-            GList *list;
+            // BnetFriendInfo by server position (NULL once removed locally)
+            GPtrArray *list;
+            // normalized account name -> BnetFriendInfo (not owned)
+            GHashTable *by_name;
         } friends;
 
         /* My status state */
@@ -887,14 +1163,30 @@ typedef struct {
             gchar *name;
             BnetLookupInfoFlags flags;
             BnetClanTag w3_tag;
+            // cookies the W3 steps of this lookup wait on; an expiring cookie
+            // that isn't one of these belongs to an earlier lookup
+            guint32 w3_user_profile_cookie;
+            guint32 w3_user_stats_cookie;
+            guint32 w3_clan_stats_cookie;
+            guint32 w3_clan_mi_cookie;
             PurpleNotifyUserInfo *prpl_notify_handle;
         } lookup_info;
 
         /* SID_GETUSERDATA state */
         struct {
             gboolean writing_profile;
-            GList *requests;
+            // requests not yet sent; sent requests are kept in the packet cookie table
+            GList *pending;
+            guint batch_timer_handle;
+            // requests answered from cache, waiting to be processed
+            GList *cached;
+            guint cached_timer_handle;
+            // lowercase account name -> (key -> BnetUserDataValue)
+            GHashTable *cache;
             PurpleRequestFields *prpl_profile_fields_handle;
+            // clan roster fetch: the accounts asked for, and how many are still unanswered
+            GPtrArray *roster_accounts;
+            guint roster_waiting;
         } user_data;
         
         /* Warcraft III clan state */
@@ -903,7 +1195,8 @@ typedef struct {
             gboolean clan_members_in_blist;
             BnetClanTag my_clantag;
             gchar *my_clanname;
-            GList *my_clanmembers;
+            // lowercase account name -> BnetClanMember
+            GHashTable *my_clanmembers;
             BnetClanMemberRank my_rank;
             PurpleRequestFields *prpl_setmotd_fields_handle;
         } w3_clan;
@@ -911,8 +1204,10 @@ typedef struct {
 
     /* BNLS (Battle.net Logon Server) state */
     struct {
-        /* Generic connection data */
+        /* The "Logon Server" option; sockets belong to the shared BnetBnlsClient */
         struct SocketData conn;
+        /* Configured servers as "host:port", NULL-terminated */
+        gchar **servers;
     } bnls;
 
     /* D2MCP (Battle.net D2 Character Realm/Master Control Protocol) state */
@@ -939,6 +1234,64 @@ typedef struct {
     } d2mcp;
 } BnetConnectionData;
 
+// a BNLS request, shared by every account that asked the same question
+typedef struct {
+    BnetBnlsPacketID id;
+    // routes the answer back: the product for REQUESTVERSIONBYTE, the
+    // cookie for VERSIONCHECKEX2
+    guint32 tag;
+    // identical requests in flight are coalesced by this key; NULL never coalesces
+    gchar *key;
+    // built but not sent yet (the client is still connecting)
+    BnetPacket *pkt;
+    // BnetConnectionData waiting for the answer
+    GList *waiters;
+    // when it was sent, for the server's latency
+    GTimeVal sent;
+} BnetBnlsRequest;
+
+typedef struct _BnetBnlsRace BnetBnlsRace;
+
+// one persistent connection to a BNLS server, shared by all accounts
+typedef struct {
+    // "host:port"
+    gchar *key;
+    struct SocketData conn;
+    // outstanding BnetBnlsRequest, oldest first
+    GList *requests;
+    // race this client is connecting in, or NULL
+    BnetBnlsRace *race;
+    GTimeVal connect_start;
+    BnetHostStats stats;
+    // next VERSIONCHECKEX2 cookie
+    guint32 next_cookie;
+    // closes the connection once nothing is outstanding
+    guint idle_timer_handle;
+    // last BNLS_MESSAGE, handed to accounts that start using the client later
+    gchar *message;
+} BnetBnlsClient;
+
+// connects to an account's BNLS servers best ranked first, starting the next
+// one every BNET_BNLS_RACE_STAGGER ms until one is up
+struct _BnetBnlsRace {
+    // account whose proxy settings the connects use
+    PurpleAccount *account;
+    // candidate holding the queued requests until one wins
+    BnetBnlsClient *home;
+    // candidates connecting, and those not started yet, best ranked first
+    GList *connecting;
+    GList *pending;
+    guint stagger_timer_handle;
+};
+
+// process-wide BNLS clients, keyed by "server:port"
+GHashTable *bnet_bnls_clients = NULL;
+
+// process-wide worker pool for BnetCryptoJob, created on first use
+GThreadPool *bnet_crypto_pool = NULL;
+// jobs of closed connections that have not come back yet; main loop only
+GList *bnet_crypto_jobs_orphaned = NULL;
+
 typedef struct {
     BnetConnectionData *bnet;
     BnetPacketID packet_id;
@@ -1096,19 +1449,83 @@ static void bnet_buddy_free(PurpleBuddy *buddy);
 static void bnet_news_item_free(BnetNewsItem *item);
 static void bnet_connect(PurpleAccount *account, const gboolean do_register);
 static void bnet_login(PurpleAccount *account);
-static void bnet_bnls_login_cb(gpointer data, gint source, const gchar *error_message);
-static int  bnet_bnls_send_LOGONCHALLENGE(const BnetConnectionData *bnet);
-static int  bnet_bnls_send_VERSIONCHECKEX2(const BnetConnectionData *bnet,
-            guint32 login_type, guint32 server_cookie, guint32 session_cookie,
-            guint64 mpq_ft, char *mpq_fn, char *checksum_formula);
+static gboolean bnet_bncs_connect(BnetConnectionData *bnet);
+static gboolean bnet_bncs_connect_direct(BnetConnectionData *bnet);
+static void bnet_host_stats_load(BnetHostStats *stats, const gchar *name, const gchar *key);
+static void bnet_host_stats_save(BnetHostStats *stats, const gchar *name, const gchar *key);
+static void bnet_host_stats_sample(BnetHostStats *stats, const GTimeVal *start);
+static guint bnet_host_stats_score(const BnetHostStats *stats);
+static void bnet_gateway_resolved_cb(GSList *hosts, gpointer data, const char *error_message);
+static gint bnet_gateway_rank_cmp(gconstpointer a, gconstpointer b, gpointer user_data);
+static void bnet_gateway_start_next(BnetConnectionData *bnet);
+static gboolean bnet_gateway_stagger_cb(gpointer data);
+static void bnet_gateway_connect_cb(gpointer data, gint source, const gchar *error_message);
+static void bnet_gateway_attempt_free(BnetGatewayAttempt *attempt);
+static void bnet_gateway_race_free(BnetConnectionData *bnet);
+static void bnet_logon_deps_satisfy(BnetConnectionData *bnet, BnetLogonDependency dep);
+static void bnet_logon_deps_wait(BnetConnectionData *bnet, BnetLogonStep step);
+static void bnet_logon_deps_run(BnetConnectionData *bnet);
+static void bnet_logon_step_run(BnetConnectionData *bnet, BnetLogonStep step);
+static void bnet_logon_trace_start(BnetConnectionData *bnet);
+static void bnet_logon_trace_mark(BnetConnectionData *bnet, BnetLogonMark mark);
+static void bnet_json_append_string(GString *out, const gchar *str);
+static void bnet_logon_trace_finish(BnetConnectionData *bnet, const gchar *result);
+static void bnet_bnls_request_free(BnetBnlsRequest *request);
+static gchar **bnet_bnls_parse_servers(const gchar *option);
+static BnetBnlsClient *bnet_bnls_client_lookup(const gchar *server_key);
+static gint bnet_bnls_client_rank_cmp(gconstpointer a, gconstpointer b);
+static BnetBnlsClient *bnet_bnls_client_get(BnetConnectionData *bnet);
+static gboolean bnet_bnls_client_connect(BnetBnlsClient *client, PurpleAccount *account);
+static void bnet_bnls_race_rehome(BnetBnlsRace *race, BnetBnlsClient *leaving);
+static void bnet_bnls_race_start_next(BnetBnlsRace *race);
+static gboolean bnet_bnls_race_stagger_cb(gpointer data);
+static gboolean bnet_bnls_race_drop(BnetBnlsRace *race, BnetBnlsClient *client);
+static void bnet_bnls_race_won(BnetBnlsRace *race, BnetBnlsClient *winner);
+static void bnet_bnls_race_free(BnetBnlsRace *race);
+static void bnet_bnls_client_connect_cb(gpointer data, gint source, const gchar *error_message);
+static void bnet_bnls_client_close(BnetBnlsClient *client);
+static void bnet_bnls_client_fail(BnetBnlsClient *client, const gchar *message);
+static gboolean bnet_bnls_client_idle_cb(gpointer data);
+static void bnet_bnls_request_send(BnetBnlsClient *client, BnetBnlsRequest *request);
+static gboolean bnet_bnls_client_join(BnetBnlsClient *client, BnetConnectionData *bnet, const gchar *key);
+static void bnet_bnls_client_submit(BnetBnlsClient *client, BnetConnectionData *bnet,
+            BnetBnlsPacketID id, guint32 tag, const gchar *key, BnetPacket *pkt);
+static BnetBnlsRequest *bnet_bnls_client_match(BnetBnlsClient *client, const guint8 packet_id,
+            const gchar *packet_start, const guint16 packet_len);
+static void bnet_bnls_client_dispatch(BnetBnlsClient *client, const guint8 packet_id,
+            const gchar *packet_start, const guint16 packet_len);
+static void bnet_bnls_client_forget_cb(gpointer key, gpointer value, gpointer user_data);
+static void bnet_bnls_race_forget_cb(gpointer key, gpointer value, gpointer user_data);
+static void bnet_bnls_client_forget(BnetConnectionData *bnet);
+static int  bnet_bnls_send_LOGONCHALLENGE(BnetConnectionData *bnet);
+static int  bnet_bnls_send_VERSIONCHECKEX2(BnetConnectionData *bnet,
+            guint64 mpq_ft, const char *mpq_fn, const char *checksum_formula);
+static BnetGameType bnet_get_game_type(BnetProductID product_id);
 static int  bnet_bnls_send_REQUESTVERSIONBYTE(BnetConnectionData *bnet);
-static void bnet_bnls_input_cb(gpointer data, gint source, PurpleInputCondition cond);
-static void bnet_bnls_read_input(BnetConnectionData *bnet, int len);
-static void bnet_bnls_recv_CHOOSENLSREVISION(const BnetConnectionData *bnet, BnetPacket *pkt);
+static void bnet_bnls_client_input_cb(gpointer data, gint source, PurpleInputCondition cond);
+static void bnet_bnls_client_read_input(BnetBnlsClient *client, int len);
+static void bnet_bnls_recv_CHOOSENLSREVISION(BnetConnectionData *bnet, BnetPacket *pkt);
 static void bnet_bnls_recv_LOGONCHALLENGE(const BnetConnectionData *bnet, BnetPacket *pkt);
 static void bnet_bnls_recv_LOGONPROOF(const BnetConnectionData *bnet, BnetPacket *pkt);
 static void bnet_bnls_recv_REQUESTVERSIONBYTE(BnetConnectionData *bnet, BnetPacket *pkt);
 static void bnet_bnls_recv_VERSIONCHECKEX2(BnetConnectionData *bnet, BnetPacket *pkt);
+static gchar *bnet_versioning_cache_byte_key(const BnetConnectionData *bnet);
+static gboolean bnet_versioning_cache_get_byte(BnetConnectionData *bnet);
+static void bnet_versioning_cache_set_byte(BnetConnectionData *bnet);
+static gboolean bnet_versioning_cache_get_check(BnetConnectionData *bnet);
+static void bnet_versioning_cache_set_check(BnetConnectionData *bnet,
+            guint32 exe_version, guint32 exe_checksum, const gchar *exe_info);
+static gboolean bnet_versioning_cache_forget(BnetConnectionData *bnet);
+static const gchar * const *bnet_get_crev_files(BnetProductID product);
+static gboolean bnet_versioning_local(BnetConnectionData *bnet, guint64 mpq_ft,
+            const gchar *mpq_fn, const gchar *checksum_formula);
+static void bnet_versioning_local_done(BnetConnectionData *bnet, BnetCryptoJob *job);
+static void bnet_versioning_remote(BnetConnectionData *bnet, guint64 mpq_ft,
+            const gchar *mpq_fn, const gchar *checksum_formula);
+static void bnet_versioning_check(BnetConnectionData *bnet, guint64 mpq_ft,
+            const gchar *mpq_fn, const gchar *checksum_formula);
+static void bnet_versioning_report(BnetConnectionData *bnet,
+            guint32 exe_version, guint32 exe_checksum, char *exe_info);
 static void bnet_bnls_parse_packet(BnetConnectionData *bnet, const guint8 packet_id,
             const gchar *packet_start, const guint16 packet_len);
 static void bnet_realm_login_cb(gpointer data, gint source, const gchar *error_message);
@@ -1134,7 +1551,7 @@ static int  bnet_send_JOINCHANNEL(const BnetConnectionData *bnet,
 static int  bnet_send_CHATCOMMAND(const BnetConnectionData *bnet, const char *command);
 static int  bnet_send_CDKEY(const BnetConnectionData *bnet);
 static int  bnet_send_CDKEY2(const BnetConnectionData *bnet);
-static int  bnet_send_LOGONRESPONSE2(const BnetConnectionData *bnet);
+static int  bnet_send_LOGONRESPONSE2(const BnetConnectionData *bnet, const guint8 *password_hash);
 static int  bnet_send_CREATEACCOUNT2(const BnetConnectionData *bnet);
 static int  bnet_send_LOCALEINFO(const BnetConnectionData *bnet);
 static int  bnet_send_CLIENTID2(const BnetConnectionData *bnet);
@@ -1142,12 +1559,12 @@ static int  bnet_send_CLIENTID(const BnetConnectionData *bnet);
 static int  bnet_send_SYSTEMINFO(const BnetConnectionData *bnet);
 static int  bnet_send_PING(const BnetConnectionData *bnet, guint32 cookie);
 static int  bnet_send_READUSERDATA(const BnetConnectionData *bnet,
-            int request_cookie, const char *username, char **keys);
+            int request_cookie, const BnetUserDataRequest *req);
 static int  bnet_send_WRITEUSERDATA(const BnetConnectionData *bnet,
             const char *sex, const char *age, const char *location, const char *description);
 static int  bnet_send_NEWS_INFO(const BnetConnectionData *bnet, guint32 timestamp);
 static int  bnet_send_AUTH_INFO(const BnetConnectionData *bnet);
-static int  bnet_send_AUTH_CHECK(const BnetConnectionData *bnet,
+static int  bnet_send_AUTH_CHECK(const BnetConnectionData *bnet, const BnetKey *keys, guint32 key_count,
             guint32 exe_version, guint32 exe_checksum, char *exe_info);
 static int  bnet_send_AUTH_ACCOUNTCREATE(const BnetConnectionData *bnet, char *salt_and_v);
 static int  bnet_send_AUTH_ACCOUNTLOGON(const BnetConnectionData *bnet, char *A);
@@ -1202,6 +1619,17 @@ static void bnet_recv_CLANREMOVEMEMBER(BnetConnectionData *bnet, BnetPacket *pkt
 static void bnet_recv_CLANINVITATIONRESPONSE(BnetConnectionData *bnet, BnetPacket *pkt);
 static void bnet_recv_CLANRANKCHANGE(BnetConnectionData *bnet, BnetPacket *pkt);
 static void bnet_recv_CLANMOTD(BnetConnectionData *bnet, BnetPacket *pkt);
+static PurpleGroup *bnet_clan_get_group(const BnetConnectionData *bnet);
+static const gchar *bnet_clan_member_prpl_status(const BnetClanMember *member);
+static void bnet_clan_member_show(BnetConnectionData *bnet, BnetClanMember *member, PurpleGroup *group);
+static void bnet_clan_member_hide(BnetClanMember *member, gboolean remove);
+static void bnet_clan_member_hide_cb(gpointer key, gpointer value, gpointer user_data);
+static BnetClanMember *bnet_clan_update_member(BnetConnectionData *bnet, gchar *name, BnetClanMemberRank rank,
+            BnetClanMemberStatus status, gchar *location, PurpleGroup *group);
+static void bnet_clan_remove_member(BnetConnectionData *bnet, const gchar *name);
+static gboolean bnet_clan_member_sweep_cb(gpointer key, gpointer value, gpointer user_data);
+static void bnet_clan_members_free(BnetConnectionData *bnet);
+static void bnet_clan_sweep_stale(BnetConnectionData *bnet);
 static void bnet_recv_CLANMEMBERLIST(BnetConnectionData *bnet, BnetPacket *pkt);
 static void bnet_recv_CLANMEMBERREMOVED(BnetConnectionData *bnet, BnetPacket *pkt);
 static void bnet_recv_CLANMEMBERSTATUSCHANGE(BnetConnectionData *bnet, BnetPacket *pkt);
@@ -1269,6 +1697,16 @@ static void bnet_parse_packet(BnetConnectionData *bnet, const guint8 packet_id,
 static void bnet_account_register(PurpleAccount *account);
 static void bnet_account_chpw(PurpleConnection *gc, const char *oldpass, const char *newpass);
 static void bnet_account_logon(BnetConnectionData *bnet);
+static BnetCryptoJob *bnet_crypto_job_new(BnetConnectionData *bnet, BnetCryptoJobType type);
+static void bnet_crypto_job_submit(BnetCryptoJob *job);
+static gboolean bnet_crypto_job_pending(const BnetConnectionData *bnet, BnetCryptoJobType type);
+static void bnet_crypto_job_run(gpointer data, gpointer user_data);
+static gboolean bnet_crypto_job_done_cb(gpointer data);
+static void bnet_crypto_job_free(BnetCryptoJob *job);
+static void bnet_crypto_jobs_cancel(BnetConnectionData *bnet);
+static void bnet_crypto_pool_shutdown(void);
+static void bnet_srp_prepare(BnetConnectionData *bnet);
+static void bnet_account_logon_send(BnetConnectionData *bnet);
 static void bnet_enter_channel(const BnetConnectionData *bnet);
 static void bnet_realm_logon_cb(BnetConnectionData *bnet);
 static void bnet_enter_chat(BnetConnectionData *bnet);
@@ -1277,7 +1715,15 @@ static int  bnet_realm_logon(const BnetConnectionData *bnet, const guint32 clien
 static void bnet_entered_chat(BnetConnectionData *bnet);
 static void bnet_realm_character_list(BnetConnectionData *bnet, GList *char_list);
 static void bnet_realm_server_list(BnetConnectionData *bnet, GList *server_list);
+static guint32 bnet_poll_hash(const gchar *data, gsize length);
+static time_t bnet_poll_jitter(guint interval);
+static void bnet_poll_init(BnetConnectionData *bnet);
+static gboolean bnet_poll_due(BnetConnectionData *bnet, BnetPollKind kind, time_t now);
+static void bnet_poll_response(BnetConnectionData *bnet, BnetPollKind kind, const BnetPacket *pkt);
+static void bnet_poll_tighten(BnetConnectionData *bnet, BnetPollKind kind);
 static gboolean bnet_updatelist_timer(BnetConnectionData *bnet);
+static gboolean bnet_packet_cookie_expire_timer(BnetConnectionData *bnet);
+static void bnet_packet_cookie_table_free(BnetConnectionData *bnet);
 static void bnet_account_lockout_set(BnetConnectionData *bnet);
 static void bnet_account_lockout_cancel(BnetConnectionData *bnet);
 static gboolean bnet_account_lockout_timer(BnetConnectionData *bnet);
@@ -1298,6 +1744,14 @@ static char *bnet_to_utf8_crlf(const char *input);
 static char *bnet_utf8_to_iso88591(const char *input);
 static gchar *bnet_escape_text(const gchar *text, int length, gboolean replace_linebreaks);
 static void bnet_find_detached_buddies(BnetConnectionData *bnet);
+static BnetFriendInfo *bnet_friend_info_new(gchar *account_name);
+static BnetFriendInfo *bnet_friend_find(const BnetConnectionData *bnet, const char *account_name);
+static void bnet_friend_index_add(BnetConnectionData *bnet, BnetFriendInfo *bfi);
+static void bnet_friend_index_remove(BnetConnectionData *bnet, const BnetFriendInfo *bfi);
+static void bnet_friend_remove_buddy(BnetConnectionData *bnet, BnetFriendInfo *bfi);
+static gboolean bnet_friend_info_changed(const BnetFriendInfo *bfi, BnetFriendStatus status,
+            BnetFriendLocation location, BnetProductID product_id,
+            const gchar *location_name);
 static void bnet_do_whois(const BnetConnectionData *bnet, const char *who);
 static void bnet_friend_update(const BnetConnectionData *bnet, int index,
             BnetFriendInfo *bfi, BnetFriendStatus status,
@@ -1318,22 +1772,77 @@ static void bnet_lookup_info_w3_user_profile(BnetConnectionData *bnet);
 static void bnet_lookup_info_w3_user_stats(BnetConnectionData *bnet);
 static void bnet_lookup_info_w3_clan_stats(BnetConnectionData *bnet);
 static void bnet_lookup_info_w3_clan_mi(BnetConnectionData *bnet);
+static void bnet_lookup_info_cookie_expired(gpointer data, guint8 packet_id, guint32 cookie, gpointer cookie_data);
+static gboolean bnet_lookup_info_awaits_userdata(BnetConnectionData *bnet, const BnetUserDataRequest *req);
+static void bnet_lookup_info_step_failed(BnetConnectionData *bnet, BnetLookupInfoFlags step);
 static void bnet_action_set_motd_cb(gpointer data);
 static gint bnet_news_item_sort(gconstpointer a, gconstpointer b);
+static gchar *bnet_cache_entry_id(const gchar *name, const gchar *key);
+static gchar *bnet_cache_path(void);
+static void bnet_cache_load(void);
+static gpointer bnet_cache_write_thread(gpointer data);
+static BnetCacheWrite *bnet_cache_take_dirty(void);
+static void bnet_cache_write_start(void);
+static void bnet_cache_writer_wait(void);
+static gboolean bnet_cache_write_timer(gpointer data);
+static void bnet_cache_schedule_write(void);
+static void bnet_cache_flush(void);
+static void bnet_cache_set(BnetConnectionData *bnet, const gchar *name, guint64 timestamp, const gchar *key,
+            gconstpointer value, gsize length);
+static gpointer bnet_cache_get(BnetConnectionData *bnet, const gchar *name, const gchar *key,
+            guint64 *timestamp, gsize *length);
+static gchar *bnet_news_cache_key(BnetConnectionData *bnet);
+static gchar *bnet_warm_cache_key(const BnetConnectionData *bnet);
+static void bnet_warm_save_member(gpointer key, gpointer value, gpointer user_data);
+static void bnet_warm_save(BnetConnectionData *bnet);
+static void bnet_warm_load(BnetConnectionData *bnet);
+static gboolean bnet_user_is_stale(const BnetUser *bu);
 static void bnet_news_save(BnetConnectionData *bnet);
 static void bnet_news_load(BnetConnectionData *bnet);
 static void bnet_action_show_news(PurplePluginAction *action);
+static const gchar *bnet_packet_name(BnetPacketStatsProtocol protocol, guint8 id);
+static void bnet_action_show_packet_stats(PurplePluginAction *action);
+static void bnet_action_save_packet_stats_cb(gpointer data, const char *filename);
+static void bnet_action_save_packet_stats(PurplePluginAction *action);
 static void bnet_action_set_motd(PurplePluginAction *action);
+static gint bnet_clan_roster_name_cmp(gconstpointer a, gconstpointer b);
+static void bnet_action_show_clan_profiles(PurplePluginAction *action);
+static void bnet_clan_roster_accounts_done(BnetConnectionData *bnet, guint count);
+static void bnet_clan_roster_free(BnetConnectionData *bnet);
 static void bnet_action_set_user_data(PurplePluginAction *action);
 static void bnet_profile_get_for_edit(BnetConnectionData *bnet);
 static void bnet_profile_show_write_dialog(BnetConnectionData *bnet,
             const char *psex, const char *page, const char *ploc, const char *pdescr);
 static void bnet_profile_write_cb(gpointer data);
+static void bnet_userdata_request_queue(BnetConnectionData *bnet, BnetUserDataRequestType type,
+            const gchar *username, gchar **userdata_keys, BnetProductID product);
+static void bnet_userdata_request_queue_accounts(BnetConnectionData *bnet, BnetUserDataRequestType type,
+            GPtrArray *usernames, gchar **userdata_keys, BnetProductID product);
+static gboolean bnet_userdata_batch_timer(BnetConnectionData *bnet);
+static gboolean bnet_userdata_cached_timer(BnetConnectionData *bnet);
+static void bnet_userdata_value_free(BnetUserDataValue *val);
+static int bnet_userdata_cache_ttl(const gchar *key);
+static GHashTable *bnet_userdata_cache_get_account(BnetConnectionData *bnet, const gchar *username, gboolean create);
+static void bnet_userdata_cache_store(GHashTable *values, const gchar *key, gchar *value);
+static gchar *bnet_userdata_cache_value(GHashTable *values, const gchar *key);
+static gboolean bnet_userdata_cache_is_fresh(GHashTable *values, gchar **keys);
+static gboolean bnet_userdata_cache_prune_account(gpointer key, gpointer value, gpointer user_data);
+static void bnet_userdata_cache_age_account(gpointer key, gpointer value, gpointer user_data);
+static gint bnet_userdata_cache_age_cmp(gconstpointer a, gconstpointer b);
+static void bnet_userdata_cache_prune(BnetConnectionData *bnet);
+static void bnet_userdata_cache_invalidate(BnetConnectionData *bnet, const gchar *username);
+static void bnet_userdata_request_process(BnetConnectionData *bnet, const BnetUserDataRequest *req,
+            const gchar *username, GHashTable *userdata);
 static void bnet_userdata_request_free(BnetUserDataRequest *req);
-static BnetUserDataRequest *bnet_userdata_request_new(int cookie, BnetUserDataRequestType type,
+static BnetUserDataRequest *bnet_userdata_request_new(BnetUserDataRequestType type,
             const gchar *username, gchar **userdata_keys,
             BnetProductID product);
-static int bnet_userdata_request_get_cookie(const BnetUserDataRequest *req);
+static gboolean bnet_userdata_request_can_merge(const BnetUserDataRequest *req, BnetUserDataRequestType type,
+            gchar **userdata_keys, BnetProductID product);
+static void bnet_userdata_request_add_account(BnetUserDataRequest *req, const gchar *username);
+static int bnet_userdata_request_get_account_count(const BnetUserDataRequest *req);
+static const gchar *bnet_userdata_request_get_account_by_index(const BnetUserDataRequest *req, int i);
+static gchar **bnet_userdata_request_get_keys(const BnetUserDataRequest *req);
 static gchar *bnet_userdata_request_get_key_by_index(const BnetUserDataRequest *req, int i);
 static BnetUserDataRequestType bnet_userdata_request_get_type(const BnetUserDataRequest *req);
 static BnetProductID bnet_userdata_request_get_product(const BnetUserDataRequest *req);
@@ -1373,6 +1882,7 @@ static gboolean bnet_is_w3(const BnetConnectionData *bnet);
 static BnetVersioningSystem bnet_get_versioningsystem(const BnetConnectionData *bnet);
 static int bnet_get_key_count(const BnetConnectionData *bnet);
 static GList *bnet_actions(PurplePlugin *plugin, gpointer context);
+static void bnet_plugin_destroy(PurplePlugin *plugin);
 static void init_plugin(PurplePlugin *plugin);
 
 
@@ -1413,6 +1923,48 @@ struct BnetChatEvent {
     { 0, NULL, FALSE }
 };
 
+// process-wide data cache, shared by every account
+struct BnetDataCache {
+    gboolean loaded;
+    // read-only mapping of BNET_FILE_CACHE; only the main loop touches it
+    BnetCacheFile *file;
+    // id -> BnetCacheEntry, everything set this session (the mapping may lag behind)
+    GHashTable *entries;
+    // id -> BnetCacheEntry, set but not yet handed to the writer
+    GHashTable *dirty;
+    guint write_timer_handle;
+    // set while a batch is being written to disk
+    volatile gint writer_busy;
+    // bumped by the writer each time it replaces the file
+    volatile gint generation;
+    // the generation file maps
+    gint mapped_generation;
+} bnet_data_cache = { FALSE, NULL, NULL, NULL, 0, 0, 0, 0 };
+
+// the writer clears writer_busy under this mutex and broadcasts writer_idle
+GStaticMutex bnet_data_cache_mutex = G_STATIC_MUTEX_INIT;
+GCond *bnet_data_cache_writer_idle = NULL;
+
+struct BnetLogonStepDeps {
+    BnetLogonStep step;
+    guint32 requires;
+} bnet_logon_step_deps[] = {
+    { BNET_LOGON_STEP_BEGIN, BNET_LOGON_DEP_BNCS | BNET_LOGON_DEP_VERSION_BYTE },
+    { BNET_LOGON_STEP_ACCOUNTLOGON, BNET_LOGON_DEP_SRP },
+};
+
+// BnetLogonMark names in the debug log and BNET_FILE_LOGON_TRACE
+const gchar *bnet_logon_mark_names[BNET_LOGON_MARK_COUNT] = {
+    "bnls_connect",
+    "version_byte",
+    "bncs_connect",
+    "auth_info",
+    "auth_check",
+    "account_logon",
+    "realm_logon",
+    "enter_chat",
+};
+
 typedef BnetEventShowMode (*BnetRegexMatchFunction)(BnetConnectionData *, GRegex *, const gchar *, GMatchInfo *, guint64);
 
 struct BnetRegexStore {
@@ -83,6 +83,18 @@ bnet_packet_refer_bnls(const gchar *start, const gsize length)
     return bnet_packet;
 }
 
+BnetPacket *
+bnet_packet_refer_raw(const gchar *start, const gsize length)
+{
+    BnetPacket *bnet_packet = g_new0(BnetPacket, 1);
+    bnet_packet->pos = 0;
+    bnet_packet->len = length;
+    bnet_packet->data = (gchar *)start;
+    bnet_packet->allocd = FALSE;
+    
+    return bnet_packet;
+}
+
 BnetPacket *
 bnet_packet_deserialize(const gchar *str)
 {
@@ -254,14 +266,17 @@ bnet_packet_send(BnetPacket *bnet_packet, const guint8 id, const int fd)
     ret = write(fd, bnet_packet->data, bnet_packet->pos);
     
     purple_debug_misc("bnet", "BNCS C>S 0x%02x: length %d\n", id, bnet_packet->pos);
+    bnet_packet_stats_count(BNET_PACKET_STATS_BNCS, BNET_PACKET_STATS_SEND, id, bnet_packet->pos);
     
     bnet_packet_free(bnet_packet);
     
     return ret;
 }
 
-int
-bnet_packet_send_bnls(BnetPacket *bnet_packet, const guint8 id, const int fd)
+// BNLS and the D2 realm share a 3-byte header: length, then id
+static int
+bnet_packet_send_short(BnetPacket *bnet_packet, const guint8 id, const int fd,
+        BnetPacketStatsProtocol protocol, const gchar *label)
 {
     int ret;
     
@@ -271,13 +286,26 @@ bnet_packet_send_bnls(BnetPacket *bnet_packet, const guint8 id, const int fd)
     
     ret = write(fd, bnet_packet->data, bnet_packet->pos);
     
-    purple_debug_misc("bnet", "BNLS C>S 0x%02x: length %d\n", id, bnet_packet->pos);
+    purple_debug_misc("bnet", "%s C>S 0x%02x: length %d\n", label, id, bnet_packet->pos);
+    bnet_packet_stats_count(protocol, BNET_PACKET_STATS_SEND, id, bnet_packet->pos);
     
     bnet_packet_free(bnet_packet);
     
     return ret;
 }
 
+int
+bnet_packet_send_bnls(BnetPacket *bnet_packet, const guint8 id, const int fd)
+{
+    return bnet_packet_send_short(bnet_packet, id, fd, BNET_PACKET_STATS_BNLS, "BNLS");
+}
+
+int
+bnet_packet_send_d2mcp(BnetPacket *bnet_packet, const guint8 id, const int fd)
+{
+    return bnet_packet_send_short(bnet_packet, id, fd, BNET_PACKET_STATS_D2MCP, "Realm");
+}
+
 gchar *
 bnet_packet_serialize(BnetPacket *bnet_packet)
 {
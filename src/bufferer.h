@@ -35,6 +35,8 @@
 #include "debug.h"
 #include "util.h"
 
+#include "packetstats.h"
+
 // sizes
 #define BNET_SIZE_FILETIME 8
 #define BNET_SIZE_DWORD 4
@@ -68,6 +70,7 @@ gboolean bnet_packet_insert(BnetPacket *bnet_packet, gconstpointer data, const g
 BnetPacket *bnet_packet_refer(const gchar *start, const gsize length);
 BnetPacket *bnet_packet_refer_bnls(const gchar *start, const gsize length);
 #define bnet_packet_refer_d2mcp bnet_packet_refer_bnls
+BnetPacket *bnet_packet_refer_raw(const gchar *start, const gsize length);
 BnetPacket *bnet_packet_deserialize(const gchar *start);
 
 gboolean bnet_packet_can_read(BnetPacket *bnet_packet, const gsize size);
@@ -82,7 +85,7 @@ BnetPacket *bnet_packet_create(const gsize header_length);
 
 int bnet_packet_send(BnetPacket *bnet_packet, const guint8 id, const int fd);
 int bnet_packet_send_bnls(BnetPacket *bnet_packet, const guint8 id, const int fd);
-#define bnet_packet_send_d2mcp bnet_packet_send_bnls
+int bnet_packet_send_d2mcp(BnetPacket *bnet_packet, const guint8 id, const int fd);
 gchar *bnet_packet_serialize(BnetPacket *bnet_packet);
 
 char *bnet_packet_debug(const BnetPacket *bnet_packet);
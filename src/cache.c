@@ -0,0 +1,443 @@
+/**
+ * pidgin-libbnet
+ * A Protocol Plugin for Pidgin, allowing emulation of a chat-only client
+ * connected to the Battle.net Service.
+ * Copyright (C) 2011-2012 Nate Book
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CACHE_C_
+#define _CACHE_C_
+
+#include "cache.h"
+
+#include <glib/gstdio.h>
+
+// nothing in this file may call into libpurple: bnet_cache_file_write runs
+// on the cache writer thread, and must not touch any file the main loop has
+// mapped
+
+static guint32
+bnet_cache_hash(const gchar *id, gsize length)
+{
+    // FNV-1a
+    guint32 hash = 2166136261U;
+    gsize i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= (guint8)id[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static guint32
+bnet_cache_record_size(const BnetCacheRecord *record)
+{
+    return sizeof(BnetCacheRecord) + record->id_length + record->value_length;
+}
+
+// copies out the header and checks it describes this file; a log that runs
+// past the end of the mapping (appended after we mapped it) is cut short
+static gboolean
+bnet_cache_header_read(const gchar *data, gsize length, BnetCacheHeader *header)
+{
+    guint64 index_end;
+
+    if (data == NULL || length < sizeof(BnetCacheHeader)) {
+        return FALSE;
+    }
+    memcpy(header, data, sizeof(BnetCacheHeader));
+
+    if (header->magic != BNET_CACHE_MAGIC || header->version != BNET_CACHE_VERSION) {
+        return FALSE;
+    }
+    if (header->index_size == 0 || (header->index_size & (header->index_size - 1)) != 0) {
+        return FALSE;
+    }
+    index_end = sizeof(BnetCacheHeader) + (guint64)header->index_size * sizeof(BnetCacheSlot);
+    if (header->log_start != index_end || index_end > length || header->log_end < header->log_start) {
+        return FALSE;
+    }
+    if (header->log_end > length) {
+        header->log_end = length;
+    }
+    return TRUE;
+}
+
+static gboolean
+bnet_cache_record_read(const gchar *data, const BnetCacheHeader *header, guint32 offset,
+        BnetCacheRecord *record, const gchar **id, const gchar **value)
+{
+    if (offset < header->log_start ||
+            (guint64)offset + sizeof(BnetCacheRecord) > header->log_end) {
+        return FALSE;
+    }
+    memcpy(record, data + offset, sizeof(BnetCacheRecord));
+    if ((guint64)offset + sizeof(BnetCacheRecord) + record->id_length + record->value_length > header->log_end) {
+        return FALSE;
+    }
+    *id = data + offset + sizeof(BnetCacheRecord);
+    *value = *id + record->id_length;
+    return TRUE;
+}
+
+// returns the slot holding id (found is set) or the empty slot ending its
+// probe run; index_size if the index is full
+static guint32
+bnet_cache_find_slot(const gchar *data, const BnetCacheHeader *header, const BnetCacheSlot *index,
+        const gchar *id, gsize id_length, guint32 hash, gboolean *found)
+{
+    guint32 mask = header->index_size - 1;
+    guint32 i = hash & mask;
+    guint32 n;
+
+    *found = FALSE;
+    for (n = 0; n < header->index_size; n++) {
+        BnetCacheRecord record;
+        const gchar *record_id;
+        const gchar *record_value;
+
+        if (index[i].offset == 0) {
+            return i;
+        }
+        if (index[i].hash == hash &&
+                bnet_cache_record_read(data, header, index[i].offset, &record, &record_id, &record_value) &&
+                record.id_length == id_length && memcmp(record_id, id, id_length) == 0) {
+            *found = TRUE;
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+    return header->index_size;
+}
+
+BnetCacheFile *
+bnet_cache_file_open(const gchar *path)
+{
+    BnetCacheFile *cache = g_new0(BnetCacheFile, 1);
+
+    cache->mapped = g_mapped_file_new(path, FALSE, NULL);
+    if (cache->mapped != NULL) {
+        cache->data = g_mapped_file_get_contents(cache->mapped);
+        cache->length = g_mapped_file_get_length(cache->mapped);
+    }
+    return cache;
+}
+
+void
+bnet_cache_file_close(BnetCacheFile *cache)
+{
+    if (cache->mapped != NULL) {
+        g_mapped_file_free(cache->mapped);
+    }
+    g_free(cache);
+}
+
+// value is a copy (NUL terminated, like BnetCacheEntry) for the caller to
+// g_free, so it outlives the mapping
+gboolean
+bnet_cache_file_lookup(const BnetCacheFile *cache, const gchar *id,
+        guint64 *timestamp, gchar **value, gsize *value_length)
+{
+    BnetCacheHeader header;
+    const BnetCacheSlot *index;
+    BnetCacheRecord record;
+    const gchar *record_id;
+    const gchar *record_value;
+    gsize id_length = strlen(id);
+    gboolean found;
+    guint32 i;
+
+    if (cache == NULL || !bnet_cache_header_read(cache->data, cache->length, &header)) {
+        return FALSE;
+    }
+    // the mapping is page aligned and the header is a multiple of 8 bytes
+    index = (const BnetCacheSlot *)(const void *)(cache->data + sizeof(BnetCacheHeader));
+
+    i = bnet_cache_find_slot(cache->data, &header, index, id, id_length,
+            bnet_cache_hash(id, id_length), &found);
+    if (!found || !bnet_cache_record_read(cache->data, &header, index[i].offset,
+                &record, &record_id, &record_value)) {
+        return FALSE;
+    }
+    *timestamp = record.timestamp;
+    *value = g_malloc(record.value_length + 1);
+    memcpy(*value, record_value, record.value_length);
+    (*value)[record.value_length] = '\0';
+    *value_length = record.value_length;
+    return TRUE;
+}
+
+// the new contents when entries can be appended to a valid file: old's bytes
+// as they are, the records after them, and the index and header updated;
+// NULL if the file should be rebuilt instead
+static GString *
+bnet_cache_build_append(const BnetCacheFile *old, const BnetCacheHeader *old_header, GList *entries)
+{
+    BnetCacheHeader header = *old_header;
+    gsize index_bytes = header.index_size * sizeof(BnetCacheSlot);
+    BnetCacheSlot *index;
+    GString *out;
+    GList *el;
+    gboolean ok = TRUE;
+
+    // keep the index at most 3/4 full
+    if ((header.entry_count + g_list_length(entries)) * 4 > header.index_size * 3) {
+        return NULL;
+    }
+
+    out = g_string_sized_new(header.log_end);
+    g_string_append_len(out, old->data, header.log_end);
+    index = g_malloc(index_bytes);
+    memcpy(index, old->data + sizeof(BnetCacheHeader), index_bytes);
+
+    for (el = entries; ok && el != NULL; el = g_list_next(el)) {
+        BnetCacheEntry *entry = el->data;
+        BnetCacheRecord record;
+        gsize id_length = strlen(entry->id);
+        guint32 hash = bnet_cache_hash(entry->id, id_length);
+        gboolean found;
+        // slots filled earlier in this batch point past old_header->log_end, so
+        // they never match; ids within one batch are unique
+        guint32 i = bnet_cache_find_slot(old->data, old_header, index,
+                entry->id, id_length, hash, &found);
+
+        if (i == header.index_size) {
+            ok = FALSE;
+            break;
+        }
+        if (found) {
+            BnetCacheRecord old_record;
+            const gchar *old_id;
+            const gchar *old_value;
+            bnet_cache_record_read(old->data, old_header, index[i].offset, &old_record, &old_id, &old_value);
+            header.dead_bytes += bnet_cache_record_size(&old_record);
+        } else {
+            header.entry_count++;
+        }
+
+        record.id_length = id_length;
+        record.value_length = entry->value_length;
+        record.timestamp = entry->timestamp;
+        if ((guint64)header.log_end + bnet_cache_record_size(&record) > G_MAXUINT32) {
+            ok = FALSE;
+            break;
+        }
+        g_string_append_len(out, (const gchar *)&record, sizeof(BnetCacheRecord));
+        g_string_append_len(out, entry->id, id_length);
+        g_string_append_len(out, entry->value, entry->value_length);
+        index[i].hash = hash;
+        index[i].offset = header.log_end;
+        header.log_end += bnet_cache_record_size(&record);
+    }
+
+    // too much of the log is dead
+    if (ok && header.dead_bytes > BNET_CACHE_DEAD_MIN &&
+            header.dead_bytes * BNET_CACHE_DEAD_RATIO > header.log_end - header.log_start) {
+        ok = FALSE;
+    }
+
+    if (ok) {
+        memcpy(out->str, &header, sizeof(BnetCacheHeader));
+        memcpy(out->str + sizeof(BnetCacheHeader), index, index_bytes);
+    } else {
+        g_string_free(out, TRUE);
+        out = NULL;
+    }
+    g_free(index);
+    return out;
+}
+
+// appends a record to out, which already holds the header and index region
+static void
+bnet_cache_build_add(GString *out, BnetCacheSlot *index, const BnetCacheHeader *header,
+        const gchar *id, gsize id_length, guint64 timestamp, gconstpointer value, gsize value_length)
+{
+    BnetCacheRecord record;
+    guint32 mask = header->index_size - 1;
+    guint32 hash = bnet_cache_hash(id, id_length);
+    guint32 i = hash & mask;
+
+    while (index[i].offset != 0) {
+        i = (i + 1) & mask;
+    }
+    index[i].hash = hash;
+    index[i].offset = out->len;
+
+    record.id_length = id_length;
+    record.value_length = value_length;
+    record.timestamp = timestamp;
+    g_string_append_len(out, (const gchar *)&record, sizeof(BnetCacheRecord));
+    g_string_append_len(out, id, id_length);
+    g_string_append_len(out, value, value_length);
+}
+
+// the contents of a fresh file holding the live records of old (if valid)
+// and entries
+static GString *
+bnet_cache_build_rebuild(const BnetCacheFile *old, GList *entries)
+{
+    BnetCacheHeader old_header;
+    BnetCacheHeader header;
+    GHashTable *replaced = g_hash_table_new(g_str_hash, g_str_equal);
+    const BnetCacheSlot *old_index = NULL;
+    BnetCacheSlot *index;
+    GString *out;
+    GList *el;
+    guint32 count = 0;
+    guint32 i;
+
+    for (el = entries; el != NULL; el = g_list_next(el)) {
+        BnetCacheEntry *entry = el->data;
+        g_hash_table_insert(replaced, entry->id, entry);
+        count++;
+    }
+    if (bnet_cache_header_read(old->data, old->length, &old_header)) {
+        old_index = (const BnetCacheSlot *)(const void *)(old->data + sizeof(BnetCacheHeader));
+        count += old_header.entry_count;
+    }
+
+    memset(&header, 0, sizeof(BnetCacheHeader));
+    header.magic = BNET_CACHE_MAGIC;
+    header.version = BNET_CACHE_VERSION;
+    header.index_size = BNET_CACHE_INDEX_MIN;
+    while (header.index_size < count * 2) {
+        header.index_size *= 2;
+    }
+    header.log_start = sizeof(BnetCacheHeader) + header.index_size * sizeof(BnetCacheSlot);
+    index = g_new0(BnetCacheSlot, header.index_size);
+    out = g_string_sized_new(header.log_start);
+    g_string_set_size(out, header.log_start);
+
+    for (el = entries; el != NULL; el = g_list_next(el)) {
+        BnetCacheEntry *entry = el->data;
+        bnet_cache_build_add(out, index, &header, entry->id, strlen(entry->id),
+                entry->timestamp, entry->value, entry->value_length);
+        header.entry_count++;
+    }
+    for (i = 0; old_index != NULL && i < old_header.index_size; i++) {
+        BnetCacheRecord record;
+        const gchar *record_id;
+        const gchar *record_value;
+        gchar *id;
+        gboolean keep;
+
+        if (old_index[i].offset == 0 || !bnet_cache_record_read(old->data, &old_header,
+                    old_index[i].offset, &record, &record_id, &record_value)) {
+            continue;
+        }
+        id = g_strndup(record_id, record.id_length);
+        keep = g_hash_table_lookup(replaced, id) == NULL;
+        g_free(id);
+        if (keep && header.entry_count * 4 < header.index_size * 3) {
+            bnet_cache_build_add(out, index, &header, record_id, record.id_length,
+                    record.timestamp, record_value, record.value_length);
+            header.entry_count++;
+        }
+    }
+    header.log_end = out->len;
+
+    memcpy(out->str, &header, sizeof(BnetCacheHeader));
+    memcpy(out->str + sizeof(BnetCacheHeader), index, header.index_size * sizeof(BnetCacheSlot));
+
+    g_free(index);
+    g_hash_table_destroy(replaced);
+    return out;
+}
+
+// builds the next file from the current one and entries, and puts it in
+// place by rename; the file a reader has mapped is never written to
+gboolean
+bnet_cache_file_write(const gchar *path, GList *entries)
+{
+    gchar *new_path = g_strconcat(path, BNET_CACHE_NEW_SUFFIX, NULL);
+    BnetCacheFile *old;
+    BnetCacheHeader header;
+    GString *out = NULL;
+    gboolean ok;
+
+#ifdef G_OS_WIN32
+    // a file bnet_cache_file_commit has not moved into place yet is the newest
+    old = bnet_cache_file_open(g_file_test(new_path, G_FILE_TEST_EXISTS) ? new_path : path);
+#else
+    old = bnet_cache_file_open(path);
+#endif
+    if (bnet_cache_header_read(old->data, old->length, &header) &&
+            header.log_end == old->length) {
+        out = bnet_cache_build_append(old, &header, entries);
+    }
+    if (out == NULL) {
+        out = bnet_cache_build_rebuild(old, entries);
+    }
+    bnet_cache_file_close(old);
+
+#ifdef G_OS_WIN32
+    // a mapped file cannot be replaced: bnet_cache_file_commit does it once
+    // the main loop has let go of the old mapping
+    ok = g_file_set_contents(new_path, out->str, out->len, NULL);
+#else
+    // writes a temporary file and renames it over the old one; mappings of
+    // the old file keep its contents
+    ok = g_file_set_contents(path, out->str, out->len, NULL);
+#endif
+
+    g_string_free(out, TRUE);
+    g_free(new_path);
+    return ok;
+}
+
+// moves a file bnet_cache_file_write left beside path into place; path must
+// not be mapped
+void
+bnet_cache_file_commit(const gchar *path)
+{
+#ifdef G_OS_WIN32
+    gchar *new_path = g_strconcat(path, BNET_CACHE_NEW_SUFFIX, NULL);
+
+    if (g_file_test(new_path, G_FILE_TEST_EXISTS)) {
+        // rename does not replace an existing file here
+        g_unlink(path);
+        g_rename(new_path, path);
+    }
+    g_free(new_path);
+#else
+    // bnet_cache_file_write already renamed it into place
+    (void)path;
+#endif
+}
+
+BnetCacheEntry *
+bnet_cache_entry_new(const gchar *id, guint64 timestamp, gconstpointer value, gsize value_length)
+{
+    BnetCacheEntry *entry = g_new0(BnetCacheEntry, 1);
+    entry->id = g_strdup(id);
+    entry->timestamp = timestamp;
+    entry->value = g_malloc(value_length + 1);
+    memcpy(entry->value, value, value_length);
+    entry->value[value_length] = '\0';
+    entry->value_length = value_length;
+    return entry;
+}
+
+void
+bnet_cache_entry_free(BnetCacheEntry *entry)
+{
+    g_free(entry->id);
+    g_free(entry->value);
+    g_free(entry);
+}
+
+#endif
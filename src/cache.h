@@ -0,0 +1,105 @@
+/**
+ * pidgin-libbnet
+ * A Protocol Plugin for Pidgin, allowing emulation of a chat-only client
+ * connected to the Battle.net Service.
+ * Copyright (C) 2011-2012 Nate Book
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+// libraries
+#include <glib.h>
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Data cache file layout (native byte order; a magic mismatch means the
+ * file is rebuilt):
+ *
+ *   BnetCacheHeader
+ *   BnetCacheSlot[index_size]     open-addressed, linear probing
+ *   records from log_start to log_end, each a BnetCacheRecord followed by
+ *   id_length bytes of id and value_length bytes of value
+ *
+ * Lookups read the file through a read-only mapping and copy values out.
+ * Writes never modify a file in place: each one writes a new file, either
+ * the old bytes with records appended and the index updated, or a rebuild
+ * once too much of the log is dead or the index fills up, and renames it
+ * over the old one. Replaced records become dead space until the rebuild.
+ */
+
+#define BNET_CACHE_MAGIC   0x41434E42 /* "BNCA" */
+#define BNET_CACHE_VERSION 1
+
+// minimum number of index slots
+#define BNET_CACHE_INDEX_MIN 64
+// rebuild once dead bytes exceed 1/N of the log
+#define BNET_CACHE_DEAD_RATIO 2
+// ... but never for logs smaller than this
+#define BNET_CACHE_DEAD_MIN 4096
+// where a write leaves the new file when it cannot rename over a mapped one
+#define BNET_CACHE_NEW_SUFFIX ".new"
+
+typedef struct {
+    guint32 magic;
+    guint32 version;
+    guint32 index_size;
+    guint32 entry_count;
+    guint32 log_start;
+    guint32 log_end;
+    guint32 dead_bytes;
+    guint32 reserved;
+} BnetCacheHeader;
+
+typedef struct {
+    guint32 hash;
+    // file offset of the record, 0 for an empty slot
+    guint32 offset;
+} BnetCacheSlot;
+
+typedef struct {
+    guint32 id_length;
+    guint32 value_length;
+    guint64 timestamp;
+} BnetCacheRecord;
+
+typedef struct {
+    GMappedFile *mapped;
+    const gchar *data;
+    gsize length;
+} BnetCacheFile;
+
+typedef struct {
+    gchar *id;
+    guint64 timestamp;
+    gchar *value;
+    gsize value_length;
+} BnetCacheEntry;
+
+BnetCacheFile *bnet_cache_file_open(const gchar *path);
+void bnet_cache_file_close(BnetCacheFile *cache);
+gboolean bnet_cache_file_lookup(const BnetCacheFile *cache, const gchar *id,
+        guint64 *timestamp, gchar **value, gsize *value_length);
+gboolean bnet_cache_file_write(const gchar *path, GList *entries);
+void bnet_cache_file_commit(const gchar *path);
+
+BnetCacheEntry *bnet_cache_entry_new(const gchar *id, guint64 timestamp,
+        gconstpointer value, gsize value_length);
+void bnet_cache_entry_free(BnetCacheEntry *entry);
+
+#endif
@@ -0,0 +1,307 @@
+/**
+ * pidgin-libbnet
+ * A Protocol Plugin for Pidgin, allowing emulation of a chat-only client
+ * connected to the Battle.net Service.
+ * Copyright (C) 2011-2012 Nate Book
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CHECKREVISION_C_
+#define _CHECKREVISION_C_
+
+#include "checkrevision.h"
+
+#include <time.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+// VS_FIXEDFILEINFO signature
+#define BNET_CREV_FFI_SIGNATURE 0xFEEF04BD
+
+// A is xor'd with the seed for the archive number
+static const guint32 bnet_crev_seeds[] = {
+    0xE7F4CB62, 0xF6A14FFC, 0xAA5504AF, 0x871FCDC2,
+    0x11BF6A18, 0xC57292E6, 0x7927D27E, 0x2FEC8733,
+};
+
+// returns the archive number of a classic version check archive, or -1
+gint
+bnet_crev_get_mpq_number(const gchar *mpq_fn)
+{
+    gchar *lower;
+    const gchar *dot;
+    gint number = -1;
+
+    if (mpq_fn == NULL) {
+        return -1;
+    }
+
+    lower = g_ascii_strdown(mpq_fn, -1);
+    dot = strrchr(lower, '.');
+    if (strstr(lower, "lockdown") == NULL && strstr(lower, "ver") != NULL &&
+            g_str_has_suffix(lower, ".mpq") && dot > lower && g_ascii_isdigit(dot[-1])) {
+        number = dot[-1] - '0';
+        if (number >= G_N_ELEMENTS(bnet_crev_seeds)) {
+            number = -1;
+        }
+    }
+    g_free(lower);
+    return number;
+}
+
+static gint
+bnet_crev_var_index(gchar c)
+{
+    switch (c) {
+        case 'A': return 0;
+        case 'B': return 1;
+        case 'C': return 2;
+        case 'S': return 3;
+        default:  return -1;
+    }
+}
+
+// parses "A=n B=n C=n 4 A=A^S B=B-C C=C+A A=A+B"
+BnetCRevResult
+bnet_crev_formula_parse(const gchar *formula, BnetCRevFormula *parsed)
+{
+    gchar **tokens;
+    gchar **token;
+    BnetCRevResult result = BNET_CREV_SUCCESS;
+
+    memset(parsed, 0, sizeof(BnetCRevFormula));
+    if (formula == NULL) {
+        return BNET_CREV_BAD_FORMULA;
+    }
+
+    tokens = g_strsplit(formula, " ", -1);
+    for (token = tokens; *token != NULL && result == BNET_CREV_SUCCESS; token++) {
+        const gchar *t = *token;
+        gsize len = strlen(t);
+        gint dest;
+
+        if (len == 0) {
+            continue;
+        }
+        if (len == 1 && g_ascii_isdigit(t[0])) {
+            // operation count; we count them ourselves
+            continue;
+        }
+
+        dest = bnet_crev_var_index(t[0]);
+        if (len < 3 || t[1] != '=' || dest < 0) {
+            result = BNET_CREV_BAD_FORMULA;
+        } else if (g_ascii_isdigit(t[2])) {
+            gchar *end = NULL;
+            parsed->values[dest] = (guint32)g_ascii_strtoull(t + 2, &end, 10);
+            if (end == NULL || *end != '\0') {
+                result = BNET_CREV_BAD_FORMULA;
+            }
+        } else if (len == 5 && bnet_crev_var_index(t[2]) >= 0 && bnet_crev_var_index(t[4]) >= 0 &&
+                strchr("+-^*/&|", t[3]) != NULL && parsed->op_count < BNET_CREV_OP_MAX) {
+            BnetCRevOperation *op = &parsed->ops[parsed->op_count++];
+            op->dest = dest;
+            op->src1 = bnet_crev_var_index(t[2]);
+            op->operation = t[3];
+            op->src2 = bnet_crev_var_index(t[4]);
+        } else {
+            result = BNET_CREV_BAD_FORMULA;
+        }
+    }
+    g_strfreev(tokens);
+
+    if (result == BNET_CREV_SUCCESS && parsed->op_count == 0) {
+        result = BNET_CREV_BAD_FORMULA;
+    }
+    return result;
+}
+
+static void
+bnet_crev_hash_block(BnetCRevFormula *formula, const guint8 *block)
+{
+    guint32 *values = formula->values;
+    const BnetCRevOperation *ops = formula->ops;
+    const guint op_count = formula->op_count;
+    gsize i;
+    guint k;
+
+    for (i = 0; i < BNET_CREV_BLOCK_SIZE; i += 4) {
+        values[3] = (guint32)block[i] | ((guint32)block[i + 1] << 8) |
+            ((guint32)block[i + 2] << 16) | ((guint32)block[i + 3] << 24);
+        for (k = 0; k < op_count; k++) {
+            guint32 a = values[ops[k].src1];
+            guint32 b = values[ops[k].src2];
+            guint32 r;
+
+            switch (ops[k].operation) {
+                case '+': r = a + b; break;
+                case '-': r = a - b; break;
+                case '^': r = a ^ b; break;
+                case '*': r = a * b; break;
+                case '/': r = (b != 0) ? a / b : 0; break;
+                case '&': r = a & b; break;
+                default:
+                case '|': r = a | b; break;
+            }
+            values[ops[k].dest] = r;
+        }
+    }
+}
+
+// streams one file through the formula out of a read-only mapping
+static BnetCRevResult
+bnet_crev_hash_file(BnetCRevFormula *formula, const gchar *path)
+{
+    GMappedFile *mapped = g_mapped_file_new(path, FALSE, NULL);
+    const guint8 *data;
+    gsize length;
+    gsize whole;
+    gsize pos;
+
+    if (mapped == NULL) {
+        return BNET_CREV_FILE_ERROR;
+    }
+    data = (const guint8 *)g_mapped_file_get_contents(mapped);
+    length = g_mapped_file_get_length(mapped);
+    whole = length - (length % BNET_CREV_BLOCK_SIZE);
+
+    for (pos = 0; pos < whole; pos += BNET_CREV_BLOCK_SIZE) {
+        bnet_crev_hash_block(formula, data + pos);
+    }
+    if (whole < length) {
+        guint8 block[BNET_CREV_BLOCK_SIZE];
+        gsize rest = length - whole;
+        gsize i;
+
+        memcpy(block, data + whole, rest);
+        for (i = 0; rest + i < BNET_CREV_BLOCK_SIZE; i++) {
+            block[rest + i] = (guint8)(0xFF - (i % 0xFF));
+        }
+        bnet_crev_hash_block(formula, block);
+    }
+
+    g_mapped_file_free(mapped);
+    return BNET_CREV_SUCCESS;
+}
+
+// files is NULL-terminated; the checksum is the final value of C
+BnetCRevResult
+bnet_crev_classic(const gchar *formula, const gchar *mpq_fn,
+        gchar **files, guint32 *checksum)
+{
+    BnetCRevFormula parsed;
+    BnetCRevResult result;
+    gint mpq_number = bnet_crev_get_mpq_number(mpq_fn);
+    gchar **file;
+
+    if (mpq_number < 0) {
+        return BNET_CREV_UNSUPPORTED;
+    }
+    result = bnet_crev_formula_parse(formula, &parsed);
+    if (result != BNET_CREV_SUCCESS) {
+        return result;
+    }
+
+    parsed.values[0] ^= bnet_crev_seeds[mpq_number];
+    for (file = files; *file != NULL; file++) {
+        result = bnet_crev_hash_file(&parsed, *file);
+        if (result != BNET_CREV_SUCCESS) {
+            return result;
+        }
+    }
+
+    *checksum = parsed.values[2];
+    return BNET_CREV_SUCCESS;
+}
+
+// version from the executable's VS_FIXEDFILEINFO, and the
+// "name mm/dd/yy hh:mm:ss size" info string
+BnetCRevResult
+bnet_crev_exe_info(const gchar *path, guint32 *exe_version, gchar **exe_info)
+{
+    GMappedFile *mapped;
+    const guint8 *data;
+    gsize length;
+    gsize pos;
+    gboolean found = FALSE;
+    struct stat st;
+    time_t mtime;
+    struct tm *tm;
+    gchar *base;
+
+    if (g_stat(path, &st) != 0) {
+        return BNET_CREV_FILE_ERROR;
+    }
+    mapped = g_mapped_file_new(path, FALSE, NULL);
+    if (mapped == NULL) {
+        return BNET_CREV_FILE_ERROR;
+    }
+    data = (const guint8 *)g_mapped_file_get_contents(mapped);
+    length = g_mapped_file_get_length(mapped);
+
+    // signature, struct version, file version MS/LS, product version MS/LS
+    for (pos = 0; pos + 24 <= length; pos += 4) {
+        guint32 fields[6];
+
+        memcpy(fields, data + pos, sizeof(fields));
+        if (GUINT32_FROM_LE(fields[0]) == BNET_CREV_FFI_SIGNATURE) {
+            guint32 ms = GUINT32_FROM_LE(fields[4]);
+            guint32 ls = GUINT32_FROM_LE(fields[5]);
+            *exe_version = ((ms & 0xFF0000) << 8) | ((ms & 0xFF) << 16) |
+                ((ls & 0xFF0000) >> 8) | (ls & 0xFF);
+            found = TRUE;
+            break;
+        }
+    }
+    g_mapped_file_free(mapped);
+    if (!found) {
+        return BNET_CREV_FILE_ERROR;
+    }
+
+    mtime = st.st_mtime;
+    tm = gmtime(&mtime);
+    if (tm == NULL) {
+        return BNET_CREV_FILE_ERROR;
+    }
+    base = g_path_get_basename(path);
+    *exe_info = g_strdup_printf("%s %02u/%02u/%02u %02u:%02u:%02u %lu", base,
+            tm->tm_mon + 1, tm->tm_mday, tm->tm_year % 100,
+            tm->tm_hour, tm->tm_min, tm->tm_sec, (gulong)st.st_size);
+    g_free(base);
+    return BNET_CREV_SUCCESS;
+}
+
+// case-insensitive lookup of a game file; returns a newly allocated path or NULL
+gchar *
+bnet_crev_find_file(const gchar *directory, const gchar *name)
+{
+    GDir *dir = g_dir_open(directory, 0, NULL);
+    const gchar *entry;
+    gchar *path = NULL;
+
+    if (dir == NULL) {
+        return NULL;
+    }
+    while ((entry = g_dir_read_name(dir)) != NULL) {
+        if (g_ascii_strcasecmp(entry, name) == 0) {
+            path = g_build_filename(directory, entry, NULL);
+            break;
+        }
+    }
+    g_dir_close(dir);
+    return path;
+}
+
+#endif
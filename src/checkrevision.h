@@ -0,0 +1,84 @@
+/**
+ * pidgin-libbnet
+ * A Protocol Plugin for Pidgin, allowing emulation of a chat-only client
+ * connected to the Battle.net Service.
+ * Copyright (C) 2011-2012 Nate Book
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CHECKREVISION_H_
+#define _CHECKREVISION_H_
+
+// libraries
+#include <glib.h>
+
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Local implementation of the classic CheckRevision version check
+ * (ver-IX86-N.mpq and IX86verN.mpq archives):
+ *
+ *   the formula sets initial values for A, B and C, then lists the
+ *   operations applied for every little-endian dword S of every game file;
+ *   A is seeded by the archive number, and C is the checksum
+ *
+ * Each file is hashed straight out of a read-only mapping, 1024 bytes at a
+ * time; a partial last block is padded with 0xFF, 0xFE, ...
+ *
+ * Lockdown archives need relocation-aware hashing of the archive's DLL and
+ * a screen dump; they are reported as unsupported.
+ */
+
+// number of game files hashed
+#define BNET_CREV_FILE_COUNT 3
+// formula variables: A, B, C and the current dword S
+#define BNET_CREV_VAR_COUNT  4
+// most operations a formula may list
+#define BNET_CREV_OP_MAX     8
+// bytes hashed at a time
+#define BNET_CREV_BLOCK_SIZE 1024
+
+typedef enum {
+    BNET_CREV_SUCCESS = 0,
+    // the archive or formula is not one we can compute
+    BNET_CREV_UNSUPPORTED,
+    // the formula could not be parsed
+    BNET_CREV_BAD_FORMULA,
+    // a game file is missing or unreadable
+    BNET_CREV_FILE_ERROR,
+} BnetCRevResult;
+
+typedef struct {
+    guint8 dest;
+    guint8 src1;
+    gchar operation;
+    guint8 src2;
+} BnetCRevOperation;
+
+typedef struct {
+    guint32 values[BNET_CREV_VAR_COUNT];
+    BnetCRevOperation ops[BNET_CREV_OP_MAX];
+    guint op_count;
+} BnetCRevFormula;
+
+gint bnet_crev_get_mpq_number(const gchar *mpq_fn);
+BnetCRevResult bnet_crev_formula_parse(const gchar *formula, BnetCRevFormula *parsed);
+BnetCRevResult bnet_crev_classic(const gchar *formula, const gchar *mpq_fn,
+        gchar **files, guint32 *checksum);
+BnetCRevResult bnet_crev_exe_info(const gchar *path, guint32 *exe_version, gchar **exe_info);
+gchar *bnet_crev_find_file(const gchar *directory, const gchar *name);
+
+#endif
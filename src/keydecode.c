@@ -143,68 +143,526 @@ static const unsigned char w3TranslateMap[] = {
     0x0D, 0x0B, 0x09, 0x0E, 0x0F, 0x06, 0x01, 0x07, 0x02, 0x00, 0x05, 0x08
 };
 
+/*
+ * W3 decode tables, built once from w3TranslateMap by
+ * bnet_key_build_w3_tables():
+ *
+ * w3Step[p][c][n] is one step of pass 1 in row p, taking the running
+ * value c and the nibble n to the next running value, which otherwise
+ * takes two dependent lookups.
+ *
+ * w3Scatter[p][n] is where pass 2 puts the four bits of nibble p when
+ * it holds n, as the four words of the key table.
+ */
+static guint8 w3Step[30][16][16];
+static guint32 w3Scatter[30][16][4];
+static gsize w3TablesReady = 0;
+
+static void bnet_key_build_w3_tables(void)
+{
+    int p, c, n, b;
+
+    for (p = 0; p < 30; p++) {
+        const unsigned char *row = w3TranslateMap + (p << 4);
+        for (c = 0; c < 16; c++) {
+            for (n = 0; n < 16; n++) {
+                w3Step[p][c][n] = row[n ^ row[c]];
+            }
+        }
+        for (n = 0; n < 16; n++) {
+            for (b = 0; b < 4; b++) {
+                if (n & (1 << b)) {
+                    // pass 2 moves bit 11 * e mod 120 to bit e, so
+                    // bit k goes to 11 * k mod 120 (11 * 11 = 121)
+                    int e = (11 * ((p << 2) + b)) % 120;
+                    w3Scatter[p][n][3 - (e >> 5)] |= 1U << (e & 31);
+                }
+            }
+        }
+    }
+}
+
 /**
- * Call this to decode one or two keys for SID_AUTH_CHECK.
- * Returns a boolean indicating success. Stores the data it extracts into keys[].
+ * Copies the alphanumeric characters of key_string, upper cased, into
+ * out (at least W3_KEYLEN + 1 bytes). Returns the resulting length.
  */
-gboolean bnet_key_decode(BnetKey keys[2], int key_count,
-     guint32 client_cookie, guint32 server_cookie,
-     const char *key1_string, const char *key2_string)
+static gsize bnet_key_normalize(const char *key_string, char *out)
 {
-    char key1[27];
-    char key2[27];
-    
-    int i, j;
-    for (i = 0, j = 0; i < strlen(key1_string) && j < 26; i++) {
-        if (isalnum(key1_string[i])) {
-            key1[j] = toupper(key1_string[i]);
-            j++;
+    gsize j = 0;
+
+    if (key_string != NULL) {
+        for (; *key_string != '\0' && j < W3_KEYLEN; key_string++) {
+            if (isalnum(*key_string)) {
+                out[j++] = toupper(*key_string);
+            }
         }
     }
-    key1[j] = '\0';
-    for (i = 0, j = 0; i < strlen(key2_string) && j < 26; i++) {
-        if (isalnum(key2_string[i])) {
-            key2[j] = toupper(key2_string[i]);
-            j++;
+    out[j] = '\0';
+    return j;
+}
+
+static guint32 bnet_key_parse_number(const char *digits, int length, int base)
+{
+    guint32 value = 0;
+
+    while (length--) {
+        value = value * base + getNumValue(*digits++);
+    }
+    return value;
+}
+
+/**
+ * Decodes a 13-digit StarCraft key. Same results as process_sc().
+ */
+static gboolean bnet_key_decode_sc(const char *key, guint32 *product,
+        guint32 *value1, guint32 *value2)
+{
+    int accum, pos, i;
+    char temp;
+    int hashKey = 0x13AC9741;
+    char cdkey[14];
+
+    memcpy(cdkey, key, 13);
+    cdkey[13] = '\0';
+
+    // Verification
+    accum = 3;
+    for (i = 0; i < 12; i++) {
+        accum += ((cdkey[i] - '0') ^ (accum * 2));
+    }
+    if ((accum % 10) != (cdkey[12] - '0')) {
+        return FALSE;
+    }
+
+    // Shuffling
+    pos = 0x0B;
+    for (i = 0xC2; i >= 7; i -= 0x11) {
+        temp = cdkey[pos];
+        cdkey[pos] = cdkey[i % 0x0C];
+        cdkey[i % 0x0C] = temp;
+        pos--;
+    }
+
+    // Final Value
+    for (i = 11; i >= 0; i--) {
+        temp = cdkey[i];
+        if (temp <= '7') {
+            cdkey[i] ^= (char) (hashKey & 7);
+            hashKey >>= 3;
+        } else if (temp < 'A') {
+            cdkey[i] ^= ((char) i & 1);
         }
     }
-    key2[j] = '\0';
-    
-    if (key_count > 0) {
-        CDKeyDecoder *ctx = bnet_key_create_context(key1);
-        if (bnet_is_key_valid(ctx)) {
-            keys[0].length = strlen(key1);
-            keys[0].product_value = bnet_key_get_product(ctx);
-            keys[0].public_value = bnet_key_get_val1(ctx);
-            keys[0].private_value = 0;
-            bnet_key_calculate_hash(ctx, client_cookie, server_cookie);
-            bnet_key_get_hash(ctx, (guint8 *)(&(keys[0].key_hash)));
-            bnet_key_free(ctx);
-        } else {
-            keys[0].length = 0;
-            return FALSE;
+
+    // Final Calculations: "%2ld%7ld%3ld"
+    *product = bnet_key_parse_number(cdkey, 2, 10);
+    *value1 = bnet_key_parse_number(cdkey + 2, 7, 10);
+    *value2 = bnet_key_parse_number(cdkey + 9, 3, 10);
+    return TRUE;
+}
+
+/**
+ * Decodes a 16-character WarCraft II / Diablo II key. Same results as
+ * process_w2d2().
+ */
+static gboolean bnet_key_decode_w2d2(const char *key, guint32 *product,
+        guint32 *value1, guint32 *value2)
+{
+    unsigned long r, n, n2, v, v2, checksum;
+    int i, j;
+    unsigned char c1, c2, c;
+    char cdkey[17];
+
+    memcpy(cdkey, key, 16);
+    cdkey[16] = '\0';
+
+    r = 1;
+    checksum = 0;
+    for (i = 0; i < 16; i += 2) {
+        c1 = w2Map[(int) cdkey[i]];
+        n = c1 * 3;
+        c2 = w2Map[(int) cdkey[i + 1]];
+        n = c2 + n * 8;
+
+        if (n >= 0x100) {
+            n -= 0x100;
+            checksum |= r;
         }
+        n2 = n >> 4;
+        cdkey[i] = getHexValue(n2);
+        cdkey[i + 1] = getHexValue(n);
+        r <<= 1;
     }
-    
-    if (key_count > 1) {
-        CDKeyDecoder *ctx = bnet_key_create_context(key2);
-        if (bnet_is_key_valid(ctx)) {
-            keys[1].length = strlen(key2);
-            keys[1].product_value = bnet_key_get_product(ctx);
-            keys[1].public_value = bnet_key_get_val1(ctx);
-            keys[1].private_value = 0;
-            bnet_key_calculate_hash(ctx, client_cookie, server_cookie);
-            bnet_key_get_hash(ctx, (guint8 *)(&(keys[1].key_hash)));
-            bnet_key_free(ctx);
-        } else {
-            keys[1].length = 0;
-            return FALSE;
+
+    v = 3;
+    for (i = 0; i < 16; i++) {
+        n = getNumValue(cdkey[i]);
+        n2 = v * 2;
+        n ^= n2;
+        v += n;
+    }
+    v &= 0xFF;
+
+    if (v != checksum) {
+        return FALSE;
+    }
+
+    for (j = 15; j >= 0; j--) {
+        c = cdkey[j];
+        n = (j > 8) ? (j - 9) : (0xF - (8 - j));
+        n &= 0xF;
+        cdkey[j] = cdkey[n];
+        cdkey[n] = c;
+    }
+    v2 = 0x13AC9741;
+    for (j = 15; j >= 0; j--) {
+        c = cdkey[j];
+        if (c <= '7') {
+            cdkey[j] = (char) ((v2 & 7) ^ c);
+            v2 >>= 3;
+        } else if (c < 'A') {
+            cdkey[j] = (((char) j) & 1) ^ c;
         }
     }
-    
+
+    // Final Calculations: "%2lx%6lx%8lx"
+    *product = bnet_key_parse_number(cdkey, 2, 16);
+    *value1 = bnet_key_parse_number(cdkey + 2, 6, 16);
+    *value2 = bnet_key_parse_number(cdkey + 8, 8, 16);
     return TRUE;
 }
 
+/**
+ * Decodes a 26-character WarCraft III key (upper case). Same results as
+ * the old process_w3(), whose mult() and decodeKeyTable() steps this
+ * replaces:
+ *
+ * The key's 52 base-5 digits are accumulated into a 128-bit value (four
+ * 32-bit words, most significant first, with the carry out of each add
+ * dropped like the original). Pass 1 works on that value's 30 low
+ * nibbles through w3Step, and pass 2's fixed bit permutation is an OR
+ * of w3Scatter entries, one per nibble.
+ */
+static void bnet_key_decode_w3(const char *cdkey, guint32 *product,
+        guint32 *value1, guint8 *value2)
+{
+    signed char digits[W3_BUFLEN];
+    guint8 nibbles[30];
+    guint32 values[4] = { 0, 0, 0, 0 };
+    guint32 scattered[4];
+    guint8 bytes[16];
+    guint16 word16;
+    guint32 word;
+    int a, b = 0x21;
+    int i, j, p;
+
+    if (g_once_init_enter(&w3TablesReady)) {
+        bnet_key_build_w3_tables();
+        g_once_init_leave(&w3TablesReady, 1);
+    }
+
+    for (i = 0; i < W3_KEYLEN; i++) {
+        // a signed char, as in the original
+        signed char decode = (signed char) w3KeyMap[(int) cdkey[i]];
+        a = (b + 0x07B5) % W3_BUFLEN;
+        b = (a + 0x07B5) % W3_BUFLEN;
+        digits[a] = decode / 5;
+        digits[b] = decode % 5;
+    }
+
+    // values = values * 5 + digit, for each digit
+    for (i = W3_BUFLEN; i > 0; i--) {
+        guint32 carry = (guint32) (gint32) digits[i - 1];
+        for (j = 3; j >= 0; j--) {
+            guint64 product64 = (guint64) values[j] * 5;
+            values[j] = carry + (guint32) product64;
+            carry = (guint32) (product64 >> 32);
+        }
+    }
+
+    // pass 1
+    for (p = 0; p < 30; p++) {
+        nibbles[p] = (values[3 - (p >> 3)] >> ((p & 7) << 2)) & 0xF;
+    }
+    for (p = 29; p >= 0; p--) {
+        guint8 (*step)[16] = w3Step[p];
+        guint8 c = nibbles[p];
+        for (j = 29; j > p; j--) {
+            c = step[c][nibbles[j]];
+        }
+        for (j = p - 1; j >= 0; j--) {
+            c = step[c][nibbles[j]];
+        }
+        nibbles[p] = w3TranslateMap[(p << 4) + c];
+    }
+
+    // pass 2; the top byte isn't permuted
+    scattered[0] = values[0] & 0xFF000000;
+    scattered[1] = scattered[2] = scattered[3] = 0;
+    for (p = 0; p < 30; p++) {
+        const guint32 *bits = w3Scatter[p][nibbles[p]];
+        scattered[0] |= bits[0];
+        scattered[1] |= bits[1];
+        scattered[2] |= bits[2];
+        scattered[3] |= bits[3];
+    }
+
+    *product = MSB4((guint32) SWAP4((guint32) ((gint32) scattered[0] >> 0xA)));
+
+    for (i = 0; i < 4; i++) {
+        word = MSB4(scattered[i]);
+        memcpy(bytes + (i << 2), &word, 4);
+    }
+    memcpy(&word, bytes + 2, 4);
+    *value1 = MSB4(LSB4(word) & 0xFFFFFF03);
+
+    memcpy(&word16, bytes + 6, 2);
+    word16 = MSB2(word16);
+    memcpy(value2, &word16, 2);
+    memcpy(&word, bytes + 8, 4);
+    word = MSB4(word);
+    memcpy(value2 + 2, &word, 4);
+    memcpy(&word, bytes + 12, 4);
+    word = MSB4(word);
+    memcpy(value2 + 6, &word, 4);
+}
+
+/**
+ * Decodes a normalized key into entry, which gets the key's string too.
+ */
+static void bnet_key_decode_entry(const char *cdkey, gsize length,
+        BnetDecodedKey *entry)
+{
+    gsize k;
+
+    memset(entry, 0, sizeof(BnetDecodedKey));
+    memcpy(entry->cdkey, cdkey, length);
+    entry->length = length;
+    switch (length) {
+        case CDKEY_TYPE_SC:
+            for (k = 0; k < length && isdigit(cdkey[k]); k++);
+            entry->valid = (k == length) && bnet_key_decode_sc(cdkey,
+                    &entry->product, &entry->value1, &entry->value2);
+            break;
+        case CDKEY_TYPE_W2D2:
+            entry->valid = bnet_key_decode_w2d2(cdkey,
+                    &entry->product, &entry->value1, &entry->value2);
+            break;
+        case CDKEY_TYPE_W3:
+            bnet_key_decode_w3(cdkey,
+                    &entry->product, &entry->value1, entry->w3_value2);
+            entry->valid = TRUE;
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Overwrites key material; unlike a plain memset, this can't be dropped
+ * as a dead store before the memory is freed or goes out of scope.
+ */
+static void bnet_key_zero(gpointer data, gsize length)
+{
+    volatile guint8 *p = data;
+
+    while (length--) {
+        *p++ = 0;
+    }
+}
+
+/*
+ * Decoded keys by key string, shared by every connection: a reconnect only
+ * needs the cookie-dependent hash. Crypto jobs run on pool threads, so
+ * the table is only touched under bnet_key_cache_mutex. Entries (and the
+ * key strings they're keyed by) are zeroed when freed.
+ */
+static GHashTable *bnet_key_cache = NULL;
+static GStaticMutex bnet_key_cache_mutex = G_STATIC_MUTEX_INIT;
+
+static void bnet_key_cache_entry_free(gpointer data)
+{
+    bnet_key_zero(data, sizeof(BnetDecodedKey));
+    g_free(data);
+}
+
+// drops every other entry
+static gboolean bnet_key_cache_evict_cb(gpointer key, gpointer value, gpointer user_data)
+{
+    guint *seen = user_data;
+
+    return ((*seen)++ & 1) == 0;
+}
+
+/**
+ * Copies the cached decode of cdkey into entry. Returns FALSE if the key
+ * isn't cached.
+ */
+static gboolean bnet_key_cache_lookup(const char *cdkey, BnetDecodedKey *entry)
+{
+    BnetDecodedKey *cached = NULL;
+
+    g_static_mutex_lock(&bnet_key_cache_mutex);
+    if (bnet_key_cache != NULL) {
+        cached = g_hash_table_lookup(bnet_key_cache, cdkey);
+        if (cached != NULL) {
+            memcpy(entry, cached, sizeof(BnetDecodedKey));
+        }
+    }
+    g_static_mutex_unlock(&bnet_key_cache_mutex);
+    return (cached != NULL);
+}
+
+static void bnet_key_cache_store(const BnetDecodedKey *entry)
+{
+    BnetDecodedKey *cached = g_memdup(entry, sizeof(BnetDecodedKey));
+
+    g_static_mutex_lock(&bnet_key_cache_mutex);
+    if (bnet_key_cache == NULL) {
+        bnet_key_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+                NULL, bnet_key_cache_entry_free);
+    } else if (g_hash_table_size(bnet_key_cache) >= BNET_KEY_CACHE_MAX) {
+        guint seen = 0;
+        g_hash_table_foreach_remove(bnet_key_cache, bnet_key_cache_evict_cb, &seen);
+    }
+    // the entry owns the key string
+    g_hash_table_replace(bnet_key_cache, cached->cdkey, cached);
+    g_static_mutex_unlock(&bnet_key_cache_mutex);
+}
+
+/**
+ * Zeroes and frees every cached key decode.
+ */
+void bnet_key_cache_clear(void)
+{
+    g_static_mutex_lock(&bnet_key_cache_mutex);
+    if (bnet_key_cache != NULL) {
+        g_hash_table_destroy(bnet_key_cache);
+        bnet_key_cache = NULL;
+    }
+    g_static_mutex_unlock(&bnet_key_cache_mutex);
+}
+
+static guint bnet_key_decode_keys(BnetKey *keys, guint count,
+     guint32 client_cookie, guint32 server_cookie,
+     const char *const *key_strings, gboolean use_cache);
+
+/**
+ * Call this to decode one or two keys for SID_AUTH_CHECK.
+ * Returns a boolean indicating success. Stores the data it extracts into keys[].
+ */
+gboolean bnet_key_decode(BnetKey keys[2], int key_count,
+     guint32 client_cookie, guint32 server_cookie,
+     const char *key1_string, const char *key2_string)
+{
+    const char *key_strings[2];
+
+    if (key_count <= 0)
+        return TRUE;
+    if (key_count > 2)
+        key_count = 2;
+
+    key_strings[0] = key1_string;
+    key_strings[1] = key2_string;
+    return bnet_key_decode_keys(keys, key_count, client_cookie, server_cookie,
+            key_strings, TRUE) == (guint) key_count;
+}
+
+/**
+ * Decodes count keys for SID_AUTH_CHECK into keys[], without allocating.
+ * Keys that don't decode get a length of 0. The key hashes are computed
+ * BNET_KEY_BATCH at a time with sha1_digest_many().
+ * Returns the number of keys that decoded.
+ *
+ * This skips the decoded key cache, so bulk checks of key pools don't
+ * push out the keys accounts log on with.
+ */
+guint bnet_key_decode_batch(BnetKey *keys, guint count,
+     guint32 client_cookie, guint32 server_cookie,
+     const char *const *key_strings)
+{
+    return bnet_key_decode_keys(keys, count, client_cookie, server_cookie,
+            key_strings, FALSE);
+}
+
+/**
+ * bnet_key_decode_batch(), optionally through the decoded key cache.
+ */
+static guint bnet_key_decode_keys(BnetKey *keys, guint count,
+     guint32 client_cookie, guint32 server_cookie,
+     const char *const *key_strings, gboolean use_cache)
+{
+    // hash input: client and server cookies, product, value1, then
+    // 0 and value2 (SC, W2/D2; broken SHA-1) or the 10-byte value2 (W3)
+    guint8 input[BNET_KEY_BATCH][BNET_KEY_HASH_INPUT_MAX];
+    const guint8 *data[2][BNET_KEY_BATCH];
+    guint32 lengths[2][BNET_KEY_BATCH];
+    BnetKey *owners[2][BNET_KEY_BATCH];
+    guint8 digests[BNET_KEY_BATCH * SHA1_HASH_SIZE];
+    guint decoded_count = 0;
+    guint start, i, k;
+
+    for (start = 0; start < count; start += BNET_KEY_BATCH) {
+        guint end = MIN(count, start + BNET_KEY_BATCH);
+        // [0] broken SHA-1 keys, [1] standard SHA-1 keys
+        guint batch[2] = { 0, 0 };
+
+        for (i = start; i < end; i++) {
+            BnetKey *key = &keys[i];
+            guint8 *in = input[i - start];
+            char cdkey[W3_KEYLEN + 1];
+            gsize length = bnet_key_normalize(key_strings[i], cdkey);
+            BnetDecodedKey decoded;
+            guint32 zero = 0;
+            int kind = (length == CDKEY_TYPE_W3) ? 1 : 0;
+
+            if (!use_cache || !bnet_key_cache_lookup(cdkey, &decoded)) {
+                bnet_key_decode_entry(cdkey, length, &decoded);
+                if (use_cache) {
+                    bnet_key_cache_store(&decoded);
+                }
+            }
+            bnet_key_zero(cdkey, sizeof(cdkey));
+
+            key->length = 0;
+            key->private_value = 0;
+            if (decoded.valid) {
+                key->length = length;
+                key->product_value = decoded.product;
+                key->public_value = decoded.value1;
+
+                memcpy(in, &client_cookie, 4);
+                memcpy(in + 4, &server_cookie, 4);
+                memcpy(in + 8, &decoded.product, 4);
+                memcpy(in + 12, &decoded.value1, 4);
+                if (kind == 0) {
+                    memcpy(in + 16, &zero, 4);
+                    memcpy(in + 20, &decoded.value2, 4);
+                } else {
+                    memcpy(in + 16, decoded.w3_value2, 10);
+                }
+                data[kind][batch[kind]] = in;
+                lengths[kind][batch[kind]] = (kind == 0) ? 24 : 26;
+                owners[kind][batch[kind]] = key;
+                batch[kind]++;
+                decoded_count++;
+            }
+            bnet_key_zero(&decoded, sizeof(decoded));
+        }
+
+        for (k = 0; k < 2; k++) {
+            sha1_digest_many((k == 0) ? SHA1_TYPE_BROKEN : SHA1_TYPE_NORMAL,
+                    batch[k], data[k], lengths[k], digests, 0);
+            for (i = 0; i < batch[k]; i++) {
+                memcpy(owners[k][i]->key_hash, digests + i * SHA1_HASH_SIZE, SHA1_HASH_SIZE);
+            }
+        }
+    }
+
+    bnet_key_zero(input, sizeof(input));
+    return decoded_count;
+}
+
 /**
  * Call this to decode one key for SID_CDKEY (JSTR ONLY).
  * Returns a boolean indicating success. Stores the key it verifies into key.
@@ -218,7 +676,7 @@ gboolean bnet_key_decode_legacy_verify_only(char *key,
     CDKeyDecoder *ctx;
     int i, j;
 
-    for (i = 0, j = 0; i < strlen(key1_string) && j < 13; i++) {
+    for (i = 0, j = 0; key1_string[i] != '\0' && j < 13; i++) {
         if (isalnum(key1_string[i])) {
             key1[j] = toupper(key1_string[i]);
             j++;
@@ -258,7 +716,7 @@ gboolean bnet_key_decode_legacy(BnetKey *key,
     CDKeyDecoder *ctx;
     int i, j;
 
-    for (i = 0, j = 0; i < strlen(key1_string) && j < 16; i++) {
+    for (i = 0, j = 0; key1_string[i] != '\0' && j < 16; i++) {
         if (isalnum(key1_string[i])) {
             key1[j] = toupper(key1_string[i]);
             j++;
@@ -606,288 +1064,43 @@ void CDKeyDecoder::swapChars(char* string, int a, int b) {
 
 gboolean process_sc(CDKeyDecoder *ctx)
 {
-    int accum, pos, i;
-    char temp;
-    int hashKey = 0x13AC9741;
-    char cdkey[14];
-    
-    strcpy(cdkey, ctx->cdkey);
-    
-    // Verification
-    accum = 3;
-    for (i = 0; i < (int) (ctx->keyLen - 1); i++) {
-        accum += ((tolower(cdkey[i]) - '0') ^ (accum * 2));
-    }
-    
-        if ((accum % 10) != (cdkey[12] - '0')) {
-#if DEBUG
-                bncsutil_debug_message_a("error: %s is not a valid StarCraft key", cdkey);
-#endif
+    guint32 product, value1, value2;
+
+    if (!bnet_key_decode_sc(ctx->cdkey, &product, &value1, &value2))
         return 0;
-        }
-    
-    // Shuffling
-    pos = 0x0B;
-    for (i = 0xC2; i >= 7; i -= 0x11) {
-        temp = cdkey[pos];
-        cdkey[pos] = cdkey[i % 0x0C];
-        cdkey[i % 0x0C] = temp;
-        pos--;
-    }
-    
-    // Final Value
-    for (i = (int) (ctx->keyLen - 2); i >= 0; i--) {
-        temp = toupper(cdkey[i]);
-        cdkey[i] = temp;
-        if (temp <= '7') {
-            cdkey[i] ^= (char) (hashKey & 7);
-            hashKey >>= 3;
-        } else if (temp < 'A') {
-            cdkey[i] ^= ((char) i & 1);
-        }
-    }
-    
-    // Final Calculations
-    sscanf(cdkey, "%2ld%7ld%3ld", (long int *)&ctx->product, (long int *)&ctx->value1, (long int *)&ctx->value2);
-    
+    ctx->product = product;
+    ctx->value1 = value1;
+    ctx->value2 = value2;
     return 1;
 }
 
 gboolean process_w2d2(CDKeyDecoder *ctx)
 {
-    unsigned long r, n, n2, v, v2, checksum;
-    int i, j;
-    unsigned char c1, c2, c;
-    char cdkey[17];
+    guint32 product, value1, value2;
 
-    strcpy(cdkey, ctx->cdkey);
-    
-    r = 1;
-    checksum = 0;
-    for (i = 0; i < 16; i += 2) {
-        c1 = w2Map[(int) cdkey[i]];
-        n = c1 * 3;
-        c2 = w2Map[(int) cdkey[i + 1]];
-        n = c2 + n * 8;
-        
-        if (n >= 0x100) {
-            n -= 0x100;
-            checksum |= r;
-        }
-        // !
-        n2 = n >> 4;
-        // !
-        cdkey[i] = getHexValue(n2);
-        cdkey[i + 1] = getHexValue(n);
-        r <<= 1;
-    }
-    
-    v = 3;
-    for (i = 0; i < 16; i++) {
-        c = cdkey[i];
-        n = getNumValue(c);
-        n2 = v * 2;
-        n ^= n2;
-        v += n;
-    }
-    v &= 0xFF;
-    
-    if (v != checksum) {
+    if (!bnet_key_decode_w2d2(ctx->cdkey, &product, &value1, &value2))
         return 0;
-    }
-    
-    n = 0;
-    for (j = 15; j >= 0; j--) {
-        c = cdkey[j];
-        if (j > 8) {
-            n = (j - 9);
-        } else {
-            n = (0xF - (8 - j));
-        }
-        n &= 0xF;
-        c2 = cdkey[n];
-        cdkey[j] = c2;
-        cdkey[n] = c;
-    }
-    v2 = 0x13AC9741;
-    for (j = 15; j >= 0; j--) {
-        c = toupper(cdkey[j]);
-        cdkey[j] = c;
-        if (c <= '7') {
-            v = v2;
-            c2 = (((char) (v & 0xFF)) & 7) ^ c;
-            v >>= 3;
-            cdkey[j] = (char) c2;
-            v2 = v;
-        } else if (c < 'A') {
-            cdkey[j] = (((char) j) & 1) ^ c;
-        }
-    }
-
-    // Final Calculations
-    sscanf(cdkey, "%2lx%6lx%8lx", (long int *)&ctx->product, (long int *)&ctx->value1, (long int *) &ctx->value2);
+    ctx->product = product;
+    ctx->value1 = value1;
+    ctx->value2 = value2;
     return 1;
 }
 
 gboolean process_w3(CDKeyDecoder *ctx)
 {
-    char table[W3_BUFLEN];
-    int values[4];
-    int a, b;
+    guint32 product, value1;
     int i;
-    char decode;
-    
-    a = 0;
-    b = 0x21;
-    
-    memset(table, 0, W3_BUFLEN);
-    memset(values, 0, (sizeof(int) * 4));
-    
+
     for (i = 0; ((unsigned int) i) < ctx->keyLen; i++) {
         ctx->cdkey[i] = toupper(ctx->cdkey[i]);
-        a = (b + 0x07B5) % W3_BUFLEN;
-        b = (a + 0x07B5) % W3_BUFLEN;
-        decode = w3KeyMap[(int)ctx->cdkey[i]];
-        table[a] = (decode / 5);
-        table[b] = (decode % 5);
-    }
-    
-    // Mult
-    i = W3_BUFLEN;
-    do {
-        mult(4, 5, values + 3, table[i - 1]);
-    } while (--i);
-    
-    decodeKeyTable(values);
-        
-        // 00 00 38 08 f0 64 18 6c 79 14 14 8E B9 49 1D BB
-        //          --------
-        //            val1
-
-        ctx->product = values[0] >> 0xA;
-        ctx->product = SWAP4(ctx->product);
-#if defined(BIGENDIAN) && BIGENDIAN
-#else
-        for (i = 0; i < 4; i++) {
-                values[i] = MSB4(values[i]);
-        }
-#endif
-
-        ctx->value1 = LSB4(*(guint32 *) (((char*) values) + 2)) & 0xFFFFFF03;
-        
-        ctx->w3value2 = g_malloc0(10);
-#if defined(BIGENDIAN) && BIGENDIAN
-        *((guint16 *) ctx->w3value2) = LSB2(*((guint16 *) (((char*) values) + 6)));
-        *((guint32 *) ((char*) ctx->w3value2 + 2)) = LSB4(*((guint32 *) (((char*) values) + 8)));
-        *((guint32 *) ((char*) ctx->w3value2 + 6)) = LSB4(*((guint32 *) (((char*) values) + 12)));
-#else
-        *((guint16 *) ctx->w3value2) = MSB2(*((guint16 *) (((char*) values) + 6)));
-        *((guint32 *) ((char*) ctx->w3value2 + 2)) = MSB4(*((guint32 *) (((char*) values) + 8)));
-        *((guint32 *) ((char*) ctx->w3value2 + 6)) = MSB4(*((guint32 *) (((char*) values) + 12)));
-#endif
-        return 1;
-}
-
-void mult(int r, const int x, int* a, int dcByte)
-{
-    while (r--) {
-        int64_t edxeax = ((int64_t) (*a & 0x00000000FFFFFFFFl))
-            * ((int64_t) (x & 0x00000000FFFFFFFFl));
-        *a-- = dcByte + (int32_t) edxeax;
-        dcByte = (int32_t) (edxeax >> 32);
     }
-}
 
-void decodeKeyTable(int* keyTable)
-{
-    unsigned int eax, ebx, ecx, edx, edi, esi, ebp;
-    unsigned int varC, var4, var8;
-    unsigned int copy[4];
-    unsigned char* scopy;
-    int* ckt;
-    int ckt_temp;
-    int i = 464;
-    var8 = 29;
-    
-    // pass 1
-    do {
-        int j;
-        esi = (var8 & 7) << 2;
-        var4 = var8 >> 3;
-        //varC = (keyTable[3 - var4] & (0xF << esi)) >> esi;
-        varC = keyTable[3 - var4];
-        varC &= (0xF << esi);
-        varC = varC >> esi;
-        
-        if (i < 464) {
-            for (j = 29; (unsigned int) j > var8; j--) {
-                /*
-                ecx = (j & 7) << 2;
-                ebp = (keyTable[0x3 - (j >> 3)] & (0xF << ecx)) >> ecx;
-                varC = w3TranslateMap[ebp ^ w3TranslateMap[varC + i] + i];
-                */
-                ecx = (j & 7) << 2;
-                //ebp = (keyTable[0x3 - (j >> 3)] & (0xF << ecx)) >> ecx;
-                ebp = (keyTable[0x3 - (j >> 3)]);
-                ebp &= (0xF << ecx);
-                ebp = ebp >> ecx;
-                varC = w3TranslateMap[ebp ^ (w3TranslateMap[varC + i] + i)];
-            }
-        }
-        
-        j = --var8;
-        while (j >= 0) {
-            ecx = (j & 7) << 2;
-            //ebp = (keyTable[0x3 - (j >> 3)] & (0xF << ecx)) >> ecx;
-            ebp = (keyTable[0x3 - (j >> 3)]);
-            ebp &= (0xF << ecx);
-            ebp = ebp >> ecx;
-            varC = w3TranslateMap[ebp ^ (w3TranslateMap[varC + i] + i)];
-            j--;
-        }
-        
-        j = 3 - var4;
-        ebx = (w3TranslateMap[varC + i] & 0xF) << esi;
-        keyTable[j] = (ebx | (~(0xF << esi) & ((int) keyTable[j])));
-    } while ((i -= 16) >= 0);
-    
-    // pass 2
-    eax = 0;
-    edx = 0;
-    ecx = 0;
-    edi = 0;
-    esi = 0;
-    ebp = 0;
-    
-    for (i = 0; i < 4; i++) {
-        copy[i] = LSB4(keyTable[i]);
-    }
-    scopy = (unsigned char*) copy;
-    
-    for (edi = 0; edi < 120; edi++) {
-        unsigned int location = 12;
-        eax = edi & 0x1F;
-        ecx = esi & 0x1F;
-        edx = 3 - (edi >> 5);
-        
-        location -= ((esi >> 5) << 2);
-        ebp = *(int*) (scopy + location);
-        ebp = LSB4(ebp);
-        
-        //ebp = (ebp & (1 << ecx)) >> ecx;
-        ebp &= (1 << ecx);
-        ebp = ebp >> ecx;
-        
-        //keyTable[edx] = ((ebp & 1) << eax) | (~(1 << eax) & keyTable[edx]);
-        ckt = (keyTable + edx);
-        ckt_temp = *ckt;
-        *ckt = ebp & 1;
-        *ckt = *ckt << eax;
-        *ckt |= (~(1 << eax) & ckt_temp);
-        esi += 0xB;
-        if (esi >= 120)
-            esi -= 120;
-    }
+    ctx->w3value2 = g_malloc0(10);
+    bnet_key_decode_w3(ctx->cdkey, &product, &value1, (guint8 *) ctx->w3value2);
+    // stored the way bnet_key_get_product() and bnet_key_get_val1() read them
+    ctx->product = MSB4(product);
+    ctx->value1 = MSB4(value1);
+    return 1;
 }
 
 char getHexValue(int v)
@@ -92,6 +92,16 @@
 
 #define DEBUG 0
 
+#define W3_KEYLEN 26
+#define W3_BUFLEN (W3_KEYLEN << 1)
+
+// keys decoded per group by bnet_key_decode_batch()
+#define BNET_KEY_BATCH 32
+// longest key hash input (W3)
+#define BNET_KEY_HASH_INPUT_MAX 26
+// decoded keys kept by bnet_key_decode(); half are dropped when it fills
+#define BNET_KEY_CACHE_MAX 1024
+
 typedef struct {
     guint32 length;
     guint32 product_value;
@@ -107,6 +117,20 @@ typedef enum {
     CDKEY_TYPE_UNKNOWN = 0
 } CDKeyType;
 
+/**
+ * A key's decoded values, which only depend on the key string; see
+ * bnet_key_cache_lookup().
+ */
+typedef struct {
+    char cdkey[W3_KEYLEN + 1];
+    gsize length;
+    gboolean valid;
+    guint32 product;
+    guint32 value1;
+    guint32 value2;
+    guint8 w3_value2[10];
+} BnetDecodedKey;
+
 /**
  * Decoder "context"
  */
@@ -127,6 +151,10 @@ typedef struct {
 gboolean bnet_key_decode(BnetKey keys[2], int key_count,
          guint32 client_cookie, guint32 server_cookie,
          const char *key1_string, const char *key2_string);
+guint bnet_key_decode_batch(BnetKey *keys, guint count,
+         guint32 client_cookie, guint32 server_cookie,
+         const char *const *key_strings);
+void bnet_key_cache_clear(void);
 gboolean bnet_key_decode_legacy_verify_only(char *key,
          guint32 client_cookie, guint32 server_cookie,
          const char *key1_string);
@@ -149,12 +177,8 @@ gsize bnet_key_get_hash(CDKeyDecoder *ctx, guint8* outputBuffer);
 gboolean process_sc(CDKeyDecoder *ctx);
 gboolean process_w2d2(CDKeyDecoder *ctx);
 gboolean process_w3(CDKeyDecoder *ctx);
-void mult(int r, const int x, int* a, int dcByte);
-void decodeKeyTable(int* keyTable);
 char getHexValue(int v);
 int getNumValue(char c);
 
-#define W3_KEYLEN 26
-#define W3_BUFLEN (W3_KEYLEN << 1)
 
 #endif
@@ -0,0 +1,281 @@
+/**
+ * pidgin-libbnet
+ * A Protocol Plugin for Pidgin, allowing emulation of a chat-only client
+ * connected to the Battle.net Service.
+ * Copyright (C) 2011-2012 Nate Book
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PACKETSTATS_C_
+#define _PACKETSTATS_C_
+
+#include "packetstats.h"
+
+#define BNET_PACKET_STATS_IDS 256
+
+static BnetPacketStats bnet_packet_stats[BNET_PACKET_STATS_PROTOCOLS][BNET_PACKET_STATS_DIRECTIONS][BNET_PACKET_STATS_IDS];
+// when counting started (first packet or last reset), 0 before that
+static time_t bnet_packet_stats_since = 0;
+
+static const gchar *bnet_packet_stats_protocol_names[BNET_PACKET_STATS_PROTOCOLS] = {
+    "BNCS", "BNLS", "Realm"
+};
+
+static const gchar *bnet_packet_stats_direction_names[BNET_PACKET_STATS_DIRECTIONS] = {
+    "S>C", "C>S"
+};
+
+static BnetPacketStats *
+bnet_packet_stats_slot(BnetPacketStatsProtocol protocol,
+        BnetPacketStatsDirection direction, guint8 id)
+{
+    if (bnet_packet_stats_since == 0) {
+        bnet_packet_stats_since = time(NULL);
+    }
+    return &bnet_packet_stats[protocol][direction][id];
+}
+
+void
+bnet_packet_stats_count(BnetPacketStatsProtocol protocol,
+        BnetPacketStatsDirection direction, guint8 id, gsize length)
+{
+    BnetPacketStats *stats = bnet_packet_stats_slot(protocol, direction, id);
+
+    stats->packets++;
+    stats->bytes += length;
+}
+
+// counts a received packet and the time its handler took since start
+void
+bnet_packet_stats_handled(BnetPacketStatsProtocol protocol, guint8 id,
+        gsize length, const GTimeVal *start)
+{
+    BnetPacketStats *stats = bnet_packet_stats_slot(protocol, BNET_PACKET_STATS_RECV, id);
+    GTimeVal now;
+    gint64 us;
+    guint bucket;
+
+    g_get_current_time(&now);
+    us = (gint64)(now.tv_sec - start->tv_sec) * G_USEC_PER_SEC + (now.tv_usec - start->tv_usec);
+    // the wall clock can step backwards
+    if (us < 0) {
+        us = 0;
+    } else if (us > G_MAXUINT32) {
+        us = G_MAXUINT32;
+    }
+
+    bucket = g_bit_storage((gulong)us) - 1;
+    if (bucket >= BNET_PACKET_STATS_BUCKETS) {
+        bucket = BNET_PACKET_STATS_BUCKETS - 1;
+    }
+
+    stats->packets++;
+    stats->bytes += length;
+    stats->handler_us += us;
+    if (us > stats->handler_max_us) {
+        stats->handler_max_us = (guint32)us;
+    }
+    stats->handler_hist[bucket]++;
+}
+
+const BnetPacketStats *
+bnet_packet_stats_get(BnetPacketStatsProtocol protocol,
+        BnetPacketStatsDirection direction, guint8 id)
+{
+    return &bnet_packet_stats[protocol][direction][id];
+}
+
+// upper bound in us of the bucket holding the given percentile of handler
+// times, never more than the slowest handler seen; 0 without samples
+guint32
+bnet_packet_stats_percentile(const BnetPacketStats *stats, guint percent)
+{
+    guint64 total = 0;
+    guint64 target;
+    guint64 seen = 0;
+    guint i;
+
+    for (i = 0; i < BNET_PACKET_STATS_BUCKETS; i++) {
+        total += stats->handler_hist[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    target = (total * percent + 99) / 100;
+    if (target == 0) {
+        target = 1;
+    }
+
+    for (i = 0; i < BNET_PACKET_STATS_BUCKETS - 1; i++) {
+        seen += stats->handler_hist[i];
+        if (seen >= target) {
+            return MIN((guint32)2 << i, stats->handler_max_us);
+        }
+    }
+    return stats->handler_max_us;
+}
+
+void
+bnet_packet_stats_reset(void)
+{
+    memset(bnet_packet_stats, 0, sizeof(bnet_packet_stats));
+    bnet_packet_stats_since = time(NULL);
+}
+
+static gboolean
+bnet_packet_stats_timed(const BnetPacketStats *stats)
+{
+    guint i;
+
+    for (i = 0; i < BNET_PACKET_STATS_BUCKETS; i++) {
+        if (stats->handler_hist[i] != 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// most handler time first, then most packets
+static gint
+bnet_packet_stats_compare(gconstpointer a, gconstpointer b)
+{
+    const BnetPacketStats *sa = *(const BnetPacketStats * const *)a;
+    const BnetPacketStats *sb = *(const BnetPacketStats * const *)b;
+
+    if (sa->handler_us != sb->handler_us) {
+        return (sa->handler_us > sb->handler_us) ? -1 : 1;
+    }
+    if (sa->packets != sb->packets) {
+        return (sa->packets > sb->packets) ? -1 : 1;
+    }
+    return (sa < sb) ? -1 : 1;
+}
+
+// writes "BNCS S>C 0x0f SID_CHATEVENT" for a slot of the table
+static void
+bnet_packet_stats_append_key(GString *out, const BnetPacketStats *stats,
+        BnetPacketStatsNameFunc name_func)
+{
+    gsize index = stats - &bnet_packet_stats[0][0][0];
+    guint8 id = index % BNET_PACKET_STATS_IDS;
+    guint direction = (index / BNET_PACKET_STATS_IDS) % BNET_PACKET_STATS_DIRECTIONS;
+    guint protocol = index / (BNET_PACKET_STATS_IDS * BNET_PACKET_STATS_DIRECTIONS);
+    const gchar *name = NULL;
+
+    if (name_func != NULL) {
+        name = name_func(protocol, id);
+    }
+
+    g_string_append_printf(out, "%-5s %-3s 0x%02x %-26s",
+            bnet_packet_stats_protocol_names[protocol],
+            bnet_packet_stats_direction_names[direction],
+            id, (name != NULL) ? name : "");
+}
+
+// a plain text table of every packet seen, most expensive handlers first;
+// with histograms set, the handler time histograms follow the table
+gchar *
+bnet_packet_stats_report(BnetPacketStatsNameFunc name_func, gboolean histograms)
+{
+    GString *out = g_string_new(NULL);
+    GPtrArray *rows = g_ptr_array_new();
+    const BnetPacketStats *first = &bnet_packet_stats[0][0][0];
+    gsize count = sizeof(bnet_packet_stats) / sizeof(BnetPacketStats);
+    gsize i;
+
+    for (i = 0; i < count; i++) {
+        if (first[i].packets != 0) {
+            g_ptr_array_add(rows, (gpointer)&first[i]);
+        }
+    }
+    g_ptr_array_sort(rows, bnet_packet_stats_compare);
+
+    if (bnet_packet_stats_since != 0) {
+        gchar since[64];
+        time_t now = time(NULL);
+
+        strftime(since, sizeof(since), "%Y-%m-%d %H:%M:%S", localtime(&bnet_packet_stats_since));
+        g_string_append_printf(out, "Packets for all accounts since %s (%ld s)\n\n",
+                since, (long)(now - bnet_packet_stats_since));
+    }
+
+    if (rows->len == 0) {
+        g_string_append(out, "No packets yet.\n");
+    } else {
+        g_string_append_printf(out, "%-5s %-3s %-4s %-26s %10s %12s %11s %8s %8s %8s %8s\n",
+                "proto", "dir", "id", "name", "packets", "bytes",
+                "handler ms", "avg us", "p50 us", "p99 us", "max us");
+    }
+
+    for (i = 0; i < rows->len; i++) {
+        const BnetPacketStats *stats = g_ptr_array_index(rows, i);
+
+        bnet_packet_stats_append_key(out, stats, name_func);
+        g_string_append_printf(out, " %10" G_GUINT64_FORMAT " %12" G_GUINT64_FORMAT,
+                stats->packets, stats->bytes);
+        if (bnet_packet_stats_timed(stats)) {
+            g_string_append_printf(out, " %11.1f %8" G_GUINT64_FORMAT " %8u %8u %8u",
+                    stats->handler_us / 1000.0, stats->handler_us / stats->packets,
+                    bnet_packet_stats_percentile(stats, 50),
+                    bnet_packet_stats_percentile(stats, 99),
+                    stats->handler_max_us);
+        }
+        g_string_append_c(out, '\n');
+    }
+
+    if (histograms && rows->len != 0) {
+        g_string_append(out, "\nHandler time histograms (bucket upper bound in us: packets)\n");
+        for (i = 0; i < rows->len; i++) {
+            const BnetPacketStats *stats = g_ptr_array_index(rows, i);
+            guint b;
+
+            if (!bnet_packet_stats_timed(stats)) {
+                continue;
+            }
+
+            bnet_packet_stats_append_key(out, stats, name_func);
+            for (b = 0; b < BNET_PACKET_STATS_BUCKETS; b++) {
+                if (stats->handler_hist[b] == 0) {
+                    continue;
+                }
+                if (b == BNET_PACKET_STATS_BUCKETS - 1) {
+                    g_string_append_printf(out, " >=%u:%u", 1U << b, stats->handler_hist[b]);
+                } else {
+                    g_string_append_printf(out, " <%u:%u", 2U << b, stats->handler_hist[b]);
+                }
+            }
+            g_string_append_c(out, '\n');
+        }
+    }
+
+    g_ptr_array_free(rows, TRUE);
+
+    return g_string_free(out, FALSE);
+}
+
+// dumps the report with histograms to path
+gboolean
+bnet_packet_stats_write(const gchar *path, BnetPacketStatsNameFunc name_func)
+{
+    gchar *report = bnet_packet_stats_report(name_func, TRUE);
+    gboolean ok = g_file_set_contents(path, report, -1, NULL);
+
+    g_free(report);
+
+    return ok;
+}
+
+#endif
@@ -0,0 +1,85 @@
+/**
+ * pidgin-libbnet
+ * A Protocol Plugin for Pidgin, allowing emulation of a chat-only client
+ * connected to the Battle.net Service.
+ * Copyright (C) 2011-2012 Nate Book
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PACKETSTATS_H_
+#define _PACKETSTATS_H_
+
+// libraries
+#include <glib.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Process-wide packet statistics, kept per (protocol, direction, packet ID)
+ * for every account. Received packets also record how long their handler
+ * ran, as wall time in a log2 histogram of microseconds: bucket 0 holds
+ * handlers under 2 us, bucket i holds [2^i, 2^(i+1)) us, and the last bucket
+ * is open-ended.
+ *
+ * Only used from the main loop.
+ */
+
+// 2^23 us is about 8 seconds
+#define BNET_PACKET_STATS_BUCKETS 24
+
+typedef enum {
+    BNET_PACKET_STATS_BNCS = 0,
+    BNET_PACKET_STATS_BNLS,
+    BNET_PACKET_STATS_D2MCP,
+} BnetPacketStatsProtocol;
+
+#define BNET_PACKET_STATS_PROTOCOLS 3
+
+typedef enum {
+    // S>C
+    BNET_PACKET_STATS_RECV = 0,
+    // C>S
+    BNET_PACKET_STATS_SEND,
+} BnetPacketStatsDirection;
+
+#define BNET_PACKET_STATS_DIRECTIONS 2
+
+typedef struct {
+    guint64 packets;
+    guint64 bytes;
+    // received packets only
+    guint64 handler_us;
+    guint32 handler_max_us;
+    guint32 handler_hist[BNET_PACKET_STATS_BUCKETS];
+} BnetPacketStats;
+
+// names a packet ID for the report, or returns NULL if it is unknown
+typedef const gchar *(*BnetPacketStatsNameFunc)(BnetPacketStatsProtocol protocol, guint8 id);
+
+void bnet_packet_stats_count(BnetPacketStatsProtocol protocol,
+        BnetPacketStatsDirection direction, guint8 id, gsize length);
+void bnet_packet_stats_handled(BnetPacketStatsProtocol protocol, guint8 id,
+        gsize length, const GTimeVal *start);
+const BnetPacketStats *bnet_packet_stats_get(BnetPacketStatsProtocol protocol,
+        BnetPacketStatsDirection direction, guint8 id);
+guint32 bnet_packet_stats_percentile(const BnetPacketStats *stats, guint percent);
+void bnet_packet_stats_reset(void);
+
+gchar *bnet_packet_stats_report(BnetPacketStatsNameFunc name_func, gboolean histograms);
+gboolean bnet_packet_stats_write(const gchar *path, BnetPacketStatsNameFunc name_func);
+
+#endif
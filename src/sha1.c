@@ -59,6 +59,8 @@
 #ifndef _SHA1_C_
 #define _SHA1_C_
  
+#include <string.h>
+
 #include "sha1.h"
 
 #define SHA1RoL(bits, word) \
@@ -79,10 +81,79 @@
 #define xSHA1itoba(a, ba, i) \
   (ba[i+3] = (guint8)(a >> 24)); (ba[i+2] = (guint8)(a >> 16)); (ba[i+1] = (guint8)(a >> 8)); (ba[i] = (guint8)a);
 
+/*
+ * The broken SHA-1 of the Old Logon System swaps the operands of the
+ * schedule's rotate: it rotates 1 left by the expanded word. This is
+ * what the x86 rotate the original was built with gives.
+ */
+#define xSHA1Expand(word) \
+    (1U << ((word) & 31))
+
+/* SHA-NI and SSSE3 are only tried with a compiler that can target them */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SHA1_HAVE_SHANI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 /* Local Function Prototyptes */
 static void sha1_pad_message(sha1_context *);
 static void sha1_process_message_block(sha1_context *);
-static guint32 sha1_math(guint16 t, guint32 B, guint32 C, guint32 D);
+static void sha1_block_normal(guint32 *hash, const guint8 *block);
+static void sha1_block_broken(guint32 *hash, const guint8 *block);
+static void sha1_block_lockdown(guint32 *hash, const guint8 *block);
+#ifdef SHA1_HAVE_SHANI
+static void sha1_cpu_features(void);
+static gboolean sha1_cpu_has_shani(void);
+static void sha1_block_shani(guint32 *hash, const guint8 *block, gboolean swap_bytes);
+static void sha1_block_normal_shani(guint32 *hash, const guint8 *block);
+static void sha1_block_lockdown_shani(guint32 *hash, const guint8 *block);
+#endif
+
+/* Kernels for each sha1_type, picked once by sha1_select_kernels() */
+static void (*sha1_kernels[3])(guint32 *, const guint8 *) = {
+    sha1_block_normal, sha1_block_broken, sha1_block_lockdown
+};
+static gsize sha1_kernels_ready = 0;
+static void sha1_select_kernels(void);
+
+/*
+ * Multi-buffer kernels: one block for each of lanes messages. state holds
+ * word w of lane l at state[w * SHA1_MAX_LANES + l]; lanes whose active
+ * entry is 0 are left untouched.
+ */
+typedef void (*sha1_mb_kernel)(guint32 *state, const guint8 *const *blocks,
+        const guint32 *active, sha1_type version);
+
+/* A message being hashed in one lane of sha1_digest_many */
+typedef struct {
+    guint index;                    /* Which message                    */
+    const guint8 *data;
+    guint32 full_blocks;            /* Blocks read straight from data   */
+    guint32 blocks;                 /* All blocks, padding included     */
+    guint32 next;                   /* Next block to hash               */
+    guint8 tail[128];               /* The padded end of the message    */
+} sha1_mb_lane;
+
+/* Widest multi-buffer kernel, set by sha1_select_kernels() */
+static guint sha1_mb_lanes = 1;
+static void sha1_mb_lane_start(sha1_mb_lane *lane, sha1_type version, guint index,
+        const guint8 *data, guint32 length);
+static void sha1_mb_lane_digest(const guint32 *state, guint l, sha1_type version,
+        guint8 *digest);
+#ifdef SHA1_HAVE_SHANI
+static gboolean sha1_cpu_shani = FALSE;
+static gboolean sha1_cpu_sse2 = FALSE;
+static gboolean sha1_cpu_avx2 = FALSE;
+static gboolean sha1_cpu_avx512 = FALSE;
+static void sha1_mb_kernel_4(guint32 *state, const guint8 *const *blocks,
+        const guint32 *active, sha1_type version);
+static void sha1_mb_kernel_8(guint32 *state, const guint8 *const *blocks,
+        const guint32 *active, sha1_type version);
+static void sha1_mb_kernel_16(guint32 *state, const guint8 *const *blocks,
+        const guint32 *active, sha1_type version);
+#endif
 
 /*
  *  SHA1Reset
@@ -100,9 +171,16 @@ static guint32 sha1_math(guint16 t, guint32 B, guint32 C, guint32 D);
  *
  */
 sha1_result sha1_reset(sha1_context *ctx){
-    guint8 x;
     if (!ctx)
         return SHA1_RESULT_NULL;
+
+    if (g_once_init_enter(&sha1_kernels_ready)) {
+        sha1_select_kernels();
+        g_once_init_leave(&sha1_kernels_ready, 1);
+    }
+    if (ctx->version > SHA1_TYPE_LOCKDOWN)
+        ctx->version = SHA1_TYPE_NORMAL;
+    ctx->process_block = sha1_kernels[ctx->version];
   
     ctx->length_low           = 0;
     ctx->length_high          = 0;
@@ -114,9 +192,7 @@ sha1_result sha1_reset(sha1_context *ctx){
     ctx->intermediate_hash[3] = 0x10325476;
     ctx->intermediate_hash[4] = 0xC3D2E1F0;
 
-    for (x = 0; x < 64; x++) {
-        ctx->message_block[x] = 0;
-    }
+    memset(ctx->message_block, 0, 64);
     ctx->computed  = 0;
     ctx->corrupted = 0;
 
@@ -193,7 +269,8 @@ sha1_result sha1_digest(sha1_context *ctx, guint8 *digest){
  *
  */
 sha1_result sha1_input(sha1_context *ctx, const guint8 *data, guint32 length){
-    guint32 x;
+    guint32 n;
+    guint32 old_low;
     if(!length)
         return SHA1_RESULT_SUCCESS;
   
@@ -205,44 +282,44 @@ sha1_result sha1_input(sha1_context *ctx, const guint8 *data, guint32 length){
         return SHA1_RESULT_STATE_ERROR;
     }
 
-    for(x = 0; x < length; x++){
-        ctx->message_block[ctx->message_block_index++] = (data[x] & 0xFF);
-        ctx->length_low += 8;
+    while(length > 0){
+        /* whole blocks go straight from the caller's buffer */
+        if (ctx->message_block_index == 0 && length >= 64){
+            ctx->process_block(ctx->intermediate_hash, data);
+            n = 64;
+        } else {
+            n = 64 - ctx->message_block_index;
+            if (n > length)
+                n = length;
+            memcpy(ctx->message_block + ctx->message_block_index, data, n);
+            ctx->message_block_index += n;
+            if (ctx->message_block_index == 64)
+                sha1_process_message_block(ctx);
+        }
+        data += n;
+        length -= n;
 
-        if (ctx->length_low == 0){
+        old_low = ctx->length_low;
+        ctx->length_low += n << 3;
+        if (ctx->length_low < old_low){
             ctx->length_high++;
             if(ctx->length_high == 0){
                 ctx->corrupted = SHA1_RESULT_INPUT_TOO_LONG;
                 return SHA1_RESULT_INPUT_TOO_LONG;
             }
         }
-
-        if (ctx->message_block_index == 64)
-            sha1_process_message_block(ctx);
     }
 
     return SHA1_RESULT_SUCCESS;
 }
 
-/*
- * SHA1Math
- *
- * Description:
- *   This is simply so I can have a clean way of 
- * doing the Process in one loop insted of 4.
- */
-static guint32 sha1_math(guint16 t, guint32 B, guint32 C, guint32 D){
-    if(t < 20)      return ((B & C) | ((~B) & D));
-    else if(t < 40) return (B ^ C ^ D);
-    else if(t < 60) return ((B & C) | (B & D) | (C & D));
-    else            return (B ^ C ^ D);
-}
 /*
  *  SHA1ProcessMessageBlock
  *
  *  Description:
  *    This function will process the next 512 bits of the message
- *    stored in the Message_Block array.
+ *    stored in the Message_Block array, with the kernel sha1_reset
+ *    picked for the context's version.
  *
  *  Parameters:
  *    None.
@@ -250,57 +327,512 @@ static guint32 sha1_math(guint16 t, guint32 B, guint32 C, guint32 D){
  *  Returns:
  *    Nothing.
  *
- *  Comments:
- *    Many of the variable names in this code, especially the
- *    single character names, were used because those were the
- *    names used in the publication.
+ */
+static void sha1_process_message_block(sha1_context *ctx){
+    ctx->process_block(ctx->intermediate_hash, ctx->message_block);
+    ctx->message_block_index = 0;
+}
+
+/*
+ *  Round functions. F1 is (B & C) | (~B & D) and F3 is the majority of
+ *  B, C and D, both in fewer operations.
+ */
+#define SHA1F1(b, c, d) ((d) ^ ((b) & ((c) ^ (d))))
+#define SHA1F2(b, c, d) ((b) ^ (c) ^ (d))
+#define SHA1F3(b, c, d) (((b) & (c)) | ((d) & ((b) | (c))))
+
+/*
+ *  One round, with the working variables renamed instead of shifted:
+ *  the new A lands in e, and the next round is called as (e, a, b, c, d).
+ */
+#define SHA1Round(a, b, c, d, e, F, K, t) \
+    e += SHA1RoL(5, a) + F(b, c, d) + K + W[t]; \
+    b = SHA1RoL(30, b);
+
+#define SHA1Rounds5(F, K, t) \
+    SHA1Round(A, B, C, D, E, F, K, t) \
+    SHA1Round(E, A, B, C, D, F, K, t + 1) \
+    SHA1Round(D, E, A, B, C, F, K, t + 2) \
+    SHA1Round(C, D, E, A, B, F, K, t + 3) \
+    SHA1Round(B, C, D, E, A, F, K, t + 4)
+
+#define SHA1Rounds20(F, K, t) \
+    SHA1Rounds5(F, K, t) \
+    SHA1Rounds5(F, K, t + 5) \
+    SHA1Rounds5(F, K, t + 10) \
+    SHA1Rounds5(F, K, t + 15)
+
+/*
+ *  The 80 rounds over W[], added into hash. Shared by the kernels,
+ *  which only differ in how they build W[].
+ */
+#define SHA1Compress(hash) { \
+    guint32 A = hash[0], B = hash[1], C = hash[2], D = hash[3], E = hash[4]; \
+    SHA1Rounds20(SHA1F1, 0x5A827999, 0) \
+    SHA1Rounds20(SHA1F2, 0x6ED9EBA1, 20) \
+    SHA1Rounds20(SHA1F3, 0x8F1BBCDC, 40) \
+    SHA1Rounds20(SHA1F2, 0xCA62C1D6, 60) \
+    hash[0] += A; \
+    hash[1] += B; \
+    hash[2] += C; \
+    hash[3] += D; \
+    hash[4] += E; \
+}
+
+/* SHA1_TYPE_NORMAL: big-endian words, standard schedule */
+static void sha1_block_normal(guint32 *hash, const guint8 *block){
+    guint32 W[80];
+    int t;
+
+    for(t = 0; t < 16; t++)  W[t] = SHA1batoi(block, t * 4);
+    for(t = 16; t < 80; t++) W[t] = SHA1RoL(1, W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
+
+    SHA1Compress(hash)
+}
+
+/* SHA1_TYPE_BROKEN: little-endian words, broken schedule */
+static void sha1_block_broken(guint32 *hash, const guint8 *block){
+    guint32 W[80];
+    int t;
+
+    for(t = 0; t < 16; t++)  W[t] = xSHA1batoi(block, t * 4);
+    for(t = 16; t < 80; t++) W[t] = xSHA1Expand(W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
+
+    SHA1Compress(hash)
+}
+
+/* SHA1_TYPE_LOCKDOWN: little-endian words, standard schedule */
+static void sha1_block_lockdown(guint32 *hash, const guint8 *block){
+    guint32 W[80];
+    int t;
+
+    for(t = 0; t < 16; t++)  W[t] = xSHA1batoi(block, t * 4);
+    for(t = 16; t < 80; t++) W[t] = SHA1RoL(1, W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
+
+    SHA1Compress(hash)
+}
+
+/*
+ *  SHA1SelectKernels
  *
+ *  Description:
+ *    Swaps in the SHA-NI kernels for the versions with the standard
+ *    schedule when the CPU has the SHA extensions (which come with
+ *    SSSE3 and SSE4.1). The broken schedule has no hardware form.
+ */
+static void sha1_select_kernels(void){
+#ifdef SHA1_HAVE_SHANI
+    if (sha1_cpu_has_shani()) {
+        sha1_cpu_shani = TRUE;
+        sha1_kernels[SHA1_TYPE_NORMAL] = sha1_block_normal_shani;
+        sha1_kernels[SHA1_TYPE_LOCKDOWN] = sha1_block_lockdown_shani;
+    }
+    sha1_cpu_features();
+    if (sha1_cpu_avx512)
+        sha1_mb_lanes = 16;
+    else if (sha1_cpu_avx2)
+        sha1_mb_lanes = 8;
+    else if (sha1_cpu_sse2)
+        sha1_mb_lanes = 4;
+#endif
+}
+
+#ifdef SHA1_HAVE_SHANI
+/* The AVX registers also need saving by the OS, which XGETBV reports */
+static void sha1_cpu_features(void){
+    unsigned int eax, ebx, ecx, edx;
+    unsigned int xcr0 = 0, xcr0_high;
+
+    if (__get_cpuid_max(0, NULL) < 1)
+        return;
+    __cpuid(1, eax, ebx, ecx, edx);
+    sha1_cpu_sse2 = (edx & (1 << 26)) != 0;
+    /* OSXSAVE, AVX */
+    if (!(ecx & (1 << 27)) || !(ecx & (1 << 28)))
+        return;
+    __asm__ __volatile__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0_high) : "c" (0));
+    if (__get_cpuid_max(0, NULL) < 7)
+        return;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    /* XMM and YMM state; AVX2 */
+    sha1_cpu_avx2 = (xcr0 & 0x06) == 0x06 && (ebx & (1 << 5));
+    /* opmask and ZMM state too; AVX-512F */
+    sha1_cpu_avx512 = (xcr0 & 0xE6) == 0xE6 && (ebx & (1 << 16));
+}
+
+static gboolean sha1_cpu_has_shani(void){
+    unsigned int eax, ebx, ecx, edx;
+
+    if (__get_cpuid_max(0, NULL) < 7)
+        return FALSE;
+    __cpuid(1, eax, ebx, ecx, edx);
+    /* SSSE3, SSE4.1 */
+    if (!(ecx & (1 << 9)) || !(ecx & (1 << 19)))
+        return FALSE;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    /* SHA */
+    return (ebx & (1 << 29)) != 0;
+}
+
+/*
+ *  SHA1BlockSHANI
  *
+ *  Description:
+ *    One block with the x86 SHA extensions. The instructions want W[0]
+ *    in the top lane, so the loaded words are reversed, and with
+ *    swap_bytes each word is also byte-swapped (big-endian input).
  */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha1_block_shani(guint32 *hash, const guint8 *block, gboolean swap_bytes){
+    __m128i ABCD, ABCD_SAVE, E0, E0_SAVE, E1;
+    __m128i MSG0, MSG1, MSG2, MSG3;
+    const __m128i MASK = swap_bytes ?
+        _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL) :
+        _mm_set_epi64x(0x0302010007060504ULL, 0x0b0a09080f0e0d0cULL);
+
+    ABCD = _mm_loadu_si128((const __m128i *) hash);
+    E0 = _mm_set_epi32((int) hash[4], 0, 0, 0);
+    ABCD = _mm_shuffle_epi32(ABCD, 0x1B);
+    ABCD_SAVE = ABCD;
+    E0_SAVE = E0;
+
+    /* Rounds 0-3 */
+    MSG0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (block + 0)), MASK);
+    E0 = _mm_add_epi32(E0, MSG0);
+    E1 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+
+    /* Rounds 4-7 */
+    MSG1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (block + 16)), MASK);
+    E1 = _mm_sha1nexte_epu32(E1, MSG1);
+    E0 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 0);
+    MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+
+    /* Rounds 8-11 */
+    MSG2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (block + 32)), MASK);
+    E0 = _mm_sha1nexte_epu32(E0, MSG2);
+    E1 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+    MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+    MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+    /* Rounds 12-15 */
+    MSG3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (block + 48)), MASK);
+    E1 = _mm_sha1nexte_epu32(E1, MSG3);
+    E0 = ABCD;
+    MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 0);
+    MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+    MSG1 = _mm_xor_si128(MSG1, MSG3);
 
+/*
+ *  Four rounds from the middle of the schedule: finish the words for
+ *  the next group (M1), start the ones after (M3), and fold in M0.
+ */
+#define SHA1NIRounds4(Ea, Eb, M0, M1, M2, M3, F) \
+    Ea = _mm_sha1nexte_epu32(Ea, M0); \
+    Eb = ABCD; \
+    M1 = _mm_sha1msg2_epu32(M1, M0); \
+    ABCD = _mm_sha1rnds4_epu32(ABCD, Ea, F); \
+    M3 = _mm_sha1msg1_epu32(M3, M0); \
+    M2 = _mm_xor_si128(M2, M0);
+
+    SHA1NIRounds4(E0, E1, MSG0, MSG1, MSG2, MSG3, 0) /* 16-19 */
+    SHA1NIRounds4(E1, E0, MSG1, MSG2, MSG3, MSG0, 1) /* 20-23 */
+    SHA1NIRounds4(E0, E1, MSG2, MSG3, MSG0, MSG1, 1) /* 24-27 */
+    SHA1NIRounds4(E1, E0, MSG3, MSG0, MSG1, MSG2, 1) /* 28-31 */
+    SHA1NIRounds4(E0, E1, MSG0, MSG1, MSG2, MSG3, 1) /* 32-35 */
+    SHA1NIRounds4(E1, E0, MSG1, MSG2, MSG3, MSG0, 1) /* 36-39 */
+    SHA1NIRounds4(E0, E1, MSG2, MSG3, MSG0, MSG1, 2) /* 40-43 */
+    SHA1NIRounds4(E1, E0, MSG3, MSG0, MSG1, MSG2, 2) /* 44-47 */
+    SHA1NIRounds4(E0, E1, MSG0, MSG1, MSG2, MSG3, 2) /* 48-51 */
+    SHA1NIRounds4(E1, E0, MSG1, MSG2, MSG3, MSG0, 2) /* 52-55 */
+    SHA1NIRounds4(E0, E1, MSG2, MSG3, MSG0, MSG1, 2) /* 56-59 */
+    SHA1NIRounds4(E1, E0, MSG3, MSG0, MSG1, MSG2, 3) /* 60-63 */
+    SHA1NIRounds4(E0, E1, MSG0, MSG1, MSG2, MSG3, 3) /* 64-67 */
+#undef SHA1NIRounds4
+
+    /* Rounds 68-71 */
+    E1 = _mm_sha1nexte_epu32(E1, MSG1);
+    E0 = ABCD;
+    MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 3);
+    MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+    /* Rounds 72-75 */
+    E0 = _mm_sha1nexte_epu32(E0, MSG2);
+    E1 = ABCD;
+    MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 3);
+
+    /* Rounds 76-79 */
+    E1 = _mm_sha1nexte_epu32(E1, MSG3);
+    E0 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 3);
+
+    E0 = _mm_sha1nexte_epu32(E0, E0_SAVE);
+    ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+
+    ABCD = _mm_shuffle_epi32(ABCD, 0x1B);
+    _mm_storeu_si128((__m128i *) hash, ABCD);
+    hash[4] = (guint32) _mm_extract_epi32(E0, 3);
+}
 
-static void sha1_process_message_block(sha1_context *ctx){
-    guint16 t;             /* Loop counter        */
-    guint32 temp;          /* Temporary word value*/
-    guint32 W[80];         /* Word sequence       */
-    guint32 A, B, C, D, E; /* Word buffers        */
-    const guint32 K[] = {0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6};
-  
-    if(ctx->version == SHA1_TYPE_BROKEN){
-        for(t = 0; t < 16; t++)  W[t] = xSHA1batoi(ctx->message_block, t * 4);
-        for(t = 16; t < 80; t++) W[t] = xSHA1RoL(1, W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
-    }else if(ctx->version == SHA1_TYPE_LOCKDOWN){
-        for(t = 0; t < 16; t++)  W[t] = xSHA1batoi(ctx->message_block, t * 4);
-        for(t = 16; t < 80; t++) W[t] = SHA1RoL(1, W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
-    }else{
-        for(t = 0; t < 16; t++)  W[t] = SHA1batoi(ctx->message_block, t * 4);
-        for(t = 16; t < 80; t++) W[t] = SHA1RoL(1, W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
+static void sha1_block_normal_shani(guint32 *hash, const guint8 *block){
+    sha1_block_shani(hash, block, TRUE);
+}
+
+static void sha1_block_lockdown_shani(guint32 *hash, const guint8 *block){
+    sha1_block_shani(hash, block, FALSE);
+}
+#endif
+
+#ifdef SHA1_HAVE_SHANI
+/*
+ *  SHA1MBKernel
+ *
+ *  Description:
+ *    Defines a multi-buffer kernel over GCC vectors of lanes words,
+ *    compiled for isa. The round macros are the scalar ones; each
+ *    operation just works on a whole vector. Each lane reads a different
+ *    message, so the words are transposed through X on the way in.
+ */
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define SHA1LoadBE(word) __builtin_bswap32(word)
+#define SHA1LoadLE(word) (word)
+#else
+#define SHA1LoadBE(word) (word)
+#define SHA1LoadLE(word) __builtin_bswap32(word)
+#endif
+
+#define SHA1MBKernel(name, lanes, isa) \
+__attribute__((target(isa))) \
+static void name(guint32 *state, const guint8 *const *blocks, \
+        const guint32 *active, sha1_type version){ \
+    typedef guint32 vec __attribute__((vector_size(lanes * 4))); \
+    vec W[80], H[5], mask; \
+    guint32 X[16][lanes]; \
+    int t, l, w; \
+    for (w = 0; w < 5; w++) \
+        memcpy(&H[w], state + w * SHA1_MAX_LANES, sizeof(vec)); \
+    memcpy(&mask, active, sizeof(vec)); \
+    for (l = 0; l < lanes; l++) { \
+        guint32 words[16]; \
+        memcpy(words, blocks[l], 64); \
+        for (t = 0; t < 16; t++) \
+            X[t][l] = (version == SHA1_TYPE_NORMAL) ? SHA1LoadBE(words[t]) : SHA1LoadLE(words[t]); \
+    } \
+    memcpy(W, X, sizeof(X)); \
+    if (version == SHA1_TYPE_BROKEN) { \
+        for (t = 16; t < 80; t++) \
+            W[t] = xSHA1Expand(W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]); \
+    } else { \
+        for (t = 16; t < 80; t++) \
+            W[t] = SHA1RoL(1, W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]); \
+    } \
+    { \
+        vec A = H[0], B = H[1], C = H[2], D = H[3], E = H[4]; \
+        SHA1Rounds20(SHA1F1, 0x5A827999, 0) \
+        SHA1Rounds20(SHA1F2, 0x6ED9EBA1, 20) \
+        SHA1Rounds20(SHA1F3, 0x8F1BBCDC, 40) \
+        SHA1Rounds20(SHA1F2, 0xCA62C1D6, 60) \
+        H[0] += A & mask; \
+        H[1] += B & mask; \
+        H[2] += C & mask; \
+        H[3] += D & mask; \
+        H[4] += E & mask; \
+    } \
+    for (w = 0; w < 5; w++) \
+        memcpy(state + w * SHA1_MAX_LANES, &H[w], sizeof(vec)); \
+}
+
+SHA1MBKernel(sha1_mb_kernel_4, 4, "sse2")
+SHA1MBKernel(sha1_mb_kernel_8, 8, "avx2")
+SHA1MBKernel(sha1_mb_kernel_16, 16, "avx512f")
+#endif
+
+guint sha1_max_lanes(void){
+    if (g_once_init_enter(&sha1_kernels_ready)) {
+        sha1_select_kernels();
+        g_once_init_leave(&sha1_kernels_ready, 1);
     }
-  
-    A = ctx->intermediate_hash[0];
-    B = ctx->intermediate_hash[1];
-    C = ctx->intermediate_hash[2];
-    D = ctx->intermediate_hash[3];
-    E = ctx->intermediate_hash[4];
-  
-    for(t = 0; t < 80; t++){
-        temp = SHA1RoL(5,A) + sha1_math(t, B, C, D) + E + W[t] + K[t / 20];
-        E = D;
-        D = C;
-        C = SHA1RoL(30,B);
-        B = A;
-        A = temp;
+    return sha1_mb_lanes;
+}
+
+/*
+ *  SHA1SetSHANI
+ *
+ *  Description:
+ *    Turns the SHA-NI kernels off, or back on where the CPU has them,
+ *    so tests and benchmarks can hold them against the portable code.
+ *    Nothing may be hashing on another thread meanwhile. Returns
+ *    whether SHA-NI is in use now.
+ */
+gboolean sha1_set_shani(gboolean enabled){
+    sha1_max_lanes();
+#ifdef SHA1_HAVE_SHANI
+    if (!sha1_cpu_has_shani())
+        enabled = FALSE;
+    sha1_cpu_shani = enabled;
+    sha1_kernels[SHA1_TYPE_NORMAL] = enabled ? sha1_block_normal_shani : sha1_block_normal;
+    sha1_kernels[SHA1_TYPE_LOCKDOWN] = enabled ? sha1_block_lockdown_shani : sha1_block_lockdown;
+    return enabled;
+#else
+    return FALSE;
+#endif
+}
+
+/*
+ *  SHA1MBLaneStart
+ *
+ *  Description:
+ *    Sets a lane up for a message: whole blocks are read from the
+ *    message itself, and the rest plus the version's padding (see
+ *    sha1_pad_message) goes into the lane's tail.
+ */
+static void sha1_mb_lane_start(sha1_mb_lane *lane, sha1_type version, guint index,
+        const guint8 *data, guint32 length){
+    guint32 rest = length % 64;
+    guint32 length_high = length >> 29;
+    guint32 length_low = length << 3;
+
+    lane->index = index;
+    lane->data = data;
+    lane->full_blocks = length / 64;
+    lane->next = 0;
+    memset(lane->tail, 0, sizeof(lane->tail));
+    memcpy(lane->tail, data + lane->full_blocks * 64, rest);
+
+    if (version == SHA1_TYPE_BROKEN) {
+        /* zero padding only, always one more block */
+        lane->blocks = lane->full_blocks + 1;
+        return;
     }
-  
-    ctx->intermediate_hash[0] += A;
-    ctx->intermediate_hash[1] += B;
-    ctx->intermediate_hash[2] += C;
-    ctx->intermediate_hash[3] += D;
-    ctx->intermediate_hash[4] += E;
 
-    ctx->message_block_index = 0;
+    lane->tail[rest] = 0x80;
+    lane->blocks = lane->full_blocks + (rest > 55 ? 2 : 1);
+    if (version == SHA1_TYPE_LOCKDOWN) {
+        guint8 *end = lane->tail + (rest > 55 ? 64 : 0);
+        xSHA1itoba(length_high, end, 60);
+        xSHA1itoba(length_low, end, 56);
+    } else {
+        guint8 *end = lane->tail + (rest > 55 ? 64 : 0);
+        SHA1itoba(length_high, end, 56);
+        SHA1itoba(length_low, end, 60);
+    }
+}
+
+static void sha1_mb_lane_digest(const guint32 *state, guint l, sha1_type version,
+        guint8 *digest){
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        guint32 word = state[i * SHA1_MAX_LANES + l];
+        if (version != SHA1_TYPE_NORMAL) {
+            xSHA1itoba(word, digest, i * 4);
+        } else {
+            SHA1itoba(word, digest, i * 4);
+        }
+    }
 }
 
+/*
+ *  SHA1DigestMany
+ *
+ *  Description:
+ *    Runs the messages through the lanes of a multi-buffer kernel. A
+ *    lane that finishes its message takes the next one right away, so
+ *    messages of different lengths still keep the lanes busy.
+ */
+void sha1_digest_many(sha1_type version, guint count, const guint8 *const *data,
+        const guint32 *lengths, guint8 *digests, guint lanes){
+    static const guint8 zero_block[64] = { 0 };
+    static const guint32 iv[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    sha1_mb_kernel kernel = NULL;
+    sha1_mb_lane lane[SHA1_MAX_LANES];
+    guint32 state[5 * SHA1_MAX_LANES];
+    guint32 active[SHA1_MAX_LANES];
+    const guint8 *blocks[SHA1_MAX_LANES];
+    guint next_message = 0;
+    guint busy = 0;
+    gboolean forced = (lanes != 0);
+    guint l, i;
+
+    if (version > SHA1_TYPE_LOCKDOWN)
+        version = SHA1_TYPE_NORMAL;
+    if (lanes == 0 || lanes > sha1_max_lanes())
+        lanes = sha1_mb_lanes;
+#ifdef SHA1_HAVE_SHANI
+    /* unless forced: SHA-NI beats anything narrower than AVX-512 at the standard schedule */
+    if (!forced && sha1_cpu_shani && version != SHA1_TYPE_BROKEN && lanes < 16)
+        lanes = 1;
+    if (lanes >= 16 && sha1_cpu_avx512) {
+        lanes = 16;
+        kernel = sha1_mb_kernel_16;
+    } else if (lanes >= 8 && sha1_cpu_avx2) {
+        lanes = 8;
+        kernel = sha1_mb_kernel_8;
+    } else if (lanes >= 4 && sha1_cpu_sse2) {
+        lanes = 4;
+        kernel = sha1_mb_kernel_4;
+    }
+#endif
+
+    if (kernel == NULL || count < 2) {
+        for (i = 0; i < count; i++) {
+            sha1_context ctx;
+            ctx.version = version;
+            sha1_reset(&ctx);
+            sha1_input(&ctx, data[i], lengths[i]);
+            sha1_digest(&ctx, digests + i * SHA1_HASH_SIZE);
+        }
+        return;
+    }
+
+    memset(active, 0, sizeof(active));
+    for (l = 0; l < SHA1_MAX_LANES; l++) {
+        blocks[l] = zero_block;
+    }
+
+    for (;;) {
+        /* give idle lanes the next messages */
+        for (l = 0; l < lanes; l++) {
+            if (!active[l] && next_message < count) {
+                sha1_mb_lane_start(&lane[l], version, next_message,
+                        data[next_message], lengths[next_message]);
+                for (i = 0; i < 5; i++)
+                    state[i * SHA1_MAX_LANES + l] = iv[i];
+                active[l] = 0xFFFFFFFF;
+                next_message++;
+                busy++;
+            }
+        }
+        if (busy == 0)
+            break;
+
+        for (l = 0; l < lanes; l++) {
+            if (!active[l]) {
+                blocks[l] = zero_block;
+            } else if (lane[l].next < lane[l].full_blocks) {
+                blocks[l] = lane[l].data + lane[l].next * 64;
+            } else {
+                blocks[l] = lane[l].tail + (lane[l].next - lane[l].full_blocks) * 64;
+            }
+        }
+
+        kernel(state, blocks, active, version);
+
+        for (l = 0; l < lanes; l++) {
+            if (active[l] && ++lane[l].next == lane[l].blocks) {
+                sha1_mb_lane_digest(state, l, version,
+                        digests + lane[l].index * SHA1_HASH_SIZE);
+                active[l] = 0;
+                busy--;
+            }
+        }
+    }
+}
 
 /*
  *  SHA1PadMessage
@@ -77,6 +77,8 @@ typedef struct {
     guint8 computed;                /* Is the digest computed?          */
     guint8 corrupted;               /* Is the message digest corrupted? */
     sha1_type version;              /* What "version" of SHA1 is this?  */
+    void (*process_block)(guint32 *, const guint8 *);
+                                    /* Kernel for version, from Reset   */
 } sha1_context;
 
 /* Function Prototypes */
@@ -86,4 +88,21 @@ sha1_result sha1_input(sha1_context *, const guint8 *, guint32);
 sha1_result sha1_digest(sha1_context *, guint8 *);
 guint32 sha1_checksum(guint8 *data, guint32 length, guint32 version);
 
+/*
+ *  Multi-buffer hashing: count independent messages are hashed side by
+ *  side in SIMD lanes (4 with SSE2, 8 with AVX2, 16 with AVX-512), each
+ *  with the same result as sha1_reset/sha1_input/sha1_digest. Digest i
+ *  is written to digests + i * SHA1_HASH_SIZE. lanes forces a width for
+ *  tests and benchmarks, capped at what this CPU has; 0 picks the fastest
+ *  path, which may be SHA-NI one at a time; 1 hashes one at a time.
+ */
+#define SHA1_MAX_LANES 16
+
+void sha1_digest_many(sha1_type version, guint count, const guint8 *const *data,
+        const guint32 *lengths, guint8 *digests, guint lanes);
+guint sha1_max_lanes(void);
+
+/* For tests and benchmarks only: see sha1.c */
+gboolean sha1_set_shani(gboolean enabled);
+
 #endif
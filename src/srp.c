@@ -56,8 +56,24 @@
 #ifndef _SRP_C_
 #define _SRP_C_
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include "srp.h"
 
+#include <errno.h>
+#ifdef _WIN32
+#include <ntsecapi.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(HAVE_GETRANDOM) && defined(HAVE_SYS_RANDOM_H)
+#include <sys/random.h>
+#define SRP_HAVE_GETRANDOM 1
+#endif
+#endif
+
 /*#ifdef MOS_WINDOWS
 #  include <windows.h>
 #  if DEBUG
@@ -90,15 +106,108 @@ static const gchar srp_sig_n[] = {
     0xB6, 0x8D, 0xC2, 0xBA, 0x7F, 0x69, 0x8D, 0xCF
 };
 
+/* Process-wide group; see srp_group_get(). */
+static srp_group_t srp_group;
+static gsize srp_group_ready = 0;
+
+/* Process-wide crypto state; see srp_crypto_get(). */
+static srp_crypto_t srp_crypto;
+static gsize srp_crypto_ready = 0;
+
+/* This thread's srp_scratch_t; see srp_scratch_get(). */
+static GStaticPrivate srp_scratch_key = G_STATIC_PRIVATE_INIT;
+
 /* Private-use function prototypes. */
 
-static guint32 srp_pre_seed(void);
+static void srp_group_init(srp_group_t *group);
+static void srp_crypto_init(srp_crypto_t *crypto);
+static srp_scratch_t *srp_scratch_get(void);
+static void srp_scratch_free(gpointer data);
+static gboolean srp_new_private_key(srp_t *srp);
 static void srp_get_x(srp_t *srp, mpz_t x_c, const gchar *raw_salt);
 static void srp_get_v_mpz(srp_t *srp, mpz_t v, mpz_t x);
 static guint32 srp_get_u(const gchar *B);
 
 /* Function definitons */
 
+const srp_group_t *srp_group_get(void)
+{
+    if (g_once_init_enter(&srp_group_ready)) {
+        srp_group_init(&srp_group);
+        g_once_init_leave(&srp_group_ready, 1);
+    }
+    return &srp_group;
+}
+
+void srp_group_powm_g(const srp_group_t *group, mpz_t rop, const mpz_t exp)
+{
+    const guint row_size = (1 << SRP_GROUP_WINDOW) - 1;
+    size_t bits = mpz_sizeinbase(exp, 2);
+    guint i;
+
+    if (mpz_sgn(exp) < 0 || bits > SRP_GROUP_BITS) {
+        mpz_powm(rop, group->g, exp, group->n);
+        return;
+    }
+
+    mpz_set_ui(rop, 1);
+    for (i = 0; i * SRP_GROUP_WINDOW < bits; i++) {
+        guint digit = 0;
+        gint b;
+
+        for (b = SRP_GROUP_WINDOW - 1; b >= 0; b--) {
+            digit = (digit << 1) | mpz_tstbit(exp, i * SRP_GROUP_WINDOW + b);
+        }
+        if (digit != 0) {
+            mpz_mul(rop, rop, group->table[i * row_size + digit - 1]);
+            mpz_mod(rop, rop, group->n);
+        }
+    }
+}
+
+const srp_crypto_t *srp_crypto_get(void)
+{
+    if (g_once_init_enter(&srp_crypto_ready)) {
+        srp_crypto_init(&srp_crypto);
+        g_once_init_leave(&srp_crypto_ready, 1);
+    }
+    return &srp_crypto;
+}
+
+gboolean srp_random_bytes(gchar *out, gsize length)
+{
+    const srp_crypto_t *crypto = srp_crypto_get();
+    gsize done = 0;
+
+#ifdef _WIN32
+    (void) crypto;
+    (void) done;
+    return RtlGenRandom(out, (ULONG) length) ? TRUE : FALSE;
+#else
+#ifdef SRP_HAVE_GETRANDOM
+    while (done < length) {
+        ssize_t r = getrandom(out + done, length - done, 0);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        done += r;
+    }
+#endif
+    while (done < length && crypto->random_fd >= 0) {
+        ssize_t r = read(crypto->random_fd, out + done, length - done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        done += r;
+    }
+    /* no OS randomness: fail rather than fall back to a weaker generator */
+    return (done == length);
+#endif
+}
+
 srp_t *srp_init(const gchar *username, const gchar *password)
 {
     return srp_init_l(username, (guint32) strlen(username),
@@ -152,12 +261,14 @@ srp_t *srp_init_l(const gchar *username, guint32 username_length,
     *((gchar *) srp->username_upper + username_length) = 0;
     *((gchar *) srp->password_upper + password_length) = 0;
     
-    mpz_init_set_str(srp->n, SRP_VAR_N_STR, 16);
+    srp->group = srp_group_get();
+    mpz_init_set(srp->n, srp->group->n);
     
-    gmp_randinit_default(srp->rand);
-    gmp_randseed_ui(srp->rand, srp_pre_seed());
-    mpz_init2(srp->a, 256);
-    mpz_urandomm(srp->a, srp->rand, srp->n); /* generates the private key */
+    mpz_init2(srp->a, SRP_PRIVATE_KEY_BYTES * 8);
+    if (!srp_new_private_key(srp)) {
+        srp_free(srp);
+        return NULL;
+    }
 
     /* The following line replaces preceding 2 lines during testing. */
     /*mpz_init_set_str(srp->a, "1234", 10); */
@@ -178,8 +289,6 @@ void srp_free(srp_t *srp)
     mpz_clear(srp->a);
     mpz_clear(srp->n);
 
-    gmp_randclear(srp->rand);
-
     g_free(srp->username);
     g_free(srp->username_upper);
     g_free(srp->password_upper);
@@ -229,6 +338,13 @@ srp_t *srp_reinit_l(srp_t *srp, const gchar *username,
     if (srp->M2)
         g_free(srp->M2);
 
+    /* cleared now so srp_free below is safe if the key cannot be made */
+    srp->A = NULL;
+    srp->S = NULL;
+    srp->K = NULL;
+    srp->M1 = NULL;
+    srp->M2 = NULL;
+
     srp->username_len = username_length;
     srp->password_len = password_length;
     
@@ -277,23 +393,18 @@ srp_t *srp_reinit_l(srp_t *srp, const gchar *username,
     *((gchar *) srp->username_upper + username_length) = 0;
     *((gchar *) srp->password_upper + password_length) = 0;
 
-    mpz_urandomm(srp->a, srp->rand, srp->n); /* generates the private key */
-
-    srp->A = NULL;
-    srp->S = NULL;
-    srp->K = NULL;
-    srp->M1 = NULL;
-    srp->M2 = NULL;
+    if (!srp_new_private_key(srp)) {
+        srp_free(srp);
+        return NULL;
+    }
 
     return srp;
 }
 
 void srp_get_S(srp_t *srp, gchar *out, const gchar *B, const gchar *salt)
 {
-    mpz_t temp;
-    mpz_t S_base, S_exp;
-    mpz_t x;
-    mpz_t v;
+    srp_scratch_t *scratch;
+    mpz_ptr temp, S_base, S_exp, x, v;
     size_t count;
     
     if (!srp)
@@ -303,32 +414,31 @@ void srp_get_S(srp_t *srp, gchar *out, const gchar *B, const gchar *salt)
         memcpy(out, srp->S, 32);
         return;
     }
+
+    scratch = srp_scratch_get();
+    temp = scratch->t[0];
+    S_base = scratch->t[1];
+    S_exp = scratch->t[2];
+    x = scratch->t[3];
+    v = scratch->t[4];
     
-    mpz_init2(temp, 256);
     mpz_import(temp, 32, -1, 1, 0, 0, B);
     
     srp_get_x(srp, x, salt);
     srp_get_v_mpz(srp, v, x);
     
-    mpz_init_set(S_base, srp->n);
+    mpz_set(S_base, srp->n);
     mpz_add(S_base, S_base, temp);
     mpz_sub(S_base, S_base, v);
     mpz_mod(S_base, S_base, srp->n);
     
-    mpz_init_set(S_exp, x);
+    mpz_set(S_exp, x);
     mpz_mul_ui(S_exp, S_exp, srp_get_u(B));
     mpz_add(S_exp, S_exp, srp->a);
     
-    mpz_clear(x);
-    mpz_clear(v);
-    mpz_clear(temp);
-    
-    mpz_init(temp);
     mpz_powm(temp, S_base, S_exp, srp->n);
-    mpz_clear(S_base);
-    mpz_clear(S_exp);
+    memset(out, 0, 32);
     mpz_export(out, &count, -1, 1, 0, 0, temp);
-    mpz_clear(temp);
 
     srp->S = (gchar *) g_malloc(32);
     if (srp->S)
@@ -337,57 +447,47 @@ void srp_get_S(srp_t *srp, gchar *out, const gchar *B, const gchar *salt)
 
 guint32 srp_generate_salt_and_v(srp_t *srp, gchar *out)
 {
-    mpz_t s; /* salt */
-    mpz_t v;
-    mpz_t x;
+    srp_scratch_t *scratch;
     size_t count;
 
     if (!srp)
         return 0;
+
+    scratch = srp_scratch_get();
     
-    mpz_init2(s, 256);
-    mpz_urandomb(s, srp->rand, 256);
-    mpz_export(out, &count, -1, 1, 0, 0, s);
-    /*memset(buf, 0, 32);*/
-    
-    srp_get_x(srp, x, out);
-    srp_get_v_mpz(srp, v, x);
-    mpz_export(out + 32, &count, -1, 1, 0, 0, v);
+    /* the salt is just 32 random bytes */
+    if (!srp_random_bytes(out, 32))
+        return 0;
     
-    mpz_clear(x);
-    mpz_clear(v);
-    mpz_clear(s);
+    srp_get_x(srp, scratch->t[0], out);
+    srp_get_v_mpz(srp, scratch->t[1], scratch->t[0]);
+    memset(out + 32, 0, 32);
+    mpz_export(out + 32, &count, -1, 1, 0, 0, scratch->t[1]);
     
     return 64;
 }
 
 void srp_get_v(srp_t *srp, gchar *out, const gchar *salt)
 {
-    mpz_t g;
-    mpz_t v;
-    mpz_t x;
+    srp_scratch_t *scratch;
     size_t count;
     
     if (!srp)
         return;
+
+    scratch = srp_scratch_get();
     
-    mpz_init_set_ui(g, SRP_VAR_g);
-    mpz_init(v);
-    srp_get_x(srp, x, salt);
-    
-    mpz_powm(v, g, x, srp->n);
+    srp_get_x(srp, scratch->t[0], salt);
+    srp_get_v_mpz(srp, scratch->t[1], scratch->t[0]);
     
-    mpz_export(out, &count, -1, 1, 0, 0, v);
-    mpz_clear(v);
-    mpz_clear(g);
-    mpz_clear(x);
+    memset(out, 0, 32);
+    mpz_export(out, &count, -1, 1, 0, 0, scratch->t[1]);
 }
 
 
 void srp_get_A(srp_t *srp, gchar *out)
 {
-    mpz_t g;
-    mpz_t A;
+    mpz_ptr A;
     size_t o;
     
     if (!srp)
@@ -398,14 +498,11 @@ void srp_get_A(srp_t *srp, gchar *out)
         return;
     }
     
-    mpz_init_set_ui(g, SRP_VAR_g);
-    mpz_init2(A, 256);
+    A = srp_scratch_get()->t[0];
     
-    mpz_powm(A, g, srp->a, srp->n);
+    srp_group_powm_g(srp->group, A, srp->a);
+    memset(out, 0, 32);
     mpz_export(out, &o, -1, 1, 0, 0, A);
-    
-    mpz_clear(A);
-    mpz_clear(g);
 
     srp->A = (gchar *) g_malloc(32);
     if (srp->A)
@@ -602,84 +699,118 @@ int srp_check_M2(srp_t *srp, const gchar *var_M2)
 
 int srp_check_signature(guint32 address, const gchar *signature_raw)
 {
-    gchar *result_raw;
+    const srp_crypto_t *crypto = srp_crypto_get();
+    srp_scratch_t *scratch = srp_scratch_get();
+    mpz_ptr result = scratch->t[0];
+    mpz_ptr signature = scratch->t[1];
+    /* the result is below the 1024-bit modulus */
+    gchar result_raw[128];
     gchar check[32];
-    mpz_t result;
-    mpz_t modulus;
-    mpz_t signature;
-    size_t size, alloc_size;
-    int cmp_result;
+    size_t size;
     
     /* build the "check" array */
     memcpy(check, &address, 4);
     memset(check + 4, 0xBB, 28);
     
-    /* initialize the modulus */
-    mpz_init2(modulus, 1024);
-    mpz_import(modulus, 128, -1, 1, 0, 0, srp_sig_n);
-    
-    /* initialize the server signature */
-    mpz_init2(signature, 1024);
+    /* import the server signature */
     mpz_import(signature, 128, -1, 1, 0, 0, signature_raw);
     
-    /* initialize the result */
-    mpz_init2(result, 1024);
-    
     /* calculate the result */
-    mpz_powm_ui(result, signature, SRP_SIGNATURE_KEY, modulus);
-    
-    /* clear (free) the intermediates */
-    mpz_clear(signature);
-    mpz_clear(modulus);
-
-    /* allocate space for raw signature  */
-    alloc_size = mpz_size(result) * sizeof(mp_limb_t);
-    result_raw = (gchar *) g_malloc(alloc_size);
-    if (!result_raw) {
-            mpz_clear(result);
-            return 0;
-    }
+    mpz_powm_ui(result, signature, SRP_SIGNATURE_KEY, crypto->sig_n);
     
     /* get a byte array of the signature */
+    memset(result_raw, 0, sizeof(result_raw));
     mpz_export(result_raw, &size, -1, 1, 0, 0, result);
     
-    /* clear (free) the result */
-    mpz_clear(result);
-    
     /* check the result */
-    cmp_result = (memcmp(result_raw, check, 32) == 0);
-
-    /* free the result_raw buffer */
-    g_free(result_raw);
-
-    /* return */
-    return cmp_result;
+    return (memcmp(result_raw, check, 32) == 0);
 }
     
-static guint32 srp_pre_seed()
+static void srp_group_init(srp_group_t *group)
 {
-#ifdef _WIN32
-    return (unsigned long) GetTickCount();
-#else
-    FILE *f;
-    unsigned long r;
-    /* try to get data from /dev/random or /dev/urandom */
-    f = fopen("/dev/urandom", "r");
-    if (!f) {
-        f = fopen("/dev/random", "r");
-        if (!f) {
-            srand(time(NULL));
-            return (unsigned long) rand();
+    const guint row_size = (1 << SRP_GROUP_WINDOW) - 1;
+    mpz_t base;
+    guint i, d;
+
+    mpz_init_set_str(group->n, SRP_VAR_N_STR, 16);
+    mpz_init_set_ui(group->g, SRP_VAR_g);
+
+    group->windows = (SRP_GROUP_BITS + SRP_GROUP_WINDOW - 1) / SRP_GROUP_WINDOW;
+    group->table = g_new(mpz_t, group->windows * row_size);
+
+    /* base is g^(2^(SRP_GROUP_WINDOW * i)) for row i */
+    mpz_init_set(base, group->g);
+    for (i = 0; i < group->windows; i++) {
+        mpz_t *row = group->table + i * row_size;
+
+        mpz_init_set(row[0], base);
+        for (d = 1; d < row_size; d++) {
+            mpz_init2(row[d], 256);
+            mpz_mul(row[d], row[d - 1], base);
+            mpz_mod(row[d], row[d], group->n);
         }
+        mpz_mul(base, row[row_size - 1], base);
+        mpz_mod(base, base, group->n);
     }
-    if (fread(&r, sizeof(unsigned long), 1, f) != 1) {
-        fclose(f);
-        srand(time(NULL));
-        return (unsigned long) rand();
+    mpz_clear(base);
+}
+
+static void srp_crypto_init(srp_crypto_t *crypto)
+{
+    mpz_init2(crypto->sig_n, 1024);
+    mpz_import(crypto->sig_n, 128, -1, 1, 0, 0, srp_sig_n);
+
+    crypto->random_fd = -1;
+#ifndef _WIN32
+#ifdef SRP_HAVE_GETRANDOM
+    {
+        /* a kernel without getrandom() still needs the device */
+        gchar probe;
+        if (getrandom(&probe, 1, GRND_NONBLOCK) >= 0 || errno != ENOSYS)
+            return;
     }
-    fclose(f);
-    return r;
 #endif
+    crypto->random_fd = open("/dev/urandom", O_RDONLY);
+#endif
+}
+
+static srp_scratch_t *srp_scratch_get(void)
+{
+    srp_scratch_t *scratch = g_static_private_get(&srp_scratch_key);
+    guint i;
+
+    if (scratch == NULL) {
+        scratch = g_new(srp_scratch_t, 1);
+        for (i = 0; i < SRP_SCRATCH_COUNT; i++) {
+            mpz_init2(scratch->t[i], SRP_SCRATCH_BITS);
+        }
+        g_static_private_set(&srp_scratch_key, scratch, srp_scratch_free);
+    }
+    return scratch;
+}
+
+static void srp_scratch_free(gpointer data)
+{
+    srp_scratch_t *scratch = data;
+    guint i;
+
+    for (i = 0; i < SRP_SCRATCH_COUNT; i++) {
+        mpz_clear(scratch->t[i]);
+    }
+    g_free(scratch);
+}
+
+/* a = random mod N; generates the private key */
+static gboolean srp_new_private_key(srp_t *srp)
+{
+    gchar raw[SRP_PRIVATE_KEY_BYTES];
+
+    if (!srp_random_bytes(raw, sizeof(raw)))
+        return FALSE;
+    mpz_import(srp->a, sizeof(raw), -1, 1, 0, 0, raw);
+    mpz_mod(srp->a, srp->a, srp->n);
+    memset(raw, 0, sizeof(raw));
+    return TRUE;
 }
 
 static void srp_get_x(srp_t *srp, mpz_t x_c, const gchar *raw_salt)
@@ -711,17 +842,12 @@ static void srp_get_x(srp_t *srp, mpz_t x_c, const gchar *raw_salt)
     sha1_digest(&ctx, final_hash);
     
     // create an arbitrary-length integer from the hash and return it
-    mpz_init2(x_c, 160);
     mpz_import(x_c, 20, -1, 1, 0, 0, (gchar *) final_hash);
 }
 
 static void srp_get_v_mpz(srp_t *srp, mpz_t v, mpz_t x)
 {
-    mpz_t g;
-    mpz_init_set_ui(g, SRP_VAR_g);
-    mpz_init(v);
-    mpz_powm(v, g, x, srp->n);
-    mpz_clear(g);
+    srp_group_powm_g(srp->group, v, x);
 }
 
 #define MSB4(num) ((((num) >> 24) & 0x000000FF) | (((num) >> 8) & 0x0000FF00) | (((num) << 8) & 0x00FF0000) | (((num) << 24) & 0xFF000000))
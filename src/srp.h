@@ -74,8 +74,55 @@
 #define SRP_VAR_I_STR "8018CF0A425BA8BEB8958B1AB6BF90AED970E6C"
 // Server Signature Key
 #define SRP_SIGNATURE_KEY 0x10001
+// bits of exponent covered by the fixed-base table for g (N is 256 bits)
+#define SRP_GROUP_BITS 256
+// exponent bits per table row; a row holds 2^SRP_GROUP_WINDOW - 1 powers
+#define SRP_GROUP_WINDOW 6
+// random bytes behind a private key (a); the extra 64 bits over N keep
+// the reduction mod N from biasing it
+#define SRP_PRIVATE_KEY_BYTES 40
+// bignum temporaries per thread, and the size they're allocated at
+#define SRP_SCRATCH_COUNT 5
+#define SRP_SCRATCH_BITS 1024
+
+/*
+ * The SRP group (N, g), shared by every srp_t in the process and built once
+ * on first use. g^e mod N is computed from a fixed-base table: row i holds
+ * g^(d * 2^(SRP_GROUP_WINDOW * i)) for d = 1..2^SRP_GROUP_WINDOW - 1, so an
+ * exponent costs one multiplication per non-zero window and no squarings.
+ */
+typedef struct {
+    mpz_t n;
+    mpz_t g;
+    guint windows;
+    // windows rows of (1 << SRP_GROUP_WINDOW) - 1 entries
+    mpz_t *table;
+} srp_group_t;
+
+/*
+ * Process-wide crypto state, set up once by srp_crypto_get(): the server
+ * signature modulus, imported once, and the source srp_random_bytes()
+ * reads. Random bytes come straight from the OS CSPRNG (getrandom(),
+ * RtlGenRandom()); only without getrandom() is /dev/urandom kept open.
+ */
+typedef struct {
+    mpz_t sig_n;
+    // /dev/urandom, or -1
+    int random_fd;
+} srp_crypto_t;
+
+/*
+ * Bignum temporaries, one set per thread, made on the thread's first use
+ * and kept for its lifetime; SRP math runs on the crypto pool's threads,
+ * so logons reuse them instead of allocating their own.
+ */
+typedef struct {
+    mpz_t t[SRP_SCRATCH_COUNT];
+} srp_scratch_t;
 
 typedef struct {
+    const srp_group_t *group;
+
     gchar *username;
     gchar *username_upper;
     gchar *password_upper;
@@ -84,8 +131,6 @@ typedef struct {
     
     mpz_t n;
     mpz_t a;
-    
-    gmp_randstate_t rand;
 
     gchar *A;
     gchar *S;
@@ -96,6 +141,30 @@ typedef struct {
     gchar *B;
 } srp_t;
 
+/**
+ * Returns the process-wide SRP group, building it on the first call.
+ * Safe to call from any thread.
+ */
+const srp_group_t *srp_group_get(void);
+
+/**
+ * Computes g^exp mod N using the group's table.
+ */
+void srp_group_powm_g(const srp_group_t *group, mpz_t rop, const mpz_t exp);
+
+/**
+ * Returns the process-wide crypto state, setting it up on the first call.
+ * Safe to call from any thread.
+ */
+const srp_crypto_t *srp_crypto_get(void);
+
+/**
+ * Fills out with length bytes from the OS CSPRNG.
+ * Returns FALSE if the OS source failed; there is no weaker fallback.
+ * Safe to call from any thread.
+ */
+gboolean srp_random_bytes(gchar *out, gsize length);
+
 /**
  * Allocates and initializes an srp_t structure.
  * Returns a NULL pointer on failure.
@@ -118,7 +187,8 @@ void srp_free(srp_t* srp);
 /**
  * Re-initializes an srp_t structure with a new username and
  * password.  Returns the srp argument on success or a NULL
- * pointer on failure.
+ * pointer on failure, in which case srp has been freed, as
+ * srp_init would have; it must not be used or freed again.
  */
 srp_t* srp_reinit(srp_t* srp, const char* username,
         const char* password);
@@ -126,7 +196,8 @@ srp_t* srp_reinit(srp_t* srp, const char* username,
 /**
  * Re-initializes an srp_t structure with a new username and
  * password and their given lengths.  Returns the srp argument
- * on success or a NULL pointer on failure.
+ * on success or a NULL pointer on failure, in which case srp
+ * has been freed (see srp_reinit).
  */
 srp_t *srp_reinit_l(srp_t *srp, const gchar *username,
         guint32 username_length, const gchar *password,
@@ -134,6 +205,7 @@ srp_t *srp_reinit_l(srp_t *srp, const gchar *username,
 
 /**
  * Generates a salt and verifier. (64 bytes)
+ * Returns 0 on failure.
  */
 guint32 srp_generate_salt_and_v(srp_t *srp, gchar *out);
 
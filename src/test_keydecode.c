@@ -0,0 +1,263 @@
+/**
+ * pidgin-libbnet
+ * A Protocol Plugin for Pidgin, allowing emulation of a chat-only client
+ * connected to the Battle.net Service.
+ * Copyright (C) 2011-2012 Nate Book
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// make check: bnet_key_decode_batch() and bnet_key_decode() against the
+// original decoder (test_keydecode_ref.c) on synthetic SC, W2/D2 and W3
+// keys, and how many keys a second each of them decodes.
+// Usage: test_keydecode [--no-bench] [key count] [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "keydecode.h"
+#include "test_keydecode.h"
+
+#define TEST_KEYDECODE_COUNT 100000
+// keys decoded with one pair of cookies
+#define TEST_KEYDECODE_CHUNK 1000
+#define TEST_KEYDECODE_STRING 40
+
+static const gchar *test_keydecode_type_names[] = { "SC", "W2/D2", "W3" };
+static const gchar test_keydecode_w2_alphabet[] = "246789BCDEFGHJKMNPRTVWXZ";
+static const gchar test_keydecode_w3_alphabet[] = "246789BCDEFGHJKMNPRTVWXYZ";
+
+static void
+test_keydecode_random_chars(GRand *rand, gchar *out, int length, const gchar *alphabet)
+{
+    int alphabet_length = strlen(alphabet);
+    int i;
+
+    for (i = 0; i < length; i++) {
+        out[i] = alphabet[g_rand_int_range(rand, 0, alphabet_length)];
+    }
+    out[length] = '\0';
+}
+
+/**
+ * Writes a key of type (0 SC, 1 W2/D2, 2 W3) to out. Most are valid;
+ * some have a bad check digit or character, or the wrong length, and
+ * some are written the way users paste them: dashed, lower case.
+ */
+static void
+test_keydecode_generate(GRand *rand, int type, gchar *out)
+{
+    gchar key[W3_KEYLEN + 1];
+    int length = 0;
+    int i, j;
+
+    switch (type) {
+        case 0:
+            {
+                int accum = 3;
+
+                length = 13;
+                test_keydecode_random_chars(rand, key, length, "0123456789");
+                for (i = 0; i < 12; i++) {
+                    accum += ((key[i] - '0') ^ (accum * 2));
+                }
+                key[12] = '0' + accum % 10;
+                if (g_rand_int_range(rand, 0, 10) == 0) {
+                    key[12] = '0' + g_rand_int_range(rand, 0, 10);
+                }
+                break;
+            }
+        case 1:
+            length = 16;
+            // one in 256 random keys has a matching checksum; most should
+            if (g_rand_int_range(rand, 0, 10) == 0) {
+                test_keydecode_random_chars(rand, key, length, test_keydecode_w2_alphabet);
+            } else {
+                do {
+                    test_keydecode_random_chars(rand, key, length, test_keydecode_w2_alphabet);
+                } while (!test_keydecode_ref_w2d2_valid(key));
+            }
+            break;
+        case 2:
+            length = 26;
+            test_keydecode_random_chars(rand, key, length, test_keydecode_w3_alphabet);
+            if (g_rand_int_range(rand, 0, 20) == 0) {
+                key[g_rand_int_range(rand, 0, length)] = 'A';
+            }
+            break;
+    }
+
+    switch (g_rand_int_range(rand, 0, 20)) {
+        case 0:
+            // wrong length
+            key[--length] = '\0';
+            break;
+        case 1:
+        case 2:
+        case 3:
+            // pasted with dashes, in lower case
+            for (i = 0, j = 0; i < length; i++) {
+                if (i > 0 && i % 4 == 0) {
+                    out[j++] = '-';
+                }
+                out[j++] = g_ascii_tolower(key[i]);
+            }
+            out[j] = '\0';
+            return;
+    }
+    g_strlcpy(out, key, TEST_KEYDECODE_STRING);
+}
+
+static gboolean
+test_keydecode_same(const BnetKey *expected, gboolean expected_ok, const BnetKey *actual)
+{
+    if (!expected_ok) {
+        return actual->length == 0;
+    }
+    return actual->length == expected->length &&
+        actual->product_value == expected->product_value &&
+        actual->public_value == expected->public_value &&
+        actual->private_value == expected->private_value &&
+        memcmp(actual->key_hash, expected->key_hash, SHA1_HASH_SIZE) == 0;
+}
+
+static int
+test_keydecode_equivalence(GRand *rand, gchar (*strings)[TEST_KEYDECODE_STRING],
+        const char **key_strings, int count)
+{
+    BnetKey *batch = g_new0(BnetKey, TEST_KEYDECODE_CHUNK);
+    int checked[3] = { 0, 0, 0 };
+    int valid[3] = { 0, 0, 0 };
+    int failures = 0;
+    int start, i;
+
+    for (start = 0; start < count; start += TEST_KEYDECODE_CHUNK) {
+        int end = MIN(count, start + TEST_KEYDECODE_CHUNK);
+        guint32 client_cookie = g_rand_int(rand);
+        guint32 server_cookie = g_rand_int(rand);
+
+        bnet_key_decode_batch(batch, end - start, client_cookie, server_cookie, key_strings + start);
+
+        for (i = start; i < end; i++) {
+            BnetKey expected, single[2];
+            gboolean expected_ok, single_ok;
+            int type = i % 3;
+
+            memset(&expected, 0, sizeof(expected));
+            memset(single, 0, sizeof(single));
+            expected_ok = test_keydecode_ref_decode(&expected, client_cookie, server_cookie, strings[i]);
+            single_ok = bnet_key_decode(single, 1, client_cookie, server_cookie, strings[i], NULL);
+
+            checked[type]++;
+            if (expected_ok) {
+                valid[type]++;
+            }
+            if (!test_keydecode_same(&expected, expected_ok, &batch[i - start]) ||
+                    single_ok != expected_ok ||
+                    !test_keydecode_same(&expected, expected_ok, &single[0])) {
+                if (failures < 10) {
+                    printf("FAIL %s key %s: the original %s it\n", test_keydecode_type_names[type],
+                            strings[i], expected_ok ? "decodes" : "rejects");
+                }
+                failures++;
+            }
+        }
+    }
+
+    for (i = 0; i < 3; i++) {
+        printf("%-5s %6d keys, %6d valid\n", test_keydecode_type_names[i], checked[i], valid[i]);
+    }
+    printf("%d keys differ from the original decoder\n", failures);
+
+    g_free(batch);
+    return failures;
+}
+
+static void
+test_keydecode_bench(gchar (*strings)[TEST_KEYDECODE_STRING], const char **key_strings, int count)
+{
+    BnetKey *keys = g_new0(BnetKey, count);
+    GTimer *timer = g_timer_new();
+    gdouble elapsed;
+    int i;
+
+    g_timer_start(timer);
+    for (i = 0; i < count; i++) {
+        test_keydecode_ref_decode(&keys[i], 1, 2, strings[i]);
+    }
+    elapsed = g_timer_elapsed(timer, NULL);
+    printf("original, one at a time:  %9.0f keys/s\n", count / elapsed);
+
+    g_timer_start(timer);
+    for (i = 0; i < count; i++) {
+        bnet_key_decode(&keys[i], 1, 1, 2, strings[i], NULL);
+    }
+    elapsed = g_timer_elapsed(timer, NULL);
+    printf("bnet_key_decode:          %9.0f keys/s\n", count / elapsed);
+
+    g_timer_start(timer);
+    bnet_key_decode_batch(keys, count, 1, 2, key_strings);
+    elapsed = g_timer_elapsed(timer, NULL);
+    printf("bnet_key_decode_batch:    %9.0f keys/s\n", count / elapsed);
+
+    g_timer_destroy(timer);
+    g_free(keys);
+}
+
+int
+main(int argc, char *argv[])
+{
+    gchar (*strings)[TEST_KEYDECODE_STRING];
+    const char **key_strings;
+    guint32 seed = 20120101;
+    int count = TEST_KEYDECODE_COUNT;
+    gboolean bench = TRUE;
+    int positional = 0;
+    int failures;
+    GRand *rand;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-bench") == 0) {
+            bench = FALSE;
+        } else if (positional++ == 0) {
+            count = MAX(1, atoi(argv[i]));
+        } else {
+            seed = strtoul(argv[i], NULL, 10);
+        }
+    }
+
+    rand = g_rand_new_with_seed(seed);
+    strings = g_malloc(count * sizeof(*strings));
+    key_strings = g_new(const char *, count);
+    for (i = 0; i < count; i++) {
+        test_keydecode_generate(rand, i % 3, strings[i]);
+        key_strings[i] = strings[i];
+    }
+    printf("%d synthetic keys, seed %u\n", count, seed);
+
+    failures = test_keydecode_equivalence(rand, strings, key_strings, count);
+    if (bench) {
+        test_keydecode_bench(strings, key_strings, count);
+    }
+
+    bnet_key_cache_clear();
+    g_free(key_strings);
+    g_free(strings);
+    g_rand_free(rand);
+    return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,43 @@
+/**
+ * pidgin-libbnet
+ * A Protocol Plugin for Pidgin, allowing emulation of a chat-only client
+ * connected to the Battle.net Service.
+ * Copyright (C) 2011-2012 Nate Book
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TEST_KEYDECODE_H_
+#define _TEST_KEYDECODE_H_
+
+#include <glib.h>
+
+#include "keydecode.h"
+
+/**
+ * The CD-key decoder from before bnet_key_decode_batch(), one key at a
+ * time through BNCSUtil's original code. Same contract as one key of
+ * bnet_key_decode(): fills key and returns TRUE, or sets its length to 0
+ * and returns FALSE.
+ */
+gboolean test_keydecode_ref_decode(BnetKey *key, guint32 client_cookie,
+        guint32 server_cookie, const char *key_string);
+
+/**
+ * Whether the original decoder takes this upper cased 16-character key as
+ * a valid WarCraft II / Diablo II key (its checksum matches).
+ */
+gboolean test_keydecode_ref_w2d2_valid(const char *cdkey);
+
+#endif
@@ -0,0 +1,519 @@
+/**
+ * pidgin-libbnet
+ * A Protocol Plugin for Pidgin, allowing emulation of a chat-only client
+ * connected to the Battle.net Service.
+ * Copyright (C) 2011-2012 Nate Book
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * BNCSutil
+ * Battle.Net Utility Library
+ *
+ * Copyright (C) 2004-2006 Eric Naeseth
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+// Reference for test_keydecode only, not part of the plugin: keydecode.c's
+// CD-key decoder as it was before the table-driven batch decoder. Only the
+// names, the debug leftovers, the context struct and W3's pointer casts
+// changed, so the new code has the original to be held to.
+
+#include "test_keydecode.h"
+
+typedef struct {
+    char cdkey[W3_KEYLEN + 1];
+    gsize keyLen;
+    CDKeyType keyType;
+    guint64 value1;
+    guint64 value2;
+    guint64 product;
+    char w3value2[10];
+} RefKeyDecoder;
+
+// key tables
+static const unsigned char w2Map[] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0x00, 0xFF, 0x01, 0xFF, 0x02, 0x03, 0x04, 0x05, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B,
+    0x0C, 0xFF, 0x0D, 0x0E, 0xFF, 0x0F, 0x10, 0xFF, 0x11, 0xFF, 0x12, 0xFF,
+    0x13, 0xFF, 0x14, 0x15, 0x16, 0xFF, 0x17, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0xFF, 0x0D, 0x0E,
+    0xFF, 0x0F, 0x10, 0xFF, 0x11, 0xFF, 0x12, 0xFF, 0x13, 0xFF, 0x14, 0x15,
+    0x16, 0xFF, 0x17, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF
+};
+
+static const unsigned char w3KeyMap[] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0x00, 0xFF, 0x01, 0xFF, 0x02, 0x03, 0x04, 0x05, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x06, 0x07, 0x08, 0x09, 0x0A,
+    0x0B, 0x0C, 0xFF, 0x0D, 0x0E, 0xFF, 0x0F, 0x10, 0xFF, 0x11, 0xFF, 0x12,
+    0xFF, 0x13, 0xFF, 0x14, 0x15, 0x16, 0x17, 0x18, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0xFF, 0x0D,
+    0x0E, 0xFF, 0x0F, 0x10, 0xFF, 0x11, 0xFF, 0x12, 0xFF, 0x13, 0xFF, 0x14,
+    0x15, 0x16, 0x17, 0x18, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+static const unsigned char w3TranslateMap[] = {
+    0x09, 0x04, 0x07, 0x0F, 0x0D, 0x0A, 0x03, 0x0B, 0x01, 0x02, 0x0C, 0x08,
+    0x06, 0x0E, 0x05, 0x00, 0x09, 0x0B, 0x05, 0x04, 0x08, 0x0F, 0x01, 0x0E,
+    0x07, 0x00, 0x03, 0x02, 0x0A, 0x06, 0x0D, 0x0C, 0x0C, 0x0E, 0x01, 0x04,
+    0x09, 0x0F, 0x0A, 0x0B, 0x0D, 0x06, 0x00, 0x08, 0x07, 0x02, 0x05, 0x03,
+    0x0B, 0x02, 0x05, 0x0E, 0x0D, 0x03, 0x09, 0x00, 0x01, 0x0F, 0x07, 0x0C,
+    0x0A, 0x06, 0x04, 0x08, 0x06, 0x02, 0x04, 0x05, 0x0B, 0x08, 0x0C, 0x0E,
+    0x0D, 0x0F, 0x07, 0x01, 0x0A, 0x00, 0x03, 0x09, 0x05, 0x04, 0x0E, 0x0C,
+    0x07, 0x06, 0x0D, 0x0A, 0x0F, 0x02, 0x09, 0x01, 0x00, 0x0B, 0x08, 0x03,
+    0x0C, 0x07, 0x08, 0x0F, 0x0B, 0x00, 0x05, 0x09, 0x0D, 0x0A, 0x06, 0x0E,
+    0x02, 0x04, 0x03, 0x01, 0x03, 0x0A, 0x0E, 0x08, 0x01, 0x0B, 0x05, 0x04,
+    0x02, 0x0F, 0x0D, 0x0C, 0x06, 0x07, 0x09, 0x00, 0x0C, 0x0D, 0x01, 0x0F,
+    0x08, 0x0E, 0x05, 0x0B, 0x03, 0x0A, 0x09, 0x00, 0x07, 0x02, 0x04, 0x06,
+    0x0D, 0x0A, 0x07, 0x0E, 0x01, 0x06, 0x0B, 0x08, 0x0F, 0x0C, 0x05, 0x02,
+    0x03, 0x00, 0x04, 0x09, 0x03, 0x0E, 0x07, 0x05, 0x0B, 0x0F, 0x08, 0x0C,
+    0x01, 0x0A, 0x04, 0x0D, 0x00, 0x06, 0x09, 0x02, 0x0B, 0x06, 0x09, 0x04,
+    0x01, 0x08, 0x0A, 0x0D, 0x07, 0x0E, 0x00, 0x0C, 0x0F, 0x02, 0x03, 0x05,
+    0x0C, 0x07, 0x08, 0x0D, 0x03, 0x0B, 0x00, 0x0E, 0x06, 0x0F, 0x09, 0x04,
+    0x0A, 0x01, 0x05, 0x02, 0x0C, 0x06, 0x0D, 0x09, 0x0B, 0x00, 0x01, 0x02,
+    0x0F, 0x07, 0x03, 0x04, 0x0A, 0x0E, 0x08, 0x05, 0x03, 0x06, 0x01, 0x05,
+    0x0B, 0x0C, 0x08, 0x00, 0x0F, 0x0E, 0x09, 0x04, 0x07, 0x0A, 0x0D, 0x02,
+    0x0A, 0x07, 0x0B, 0x0F, 0x02, 0x08, 0x00, 0x0D, 0x0E, 0x0C, 0x01, 0x06,
+    0x09, 0x03, 0x05, 0x04, 0x0A, 0x0B, 0x0D, 0x04, 0x03, 0x08, 0x05, 0x09,
+    0x01, 0x00, 0x0F, 0x0C, 0x07, 0x0E, 0x02, 0x06, 0x0B, 0x04, 0x0D, 0x0F,
+    0x01, 0x06, 0x03, 0x0E, 0x07, 0x0A, 0x0C, 0x08, 0x09, 0x02, 0x05, 0x00,
+    0x09, 0x06, 0x07, 0x00, 0x01, 0x0A, 0x0D, 0x02, 0x03, 0x0E, 0x0F, 0x0C,
+    0x05, 0x0B, 0x04, 0x08, 0x0D, 0x0E, 0x05, 0x06, 0x01, 0x09, 0x08, 0x0C,
+    0x02, 0x0F, 0x03, 0x07, 0x0B, 0x04, 0x00, 0x0A, 0x09, 0x0F, 0x04, 0x00,
+    0x01, 0x06, 0x0A, 0x0E, 0x02, 0x03, 0x07, 0x0D, 0x05, 0x0B, 0x08, 0x0C,
+    0x03, 0x0E, 0x01, 0x0A, 0x02, 0x0C, 0x08, 0x04, 0x0B, 0x07, 0x0D, 0x00,
+    0x0F, 0x06, 0x09, 0x05, 0x07, 0x02, 0x0C, 0x06, 0x0A, 0x08, 0x0B, 0x00,
+    0x0F, 0x04, 0x03, 0x0E, 0x09, 0x01, 0x0D, 0x05, 0x0C, 0x04, 0x05, 0x09,
+    0x0A, 0x02, 0x08, 0x0D, 0x03, 0x0F, 0x01, 0x0E, 0x06, 0x07, 0x0B, 0x00,
+    0x0A, 0x08, 0x0E, 0x0D, 0x09, 0x0F, 0x03, 0x00, 0x04, 0x06, 0x01, 0x0C,
+    0x07, 0x0B, 0x02, 0x05, 0x03, 0x0C, 0x04, 0x0A, 0x02, 0x0F, 0x0D, 0x0E,
+    0x07, 0x00, 0x05, 0x08, 0x01, 0x06, 0x0B, 0x09, 0x0A, 0x0C, 0x01, 0x00,
+    0x09, 0x0E, 0x0D, 0x0B, 0x03, 0x07, 0x0F, 0x08, 0x05, 0x02, 0x04, 0x06,
+    0x0E, 0x0A, 0x01, 0x08, 0x07, 0x06, 0x05, 0x0C, 0x02, 0x0F, 0x00, 0x0D,
+    0x03, 0x0B, 0x04, 0x09, 0x03, 0x08, 0x0E, 0x00, 0x07, 0x09, 0x0F, 0x0C,
+    0x01, 0x06, 0x0D, 0x02, 0x05, 0x0A, 0x0B, 0x04, 0x03, 0x0A, 0x0C, 0x04,
+    0x0D, 0x0B, 0x09, 0x0E, 0x0F, 0x06, 0x01, 0x07, 0x02, 0x00, 0x05, 0x08
+};
+
+static char ref_getHexValue(int v)
+{
+    v &= 0xF;
+    return (v < 10) ? (v + 0x30) : (v + 0x37);
+}
+
+static int ref_getNumValue(char c)
+{
+    c = toupper(c);
+    return (isdigit(c)) ? (c - 0x30) : (c - 0x37);
+}
+
+static gboolean ref_process_sc(RefKeyDecoder *ctx)
+{
+    int accum, pos, i;
+    char temp;
+    int hashKey = 0x13AC9741;
+    char cdkey[14];
+
+    strcpy(cdkey, ctx->cdkey);
+
+    // Verification
+    accum = 3;
+    for (i = 0; i < (int) (ctx->keyLen - 1); i++) {
+        accum += ((tolower(cdkey[i]) - '0') ^ (accum * 2));
+    }
+
+    if ((accum % 10) != (cdkey[12] - '0')) {
+        return 0;
+    }
+
+    // Shuffling
+    pos = 0x0B;
+    for (i = 0xC2; i >= 7; i -= 0x11) {
+        temp = cdkey[pos];
+        cdkey[pos] = cdkey[i % 0x0C];
+        cdkey[i % 0x0C] = temp;
+        pos--;
+    }
+
+    // Final Value
+    for (i = (int) (ctx->keyLen - 2); i >= 0; i--) {
+        temp = toupper(cdkey[i]);
+        cdkey[i] = temp;
+        if (temp <= '7') {
+            cdkey[i] ^= (char) (hashKey & 7);
+            hashKey >>= 3;
+        } else if (temp < 'A') {
+            cdkey[i] ^= ((char) i & 1);
+        }
+    }
+
+    // Final Calculations
+    sscanf(cdkey, "%2ld%7ld%3ld", (long int *)&ctx->product, (long int *)&ctx->value1, (long int *)&ctx->value2);
+
+    return 1;
+}
+
+static gboolean ref_process_w2d2(RefKeyDecoder *ctx)
+{
+    unsigned long r, n, n2, v, v2, checksum;
+    int i, j;
+    unsigned char c1, c2, c;
+    char cdkey[17];
+
+    strcpy(cdkey, ctx->cdkey);
+
+    r = 1;
+    checksum = 0;
+    for (i = 0; i < 16; i += 2) {
+        c1 = w2Map[(int) cdkey[i]];
+        n = c1 * 3;
+        c2 = w2Map[(int) cdkey[i + 1]];
+        n = c2 + n * 8;
+
+        if (n >= 0x100) {
+            n -= 0x100;
+            checksum |= r;
+        }
+        // !
+        n2 = n >> 4;
+        // !
+        cdkey[i] = ref_getHexValue(n2);
+        cdkey[i + 1] = ref_getHexValue(n);
+        r <<= 1;
+    }
+
+    v = 3;
+    for (i = 0; i < 16; i++) {
+        c = cdkey[i];
+        n = ref_getNumValue(c);
+        n2 = v * 2;
+        n ^= n2;
+        v += n;
+    }
+    v &= 0xFF;
+
+    if (v != checksum) {
+        return 0;
+    }
+
+    n = 0;
+    for (j = 15; j >= 0; j--) {
+        c = cdkey[j];
+        if (j > 8) {
+            n = (j - 9);
+        } else {
+            n = (0xF - (8 - j));
+        }
+        n &= 0xF;
+        c2 = cdkey[n];
+        cdkey[j] = c2;
+        cdkey[n] = c;
+    }
+    v2 = 0x13AC9741;
+    for (j = 15; j >= 0; j--) {
+        c = toupper(cdkey[j]);
+        cdkey[j] = c;
+        if (c <= '7') {
+            v = v2;
+            c2 = (((char) (v & 0xFF)) & 7) ^ c;
+            v >>= 3;
+            cdkey[j] = (char) c2;
+            v2 = v;
+        } else if (c < 'A') {
+            cdkey[j] = (((char) j) & 1) ^ c;
+        }
+    }
+
+    // Final Calculations
+    sscanf(cdkey, "%2lx%6lx%8lx", (long int *)&ctx->product, (long int *)&ctx->value1, (long int *) &ctx->value2);
+    return 1;
+}
+
+static void ref_mult(int r, const int x, int* a, int dcByte)
+{
+    while (r--) {
+        int64_t edxeax = ((int64_t) (*a & 0x00000000FFFFFFFFl))
+            * ((int64_t) (x & 0x00000000FFFFFFFFl));
+        *a-- = dcByte + (int32_t) edxeax;
+        dcByte = (int32_t) (edxeax >> 32);
+    }
+}
+
+static void ref_decodeKeyTable(int* keyTable)
+{
+    unsigned int eax, ebx, ecx, edx, edi, esi, ebp;
+    unsigned int varC, var4, var8;
+    unsigned int copy[4];
+    unsigned char* scopy;
+    int* ckt;
+    int ckt_temp;
+    int i = 464;
+    var8 = 29;
+
+    // pass 1
+    do {
+        int j;
+        esi = (var8 & 7) << 2;
+        var4 = var8 >> 3;
+        varC = keyTable[3 - var4];
+        varC &= (0xF << esi);
+        varC = varC >> esi;
+
+        if (i < 464) {
+            for (j = 29; (unsigned int) j > var8; j--) {
+                ecx = (j & 7) << 2;
+                ebp = (keyTable[0x3 - (j >> 3)]);
+                ebp &= (0xF << ecx);
+                ebp = ebp >> ecx;
+                varC = w3TranslateMap[ebp ^ (w3TranslateMap[varC + i] + i)];
+            }
+        }
+
+        j = --var8;
+        while (j >= 0) {
+            ecx = (j & 7) << 2;
+            ebp = (keyTable[0x3 - (j >> 3)]);
+            ebp &= (0xF << ecx);
+            ebp = ebp >> ecx;
+            varC = w3TranslateMap[ebp ^ (w3TranslateMap[varC + i] + i)];
+            j--;
+        }
+
+        j = 3 - var4;
+        ebx = (w3TranslateMap[varC + i] & 0xF) << esi;
+        keyTable[j] = (ebx | (~(0xF << esi) & ((int) keyTable[j])));
+    } while ((i -= 16) >= 0);
+
+    // pass 2
+    eax = 0;
+    edx = 0;
+    ecx = 0;
+    edi = 0;
+    esi = 0;
+    ebp = 0;
+
+    for (i = 0; i < 4; i++) {
+        copy[i] = LSB4(keyTable[i]);
+    }
+    scopy = (unsigned char*) copy;
+
+    for (edi = 0; edi < 120; edi++) {
+        unsigned int location = 12;
+        eax = edi & 0x1F;
+        ecx = esi & 0x1F;
+        edx = 3 - (edi >> 5);
+
+        location -= ((esi >> 5) << 2);
+        ebp = *(int*) (scopy + location);
+        ebp = LSB4(ebp);
+
+        ebp &= (1 << ecx);
+        ebp = ebp >> ecx;
+
+        ckt = (keyTable + edx);
+        ckt_temp = *ckt;
+        *ckt = ebp & 1;
+        *ckt = *ckt << eax;
+        *ckt |= (~(1 << eax) & ckt_temp);
+        esi += 0xB;
+        if (esi >= 120)
+            esi -= 120;
+    }
+}
+
+static gboolean ref_process_w3(RefKeyDecoder *ctx)
+{
+    char table[W3_BUFLEN];
+    int values[4];
+    guint32 word;
+    guint16 half;
+    int a, b;
+    int i;
+    char decode;
+
+    a = 0;
+    b = 0x21;
+
+    memset(table, 0, W3_BUFLEN);
+    memset(values, 0, (sizeof(int) * 4));
+
+    for (i = 0; ((unsigned int) i) < ctx->keyLen; i++) {
+        ctx->cdkey[i] = toupper(ctx->cdkey[i]);
+        a = (b + 0x07B5) % W3_BUFLEN;
+        b = (a + 0x07B5) % W3_BUFLEN;
+        decode = w3KeyMap[(int)ctx->cdkey[i]];
+        table[a] = (decode / 5);
+        table[b] = (decode % 5);
+    }
+
+    // Mult
+    i = W3_BUFLEN;
+    do {
+        ref_mult(4, 5, values + 3, table[i - 1]);
+    } while (--i);
+
+    ref_decodeKeyTable(values);
+
+    ctx->product = values[0] >> 0xA;
+    ctx->product = SWAP4(ctx->product);
+#if !defined(BIGENDIAN) || !BIGENDIAN
+    for (i = 0; i < 4; i++) {
+        values[i] = MSB4(values[i]);
+    }
+#endif
+
+    // the original type-punned values and w3value2 through guint16 and
+    // guint32 pointers; memcpy does the same without tripping strict
+    // aliasing at -O2
+    memcpy(&word, ((char *) values) + 2, 4);
+    ctx->value1 = LSB4(word) & 0xFFFFFF03;
+
+#if defined(BIGENDIAN) && BIGENDIAN
+    memcpy(&half, ((char *) values) + 6, 2);
+    half = LSB2(half);
+    memcpy(ctx->w3value2, &half, 2);
+    memcpy(&word, ((char *) values) + 8, 4);
+    word = LSB4(word);
+    memcpy(ctx->w3value2 + 2, &word, 4);
+    memcpy(&word, ((char *) values) + 12, 4);
+    word = LSB4(word);
+    memcpy(ctx->w3value2 + 6, &word, 4);
+#else
+    memcpy(&half, ((char *) values) + 6, 2);
+    half = MSB2(half);
+    memcpy(ctx->w3value2, &half, 2);
+    memcpy(&word, ((char *) values) + 8, 4);
+    word = MSB4(word);
+    memcpy(ctx->w3value2 + 2, &word, 4);
+    memcpy(&word, ((char *) values) + 12, 4);
+    word = MSB4(word);
+    memcpy(ctx->w3value2 + 6, &word, 4);
+#endif
+    return 1;
+}
+
+gboolean test_keydecode_ref_w2d2_valid(const char *cdkey)
+{
+    RefKeyDecoder ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    g_strlcpy(ctx.cdkey, cdkey, sizeof(ctx.cdkey));
+    ctx.keyLen = strlen(ctx.cdkey);
+    return ctx.keyLen == 16 && ref_process_w2d2(&ctx);
+}
+
+gboolean test_keydecode_ref_decode(BnetKey *key, guint32 client_cookie,
+        guint32 server_cookie, const char *key_string)
+{
+    RefKeyDecoder ctx;
+    sha1_context sha;
+    gboolean ok = FALSE;
+    guint32 product, value1;
+    gsize i, j;
+
+    memset(&ctx, 0, sizeof(ctx));
+    for (i = 0, j = 0; i < strlen(key_string) && j < W3_KEYLEN; i++) {
+        if (isalnum(key_string[i])) {
+            ctx.cdkey[j] = toupper(key_string[i]);
+            j++;
+        }
+    }
+    ctx.cdkey[j] = '\0';
+    ctx.keyLen = j;
+
+    key->length = 0;
+    key->private_value = 0;
+
+    if (ctx.keyLen == 13) {
+        for (i = 0; i < ctx.keyLen; i++) {
+            if (!isdigit(ctx.cdkey[i])) return FALSE;
+        }
+        ctx.keyType = CDKEY_TYPE_SC;
+        ok = ref_process_sc(&ctx);
+    } else if (ctx.keyLen == 16) {
+        ctx.keyType = CDKEY_TYPE_W2D2;
+        ok = ref_process_w2d2(&ctx);
+    } else if (ctx.keyLen == 26) {
+        ctx.keyType = CDKEY_TYPE_W3;
+        ok = ref_process_w3(&ctx);
+    }
+    if (!ok) {
+        return FALSE;
+    }
+
+    if (ctx.keyType == CDKEY_TYPE_W3) {
+        product = (guint32) MSB4(ctx.product);
+        value1 = (guint32) MSB4(ctx.value1);
+        sha.version = SHA1_TYPE_NORMAL;
+        sha1_reset(&sha);
+        sha1_input(&sha, (guint8 *)(&client_cookie), 4);
+        sha1_input(&sha, (guint8 *)(&server_cookie), 4);
+        sha1_input(&sha, (guint8 *)(&product), 4);
+        sha1_input(&sha, (guint8 *)(&value1), 4);
+        sha1_input(&sha, (guint8 *)(ctx.w3value2), 10);
+    } else {
+        guint32 zero = 0;
+        guint32 value2 = (guint32) LSB4(ctx.value2);
+
+        product = (guint32) LSB4(ctx.product);
+        value1 = (guint32) LSB4(ctx.value1);
+        sha.version = SHA1_TYPE_BROKEN;
+        sha1_reset(&sha);
+        sha1_input(&sha, (guint8 *)(&client_cookie), 4);
+        sha1_input(&sha, (guint8 *)(&server_cookie), 4);
+        sha1_input(&sha, (guint8 *)(&product), 4);
+        sha1_input(&sha, (guint8 *)(&value1), 4);
+        sha1_input(&sha, (guint8 *)(&zero), 4);
+        sha1_input(&sha, (guint8 *)(&value2), 4);
+    }
+    sha1_digest(&sha, key->key_hash);
+
+    key->length = ctx.keyLen;
+    key->product_value = product;
+    key->public_value = value1;
+    return TRUE;
+}
@@ -0,0 +1,241 @@
+/**
+ * pidgin-libbnet
+ * A Protocol Plugin for Pidgin, allowing emulation of a chat-only client
+ * connected to the Battle.net Service.
+ * Copyright (C) 2011-2012 Nate Book
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// make check: sha1.c against known answers, with and without SHA-NI, and
+// its throughput. The broken and lockdown answers come from the original
+// BNCSUtil-derived code, before any of the kernels were added.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "sha1.h"
+
+#define TEST_SHA1_PATTERN_SIZE 1000
+#define TEST_SHA1_BENCH_SIZE (1 << 20)
+#define TEST_SHA1_BENCH_ROUNDS 32
+#define TEST_SHA1_BENCH_SHORT 200000
+
+typedef struct {
+    sha1_type version;
+    // hashed as is, or if NULL the first length bytes of the pattern
+    const gchar *message;
+    guint32 length;
+    const gchar *digest;
+} TestSha1Vector;
+
+static const TestSha1Vector test_sha1_vectors[] = {
+    { SHA1_TYPE_NORMAL, "", 0, "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+    { SHA1_TYPE_NORMAL, "abc", 0, "a9993e364706816aba3e25717850c26c9cd0d89d" },
+    { SHA1_TYPE_NORMAL, "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 0,
+        "84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+    { SHA1_TYPE_NORMAL, NULL, 55, "ddf57317ef34bfee3b6df83d359098930eb278bc" },
+    { SHA1_TYPE_NORMAL, NULL, 56, "a0d492bb0fc889d0eca3bc137066ab6f4f74f369" },
+    { SHA1_TYPE_NORMAL, NULL, 63, "c55856749bef509bdfe6bfebfc7bf4e793e82132" },
+    { SHA1_TYPE_NORMAL, NULL, 64, "bede92be29c3874e1b54ddc77988d606fc857a8e" },
+    { SHA1_TYPE_NORMAL, NULL, 65, "b05a80522b053d6dc7e0a517d0e70212c7dad11f" },
+    { SHA1_TYPE_NORMAL, NULL, 119, "504e27376a6e0f0dba8295b85cb25dc4dfa17d23" },
+    { SHA1_TYPE_NORMAL, NULL, 1000, "4231a8a50a10fa9758db8ec71fdef855b751048a" },
+
+    { SHA1_TYPE_BROKEN, "", 0, "eea03a4d5a1d2694576f4a5860998d6b80c64615" },
+    { SHA1_TYPE_BROKEN, "abc", 0, "7a7af57b99e91bcce6dc75f981fe2255d6c878ab" },
+    { SHA1_TYPE_BROKEN, "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 0,
+        "5a846bb43b36a03251512722e2ce031ec1836ff3" },
+    { SHA1_TYPE_BROKEN, NULL, 55, "a8ba76bd3c21b1e6c5b94a435657935739fe38dc" },
+    { SHA1_TYPE_BROKEN, NULL, 56, "53bd199fb250e718ef63cc552bae97a753ea1597" },
+    { SHA1_TYPE_BROKEN, NULL, 63, "e0a411d81e45ea9d64a4ba342089861f60f418ec" },
+    { SHA1_TYPE_BROKEN, NULL, 64, "975a7ca49396b0595e51d94da2e5f25538eac8c6" },
+    { SHA1_TYPE_BROKEN, NULL, 65, "a91eacb1c5ef1ece21b39d5ef59f440c5b6cfe69" },
+    { SHA1_TYPE_BROKEN, NULL, 119, "192a211ab162ed9dd1af3e457884a5bcde41fd8f" },
+    { SHA1_TYPE_BROKEN, NULL, 1000, "18c7d82dd786f80a7ce16247299cc7cbb1bac96c" },
+
+    { SHA1_TYPE_LOCKDOWN, "", 0, "1ef84498ecf608147d1332b9cfd7be33a318f5dc" },
+    { SHA1_TYPE_LOCKDOWN, "abc", 0, "50c8e95373d4856f7567b73c2df9da981062e20a" },
+    { SHA1_TYPE_LOCKDOWN, "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 0,
+        "bc7279b964faa4eb93ea2eca7e4f04b20655bfef" },
+    { SHA1_TYPE_LOCKDOWN, NULL, 55, "770f6c6cdff553fdbc8d6d9e90d0f4c6aed200fb" },
+    { SHA1_TYPE_LOCKDOWN, NULL, 56, "e6f59d26cab5207fbe80330228102657e74099a2" },
+    { SHA1_TYPE_LOCKDOWN, NULL, 63, "d2c534399177a50d903cfb80c9d579dbe1a7df87" },
+    { SHA1_TYPE_LOCKDOWN, NULL, 64, "d0aa39f482a9ba5e59d3188b2e7b521db088984a" },
+    { SHA1_TYPE_LOCKDOWN, NULL, 65, "5f8970502c628ee391c26fcfaa759814fb66f5ec" },
+    { SHA1_TYPE_LOCKDOWN, NULL, 119, "447bb7e10b798dbda2247644dfc12b1346e50b6b" },
+    { SHA1_TYPE_LOCKDOWN, NULL, 1000, "dbab24f47a10c5c76abd5876c7031eb9de4ecd7b" },
+};
+
+static const gchar *test_sha1_version_names[] = { "normal", "broken", "lockdown" };
+
+static guint8 test_sha1_pattern[TEST_SHA1_PATTERN_SIZE];
+
+static void
+test_sha1_to_hex(const guint8 *digest, gchar *out)
+{
+    int i;
+
+    for (i = 0; i < SHA1_HASH_SIZE; i++) {
+        g_snprintf(out + i * 2, 3, "%02x", digest[i]);
+    }
+}
+
+// hashes data fed step bytes at a time, 0 for all at once
+static void
+test_sha1_hash(sha1_type version, const guint8 *data, guint32 length, guint32 step, guint8 *digest)
+{
+    sha1_context sha;
+    guint32 offset = 0;
+
+    sha.version = version;
+    sha1_reset(&sha);
+    if (step == 0) {
+        step = length;
+    }
+    while (offset < length) {
+        guint32 n = MIN(step, length - offset);
+        sha1_input(&sha, data + offset, n);
+        offset += n;
+    }
+    sha1_digest(&sha, digest);
+}
+
+static int
+test_sha1_known_answers(const gchar *mode)
+{
+    static const guint32 steps[] = { 0, 1, 7, 64, 100 };
+    int failures = 0;
+    guint i, j;
+
+    for (i = 0; i < G_N_ELEMENTS(test_sha1_vectors); i++) {
+        const TestSha1Vector *v = &test_sha1_vectors[i];
+        const guint8 *data = (v->message != NULL) ? (const guint8 *)v->message : test_sha1_pattern;
+        guint32 length = (v->message != NULL) ? strlen(v->message) : v->length;
+
+        for (j = 0; j < G_N_ELEMENTS(steps); j++) {
+            guint8 digest[SHA1_HASH_SIZE];
+            gchar hex[SHA1_HASH_SIZE * 2 + 1];
+
+            test_sha1_hash(v->version, data, length, steps[j], digest);
+            test_sha1_to_hex(digest, hex);
+            if (strcmp(hex, v->digest) != 0) {
+                printf("FAIL %s %s, %u bytes fed %u at a time: %s, expected %s\n", mode,
+                        test_sha1_version_names[v->version], length, steps[j], hex, v->digest);
+                failures++;
+            }
+        }
+    }
+
+    {
+        // FIPS 180-1's million a's, through a block-sized buffer
+        sha1_context sha;
+        guint8 block[64];
+        guint8 digest[SHA1_HASH_SIZE];
+        gchar hex[SHA1_HASH_SIZE * 2 + 1];
+
+        memset(block, 'a', sizeof(block));
+        sha.version = SHA1_TYPE_NORMAL;
+        sha1_reset(&sha);
+        for (i = 0; i < 1000000 / 64; i++) {
+            sha1_input(&sha, block, sizeof(block));
+        }
+        sha1_input(&sha, block, 1000000 % 64);
+        sha1_digest(&sha, digest);
+        test_sha1_to_hex(digest, hex);
+        if (strcmp(hex, "34aa973cd4c4daa4f61eeb2bdbad27316534016f") != 0) {
+            printf("FAIL %s normal, a million a's: %s\n", mode, hex);
+            failures++;
+        }
+    }
+
+    printf("%s: %u known answers, %d failed\n", mode,
+            (guint)(G_N_ELEMENTS(test_sha1_vectors) * G_N_ELEMENTS(steps) + 1), failures);
+    return failures;
+}
+
+static void
+test_sha1_bench(const gchar *mode)
+{
+    guint8 *buffer = g_malloc(TEST_SHA1_BENCH_SIZE);
+    GTimer *timer = g_timer_new();
+    guint8 digest[SHA1_HASH_SIZE];
+    int version, i;
+
+    for (i = 0; i < TEST_SHA1_BENCH_SIZE; i++) {
+        buffer[i] = (guint8)(i * 7 + 3);
+    }
+
+    for (version = SHA1_TYPE_NORMAL; version <= SHA1_TYPE_LOCKDOWN; version++) {
+        gdouble bulk, shortmsg;
+
+        g_timer_start(timer);
+        for (i = 0; i < TEST_SHA1_BENCH_ROUNDS; i++) {
+            test_sha1_hash(version, buffer, TEST_SHA1_BENCH_SIZE, 0, digest);
+        }
+        bulk = g_timer_elapsed(timer, NULL);
+
+        // the size of a CD-key hash input
+        g_timer_start(timer);
+        for (i = 0; i < TEST_SHA1_BENCH_SHORT; i++) {
+            test_sha1_hash(version, buffer + (i & 0xff), 26, 0, digest);
+        }
+        shortmsg = g_timer_elapsed(timer, NULL);
+
+        printf("%s %-8s %8.1f MB/s, %6.1f ns per 26-byte message\n", mode,
+                test_sha1_version_names[version],
+                TEST_SHA1_BENCH_ROUNDS * (TEST_SHA1_BENCH_SIZE / 1048576.0) / bulk,
+                shortmsg * 1e9 / TEST_SHA1_BENCH_SHORT);
+    }
+
+    g_timer_destroy(timer);
+    g_free(buffer);
+}
+
+int
+main(int argc, char *argv[])
+{
+    gboolean bench = TRUE;
+    int failures = 0;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-bench") == 0) {
+            bench = FALSE;
+        }
+    }
+
+    for (i = 0; i < TEST_SHA1_PATTERN_SIZE; i++) {
+        test_sha1_pattern[i] = (guint8)(i * 7 + 3);
+    }
+
+    if (sha1_set_shani(TRUE)) {
+        failures += test_sha1_known_answers("sha-ni");
+        if (bench) {
+            test_sha1_bench("sha-ni");
+        }
+    } else {
+        printf("sha-ni: not available, skipped\n");
+    }
+
+    sha1_set_shani(FALSE);
+    failures += test_sha1_known_answers("portable");
+    if (bench) {
+        test_sha1_bench("portable");
+    }
+
+    return (failures == 0) ? 0 : 1;
+}
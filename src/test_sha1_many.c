@@ -0,0 +1,185 @@
+/**
+ * pidgin-libbnet
+ * A Protocol Plugin for Pidgin, allowing emulation of a chat-only client
+ * connected to the Battle.net Service.
+ * Copyright (C) 2011-2012 Nate Book
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// make check: sha1_digest_many() at 4, 8 and 16 lanes against one
+// sha1_context per message, on random batches, and the messages per second
+// each lane count gets. Pass a seed to replay a failure.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "sha1.h"
+
+#define TEST_SHA1_MANY_BUFFER 4096
+#define TEST_SHA1_MANY_MAX_LENGTH 300
+#define TEST_SHA1_MANY_MAX_COUNT 64
+#define TEST_SHA1_MANY_ROUNDS 300
+#define TEST_SHA1_MANY_BENCH_COUNT 4096
+#define TEST_SHA1_MANY_BENCH_ROUNDS 50
+
+static const gchar *test_sha1_many_version_names[] = { "normal", "broken", "lockdown" };
+static const guint test_sha1_many_lanes[] = { 4, 8, 16 };
+
+static void
+test_sha1_many_scalar(sha1_type version, const guint8 *data, guint32 length, guint8 *digest)
+{
+    sha1_context sha;
+
+    sha.version = version;
+    sha1_reset(&sha);
+    sha1_input(&sha, data, length);
+    sha1_digest(&sha, digest);
+}
+
+static int
+test_sha1_many_equality(GRand *rand, const guint8 *buffer, guint lanes)
+{
+    const guint8 *data[TEST_SHA1_MANY_MAX_COUNT];
+    guint32 lengths[TEST_SHA1_MANY_MAX_COUNT];
+    guint8 digests[TEST_SHA1_MANY_MAX_COUNT * SHA1_HASH_SIZE];
+    int failures = 0;
+    int version, round;
+
+    for (version = SHA1_TYPE_NORMAL; version <= SHA1_TYPE_LOCKDOWN; version++) {
+        for (round = 0; round < TEST_SHA1_MANY_ROUNDS; round++) {
+            guint count = g_rand_int_range(rand, 1, TEST_SHA1_MANY_MAX_COUNT + 1);
+            guint i;
+
+            for (i = 0; i < count; i++) {
+                lengths[i] = g_rand_int_range(rand, 0, TEST_SHA1_MANY_MAX_LENGTH + 1);
+                data[i] = buffer + g_rand_int_range(rand, 0,
+                        TEST_SHA1_MANY_BUFFER - TEST_SHA1_MANY_MAX_LENGTH);
+            }
+
+            sha1_digest_many(version, count, data, lengths, digests, lanes);
+
+            for (i = 0; i < count; i++) {
+                guint8 expected[SHA1_HASH_SIZE];
+
+                test_sha1_many_scalar(version, data[i], lengths[i], expected);
+                if (memcmp(expected, digests + i * SHA1_HASH_SIZE, SHA1_HASH_SIZE) != 0) {
+                    if (failures < 10) {
+                        printf("FAIL %u lanes %s: message %u of %u, %u bytes\n", lanes,
+                                test_sha1_many_version_names[version], i, count, lengths[i]);
+                    }
+                    failures++;
+                }
+            }
+        }
+    }
+
+    printf("%2u lanes: %d random batches per version, %d mismatches\n", lanes,
+            TEST_SHA1_MANY_ROUNDS, failures);
+    return failures;
+}
+
+// lanes 0 is whatever sha1_digest_many picks on its own
+static void
+test_sha1_many_bench(const guint8 *buffer, guint lanes, guint32 length)
+{
+    const guint8 **data = g_new(const guint8 *, TEST_SHA1_MANY_BENCH_COUNT);
+    guint32 *lengths = g_new(guint32, TEST_SHA1_MANY_BENCH_COUNT);
+    guint8 *digests = g_malloc(TEST_SHA1_MANY_BENCH_COUNT * SHA1_HASH_SIZE);
+    GTimer *timer = g_timer_new();
+    int version, round;
+    guint i;
+
+    for (i = 0; i < TEST_SHA1_MANY_BENCH_COUNT; i++) {
+        data[i] = buffer + (i * 13) % (TEST_SHA1_MANY_BUFFER - length);
+        lengths[i] = length;
+    }
+
+    printf("%2u lanes, %3u bytes:", lanes, length);
+    for (version = SHA1_TYPE_NORMAL; version <= SHA1_TYPE_LOCKDOWN; version++) {
+        gdouble elapsed;
+
+        g_timer_start(timer);
+        for (round = 0; round < TEST_SHA1_MANY_BENCH_ROUNDS; round++) {
+            sha1_digest_many(version, TEST_SHA1_MANY_BENCH_COUNT, data, lengths, digests, lanes);
+        }
+        elapsed = g_timer_elapsed(timer, NULL);
+        printf("  %s %6.2f M/s", test_sha1_many_version_names[version],
+                TEST_SHA1_MANY_BENCH_ROUNDS * TEST_SHA1_MANY_BENCH_COUNT / elapsed / 1e6);
+    }
+    printf("\n");
+
+    g_timer_destroy(timer);
+    g_free(digests);
+    g_free(lengths);
+    g_free(data);
+}
+
+int
+main(int argc, char *argv[])
+{
+    guint8 *buffer = g_malloc(TEST_SHA1_MANY_BUFFER);
+    guint32 seed = 20120101;
+    gboolean bench = TRUE;
+    GRand *rand;
+    int failures = 0;
+    int i;
+    guint j;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-bench") == 0) {
+            bench = FALSE;
+        } else {
+            seed = strtoul(argv[i], NULL, 10);
+        }
+    }
+
+    rand = g_rand_new_with_seed(seed);
+    for (i = 0; i < TEST_SHA1_MANY_BUFFER; i++) {
+        buffer[i] = (guint8)g_rand_int(rand);
+    }
+    printf("seed %u, this CPU has up to %u lanes\n", seed, sha1_max_lanes());
+
+    for (j = 0; j < G_N_ELEMENTS(test_sha1_many_lanes); j++) {
+        if (test_sha1_many_lanes[j] > sha1_max_lanes()) {
+            printf("%2u lanes: not available, skipped\n", test_sha1_many_lanes[j]);
+            continue;
+        }
+        failures += test_sha1_many_equality(rand, buffer, test_sha1_many_lanes[j]);
+    }
+
+    if (bench) {
+        // 26 bytes is a CD-key hash input
+        test_sha1_many_bench(buffer, 0, 26);
+        test_sha1_many_bench(buffer, 1, 26);
+        for (j = 0; j < G_N_ELEMENTS(test_sha1_many_lanes); j++) {
+            if (test_sha1_many_lanes[j] <= sha1_max_lanes()) {
+                test_sha1_many_bench(buffer, test_sha1_many_lanes[j], 26);
+            }
+        }
+        test_sha1_many_bench(buffer, 1, 200);
+        for (j = 0; j < G_N_ELEMENTS(test_sha1_many_lanes); j++) {
+            if (test_sha1_many_lanes[j] <= sha1_max_lanes()) {
+                test_sha1_many_bench(buffer, test_sha1_many_lanes[j], 200);
+            }
+        }
+    }
+
+    g_rand_free(rand);
+    g_free(buffer);
+    return (failures == 0) ? 0 : 1;
+}
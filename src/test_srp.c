@@ -0,0 +1,186 @@
+/**
+ * pidgin-libbnet
+ * A Protocol Plugin for Pidgin, allowing emulation of a chat-only client
+ * connected to the Battle.net Service.
+ * Copyright (C) 2011-2012 Nate Book
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// make check: srp_group_powm_g() against mpz_powm() on 2000 random
+// exponents and the window edges, and the time each takes for a private
+// key (a) and a password hash (x). Pass a seed to replay a failure.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <gmp.h>
+
+#include "srp.h"
+
+#define TEST_SRP_EXPONENTS 2000
+#define TEST_SRP_BENCH_ROUNDS 20000
+
+// exponent of the given bit length from rand; 0 bits is zero
+static void
+test_srp_random_exponent(GRand *rand, mpz_t exp, guint bits)
+{
+    guint8 bytes[(SRP_GROUP_BITS + 64) / 8];
+    guint count = (bits + 7) / 8;
+    guint i;
+
+    for (i = 0; i < count; i++) {
+        bytes[i] = (guint8)g_rand_int(rand);
+    }
+    mpz_import(exp, count, -1, 1, 0, 0, bytes);
+    mpz_fdiv_r_2exp(exp, exp, bits);
+    if (bits > 0) {
+        // the top bit set, so the length is exactly bits
+        mpz_setbit(exp, bits - 1);
+    }
+}
+
+static gboolean
+test_srp_check(const srp_group_t *group, const mpz_t exp, const gchar *what)
+{
+    mpz_t expected, actual;
+    gboolean same;
+
+    mpz_init(expected);
+    mpz_init(actual);
+    mpz_powm(expected, group->g, exp, group->n);
+    srp_group_powm_g(group, actual, exp);
+    same = (mpz_cmp(expected, actual) == 0);
+    if (!same) {
+        gmp_printf("FAIL %s: g^%Zx\n", what, exp);
+    }
+    mpz_clear(actual);
+    mpz_clear(expected);
+    return same;
+}
+
+static int
+test_srp_equality(GRand *rand, const srp_group_t *group)
+{
+    mpz_t exp;
+    int failures = 0;
+    int checked = 0;
+    guint bits;
+    int i;
+
+    mpz_init(exp);
+
+    // zero, one, and all ones up to each window boundary and past the table
+    mpz_set_ui(exp, 0);
+    failures += !test_srp_check(group, exp, "zero");
+    mpz_set_ui(exp, 1);
+    failures += !test_srp_check(group, exp, "one");
+    checked += 2;
+    for (bits = SRP_GROUP_WINDOW; bits <= SRP_GROUP_BITS + SRP_GROUP_WINDOW; bits += SRP_GROUP_WINDOW) {
+        mpz_set_ui(exp, 0);
+        mpz_setbit(exp, bits);
+        mpz_sub_ui(exp, exp, 1);
+        failures += !test_srp_check(group, exp, "2^k - 1");
+        mpz_add_ui(exp, exp, 1);
+        failures += !test_srp_check(group, exp, "2^k");
+        checked += 2;
+    }
+    mpz_sub_ui(exp, group->n, 1);
+    failures += !test_srp_check(group, exp, "N - 1");
+    checked++;
+
+    // every length from 0 to past the table, in turn
+    for (i = 0; i < TEST_SRP_EXPONENTS; i++) {
+        test_srp_random_exponent(rand, exp, i % (SRP_GROUP_BITS + 9));
+        failures += !test_srp_check(group, exp, "random");
+        checked++;
+    }
+
+    printf("%d exponents, %d differ from mpz_powm\n", checked, failures);
+    mpz_clear(exp);
+    return failures;
+}
+
+static void
+test_srp_bench(GRand *rand, const srp_group_t *group, guint bits, const gchar *what)
+{
+    mpz_t *exps = g_new(mpz_t, TEST_SRP_BENCH_ROUNDS);
+    GTimer *timer = g_timer_new();
+    gdouble plain, table;
+    mpz_t result;
+    int i;
+
+    mpz_init(result);
+    for (i = 0; i < TEST_SRP_BENCH_ROUNDS; i++) {
+        mpz_init(exps[i]);
+        test_srp_random_exponent(rand, exps[i], bits);
+    }
+
+    g_timer_start(timer);
+    for (i = 0; i < TEST_SRP_BENCH_ROUNDS; i++) {
+        mpz_powm(result, group->g, exps[i], group->n);
+    }
+    plain = g_timer_elapsed(timer, NULL);
+
+    g_timer_start(timer);
+    for (i = 0; i < TEST_SRP_BENCH_ROUNDS; i++) {
+        srp_group_powm_g(group, result, exps[i]);
+    }
+    table = g_timer_elapsed(timer, NULL);
+
+    printf("%s, %3u bits: mpz_powm %6.2f us, srp_group_powm_g %6.2f us\n", what, bits,
+            plain * 1e6 / TEST_SRP_BENCH_ROUNDS, table * 1e6 / TEST_SRP_BENCH_ROUNDS);
+
+    for (i = 0; i < TEST_SRP_BENCH_ROUNDS; i++) {
+        mpz_clear(exps[i]);
+    }
+    mpz_clear(result);
+    g_timer_destroy(timer);
+    g_free(exps);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const srp_group_t *group;
+    guint32 seed = 20120101;
+    gboolean bench = TRUE;
+    GRand *rand;
+    int failures;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--no-bench") == 0) {
+            bench = FALSE;
+        } else {
+            seed = strtoul(argv[i], NULL, 10);
+        }
+    }
+
+    rand = g_rand_new_with_seed(seed);
+    group = srp_group_get();
+    printf("seed %u\n", seed);
+
+    failures = test_srp_equality(rand, group);
+    if (bench) {
+        test_srp_bench(rand, group, SRP_GROUP_BITS, "private key a");
+        // x is a SHA-1 digest
+        test_srp_bench(rand, group, 160, "password x");
+    }
+
+    g_rand_free(rand);
+    return (failures == 0) ? 0 : 1;
+}